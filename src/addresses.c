@@ -66,36 +66,6 @@ assert_address_ffl(const la_address_t *address, const char *func,
         }
 }
 
-bool
-query_domainname(la_address_t *address)
-{
-        assert_address(address);
-        la_debug_func(address->text);
-
-        if (address->domainname)
-                return true;
-
-        address->domainname = xmalloc(NI_MAXHOST);
-        const int r = getnameinfo((struct sockaddr *) &(address->sa),
-                        address->salen, address->domainname, NI_MAXHOST, NULL,
-                        0, 0);
-
-        if (!r)
-        {
-                return true;
-        }
-        else if (r == EAI_AGAIN || r == EAI_FAMILY || r == EAI_NONAME)
-        {
-                free(address->domainname);
-                address->domainname = NULL;
-                return false;
-        }
-        else
-        {
-                die_hard(true, "Resolving hostname failed: %u", r);
-        }
-}
-
 int
 get_port(const la_address_t *const address)
 {
@@ -325,6 +295,201 @@ adrcmp(const la_address_t *const a1, const la_address_t *const a2)
         return 127;
 }
 
+static uint64_t
+load_be64(const unsigned char *const bytes)
+{
+        uint64_t result = 0;
+
+        for (int i = 0; i < 8; i++)
+                result = (result << 8) | bytes[i];
+
+        return result;
+}
+
+static void
+store_be64(unsigned char *const bytes, uint64_t value)
+{
+        for (int i = 7; i >= 0; i--)
+        {
+                bytes[i] = value & 0xFF;
+                value >>= 8;
+        }
+}
+
+/*
+ * Initialize compact address key from a socket address (port is ignored).
+ * Prefix is that of a single host.
+ */
+
+void
+init_address_key_sa(la_address_key_t *const key, const struct sockaddr *const sa)
+{
+        assert(key); assert(sa);
+
+        key->high = key->low = 0;
+        key->family = AF_UNSPEC;
+        key->prefix = 0;
+
+        if (sa->sa_family == AF_INET)
+        {
+                key->family = AF_INET;
+                key->prefix = 32;
+                key->low = ntohl(((struct sockaddr_in *) sa)->sin_addr.s_addr);
+        }
+        else if (sa->sa_family == AF_INET6)
+        {
+                const unsigned char *const bytes = ((struct sockaddr_in6 *)
+                                sa)->sin6_addr.s6_addr;
+                key->family = AF_INET6;
+                key->prefix = 128;
+                key->high = load_be64(bytes);
+                key->low = load_be64(bytes + 8);
+        }
+}
+
+/*
+ * Initialize compact address key from address. address may be NULL.
+ */
+
+void
+init_address_key(la_address_key_t *const key, const la_address_t *const address)
+{
+        assert(key);
+
+        key->high = key->low = 0;
+        key->family = AF_UNSPEC;
+        key->prefix = 0;
+
+        if (!address)
+                return;
+        assert_address(address);
+
+        key->prefix = address->prefix;
+
+        if (address->sa.ss_family == AF_INET)
+        {
+                key->family = AF_INET;
+                key->low = ntohl(((struct sockaddr_in *)
+                                        &address->sa)->sin_addr.s_addr);
+        }
+        else if (address->sa.ss_family == AF_INET6)
+        {
+                const unsigned char *const bytes = ((struct sockaddr_in6 *)
+                                &address->sa)->sin6_addr.s6_addr;
+                key->family = AF_INET6;
+                key->high = load_be64(bytes);
+                key->low = load_be64(bytes + 8);
+        }
+}
+
+/*
+ * Compare two address keys. Unlike adrcmp() this is a total order: addresses
+ * are sorted by address family first. A network sorts right before the
+ * addresses it contains, a host address and a network with the same address
+ * are different.
+ */
+
+int
+adrkeycmp(const la_address_key_t *const k1, const la_address_key_t *const k2)
+{
+        if (k1->family != k2->family)
+                return k1->family < k2->family ? -1 : 1;
+        if (k1->high != k2->high)
+                return k1->high < k2->high ? -1 : 1;
+        if (k1->low != k2->low)
+                return k1->low < k2->low ? -1 : 1;
+        if (k1->prefix != k2->prefix)
+                return k1->prefix < k2->prefix ? -1 : 1;
+
+        return 0;
+}
+
+static uint64_t
+prefix_mask64(const int bits)
+{
+        return bits <= 0 ? 0 : ~UINT64_C(0) << (64 - bits);
+}
+
+/*
+ * Turns key into the key of the network with the given prefix length the
+ * address belongs to.
+ */
+
+void
+mask_address_key(la_address_key_t *const key, const int prefix)
+{
+        assert(key);
+
+        if (key->family == AF_INET)
+        {
+                assert(prefix >= 0 && prefix <= 32);
+                key->low &= prefix_mask64(prefix + 32);
+        }
+        else if (key->family == AF_INET6)
+        {
+                assert(prefix >= 0 && prefix <= 128);
+                if (prefix <= 64)
+                {
+                        key->high &= prefix_mask64(prefix);
+                        key->low = 0;
+                }
+                else
+                {
+                        key->low &= prefix_mask64(prefix - 64);
+                }
+        }
+
+        key->prefix = prefix;
+}
+
+/*
+ * Returns true if key (address or network) is part of network.
+ */
+
+bool
+address_key_in_prefix(const la_address_key_t *const key,
+                const la_address_key_t *const network)
+{
+        assert(key); assert(network);
+
+        if (key->family != network->family || key->prefix < network->prefix)
+                return false;
+
+        la_address_key_t masked = *key;
+        mask_address_key(&masked, network->prefix);
+
+        return masked.high == network->high && masked.low == network->low;
+}
+
+/*
+ * Write textual representation of address key to buffer (which must be at
+ * least INET6_ADDRSTRLEN bytes long). Returns buffer.
+ */
+
+const char *
+address_key_text(const la_address_key_t *const key, char *const buffer)
+{
+        assert(key); assert(buffer);
+
+        if (key->family == AF_INET)
+        {
+                const struct in_addr addr = { .s_addr = htonl(key->low) };
+                if (inet_ntop(AF_INET, &addr, buffer, INET6_ADDRSTRLEN))
+                        return buffer;
+        }
+        else if (key->family == AF_INET6)
+        {
+                struct in6_addr addr;
+                store_be64(addr.s6_addr, key->high);
+                store_be64(addr.s6_addr + 8, key->low);
+                if (inet_ntop(AF_INET6, &addr, buffer, INET6_ADDRSTRLEN))
+                        return buffer;
+        }
+
+        buffer[0] = '\0';
+        return buffer;
+}
+
 /*
  * Check whether ip address matches one of the networks (address + prefix) on the list.
  * Return matching network, NULL otherwise.
@@ -383,6 +548,279 @@ address_on_list_str(const char *const host, const kw_list_t *const list)
         return result;
 }
 
+/*
+ * Prefix tree (Patricia trie) for longest prefix match lookups on large
+ * lists of networks (ignore list, receive_from list). Lookup cost only
+ * depends on the prefix length, not on the number of networks.
+ */
+
+static int
+get_key_bit(const unsigned char *const key, const int bit)
+{
+        return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/*
+ * Returns true if the first bits bits of key1 and key2 are identical.
+ */
+
+static bool
+key_prefix_matches(const unsigned char *const key1,
+                const unsigned char *const key2, const int bits)
+{
+        const int whole_bytes = bits >> 3;
+        const int remaining_bits = bits & 7;
+
+        if (whole_bytes && memcmp(key1, key2, whole_bytes))
+                return false;
+
+        if (remaining_bits)
+        {
+                const unsigned char mask = 0xFFu << (8 - remaining_bits);
+                if ((key1[whole_bytes] ^ key2[whole_bytes]) & mask)
+                        return false;
+        }
+
+        return true;
+}
+
+/*
+ * Returns number of leading bits key1 and key2 have in common, max_bits at
+ * most.
+ */
+
+static int
+common_key_prefix(const unsigned char *const key1,
+                const unsigned char *const key2, const int max_bits)
+{
+        int result = 0;
+
+        while (result < max_bits)
+        {
+                const unsigned char diff = key1[result >> 3] ^ key2[result >> 3];
+                if (!diff)
+                {
+                        result += 8;
+                        continue;
+                }
+
+                for (int bit = 7; bit >= 0 && !(diff & (1u << bit)); bit--)
+                        result++;
+                break;
+        }
+
+        return result < max_bits ? result : max_bits;
+}
+
+static la_prefix_node_t *
+create_prefix_node(const unsigned char *const key, const int prefix,
+                la_address_t *const address)
+{
+        la_prefix_node_t *const result = xmalloc0(sizeof *result);
+
+        /* Copy only the first prefix bits, leave the rest zero */
+        memcpy(result->key, key, (prefix + 7) >> 3);
+        if (prefix & 7)
+                result->key[prefix >> 3] &= 0xFFu << (8 - (prefix & 7));
+        result->prefix = prefix;
+        result->address = address;
+
+        return result;
+}
+
+static void
+free_prefix_nodes(la_prefix_node_t *const node)
+{
+        if (!node)
+                return;
+
+        free_prefix_nodes(node->child[0]);
+        free_prefix_nodes(node->child[1]);
+        free(node);
+}
+
+/*
+ * Returns pointer to the binary address and sets *bits to the number of bits
+ * of the address. Returns NULL for unsupported address families.
+ */
+
+static const unsigned char *
+get_key_from_sa(const struct sockaddr *const sa, int *const bits)
+{
+        switch (sa->sa_family)
+        {
+        case AF_INET:
+                *bits = 32;
+                return (const unsigned char *)
+                        &((const struct sockaddr_in *) sa)->sin_addr;
+        case AF_INET6:
+                *bits = 128;
+                return (const unsigned char *)
+                        ((const struct sockaddr_in6 *) sa)->sin6_addr.s6_addr;
+        default:
+                return NULL;
+        }
+}
+
+void
+init_prefix_tree(la_prefix_tree_t *const tree)
+{
+        assert(tree);
+
+        tree->root4 = tree->root6 = NULL;
+}
+
+/*
+ * Add network sa/prefix to prefix tree, address is what lookups of addresses
+ * within the network will return. If the same network is already on the
+ * tree, the existing entry is kept (i.e. same behaviour as for the first
+ * match in a list).
+ */
+
+void
+add_sa_to_prefix_tree(la_prefix_tree_t *const tree,
+                const struct sockaddr *const sa, const int prefix,
+                la_address_t *const address)
+{
+        assert(tree); assert(sa); assert(address);
+
+        int bits;
+        const unsigned char *const key = get_key_from_sa(sa, &bits);
+        if (!key || prefix < 0 || prefix > bits)
+                return;
+
+        la_prefix_node_t **link = sa->sa_family == AF_INET ?
+                &tree->root4 : &tree->root6;
+
+        for (;;)
+        {
+                la_prefix_node_t *const node = *link;
+
+                if (!node)
+                {
+                        *link = create_prefix_node(key, prefix, address);
+                        return;
+                }
+
+                const int common = common_key_prefix(node->key, key,
+                                node->prefix < prefix ? node->prefix : prefix);
+
+                if (common == node->prefix)
+                {
+                        if (prefix == node->prefix)
+                        {
+                                if (!node->address)
+                                        node->address = address;
+                                return;
+                        }
+
+                        /* node is a shorter prefix of new network, descend */
+                        link = &node->child[get_key_bit(key, node->prefix)];
+                }
+                else if (common == prefix)
+                {
+                        /* new network is a shorter prefix of node */
+                        la_prefix_node_t *const new_node =
+                                create_prefix_node(key, prefix, address);
+                        new_node->child[get_key_bit(node->key, prefix)] = node;
+                        *link = new_node;
+                        return;
+                }
+                else
+                {
+                        /* both diverge after common bits, add branching node */
+                        la_prefix_node_t *const branch =
+                                create_prefix_node(key, common, NULL);
+                        branch->child[get_key_bit(node->key, common)] = node;
+                        branch->child[get_key_bit(key, common)] =
+                                create_prefix_node(key, prefix, address);
+                        *link = branch;
+                        return;
+                }
+        }
+}
+
+/*
+ * Add network to prefix tree, see add_sa_to_prefix_tree().
+ */
+
+void
+add_to_prefix_tree(la_prefix_tree_t *const tree, la_address_t *const address)
+{
+        assert(tree); assert_address(address);
+        la_vdebug("add_to_prefix_tree(%s)", address->text);
+
+        add_sa_to_prefix_tree(tree, (struct sockaddr *) &address->sa,
+                        address->prefix, address);
+}
+
+/*
+ * (Re-)build prefix tree from all networks on list.
+ */
+
+void
+build_prefix_tree(la_prefix_tree_t *const tree, const kw_list_t *const list)
+{
+        assert(tree); assert_list(list);
+        la_debug_func(NULL);
+
+        empty_prefix_tree(tree);
+
+        FOREACH(la_address_t, address, list)
+                add_to_prefix_tree(tree, address);
+}
+
+void
+empty_prefix_tree(la_prefix_tree_t *const tree)
+{
+        if (!tree)
+                return;
+
+        free_prefix_nodes(tree->root4);
+        free_prefix_nodes(tree->root6);
+        init_prefix_tree(tree);
+}
+
+/*
+ * Check whether ip address matches one of the networks on the tree. Return
+ * most specific matching network (longest prefix), NULL otherwise.
+ */
+
+la_address_t *
+address_in_prefix_tree_sa(const la_prefix_tree_t *const tree,
+                const struct sockaddr *const sa)
+{
+        assert(tree); assert(sa);
+
+        int bits;
+        const unsigned char *const key = get_key_from_sa(sa, &bits);
+        if (!key)
+                return NULL;
+
+        la_address_t *result = NULL;
+        const la_prefix_node_t *node = sa->sa_family == AF_INET ?
+                tree->root4 : tree->root6;
+
+        while (node && key_prefix_matches(node->key, key, node->prefix))
+        {
+                if (node->address)
+                        result = node->address;
+                if (node->prefix == bits)
+                        break;
+                node = node->child[get_key_bit(key, node->prefix)];
+        }
+
+        return result;
+}
+
+la_address_t *
+address_in_prefix_tree(const la_prefix_tree_t *const tree,
+                const la_address_t *const address)
+{
+        assert_address(address);
+        return address_in_prefix_tree_sa(tree, (struct sockaddr *) &address->sa);
+}
+
 /*
  * Initializes new address based on sockaddr structure.
  */
@@ -515,11 +953,128 @@ init_address_port(la_address_t *const addr, const char *const host, const in_por
 
         freeaddrinfo(ai);
 
-#ifndef NOCRYPTO
-#ifdef WITH_LIBSODIUM
-        addr->key = addr->salt = NULL;
-#endif /* WITH_LIBSODIUM */
-#endif /* NOCRYPTO */
+        return true;
+}
+
+/*
+ * Initializes address from a numeric IPv4 / IPv6 address with optional
+ * "/prefix". Unlike init_address() this will never resolve host names and is
+ * therefore suitable for parsing large lists of addresses.
+ */
+
+bool
+init_address_numeric(la_address_t *const addr, const char *const host)
+{
+        assert(addr); assert(host);
+        la_vdebug_func(host);
+
+        char host_str[INET6_ADDRSTRLEN + 1];
+        const int n = string_copy(host_str, INET6_ADDRSTRLEN, host, 0, '/');
+        if (n == -1)
+                return false;
+
+        // Prefix - if any. String will include '/'
+        const char *const prefix_str = host[n] == '/' ? &host[n] : NULL;
+
+        memset(&addr->sa, 0, sizeof addr->sa);
+        struct sockaddr_in *const sa4 = (struct sockaddr_in *) &addr->sa;
+        struct sockaddr_in6 *const sa6 = (struct sockaddr_in6 *) &addr->sa;
+        const void *bin_addr;
+
+        if (inet_pton(AF_INET, host_str, &sa4->sin_addr) == 1)
+        {
+                sa4->sin_family = AF_INET;
+                addr->salen = sizeof *sa4;
+                addr->prefix = 32;
+                bin_addr = &sa4->sin_addr;
+        }
+        else if (inet_pton(AF_INET6, host_str, &sa6->sin6_addr) == 1)
+        {
+                sa6->sin6_family = AF_INET6;
+                addr->salen = sizeof *sa6;
+                addr->prefix = 128;
+                bin_addr = &sa6->sin6_addr;
+        }
+        else
+        {
+                return false;
+        }
+
+        if (!inet_ntop(addr->sa.ss_family, bin_addr, addr->text,
+                                MAX_ADDR_TEXT_SIZE + 1))
+                return false;
+
+        if (prefix_str)
+        {
+                addr->prefix = convert_prefix(addr->sa.ss_family, prefix_str + 1);
+                if (addr->prefix == -1)
+                        return false;
+
+                strncat(addr->text, prefix_str, 4);
+        }
+
+        addr->node.pri = 0;
+        addr->domainname = NULL;
+
+        return true;
+}
+
+/*
+ * Initializes address from a raw IPv4 (4 bytes) or IPv6 (16 bytes) address in
+ * network byte order and a prefix. Like init_address_numeric() this never
+ * involves the resolver.
+ */
+
+bool
+init_address_bin(la_address_t *const addr, const int family,
+                const unsigned char *const bytes, const int prefix)
+{
+        assert(addr); assert(bytes);
+        la_vdebug_func(NULL);
+
+        memset(&addr->sa, 0, sizeof addr->sa);
+        struct sockaddr_in *const sa4 = (struct sockaddr_in *) &addr->sa;
+        struct sockaddr_in6 *const sa6 = (struct sockaddr_in6 *) &addr->sa;
+        const void *bin_addr;
+        int max_prefix;
+
+        if (family == AF_INET)
+        {
+                sa4->sin_family = AF_INET;
+                memcpy(&sa4->sin_addr, bytes, 4);
+                addr->salen = sizeof *sa4;
+                bin_addr = &sa4->sin_addr;
+                max_prefix = 32;
+        }
+        else if (family == AF_INET6)
+        {
+                sa6->sin6_family = AF_INET6;
+                memcpy(&sa6->sin6_addr, bytes, 16);
+                addr->salen = sizeof *sa6;
+                bin_addr = &sa6->sin6_addr;
+                max_prefix = 128;
+        }
+        else
+        {
+                return false;
+        }
+
+        if (prefix < 0 || prefix > max_prefix)
+                return false;
+        addr->prefix = prefix;
+
+        if (!inet_ntop(family, bin_addr, addr->text, MAX_ADDR_TEXT_SIZE + 1))
+                return false;
+
+        if (prefix < max_prefix)
+        {
+                const size_t len = strlen(addr->text);
+                snprintf(&addr->text[len], MAX_ADDR_TEXT_SIZE + 1 - len, "/%u",
+                                prefix);
+        }
+
+        addr->node.pri = 0;
+        addr->domainname = NULL;
 
         return true;
 }
@@ -585,13 +1140,6 @@ free_address(la_address_t *const address)
         la_vdebug_func(address->text);
 
         free(address->domainname);
-#ifndef NOCRYPTO
-#ifdef WITH_LIBSODIUM
-        free(address->key);
-        free(address->salt);
-#endif /* WITH_LIBSODIUM */
-#endif /* NOCRYPTO */
-
         free(address);
 }
 
@@ -24,6 +24,7 @@
 #include <netinet/in.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #ifdef WITH_LIBSODIUM
 #ifndef NOCRYPTO
 #include <sodium.h>
@@ -58,20 +59,43 @@ typedef struct la_address_s
         int prefix;
         char text[MAX_ADDR_TEXT_SIZE + 1];
         char *domainname;
-
-        /* only used for hosts that we receive messages from */
-#ifndef NOCRYPTO
-#ifdef WITH_LIBSODIUM
-        unsigned char *key;
-        unsigned char *salt;
-#endif /* WITH_LIBSODIUM */
-#endif /* NOCRYPTO */
 } la_address_t;
 
+/* Compact representation of an IP address or network (without port) for
+ * lookups and sorting. Words are in host byte order so comparing them
+ * compares the addresses; IPv4 addresses only use low. family is AF_UNSPEC
+ * for "no address". */
+typedef struct la_address_key_s
+{
+        uint64_t high;
+        uint64_t low;
+        uint8_t family;
+        uint8_t prefix;
+} la_address_key_t;
+
+/* Node of a path-compressed binary (Patricia) trie. key holds the first
+ * prefix bits of the network, all following bits are zero. address is NULL
+ * for pure branching nodes. */
+typedef struct la_prefix_node_s
+{
+        struct la_prefix_node_s *child[2];
+        unsigned char key[16];
+        int prefix;
+        la_address_t *address;
+} la_prefix_node_t;
+
+/* Longest prefix match lookup for a list of networks. Separate tries for
+ * IPv4 and IPv6. The tree doesn't own the addresses, they remain on the list
+ * it was built from. */
+typedef struct la_prefix_tree_s
+{
+        la_prefix_node_t *root4;
+        la_prefix_node_t *root6;
+} la_prefix_tree_t;
+
 void assert_address_ffl(const la_address_t *address, const char *func,
                 const char *file, int line);
 
-bool query_domainname(la_address_t *address);
 
 int get_port(const la_address_t *address);
 
@@ -81,14 +105,49 @@ const char *get_ip_version(const la_address_t *address);
 
 int adrcmp(const la_address_t *a1, const la_address_t *a2);
 
+void init_address_key(la_address_key_t *key, const la_address_t *address);
+
+void init_address_key_sa(la_address_key_t *key, const struct sockaddr *sa);
+
+int adrkeycmp(const la_address_key_t *k1, const la_address_key_t *k2);
+
+void mask_address_key(la_address_key_t *key, int prefix);
+
+bool address_key_in_prefix(const la_address_key_t *key,
+                const la_address_key_t *network);
+
+const char *address_key_text(const la_address_key_t *key, char *buffer);
+
 la_address_t *address_on_list(const la_address_t *address, const kw_list_t *list);
 
 la_address_t *address_on_list_sa(const struct sockaddr *sa, const kw_list_t *list);
 
 la_address_t *address_on_list_str(const char *host, const kw_list_t *list);
 
+void init_prefix_tree(la_prefix_tree_t *tree);
+
+void add_sa_to_prefix_tree(la_prefix_tree_t *tree, const struct sockaddr *sa,
+                int prefix, la_address_t *address);
+
+void add_to_prefix_tree(la_prefix_tree_t *tree, la_address_t *address);
+
+void build_prefix_tree(la_prefix_tree_t *tree, const kw_list_t *list);
+
+void empty_prefix_tree(la_prefix_tree_t *tree);
+
+la_address_t *address_in_prefix_tree_sa(const la_prefix_tree_t *tree,
+                const struct sockaddr *sa);
+
+la_address_t *address_in_prefix_tree(const la_prefix_tree_t *tree,
+                const la_address_t *address);
+
 bool init_address_port(la_address_t *addr, const char *ip, in_port_t port);
 
+bool init_address_numeric(la_address_t *addr, const char *host);
+
+bool init_address_bin(la_address_t *addr, int family,
+                const unsigned char *bytes, int prefix);
+
 la_address_t *create_address_port(const char *ip, in_port_t port);
 
 bool init_address(la_address_t *addr, const char *ip);
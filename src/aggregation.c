@@ -0,0 +1,270 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Aggregation of commands for many hosts within the same network (IPv4 /24,
+ * IPv6 /64 by default) into one command for the whole network.
+ *
+ * For each command template and network, the number of hosts that triggered
+ * the command within aggregate_period is counted. Once aggregate_threshold
+ * is reached, the command is triggered for the network and all end commands
+ * for individual hosts in this network are triggered and removed from the end
+ * queue.
+ */
+
+#include <config.h>
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "ndebug.h"
+#include "aggregation.h"
+#include "addresses.h"
+#include "commands.h"
+#include "configfile.h"
+#include "endqueue.h"
+#include "logging.h"
+#include "misc.h"
+#include "nodelist.h"
+#include "rules.h"
+#include "binarytree.h"
+
+static kw_tree_t *aggregate_list;
+
+int
+aggregate_list_length(void)
+{
+        if (!aggregate_list)
+                return 0;
+
+        return aggregate_list->count;
+}
+
+static void
+free_aggregate(la_aggregate_t *const aggregate)
+{
+        la_vdebug_func(NULL);
+        assert(aggregate);
+
+        free(aggregate);
+}
+
+void
+free_aggregate_list(void)
+{
+        la_vdebug_func(NULL);
+        if (!aggregate_list)
+                return;
+        assert_tree(aggregate_list);
+
+        free_tree(aggregate_list, (void (*)(const void *)) free_aggregate, false);
+        aggregate_list = NULL;
+}
+
+static int
+cmp_aggregates(const void *p1, const void *p2)
+{
+        const la_aggregate_t *const a1 = p1;
+        const la_aggregate_t *const a2 = p2;
+
+        const int result = adrkeycmp(&a1->network, &a2->network);
+        if (result)
+                return result;
+
+        return a1->id < a2->id ? -1 : a1->id > a2->id;
+}
+
+/*
+ * Returns the aggregate for the given network and id - if one is on the
+ * aggregate_list. Returns NULL otherwise.
+ *
+ * While searching through aggregate_list, will remove (and free) all
+ * aggregates whose period has passed (same as find_on_meta_list()).
+ */
+
+static la_aggregate_t *
+find_aggregate(const la_aggregate_t *const search, const time_t now)
+{
+        assert(search);
+
+        assert_tree(aggregate_list);
+
+        kw_tree_node_t *node = aggregate_list->root;
+        for (;;)
+        {
+                if (!node)
+                        return NULL;
+
+                la_aggregate_t *const aggregate = node->payload;
+                assert(aggregate);
+                const int cmp = cmp_aggregates(aggregate, search);
+
+                if (now - aggregate->start_time > la_config->aggregate_period)
+                {
+                        /* Remove expired aggregates */
+                        kw_tree_node_t *tmp = node;
+                        node = remove_tree_node(aggregate_list, node);
+                        free_aggregate((la_aggregate_t *) tmp->payload);
+                }
+                else if (cmp == 0)
+                {
+                        return aggregate;
+                }
+                else if (cmp < 0 && node->right)
+                {
+                        node = node->right;
+                }
+                else if (cmp > 0 && node->left)
+                {
+                        node = node->left;
+                }
+                else
+                {
+                        return NULL;
+                }
+        }
+
+        /* control flow must not reach this point */
+        assert(false);
+        return NULL;
+}
+
+static const la_command_t *
+find_template(const la_command_t *const command)
+{
+        FOREACH(la_command_t, template, &command->rule->begin_commands)
+        {
+                if (template->id == command->id)
+                        return template;
+        }
+
+        return NULL;
+}
+
+/*
+ * Triggers command for network, then triggers and removes all end commands
+ * for hosts within this network (including command itself, which has not been
+ * enqueued yet). Returns false if no command could be created for the
+ * network, command is left untouched in this case.
+ */
+
+static bool
+trigger_network_command(la_command_t *const command,
+                const la_address_key_t *const network)
+{
+        assert_command(command);
+
+        const la_command_t *const template = find_template(command);
+        if (!template)
+                LOG_RETURN(false, LOG_ERR, "Unable to find action \"%s\" for "
+                                "aggregation!", command->node.nodename);
+
+        char text[MAX_ADDR_TEXT_SIZE + 1];
+        char network_text[INET6_ADDRSTRLEN];
+        snprintf(text, sizeof text, "%s/%u", address_key_text(network,
+                                network_text), network->prefix);
+
+        la_address_t address = { 0 };
+        if (!init_address_numeric(&address, text))
+                LOG_RETURN(false, LOG_ERR, "Unable to create network address "
+                                "%s!", text);
+
+        la_command_t *const network_command = create_command_from_template(
+                        template, command->pattern, &address);
+        if (!network_command)
+                return false;
+
+        la_log(LOG_INFO, "Network: %s, aggregating action \"%s\" for rule "
+                        "\"%s\".", text, command->node.nodename,
+                        command->rule_name);
+
+        trigger_command(network_command);
+        enqueue_end_command(network_command, 0);
+
+        const int n_removed = remove_and_trigger_network(network, command->id);
+
+        trigger_end_command(command, true);
+        free_command(command);
+
+        la_log(LOG_INFO, "Network: %s, replaced %u host(s).", text,
+                        n_removed + 1);
+
+        return true;
+}
+
+/*
+ * Counts command for the network its host belongs to. Returns true in case
+ * the threshold was reached. In this case, the command for the whole network
+ * has been triggered and command itself has been ended and freed - i.e. it
+ * must not be used by the caller anymore. Returns false otherwise.
+ *
+ * Must be called with config_mutex held.
+ */
+
+bool
+aggregate_command(la_command_t *const command)
+{
+        assert_command(command);
+        la_vdebug_func(command->node.nodename);
+
+        if (la_config->aggregate_threshold <= 0 || !command->address)
+                return false;
+
+        la_aggregate_t search = { .id = command->id };
+        search.network = command->adr_key;
+        const int prefix = search.network.family == AF_INET ?
+                la_config->aggregate_ipv4_prefix :
+                la_config->aggregate_ipv6_prefix;
+        /* Only aggregate hosts (or smaller networks) */
+        if (prefix >= search.network.prefix)
+                return false;
+        mask_address_key(&search.network, prefix);
+
+        if (!aggregate_list)
+                aggregate_list = create_tree();
+
+        const time_t now = xtime(NULL);
+
+        la_aggregate_t *aggregate = find_aggregate(&search, now);
+        if (!aggregate)
+        {
+                aggregate = xmalloc(sizeof *aggregate);
+                *aggregate = search;
+                aggregate->adr_node.payload = aggregate;
+                aggregate->start_time = now;
+                aggregate->count = 0;
+                add_to_tree(aggregate_list, &aggregate->adr_node,
+                                cmp_aggregates);
+        }
+
+        aggregate->count++;
+        if (aggregate->count < la_config->aggregate_threshold)
+                return false;
+
+        /* Start counting anew, the network command will make sure no further
+         * commands for hosts in this network will be triggered for a while */
+        aggregate->count = 0;
+        aggregate->start_time = now;
+
+        return trigger_network_command(command, &search.network);
+}
+
+/* vim: set autowrite expandtab: */
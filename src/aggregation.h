@@ -0,0 +1,51 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __aggregation_h
+#define __aggregation_h
+
+#include <time.h>
+#include <stdbool.h>
+
+#include "ndebug.h"
+#include "addresses.h"
+#include "commands.h"
+#include "binarytree.h"
+
+/* aggregation.c */
+
+/* Number of commands with the same id triggered for hosts within the same
+ * network during the current period */
+typedef struct la_aggregate_s
+{
+        kw_tree_node_t adr_node;
+        la_address_key_t network;
+        int id;
+        time_t start_time;
+        int count;
+} la_aggregate_t;
+
+int aggregate_list_length(void);
+
+void free_aggregate_list(void);
+
+bool aggregate_command(la_command_t *command);
+
+#endif /* __aggregation_h */
+
+/* vim: set autowrite expandtab: */
@@ -0,0 +1,216 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Binary encoding of add messages (remote setting binary_messages).
+ *
+ * Parsing a textual add message means scanning it and converting the address
+ * string - which goes through getaddrinfo(). Binary entries carry the raw
+ * address and fixed width integers instead, so decoding them is a few
+ * memcpy()s. Entries can be concatenated into a single message just like the
+ * entries of a batch message.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ndebug.h"
+#include "binmsg.h"
+#include "addresses.h"
+#include "messages.h"
+
+/* Offsets within an entry */
+#define BINMSG_FAMILY_IDX 1
+#define BINMSG_PREFIX_IDX 2
+#define BINMSG_ADDR_IDX 3
+#define BINMSG_END_TIME_IDX (BINMSG_ADDR_IDX + BINMSG_ADDR_LEN)
+#define BINMSG_FACTOR_IDX (BINMSG_END_TIME_IDX + 8)
+#define BINMSG_RULE_LEN_IDX (BINMSG_FACTOR_IDX + 4)
+
+static void
+store_be(unsigned char *const bytes, uint64_t value, const int len)
+{
+        for (int i = len - 1; i >= 0; i--)
+        {
+                bytes[i] = value & 0xFF;
+                value >>= 8;
+        }
+}
+
+static uint64_t
+load_be(const unsigned char *const bytes, const int len)
+{
+        uint64_t result = 0;
+
+        for (int i = 0; i < len; i++)
+                result = (result << 8) | bytes[i];
+
+        return result;
+}
+
+/*
+ * Creates a single entry for command, address and rule at entry (which must
+ * have room for BINMSG_ENTRY_LEN + BINMSG_MAX_RULE_LEN bytes). end_time and
+ * factor may be 0.
+ *
+ * Returns the length of the entry or 0 if address is neither IPv4 nor IPv6 or
+ * the rule name is too long.
+ */
+
+size_t
+init_binary_entry(char *const entry, const char command,
+                const la_address_t *const address, const char *const rule,
+                const time_t end_time, const int factor)
+{
+        assert(entry); assert(command == CMD_ADD || command == CMD_DEL);
+        assert_address(address); assert(rule);
+
+        const size_t rule_len = strlen(rule);
+        if (rule_len > BINMSG_MAX_RULE_LEN)
+                return 0;
+
+        unsigned char *const uentry = (unsigned char *) entry;
+        memset(uentry, 0, BINMSG_ENTRY_LEN);
+
+        if (address->sa.ss_family == AF_INET)
+        {
+                uentry[BINMSG_FAMILY_IDX] = BINMSG_INET;
+                memcpy(&uentry[BINMSG_ADDR_IDX], &((struct sockaddr_in *)
+                                        &address->sa)->sin_addr, 4);
+        }
+        else if (address->sa.ss_family == AF_INET6)
+        {
+                uentry[BINMSG_FAMILY_IDX] = BINMSG_INET6;
+                memcpy(&uentry[BINMSG_ADDR_IDX], &((struct sockaddr_in6 *)
+                                        &address->sa)->sin6_addr, 16);
+        }
+        else
+        {
+                return 0;
+        }
+
+        uentry[0] = command;
+        uentry[BINMSG_PREFIX_IDX] = address->prefix;
+        store_be(&uentry[BINMSG_END_TIME_IDX], end_time, 8);
+        store_be(&uentry[BINMSG_FACTOR_IDX], (uint32_t) factor, 4);
+        uentry[BINMSG_RULE_LEN_IDX] = rule_len;
+        memcpy(&uentry[BINMSG_ENTRY_LEN], rule, rule_len);
+
+        return BINMSG_ENTRY_LEN + rule_len;
+}
+
+/*
+ * Creates a binary message with a single add entry for address and rule in
+ * buffer (which must be at least MSG_LEN bytes long). end_time and factor may
+ * be 0.
+ *
+ * Returns false if address is neither IPv4 nor IPv6 or the rule name is too
+ * long.
+ */
+
+bool
+init_binary_add_message(char *const buffer, const la_address_t *const address,
+                const char *const rule, const time_t end_time,
+                const int factor)
+{
+        assert(buffer);
+
+        buffer[MSG_IDX] = PROTOCOL_VERSION_BINARY;
+
+        return init_binary_entry(&buffer[MSG_IDX + 1], CMD_ADD, address, rule,
+                        end_time, factor) > 0;
+}
+
+/*
+ * Returns the length of the entry at the start of the len bytes at entry - or
+ * 0 if there's no complete entry.
+ */
+
+size_t
+binary_entry_len(const char *const entry, const size_t len)
+{
+        assert(entry);
+
+        if (len < BINMSG_ENTRY_LEN ||
+                        (*entry != CMD_ADD && *entry != CMD_DEL))
+                return 0;
+
+        const size_t result = BINMSG_ENTRY_LEN +
+                (unsigned char) entry[BINMSG_RULE_LEN_IDX];
+
+        return result <= len ? result : 0;
+}
+
+/*
+ * Decodes the entry at the start of the len bytes at entry. address will be
+ * initialized, the rule name copied to rule (which must have room for
+ * BINMSG_MAX_RULE_LEN + 1 bytes).
+ *
+ * Returns the length of the entry or 0 if it is malformed.
+ */
+
+size_t
+parse_binary_entry(const char *const entry, const size_t len,
+                la_address_t *const address, char *const rule,
+                time_t *const end_time, int *const factor)
+{
+        assert(entry); assert(address); assert(rule); assert(end_time);
+        assert(factor);
+
+        const size_t result = binary_entry_len(entry, len);
+        if (!result)
+                return 0;
+
+        const unsigned char *const uentry = (const unsigned char *) entry;
+        const size_t rule_len = uentry[BINMSG_RULE_LEN_IDX];
+        if (!rule_len || rule_len > BINMSG_MAX_RULE_LEN ||
+                        memchr(&entry[BINMSG_ENTRY_LEN], '\0', rule_len))
+                return 0;
+
+        int family;
+        switch (uentry[BINMSG_FAMILY_IDX])
+        {
+        case BINMSG_INET:
+                family = AF_INET;
+                break;
+        case BINMSG_INET6:
+                family = AF_INET6;
+                break;
+        default:
+                return 0;
+        }
+
+        if (!init_address_bin(address, family, &uentry[BINMSG_ADDR_IDX],
+                                uentry[BINMSG_PREFIX_IDX]))
+                return 0;
+
+        memcpy(rule, &entry[BINMSG_ENTRY_LEN], rule_len);
+        rule[rule_len] = '\0';
+        *end_time = load_be(&uentry[BINMSG_END_TIME_IDX], 8);
+        *factor = (int32_t) load_be(&uentry[BINMSG_FACTOR_IDX], 4);
+
+        return result;
+}
+
+/* vim: set autowrite expandtab: */
@@ -0,0 +1,63 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __binmsg_h
+#define __binmsg_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "ndebug.h"
+#include "addresses.h"
+
+/*
+ * Binary message (protocol version '4'), i.e. the protocol version followed
+ * by one or more entries of the form
+ *      <command><family><prefix><address><end time><factor><length><rule>
+ *
+ * command is CMD_ADD (CMD_DEL is only used in the state journal, see state.h).
+ * family is BINMSG_INET or BINMSG_INET6, address always has BINMSG_ADDR_LEN
+ * bytes (IPv4 addresses use the first four, the rest is 0). end time (8 bytes)
+ * and factor (4 bytes) are in network byte order, 0 means the receiving end
+ * decides. length (1 byte) is the length of the rule name following (without
+ * '\0').
+ */
+#define BINMSG_INET 4
+#define BINMSG_INET6 6
+#define BINMSG_ADDR_LEN 16
+#define BINMSG_MAX_RULE_LEN 100
+/* Length of an entry without the rule name */
+#define BINMSG_ENTRY_LEN (3 + BINMSG_ADDR_LEN + 8 + 4 + 1)
+
+size_t init_binary_entry(char *entry, char command,
+                const la_address_t *address, const char *rule, time_t end_time,
+                int factor);
+
+bool init_binary_add_message(char *buffer, const la_address_t *address,
+                const char *rule, time_t end_time, int factor);
+
+size_t binary_entry_len(const char *entry, size_t len);
+
+size_t parse_binary_entry(const char *entry, size_t len,
+                la_address_t *address, char *rule, time_t *end_time,
+                int *factor);
+
+#endif /* __binmsg_h */
+
+/* vim: set autowrite expandtab: */
@@ -0,0 +1,248 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cluster mode (remote setting cluster) for several hosts sharing one
+ * firewall.
+ *
+ * Every address is owned by exactly one of the members, i.e. this host and
+ * the hosts on send_to. Only the owner executes begin and end actions, the
+ * others just keep track of the address in their end queue. Ownership is
+ * determined by rendezvous (highest random weight) hashing: each member gets
+ * a weight per address, the member with the highest weight wins. If a member
+ * goes quiet, only the addresses it owned move to other members.
+ *
+ * Members which haven't been heard from for CLUSTER_TIMEOUT seconds are left
+ * out, so their addresses are taken over by the remaining ones. This host is
+ * always in. New members count as alive until they had the chance to send a
+ * heartbeat - otherwise this host would own all addresses right after startup
+ * and e.g. execute begin actions for all restored entries.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ndebug.h"
+#include "cluster.h"
+#include "addresses.h"
+#include "logging.h"
+#include "misc.h"
+#include "nodelist.h"
+
+typedef struct la_cluster_member_s
+{
+        la_address_key_t key;
+        time_t last_seen;
+} la_cluster_member_t;
+
+/* Cluster members (except this host). cluster_enabled is false if not in
+ * cluster mode. Protected by cluster_mutex, lock any other mutex before
+ * cluster_mutex. */
+static pthread_mutex_t cluster_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool cluster_enabled = false;
+static la_address_key_t own_key;
+static la_cluster_member_t *members = NULL;
+static int members_length = 0;
+
+/*
+ * Returns member with the given key - or NULL. Must be called with
+ * cluster_mutex held.
+ */
+
+static la_cluster_member_t *
+find_member(const la_address_key_t *const key)
+{
+        assert(key);
+
+        for (int i = 0; i < members_length; i++)
+        {
+                if (!adrkeycmp(&members[i].key, key))
+                        return &members[i];
+        }
+
+        return NULL;
+}
+
+/*
+ * Sets the cluster members: this host (self) and peers, a list of
+ * la_address_t. Members already known keep their state, new ones are assumed
+ * to be alive. Switches cluster mode off if self is NULL.
+ */
+
+void
+set_cluster_members(const la_address_t *const self,
+                const kw_list_t *const peers)
+{
+        la_debug_func(self ? self->text : NULL);
+        const time_t now = xtime(NULL);
+
+        xpthread_mutex_lock(&cluster_mutex);
+
+                cluster_enabled = self;
+                if (self)
+                {
+                        init_address_key(&own_key, self);
+
+                        const int n = peers ? list_length(peers) : 0;
+                        la_cluster_member_t *const new_members = n ?
+                                xmalloc0(n * sizeof *new_members) : NULL;
+                        int i = 0;
+                        if (peers)
+                        {
+                                FOREACH(la_address_t, peer, peers)
+                                {
+                                        la_cluster_member_t *const member =
+                                                &new_members[i++];
+                                        init_address_key(&member->key, peer);
+                                        const la_cluster_member_t *const old =
+                                                find_member(&member->key);
+                                        member->last_seen = old ?
+                                                old->last_seen : now;
+                                }
+                        }
+
+                        free(members);
+                        members = new_members;
+                        members_length = n;
+                }
+
+        xpthread_mutex_unlock(&cluster_mutex);
+}
+
+/*
+ * Records that a message has been received from sa. Ignored unless sa is one
+ * of the members.
+ */
+
+void
+cluster_member_seen(const struct sockaddr *const sa)
+{
+        assert(sa);
+
+        la_address_key_t key;
+        init_address_key_sa(&key, sa);
+        const time_t now = xtime(NULL);
+
+        xpthread_mutex_lock(&cluster_mutex);
+
+                la_cluster_member_t *const member = find_member(&key);
+                if (member)
+                        member->last_seen = now;
+
+        xpthread_mutex_unlock(&cluster_mutex);
+}
+
+/*
+ * Returns weight of member for address. Mixes both keys with FNV-1a and
+ * finalizes the result so similar addresses get unrelated weights.
+ */
+
+static uint64_t
+member_weight(const la_address_key_t *const member,
+                const la_address_key_t *const address)
+{
+        const uint64_t words[] = { member->high, member->low, member->family,
+                address->high, address->low,
+                (uint64_t) address->family << 8 | address->prefix };
+
+        uint64_t result = 14695981039346656037ULL;
+        for (unsigned int i = 0; i < sizeof words / sizeof *words; i++)
+        {
+                for (int shift = 0; shift < 64; shift += 8)
+                        result = (result ^ ((words[i] >> shift) & 0xFF)) *
+                                1099511628211ULL;
+        }
+
+        result ^= result >> 33;
+        result *= 0xff51afd7ed558ccdULL;
+        result ^= result >> 33;
+        result *= 0xc4ceb9fe1a85ec53ULL;
+        result ^= result >> 33;
+
+        return result;
+}
+
+/*
+ * Returns true if this host is responsible for executing actions for address
+ * - i.e. if no other member which has been heard from recently has a higher
+ * weight for address. Always true if not in cluster mode.
+ */
+
+bool
+owns_address(const la_address_t *const address)
+{
+        assert_address(address);
+
+        la_address_key_t key;
+        init_address_key(&key, address);
+        const time_t now = xtime(NULL);
+        bool result = true;
+
+        xpthread_mutex_lock(&cluster_mutex);
+
+                if (cluster_enabled)
+                {
+                        const uint64_t own_weight = member_weight(&own_key,
+                                        &key);
+                        for (int i = 0; i < members_length && result; i++)
+                        {
+                                if (now - members[i].last_seen <
+                                                CLUSTER_TIMEOUT &&
+                                                member_weight(&members[i].key,
+                                                        &key) > own_weight)
+                                        result = false;
+                        }
+                }
+
+        xpthread_mutex_unlock(&cluster_mutex);
+
+        return result;
+}
+
+/*
+ * Returns true if in cluster mode and at least one other member has been
+ * heard from recently.
+ */
+
+bool
+cluster_peers_alive(void)
+{
+        const time_t now = xtime(NULL);
+        bool result = false;
+
+        xpthread_mutex_lock(&cluster_mutex);
+
+                if (cluster_enabled)
+                {
+                        for (int i = 0; i < members_length && !result; i++)
+                                result = now - members[i].last_seen <
+                                        CLUSTER_TIMEOUT;
+                }
+
+        xpthread_mutex_unlock(&cluster_mutex);
+
+        return result;
+}
+
+/* vim: set autowrite expandtab: */
@@ -0,0 +1,46 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __cluster_h
+#define __cluster_h
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ndebug.h"
+#include "addresses.h"
+#include "nodelist.h"
+
+/* Seconds between two heartbeats sent to the other cluster members */
+#define CLUSTER_HEARTBEAT_INTERVAL 10
+
+/* Members not heard from for that many seconds no longer own addresses */
+#define CLUSTER_TIMEOUT (3 * CLUSTER_HEARTBEAT_INTERVAL)
+
+void set_cluster_members(const la_address_t *self, const kw_list_t *peers);
+
+void cluster_member_seen(const struct sockaddr *sa);
+
+bool owns_address(const la_address_t *address);
+
+bool cluster_peers_alive(void);
+
+#endif /* __cluster_h */
+
+/* vim: set autowrite expandtab: */
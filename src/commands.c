@@ -29,6 +29,7 @@
 
 #include "ndebug.h"
 #include "addresses.h"
+#include "cluster.h"
 #include "commands.h"
 #include "configfile.h"
 #include "endqueue.h"
@@ -296,11 +297,38 @@ convert_both_commands(la_command_t *const command)
 }
 
 
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
 /*
- * Executes command string via system() and logs result.
+ * Returns false if another cluster member takes care of the command. Begin
+ * actions are executed by the owner of the address, end actions by the
+ * member which has executed the begin action - ownership might have moved in
+ * the meantime. On shutdown, end actions are left to the other members as
+ * long as any of them is still around - they keep track of the addresses and
+ * will take them over.
  */
 
-void
+static bool
+is_own_command(const la_command_t *const command,
+                const la_commandtype_t type)
+{
+        if (command->is_template || !command->address)
+                return true;
+
+        if (type == LA_COMMANDTYPE_BEGIN)
+                return owns_address(command->address);
+        else
+                return command->begin_executed &&
+                        !(shutdown_ongoing && cluster_peers_alive());
+}
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+
+/*
+ * Executes command string via system() and logs result. In cluster mode,
+ * commands for addresses owned by other members are skipped. Returns false
+ * if skipped.
+ */
+
+bool
 exec_command(const la_command_t *command, const la_commandtype_t type)
 {
         /* Don't assert_command() here, as after a reload some commands might
@@ -309,6 +337,14 @@ exec_command(const la_command_t *command, const la_commandtype_t type)
         assert(command->node.nodename);
         la_debug_func(command->node.nodename);
 
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
+        if (!is_own_command(command, type))
+                LOG_RETURN_VERBOSE(false, LOG_INFO, "Host: %s, action \"%s\" left "
+                                "to other cluster member.",
+                                command->address->text,
+                                command->node.nodename);
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+
         const int result = system(type == LA_COMMANDTYPE_BEGIN ?
                         command->begin_string_converted :
                         command->end_string_converted);
@@ -334,6 +370,8 @@ exec_command(const la_command_t *command, const la_commandtype_t type)
                                 command->end_string_converted);
                 break;
         }
+
+        return true;
 }
 
 #if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
@@ -424,10 +462,9 @@ trigger_manual_command(const la_address_t *const address,
                                 "is in the past.");
 
         assert(la_config);
-        la_address_t *tmp_addr = address_on_list(address, &la_config->ignore_addresses);
+        la_address_t *tmp_addr = find_ignored_address(address);
         if (tmp_addr)
         {
-                reprioritize_node((kw_node_t *) tmp_addr, 1);
                 LOG_RETURN(, LOG_INFO, "Host: %s, manual trigger ignored.",
                                 ADDRESS_NAME(tmp_addr));
         }
@@ -458,7 +495,7 @@ trigger_manual_command(const la_address_t *const address,
 
         command->rule->queue_count++;
 
-        exec_command(command, LA_COMMANDTYPE_BEGIN);
+        command->begin_executed = exec_command(command, LA_COMMANDTYPE_BEGIN);
         if (command->end_string && command->duration > 0)
         {
                 /* If end_time was specified, use this. Otherwise  (i.e. if
@@ -498,7 +535,7 @@ trigger_command(la_command_t *const command)
 
         log_trigger(command, NULL);
 
-        exec_command(command, LA_COMMANDTYPE_BEGIN);
+        command->begin_executed = exec_command(command, LA_COMMANDTYPE_BEGIN);
 }
 
 #endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
@@ -685,6 +722,7 @@ create_command_from_template(const la_command_t *const template,
         copy_property_list(&result->pattern_properties, &pattern->properties);
 
         result->address = address ? dup_address(address) : NULL;
+        init_address_key(&result->adr_key, address);
         result->end_time = result->n_triggers = result->start_time= 0;
         result->submission_type = LA_SUBMISSION_LOCAL;
         result->previously_on_blacklist = false;
@@ -728,6 +766,7 @@ create_manual_command_from_template(const la_command_t *const template,
         init_list(&result->pattern_properties);
 
         result->address = address ? dup_address(address) : NULL;
+        init_address_key(&result->adr_key, address);
         result->end_time = result->n_triggers = result->start_time= 0;
 #ifndef CLIENTONLY
         result->submission_type = is_local_address(from_addr) ?
@@ -827,7 +866,8 @@ const char *
 command_address_on_dnsbl(const la_command_t *const command)
 {
         assert_command(command);
-        return host_on_any_dnsbl(&command->rule->blacklists, command->address);
+        return host_on_any_dnsbl(&command->rule->blacklists, command->address,
+                        command->rule_name, command->id);
 }
 #endif /* CLIENTONLY */
 
@@ -66,6 +66,7 @@ struct la_command_s
         struct la_pattern_s *pattern;        /* related pattern*/
         struct kw_list_s pattern_properties; /* properties from matched pattern */
         struct la_address_s *address;     /* IP address */
+        la_address_key_t adr_key;      /* compact copy of address for lookups */
         enum la_need_host_s need_host;    /* Command requires host */
         int duration;                /* duration how long command shall stay active,
                                    -1 if none */
@@ -73,9 +74,13 @@ struct la_command_s
         enum la_submission_s submission_type;
         bool previously_on_blacklist;         /* True if command has been triggered via blacklist */
         bool quick_shutdown;
+        bool begin_executed;    /* begin action has been executed (or taken
+                                   over from another cluster member) here,
+                                   end action must be executed here as well */
 
         /* only relevant for end_commands */
         time_t end_time;        /* specific time for enqueued end_commands */
+        time_t dnsbl_check_deadline;   /* waiting for DNSBL lookups until then */
         char *rule_name;
 
         /* only relevant in trigger_list */
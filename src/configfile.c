@@ -36,6 +36,7 @@
 #include "ndebug.h"
 #include "addresses.h"
 #include "commands.h"
+#include "dnsbl.h"
 #include "configfile.h"
 #include "endqueue.h"
 #include "logactiond.h"
@@ -253,6 +254,43 @@ get_source_prefix(const config_setting_t *const rule,
         return result;
 }
 
+/*
+ * Returns whether syslog headers of the source corresponding to the given rule
+ * should be parsed (instead of matching the prefix for each pattern).
+ */
+
+static bool
+get_source_syslog_header(const config_setting_t *const rule,
+                const config_setting_t *const uc_rule)
+{
+        assert(uc_rule);
+
+        const config_setting_t *const source_def =
+                get_source_uc_rule_or_rule(rule, uc_rule);
+
+        int result;
+        if (!config_setting_lookup_bool(source_def, LA_SOURCE_SYSLOG_HEADER,
+                                &result))
+                result = false;
+
+        return result;
+}
+
+/*
+ * Returns unsigned int setting of the source corresponding to the given rule,
+ * -1 if not specified.
+ */
+
+static int
+get_source_unsigned_int(const config_setting_t *const rule,
+                const config_setting_t *const uc_rule, const char *const name)
+{
+        assert(uc_rule); assert(name);
+
+        return config_get_unsigned_int_or_negative(
+                        get_source_uc_rule_or_rule(rule, uc_rule), name);
+}
+
 /*
  * Return source location to corresponding rule. Look first in user
  * configuration section, then in rule section.
@@ -364,8 +402,25 @@ compile_list_of_actions(la_rule_t *const rule,
         }
 }
 
+static void
+add_blacklist(la_rule_t *const rule, const char *const name)
+{
+        assert_rule(rule);
+
+        if (!name)
+                die_hard(false, "Blacklist for rule \"%s\" is not a string!",
+                                rule->node.nodename);
+        if (!strcmp(name, DNSBL_FILE_PREFIX))
+                die_hard(false, "Missing zone file name for blacklist of rule "
+                                "\"%s\"!", rule->node.nodename);
+
+        kw_node_t *const new = create_node(sizeof *new, 0, name);
+        add_tail(&rule->blacklists, new);
+}
+
 /*
- * Reads all blacklists assigned to a rule
+ * Reads all blacklists assigned to a rule. Besides DNSBL domain names, these
+ * can be rbldnsd style zone files ("file:" followed by the file name).
  */
 
 static void
@@ -394,9 +449,8 @@ load_blacklists(la_rule_t *const rule, const config_setting_t *const uc_rule_def
 
         if (type == CONFIG_TYPE_STRING)
         {
-                kw_node_t *const new = create_node(sizeof *new, 0,
-                                config_setting_get_string(blacklist_reference));
-                add_tail(&rule->blacklists, new);
+                add_blacklist(rule, config_setting_get_string(
+                                        blacklist_reference));
         }
         else if (type == CONFIG_TYPE_LIST)
         {
@@ -406,9 +460,8 @@ load_blacklists(la_rule_t *const rule, const config_setting_t *const uc_rule_def
                 {
                         const config_setting_t *const list_item = 
                                 config_setting_get_elem(blacklist_reference, i);
-                        kw_node_t *const new = create_node(sizeof *new, 0, 
-                                        config_setting_get_string(list_item));
-                        add_tail(&rule->blacklists, new);
+                        add_blacklist(rule, config_setting_get_string(
+                                                list_item));
                 }
         }
         else
@@ -518,8 +571,12 @@ compile_address_list_port_domainname(kw_list_t *const list,
                 if (!address)
                         die_hard(false, "Invalid IP address %s!", ip);
 
+#ifndef CLIENTONLY
+                /* Only queues the reverse lookup, startup must not wait for
+                 * DNS */
                 if (domainname)
-                        (void) query_domainname(address);
+                        lookup_domainname(address);
+#endif /* CLIENTONLY */
 
                 la_debug("compile_address_list_port_domainname(%s)=%s(%s)",
                                 config_setting_name(setting),
@@ -640,6 +697,12 @@ create_file_sources(const config_setting_t *const rule_def,
 
         /* First create single source_group */
         la_source_group_t *result = create_source_group(name, location, prefix);
+        result->syslog_header = get_source_syslog_header(rule_def, uc_rule_def);
+        init_line_cache(result,
+                        get_source_unsigned_int(rule_def, uc_rule_def,
+                                LA_SOURCE_LINE_CACHE_SIZE),
+                        get_source_unsigned_int(rule_def, uc_rule_def,
+                                LA_SOURCE_LINE_CACHE_SKIP));
 
         glob_t pglob;
         if (glob(location, 0, NULL, &pglob))
@@ -660,34 +723,10 @@ create_file_sources(const config_setting_t *const rule_def,
         return result;
 }
 
-/*
- * Add systemd unit to systemd_source's list of systemd unit. Makes sure, a
- * unit with the same name isn't added more than once.
- */
-
 #if HAVE_LIBSYSTEMD
-#ifndef NOWATCH
-static void
-add_systemd_unit_to_list(const char *const systemd_unit)
-{
-        assert(systemd_unit);
-
-        kw_list_t *const ex_systemd_units = &la_config->systemd_source_group->systemd_units;
-        assert_list(ex_systemd_units);
-
-        FOREACH(kw_node_t, tmp, ex_systemd_units)
-        {
-                if (!strcmp(systemd_unit, tmp->nodename))
-                        return;
-        }
-
-        kw_node_t *const node = create_node(sizeof *node, 0, systemd_unit);
-        add_tail(ex_systemd_units, node);
-}
-#endif /* NOWATCH */
-
 /*
- * Adds a systemd unit.
+ * Returns the systemd source group. The unit itself is registered together
+ * with its rule in load_single_rule().
  *
  * Initializes la_config->systemd_source if it didn't exist so far.
  */
@@ -707,9 +746,6 @@ create_systemd_unit(const char *const systemd_unit)
                 add_tail(&la_config->systemd_source_group->sources,
                                 (kw_node_t *) systemd_source);
         }
-#ifndef NOWATCH
-        add_systemd_unit_to_list(systemd_unit);
-#endif /* NOWATCH */
 
         return la_config->systemd_source_group;
 }
@@ -819,6 +855,10 @@ load_single_rule(const config_setting_t *const uc_rule_def)
         load_blacklists(new_rule, uc_rule_def);
 
         add_tail(&source_group->rules, (kw_node_t *) new_rule);
+#if HAVE_LIBSYSTEMD && !defined(NOWATCH)
+        if (systemd_unit)
+                add_rule_to_systemd_unit(source_group, new_rule);
+#endif /* HAVE_LIBSYSTEMD && !defined(NOWATCH) */
 
         return enabled;
 }
@@ -851,6 +891,11 @@ load_rules(void)
                         num_rules_enabled++;
         }
 
+#if HAVE_LIBSYSTEMD && !defined(NOWATCH)
+        if (la_config->systemd_source_group)
+                index_systemd_units(la_config->systemd_source_group);
+#endif /* HAVE_LIBSYSTEMD && !defined(NOWATCH) */
+
         return num_rules_enabled;
 }
 
@@ -861,6 +906,14 @@ load_remote_settings(void)
         assert(la_config);
 
         la_config->remote_enabled = false;
+        la_config->remote_batch_latency = DEFAULT_REMOTE_BATCH_LATENCY;
+        la_config->remote_salt_rotation = DEFAULT_REMOTE_SALT_ROTATION;
+        la_config->remote_key_exchange = false;
+        la_config->remote_sync_stream = false;
+        la_config->remote_anti_entropy = DEFAULT_REMOTE_ANTI_ENTROPY;
+        la_config->remote_binary_messages = false;
+        la_config->remote_cluster = false;
+        init_prefix_tree(&la_config->remote_receive_from_tree);
 
         config_setting_t *const remote_section =
                 config_lookup(&la_config->config_file, LA_REMOTE_LABEL);
@@ -886,6 +939,8 @@ load_remote_settings(void)
         init_list(&la_config->remote_receive_from);
         compile_address_list_port_domainname(&la_config->remote_receive_from,
                         receive_from, 0, true);
+        build_prefix_tree(&la_config->remote_receive_from_tree,
+                        &la_config->remote_receive_from);
 
         la_config->remote_bind = xstrdup(config_get_string_or_null(remote_section,
                         LA_REMOTE_BIND_LABEL));
@@ -895,6 +950,37 @@ load_remote_settings(void)
         if (la_config->remote_port < 0)
                 la_config->remote_port = DEFAULT_PORT;
 
+        const int batch_latency = config_get_unsigned_int_or_negative(
+                        remote_section, LA_REMOTE_BATCH_LATENCY_LABEL);
+        if (batch_latency >= 0)
+                la_config->remote_batch_latency = batch_latency;
+
+        const int salt_rotation = config_get_unsigned_int_or_negative(
+                        remote_section, LA_REMOTE_SALT_ROTATION_LABEL);
+        if (salt_rotation >= 0)
+                la_config->remote_salt_rotation = salt_rotation;
+
+        config_setting_lookup_bool(remote_section, LA_REMOTE_KEY_EXCHANGE_LABEL,
+                        &la_config->remote_key_exchange);
+
+        config_setting_lookup_bool(remote_section, LA_REMOTE_SYNC_STREAM_LABEL,
+                        &la_config->remote_sync_stream);
+
+        const int anti_entropy = config_get_unsigned_int_or_negative(
+                        remote_section, LA_REMOTE_ANTI_ENTROPY_LABEL);
+        if (anti_entropy >= 0)
+                la_config->remote_anti_entropy = anti_entropy;
+
+        config_setting_lookup_bool(remote_section,
+                        LA_REMOTE_BINARY_MESSAGES_LABEL,
+                        &la_config->remote_binary_messages);
+
+        config_setting_lookup_bool(remote_section, LA_REMOTE_CLUSTER_LABEL,
+                        &la_config->remote_cluster);
+        if (la_config->remote_cluster && (!la_config->remote_bind ||
+                                !strcmp(la_config->remote_bind, "*")))
+                die_hard(false, "Cluster mode requires a bind address");
+
         /* Must obviously go after initialization of remote port... */
         const config_setting_t *const send_to = config_setting_lookup(remote_section,
                         LA_REMOTE_SEND_TO_LABEL);
@@ -948,6 +1034,224 @@ load_file_settings(void)
         }
 }
 
+static void
+load_systemd_settings(void)
+{
+        la_debug_func(NULL);
+        assert(la_config);
+
+        const config_setting_t *const systemd_section =
+                config_lookup(&la_config->config_file, LA_SYSTEMD_LABEL);
+
+        la_config->systemd_batch_size = DEFAULT_SYSTEMD_BATCH_SIZE;
+        la_config->systemd_batch_latency = DEFAULT_SYSTEMD_BATCH_LATENCY;
+
+        if (systemd_section)
+        {
+                const int batch_size = config_get_unsigned_int_or_negative(
+                                systemd_section, LA_SYSTEMD_BATCH_SIZE_LABEL);
+                if (batch_size == 0)
+                        die_hard(false, LA_SYSTEMD_BATCH_SIZE_LABEL
+                                        " must be at least 1!");
+                else if (batch_size > 0)
+                        la_config->systemd_batch_size = batch_size;
+
+                const int batch_latency = config_get_unsigned_int_or_negative(
+                                systemd_section,
+                                LA_SYSTEMD_BATCH_LATENCY_LABEL);
+                if (batch_latency >= 0)
+                        la_config->systemd_batch_latency = batch_latency;
+        }
+
+#if HAVE_LIBSYSTEMD
+        if (systemd_section && la_config->systemd_source_group)
+                init_line_cache(la_config->systemd_source_group,
+                                config_get_unsigned_int_or_negative(
+                                        systemd_section,
+                                        LA_SYSTEMD_LINE_CACHE_SIZE_LABEL), 0);
+#endif /* HAVE_LIBSYSTEMD */
+}
+
+/*
+ * Reads plain text file with one address or network (in CIDR notation) per
+ * line. Empty lines and everything after '#' are ignored. Addresses are
+ * parsed numerically, no name resolution takes place.
+ *
+ * On success, *addresses will point to a newly allocated array with
+ * *n_addresses elements and a prefix tree for these addresses will be built
+ * in *tree. Returns false if the file can't be read.
+ */
+
+static bool
+read_ignore_file(const char *const filename, la_address_t **const addresses,
+                size_t *const n_addresses, la_prefix_tree_t *const tree)
+{
+        assert(filename); assert(addresses); assert(n_addresses); assert(tree);
+        la_debug_func(filename);
+
+        FILE *const stream = fopen(filename, "r");
+        if (!stream)
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to open ignore file "
+                                "\"%s\"", filename);
+
+        la_address_t *result = NULL;
+        size_t n_result = 0;
+        size_t result_size = 0;
+        char *linebuffer = NULL;
+        size_t linebuffer_size = 0;
+        unsigned int line_no = 0;
+
+        while (getline(&linebuffer, &linebuffer_size, stream) != -1)
+        {
+                line_no++;
+
+                char *start = linebuffer;
+                while (*start == ' ' || *start == '\t')
+                        start++;
+                char *end = start;
+                while (*end && *end != '#' && *end != ' ' && *end != '\t' &&
+                                *end != '\n' && *end != '\r')
+                        end++;
+                if (end == start)
+                        continue;
+                *end = '\0';
+
+                if (n_result == result_size)
+                {
+                        result_size = result_size ? result_size * 2 : 1024;
+                        result = xrealloc(result, result_size * sizeof *result);
+                }
+
+                memset(&result[n_result], 0, sizeof *result);
+                if (init_address_numeric(&result[n_result], start))
+                        n_result++;
+                else
+                        la_log(LOG_WARNING, "Invalid address \"%s\" in line "
+                                        "%u of ignore file \"%s\"!", start,
+                                        line_no, filename);
+        }
+
+        const bool read_error = ferror(stream);
+        free(linebuffer);
+        fclose(stream);
+
+        if (read_error)
+        {
+                free(result);
+                LOG_RETURN(false, LOG_ERR, "Error reading ignore file \"%s\"",
+                                filename);
+        }
+
+        /* Tree must only be built after the array has reached its final
+         * size, as xrealloc() might move the array */
+        init_prefix_tree(tree);
+        for (size_t i = 0; i < n_result; i++)
+                add_to_prefix_tree(tree, &result[i]);
+
+        la_log(LOG_INFO, "Loaded %zu addresses from ignore file \"%s\".",
+                        n_result, filename);
+
+        *addresses = result;
+        *n_addresses = n_result;
+
+        return true;
+}
+
+static void
+free_ignore_file_addresses(la_address_t *const addresses,
+                const size_t n_addresses, la_prefix_tree_t *const tree)
+{
+        empty_prefix_tree(tree);
+        /* Domain names might have been added by lookup_domainname() */
+        for (size_t i = 0; i < n_addresses; i++)
+                free(addresses[i].domainname);
+        free(addresses);
+}
+
+#ifndef CLIENTONLY
+/*
+ * Re-reads ignore file and replaces the addresses from the previous version
+ * of the file. Rules, sources and end queue are not affected. In case the
+ * file can't be read, the old addresses are kept.
+ */
+
+bool
+reload_ignore_file(void)
+{
+        la_debug_func(NULL);
+        assert(la_config);
+
+        xpthread_mutex_lock(&config_mutex);
+                char *const filename = xstrdup(la_config->ignore_file);
+        xpthread_mutex_unlock(&config_mutex);
+
+        if (!filename)
+                LOG_RETURN(false, LOG_ERR, "No ignore file configured!");
+
+        /* Reading and building the tree happens without holding the mutex -
+         * only swapping requires it. */
+        la_address_t *addresses;
+        size_t n_addresses;
+        la_prefix_tree_t tree;
+        if (!read_ignore_file(filename, &addresses, &n_addresses, &tree))
+        {
+                free(filename);
+                return false;
+        }
+
+        xpthread_mutex_lock(&config_mutex);
+
+                /* A full reload in the meantime might have switched to a
+                 * different (or no) ignore file - discard the result then */
+                const bool current = la_config->ignore_file &&
+                        !strcmp(la_config->ignore_file, filename);
+
+                la_address_t *old_addresses = addresses;
+                size_t n_old_addresses = n_addresses;
+                la_prefix_tree_t old_tree = tree;
+
+                if (current)
+                {
+                        old_addresses = la_config->ignore_file_addresses;
+                        n_old_addresses = la_config->n_ignore_file_addresses;
+                        old_tree = la_config->ignore_file_tree;
+
+                        la_config->ignore_file_addresses = addresses;
+                        la_config->n_ignore_file_addresses = n_addresses;
+                        la_config->ignore_file_tree = tree;
+                }
+
+        xpthread_mutex_unlock(&config_mutex);
+
+        free_ignore_file_addresses(old_addresses, n_old_addresses, &old_tree);
+
+        if (!current)
+                la_log(LOG_WARNING, "Configuration reloaded while reading "
+                                "ignore file \"%s\", discarded.", filename);
+        free(filename);
+
+        return current;
+}
+#endif /* CLIENTONLY */
+
+/*
+ * Check whether address is on the ignore list or in the ignore file. Return
+ * matching network, NULL otherwise. Must be called with config_mutex held.
+ */
+
+la_address_t *
+find_ignored_address(const la_address_t *const address)
+{
+        assert(la_config); assert_address(address);
+
+        la_address_t *const result = address_in_prefix_tree(
+                        &la_config->ignore_tree, address);
+        if (result)
+                return result;
+
+        return address_in_prefix_tree(&la_config->ignore_file_tree, address);
+}
+
 static void
 load_defaults(void)
 {
@@ -959,6 +1263,11 @@ load_defaults(void)
 
         init_list(&la_config->default_properties);
         init_list(&la_config->ignore_addresses);
+        init_prefix_tree(&la_config->ignore_tree);
+        la_config->ignore_file = NULL;
+        la_config->ignore_file_addresses = NULL;
+        la_config->n_ignore_file_addresses = 0;
+        init_prefix_tree(&la_config->ignore_file_tree);
 
         if (defaults_section)
         {
@@ -984,6 +1293,30 @@ load_defaults(void)
                         la_config->default_dnsbl_duration =
                                 la_config->default_duration;
 
+                la_config->dnsbl_positive_ttl =
+                        config_get_unsigned_int_or_negative(defaults_section,
+                                        LA_DNSBL_POSITIVE_TTL_LABEL);
+                if (la_config->dnsbl_positive_ttl == -1)
+                        la_config->dnsbl_positive_ttl =
+                                DEFAULT_DNSBL_POSITIVE_TTL;
+
+                la_config->dnsbl_negative_ttl =
+                        config_get_unsigned_int_or_negative(defaults_section,
+                                        LA_DNSBL_NEGATIVE_TTL_LABEL);
+                if (la_config->dnsbl_negative_ttl == -1)
+                        la_config->dnsbl_negative_ttl =
+                                DEFAULT_DNSBL_NEGATIVE_TTL;
+
+                la_config->dnsbl_threads =
+                        config_get_unsigned_int_or_negative(defaults_section,
+                                        LA_DNSBL_THREADS_LABEL);
+                if (la_config->dnsbl_threads == -1)
+                        la_config->dnsbl_threads = DEFAULT_DNSBL_THREADS;
+                else if (la_config->dnsbl_threads < 1 ||
+                                la_config->dnsbl_threads > MAX_DNSBL_THREADS)
+                        die_hard(false, LA_DNSBL_THREADS_LABEL " must be "
+                                        "between 1 and %u!",
+                                        MAX_DNSBL_THREADS);
 
                 if (!config_setting_lookup_bool(defaults_section,
                                         LA_META_ENABLED_LABEL,
@@ -1008,21 +1341,73 @@ load_defaults(void)
                 if (la_config->default_meta_max == -1)
                         la_config->default_meta_max = DEFAULT_META_MAX;
 
+                la_config->aggregate_threshold =
+                        config_get_unsigned_int_or_negative(defaults_section,
+                                        LA_AGGREGATE_THRESHOLD_LABEL);
+                if (la_config->aggregate_threshold == -1)
+                        la_config->aggregate_threshold =
+                                DEFAULT_AGGREGATE_THRESHOLD;
+
+                la_config->aggregate_period =
+                        config_get_unsigned_int_or_negative(defaults_section,
+                                        LA_AGGREGATE_PERIOD_LABEL);
+                if (la_config->aggregate_period == -1)
+                        la_config->aggregate_period = DEFAULT_AGGREGATE_PERIOD;
+
+                la_config->aggregate_ipv4_prefix =
+                        config_get_unsigned_int_or_negative(defaults_section,
+                                        LA_AGGREGATE_IPV4_PREFIX_LABEL);
+                if (la_config->aggregate_ipv4_prefix == -1)
+                        la_config->aggregate_ipv4_prefix =
+                                DEFAULT_AGGREGATE_IPV4_PREFIX;
+                else if (la_config->aggregate_ipv4_prefix > 32)
+                        die_hard(false, LA_AGGREGATE_IPV4_PREFIX_LABEL
+                                        " must be between 0 and 32!");
+
+                la_config->aggregate_ipv6_prefix =
+                        config_get_unsigned_int_or_negative(defaults_section,
+                                        LA_AGGREGATE_IPV6_PREFIX_LABEL);
+                if (la_config->aggregate_ipv6_prefix == -1)
+                        la_config->aggregate_ipv6_prefix =
+                                DEFAULT_AGGREGATE_IPV6_PREFIX;
+                else if (la_config->aggregate_ipv6_prefix > 128)
+                        die_hard(false, LA_AGGREGATE_IPV6_PREFIX_LABEL
+                                        " must be between 0 and 128!");
+
                 load_properties(&la_config->default_properties, defaults_section);
 
                 const config_setting_t *ignore = config_setting_get_member(
                                 defaults_section, LA_IGNORE_LABEL);
                 compile_address_list_port_domainname(&la_config->ignore_addresses,
                                 ignore, 0, true);
+                build_prefix_tree(&la_config->ignore_tree,
+                                &la_config->ignore_addresses);
+
+                la_config->ignore_file = xstrdup(config_get_string_or_null(
+                                        defaults_section, LA_IGNORE_FILE_LABEL));
+                if (la_config->ignore_file && !read_ignore_file(
+                                        la_config->ignore_file,
+                                        &la_config->ignore_file_addresses,
+                                        &la_config->n_ignore_file_addresses,
+                                        &la_config->ignore_file_tree))
+                        die_hard(false, "Error loading ignore file \"%s\"",
+                                        la_config->ignore_file);
         }
         else
         {
                 la_config->default_threshold = DEFAULT_THRESHOLD;
                 la_config->default_period = DEFAULT_PERIOD;
                 la_config->default_duration = DEFAULT_DURATION;
+                la_config->dnsbl_positive_ttl = DEFAULT_DNSBL_POSITIVE_TTL;
+                la_config->dnsbl_negative_ttl = DEFAULT_DNSBL_NEGATIVE_TTL;
+                la_config->dnsbl_threads = DEFAULT_DNSBL_THREADS;
                 la_config->default_meta_enabled = DEFAULT_META_ENABLED;
                 la_config->default_meta_period = DEFAULT_META_PERIOD;
                 la_config->default_meta_max = DEFAULT_META_MAX;
+                la_config->aggregate_threshold = DEFAULT_AGGREGATE_THRESHOLD;
+                la_config->aggregate_period = DEFAULT_AGGREGATE_PERIOD;
+                la_config->aggregate_ipv4_prefix = DEFAULT_AGGREGATE_IPV4_PREFIX;
+                la_config->aggregate_ipv6_prefix = DEFAULT_AGGREGATE_IPV6_PREFIX;
         }
 }
 
@@ -1102,6 +1487,7 @@ load_la_config(void)
                 }
                 load_remote_settings();
                 load_file_settings();
+                load_systemd_settings();
 
                 config_destroy(&la_config->config_file);
 
@@ -1137,8 +1523,17 @@ unload_la_config(void)
         la_config->systemd_source_group = NULL;
 #endif /* HAVE_LIBSYSTEMD */
         empty_property_list(&la_config->default_properties);
+        empty_prefix_tree(&la_config->ignore_tree);
         empty_address_list(&la_config->ignore_addresses);
+        free_ignore_file_addresses(la_config->ignore_file_addresses,
+                        la_config->n_ignore_file_addresses,
+                        &la_config->ignore_file_tree);
+        la_config->ignore_file_addresses = NULL;
+        la_config->n_ignore_file_addresses = 0;
+        free(la_config->ignore_file);
+        la_config->ignore_file = NULL;
         free(la_config->remote_secret);
+        empty_prefix_tree(&la_config->remote_receive_from_tree);
         empty_address_list(&la_config->remote_receive_from);
         empty_address_list(&la_config->remote_send_to);
         free(la_config->remote_bind);
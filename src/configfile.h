@@ -26,6 +26,7 @@
 #include <libconfig.h>
 
 #include "ndebug.h"
+#include "addresses.h"
 #include "sources.h"
 
 #define DEFAULT_THRESHOLD 3
@@ -36,13 +37,26 @@
 #define DEFAULT_META_PERIOD 3600
 #define DEFAULT_META_FACTOR 2
 #define DEFAULT_META_MAX 86400
+#define DEFAULT_AGGREGATE_THRESHOLD 0
+#define DEFAULT_AGGREGATE_PERIOD 600
+#define DEFAULT_AGGREGATE_IPV4_PREFIX 24
+#define DEFAULT_AGGREGATE_IPV6_PREFIX 64
 
 #define DEFAULT_DNSBL_ENABLED false
+#define DEFAULT_DNSBL_POSITIVE_TTL 3600
+#define DEFAULT_DNSBL_NEGATIVE_TTL 600
+#define DEFAULT_DNSBL_THREADS 4
 
 #define DEFAULT_PORT 16473
+#define DEFAULT_REMOTE_BATCH_LATENCY 0
+#define DEFAULT_REMOTE_SALT_ROTATION 86400
+#define DEFAULT_REMOTE_ANTI_ENTROPY 0
 
 #define DEFAULT_STATE_SAVE_PERIOD 300
 
+#define DEFAULT_SYSTEMD_BATCH_SIZE 64
+#define DEFAULT_SYSTEMD_BATCH_LATENCY 100
+
 #define LA_DEFAULTS_LABEL "defaults"
 
 #define LA_PROPERTIES_LABEL "properties"
@@ -53,13 +67,22 @@
 #define LA_DNSBL_DURATION_LABEL "dnsbl_duration"
 
 #define LA_IGNORE_LABEL "ignore"
+#define LA_IGNORE_FILE_LABEL "ignore_file"
 
 #define LA_META_ENABLED_LABEL "meta_enabled"
 #define LA_META_PERIOD_LABEL "meta_period"
 #define LA_META_FACTOR_LABEL "meta_factor"
 #define LA_META_MAX_LABEL "meta_max"
 
+#define LA_AGGREGATE_THRESHOLD_LABEL "aggregate_threshold"
+#define LA_AGGREGATE_PERIOD_LABEL "aggregate_period"
+#define LA_AGGREGATE_IPV4_PREFIX_LABEL "aggregate_ipv4_prefix"
+#define LA_AGGREGATE_IPV6_PREFIX_LABEL "aggregate_ipv6_prefix"
+
 #define LA_DNSBL_ENABLED_LABEL "dnsbl_enabled"
+#define LA_DNSBL_POSITIVE_TTL_LABEL "dnsbl_positive_ttl"
+#define LA_DNSBL_NEGATIVE_TTL_LABEL "dnsbl_negative_ttl"
+#define LA_DNSBL_THREADS_LABEL "dnsbl_threads"
 
 #define LA_SERVICE_LABEL "service"
 
@@ -90,6 +113,9 @@
 
 #define LA_SOURCE_LOCATION "location"
 #define LA_SOURCE_PREFIX "prefix"
+#define LA_SOURCE_SYSLOG_HEADER "syslog_header"
+#define LA_SOURCE_LINE_CACHE_SIZE "line_cache_size"
+#define LA_SOURCE_LINE_CACHE_SKIP "line_cache_skip"
 
 #define LA_REMOTE_LABEL "remote"
 #define LA_REMOTE_RECEIVE_FROM_LABEL "receive_from"
@@ -97,6 +123,13 @@
 #define LA_REMOTE_SECRET_LABEL "secret"
 #define LA_REMOTE_BIND_LABEL "bind"
 #define LA_REMOTE_PORT_LABEL "port"
+#define LA_REMOTE_BATCH_LATENCY_LABEL "batch_latency"
+#define LA_REMOTE_SALT_ROTATION_LABEL "salt_rotation"
+#define LA_REMOTE_KEY_EXCHANGE_LABEL "key_exchange"
+#define LA_REMOTE_SYNC_STREAM_LABEL "sync_stream"
+#define LA_REMOTE_ANTI_ENTROPY_LABEL "anti_entropy"
+#define LA_REMOTE_BINARY_MESSAGES_LABEL "binary_messages"
+#define LA_REMOTE_CLUSTER_LABEL "cluster"
 
 #define LA_FILES_LABEL "files"
 #define LA_FILES_FIFO_PATH_LABEL "fifo_path"
@@ -104,6 +137,11 @@
 #define LA_FILES_FIFO_GROUP_LABEL "fifo_group"
 #define LA_FILES_FIFO_MASK_LABEL "fifo_mask"
 
+#define LA_SYSTEMD_LABEL "systemd"
+#define LA_SYSTEMD_BATCH_SIZE_LABEL "batch_size"
+#define LA_SYSTEMD_BATCH_LATENCY_LABEL "batch_latency"
+#define LA_SYSTEMD_LINE_CACHE_SIZE_LABEL "line_cache_size"
+
 typedef struct la_config_s la_config_t;
 typedef struct la_config_s
 {
@@ -114,19 +152,39 @@ typedef struct la_config_s
         int default_period;
         int default_duration;
         int default_dnsbl_duration;
+        int dnsbl_positive_ttl;
+        int dnsbl_negative_ttl;
+        int dnsbl_threads;
         int default_meta_enabled; /* should be bool but well... */
         int default_meta_period;
         int default_meta_factor;
         int default_meta_max;
+        int aggregate_threshold;
+        int aggregate_period;
+        int aggregate_ipv4_prefix;
+        int aggregate_ipv6_prefix;
         kw_list_t default_properties;
         kw_list_t ignore_addresses;
+        la_prefix_tree_t ignore_tree;
+        char *ignore_file;
+        la_address_t *ignore_file_addresses;
+        size_t n_ignore_file_addresses;
+        la_prefix_tree_t ignore_file_tree;
         int remote_enabled;
         kw_list_t remote_receive_from;
+        la_prefix_tree_t remote_receive_from_tree;
         kw_list_t remote_send_to;
         char *remote_secret;
         bool remote_secret_changed;
         char *remote_bind;
         int remote_port;
+        int remote_batch_latency;
+        int remote_salt_rotation;
+        int remote_key_exchange;
+        int remote_sync_stream;
+        int remote_anti_entropy;
+        int remote_binary_messages;
+        int remote_cluster;
         int total_clocks;
         int invocation_count;
         int  total_et_invs;
@@ -135,6 +193,8 @@ typedef struct la_config_s
         uid_t fifo_user;
         gid_t fifo_group;
         mode_t fifo_mask;
+        int systemd_batch_size;
+        int systemd_batch_latency;
 
 } la_config_t;
 
@@ -149,6 +209,10 @@ void load_la_config(void);
 void unload_la_config(void);
 
 int get_unique_id(void);
+
+bool reload_ignore_file(void);
+
+la_address_t *find_ignored_address(const la_address_t *address);
 #endif /* __configfile_h */
 
 /* vim: set autowrite expandtab: */
@@ -20,11 +20,19 @@
 #include <config.h>
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "ndebug.h"
 #include "crypto.h"
+#include "logactiond.h"
 #include "logging.h"
 #include "messages.h"
 #include "addresses.h"
@@ -33,8 +41,33 @@
 #ifdef WITH_LIBSODIUM
 #include <sodium.h>
 
+/* Key and salt used for sending messages. Protected by crypto_mutex as the
+ * KDF thread replaces them on salt rotation. */
 static unsigned char send_key[crypto_secretbox_KEYBYTES];
 static unsigned char send_salt[crypto_pwhash_SALTBYTES];
+static time_t send_salt_created = 0;
+
+#ifndef CLIENTONLY
+static pthread_mutex_t crypto_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serializes writing the salt file */
+static pthread_mutex_t salt_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Receive keys recently derived from the secret and the salts of remote
+ * hosts. Keys only depend on secret and salt, so entries are shared between
+ * all hosts using the same salt. Protected by crypto_mutex. */
+typedef struct la_key_cache_entry_s
+{
+        unsigned char salt[crypto_pwhash_SALTBYTES];
+        unsigned char key[crypto_secretbox_KEYBYTES];
+        time_t last_used;
+        bool valid;
+} la_key_cache_entry_t;
+
+static la_key_cache_entry_t key_cache[KEY_CACHE_SIZE];
+/* Secret the cached keys have been derived from */
+static char *key_cache_secret = NULL;
+#endif /* CLIENTONLY */
 
 /*
  * Encrypted message format:
@@ -42,7 +75,8 @@ static unsigned char send_salt[crypto_pwhash_SALTBYTES];
  *       |                  |     |
  *       |                  |     +- crypto_pwhash_NONCEBYTES
  *       |                  +------- crypto_pwhash_SALTBYTES
- *       +-------------------------- 180 bytes payload
+ *       +-------------------------- 180 bytes payload (protocol version '0')
+ *                                   or up to BATCH_MSG_LEN bytes (version '1')
  */
 
 static bool
@@ -56,103 +90,418 @@ generate_key(unsigned char *const key, const size_t key_len,
                                 crypto_pwhash_ALG_ARGON2I13) == 0);
 }
 
+static void
+lock_crypto(void)
+{
+#ifndef CLIENTONLY
+        xpthread_mutex_lock(&crypto_mutex);
+#endif /* CLIENTONLY */
+}
+
+static void
+unlock_crypto(void)
+{
+#ifndef CLIENTONLY
+        xpthread_mutex_unlock(&crypto_mutex);
+#endif /* CLIENTONLY */
+}
+
+/*
+ * Derives send key from password and salt and starts using both for sending.
+ * The expensive key derivation happens before taking the lock, so senders
+ * don't have to wait for it.
+ */
+
+static bool
+install_send_key_and_salt(const char *const password,
+                const unsigned char *const salt, const time_t created)
+{
+        assert(password); assert(salt);
+        unsigned char key[crypto_secretbox_KEYBYTES];
+
+        if (!generate_key(key, crypto_secretbox_KEYBYTES, password, salt))
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to generate encryption key!");
+
+        lock_crypto();
+
+                memcpy(send_key, key, crypto_secretbox_KEYBYTES);
+                memcpy(send_salt, salt, crypto_pwhash_SALTBYTES);
+                send_salt_created = created;
+
+        unlock_crypto();
+
+        sodium_memzero(key, crypto_secretbox_KEYBYTES);
+
+        return true;
+}
 
 bool
 generate_send_key_and_salt(const char *const password)
 {
 	/* First initialize salt with randomness */
-        randombytes_buf(send_salt, crypto_pwhash_SALTBYTES);
+        unsigned char salt[crypto_pwhash_SALTBYTES];
+        randombytes_buf(salt, crypto_pwhash_SALTBYTES);
 
 	/* Then generate secret key from password and salt */
-        if (!generate_key(send_key, crypto_secretbox_KEYBYTES, password, send_salt))
-                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to generate encryption key!");
+        return install_send_key_and_salt(password, salt, xtime(NULL));
+}
+
+#ifndef CLIENTONLY
+/*
+ * Returns time the current send salt has been created, 0 if there is no send
+ * salt yet.
+ */
+
+time_t
+send_salt_creation_time(void)
+{
+        xpthread_mutex_lock(&crypto_mutex);
+
+                const time_t result = send_salt_created;
+
+        xpthread_mutex_unlock(&crypto_mutex);
+
+        return result;
+}
+
+/*
+ * Writes the send salt to a new file which then replaces SALTFILE - but only
+ * once it's safely on disk. A crash midway would otherwise leave a truncated
+ * salt file behind.
+ */
+
+static void
+save_send_salt(void)
+{
+        la_debug_func(NULL);
+
+        unsigned char salt[crypto_pwhash_SALTBYTES];
+        xpthread_mutex_lock(&crypto_mutex);
+
+                memcpy(salt, send_salt, crypto_pwhash_SALTBYTES);
+
+        xpthread_mutex_unlock(&crypto_mutex);
+
+        /* Only one writer of NEW_SALTFILE at a time */
+        xpthread_mutex_lock(&salt_file_mutex);
+
+                FILE *const stream = fopen(NEW_SALTFILE, "w");
+                bool success = stream;
+                if (!success)
+                        la_log_errno(LOG_WARNING, "Unable to save salt to "
+                                        "\"%s\"", NEW_SALTFILE);
+
+                if (success && (fwrite(salt, crypto_pwhash_SALTBYTES, 1,
+                                                stream) != 1 ||
+                                        fflush(stream) == EOF ||
+                                        fsync(fileno(stream)) == -1))
+                {
+                        la_log_errno(LOG_WARNING, "Unable to save salt to "
+                                        "\"%s\"", NEW_SALTFILE);
+                        success = false;
+                }
+
+                if (stream && fclose(stream) == EOF)
+                {
+                        la_log_errno(LOG_WARNING, "Unable to save salt to "
+                                        "\"%s\"", NEW_SALTFILE);
+                        success = false;
+                }
+
+                if (success && rename(NEW_SALTFILE, SALTFILE) == -1)
+                        la_log_errno(LOG_WARNING, "Unable to replace \"%s\"",
+                                        SALTFILE);
+
+        xpthread_mutex_unlock(&salt_file_mutex);
+}
+
+/*
+ * Replaces send salt by a new random one, derives the matching key and saves
+ * the salt so it will survive a restart.
+ */
+
+bool
+rotate_send_key_and_salt(const char *const password)
+{
+        la_debug_func(NULL);
+
+        if (!generate_send_key_and_salt(password))
+                return false;
+
+        save_send_salt();
+        la_log(LOG_INFO, "Rotated salt for remote messages.");
 
         return true;
 }
 
 /*
- * Returns true if salt has not changed.
+ * Derives send key from the salt saved by a previous run - provided that salt
+ * is not older than max_age seconds. Otherwise (or if max_age is 0) switches to
+ * a new salt.
  */
 
-static bool
-same_salt_as_before(const unsigned char *const buffer, la_address_t *const from_addr)
+bool
+restore_send_key_and_salt(const char *const password, const int max_age)
+{
+        la_debug_func(NULL);
+        assert(password);
+
+        if (max_age > 0)
+        {
+                FILE *const stream = fopen(SALTFILE, "r");
+                if (stream)
+                {
+                        unsigned char salt[crypto_pwhash_SALTBYTES];
+                        struct stat statbuf;
+                        const bool read_ok = fstat(fileno(stream), &statbuf) != -1
+                                && fread(salt, crypto_pwhash_SALTBYTES, 1,
+                                                stream) == 1;
+                        fclose(stream);
+
+                        if (read_ok && xtime(NULL) - statbuf.st_mtime < max_age)
+                                return install_send_key_and_salt(password, salt,
+                                                statbuf.st_mtime);
+                }
+        }
+
+        return rotate_send_key_and_salt(password);
+}
+
+/*
+ * Must be called with crypto_mutex held. Flushes the cache if password differs
+ * from the one the cached keys have been derived from.
+ */
+
+static la_key_cache_entry_t *
+find_cached_key(const unsigned char *const salt, const char *const password)
 {
-        assert(buffer); assert_address(from_addr);
-        if (!from_addr->salt)
+        assert(salt); assert(password);
+
+        if (!key_cache_secret || strcmp(key_cache_secret, password))
+        {
+                sodium_memzero(key_cache, sizeof key_cache);
+                free(key_cache_secret);
+                key_cache_secret = xstrdup(password);
                 return NULL;
+        }
+
+        for (int i = 0; i < KEY_CACHE_SIZE; i++)
+        {
+                if (key_cache[i].valid && !sodium_memcmp(key_cache[i].salt,
+                                        salt, crypto_pwhash_SALTBYTES))
+                {
+                        key_cache[i].last_used = xtime(NULL);
+                        return &key_cache[i];
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Adds key for salt to the cache, replacing the least recently used entry if
+ * the cache is full.
+ */
 
-        return !sodium_memcmp(from_addr->salt, &buffer[SALT_IDX],
-                        crypto_pwhash_SALTBYTES);
+static void
+add_cached_key(const unsigned char *const salt, const unsigned char *const key,
+                const char *const password)
+{
+        assert(salt); assert(key); assert(password);
+
+        xpthread_mutex_lock(&crypto_mutex);
+
+                if (!find_cached_key(salt, password))
+                {
+                        la_key_cache_entry_t *entry = &key_cache[0];
+                        for (int i = 0; i < KEY_CACHE_SIZE && entry->valid; i++)
+                        {
+                                if (!key_cache[i].valid ||
+                                                key_cache[i].last_used <
+                                                entry->last_used)
+                                        entry = &key_cache[i];
+                        }
+
+                        memcpy(entry->salt, salt, crypto_pwhash_SALTBYTES);
+                        memcpy(entry->key, key, crypto_secretbox_KEYBYTES);
+                        entry->last_used = xtime(NULL);
+                        entry->valid = true;
+                }
+
+        xpthread_mutex_unlock(&crypto_mutex);
 }
 
+/*
+ * Copies the cached key for salt to key. Returns false if there is none.
+ */
+
 static bool
-copy_salt_and_generate_key_for_address(const unsigned char *const ubuffer,
-                const char *const password, la_address_t *const from_addr)
+get_cached_key(const unsigned char *const salt, const char *const password,
+                unsigned char *const key)
+{
+        assert(salt); assert(password);
+
+        xpthread_mutex_lock(&crypto_mutex);
+
+                const la_key_cache_entry_t *const entry =
+                        find_cached_key(salt, password);
+                if (entry && key)
+                        memcpy(key, entry->key, crypto_secretbox_KEYBYTES);
+
+        xpthread_mutex_unlock(&crypto_mutex);
+
+        return entry;
+}
+
+/*
+ * Returns true if the key for the salt of the encrypted message in buffer is
+ * cached, i.e. decrypt_buffer() won't have to derive it.
+ */
+
+bool
+receive_key_cached(const char *const buffer, const size_t enc_len,
+                const char *const password)
 {
-        if (!from_addr->salt)
-                from_addr->salt = xmalloc(crypto_pwhash_SALTBYTES);
-        memcpy(from_addr->salt, &ubuffer[SALT_IDX], crypto_pwhash_SALTBYTES);
+        assert(buffer); assert(password);
+        const unsigned char *const salt =
+                (const unsigned char *) &buffer[MSG_IDX + enc_len];
 
-        if (!from_addr->key)
-                from_addr->key = xmalloc(crypto_secretbox_KEYBYTES);
-        return generate_key(from_addr->key, crypto_secretbox_KEYBYTES,
-                                password, &ubuffer[SALT_IDX]);
+        return get_cached_key(salt, password, NULL);
 }
 
 /*
- * Will update from_addr->salt, from_addr->key if necessary.
+ * Derives the key for the salt of the encrypted message in buffer and adds it
+ * to the cache - unless it's already there. The key is only cached if it
+ * actually decrypts the message, so random salts can't flush the keys of
+ * legitimate hosts out of the cache. The message itself is left untouched.
  */
+
 bool
-decrypt_message(char *const buffer, const char *const password,
-                la_address_t *const from_addr)
+derive_receive_key(const char *const buffer, const size_t enc_len,
+                const char *const password)
+{
+        assert(buffer); assert(password);
+        la_debug_func(NULL);
+        const unsigned char *const ubuffer = (const unsigned char *) buffer;
+        const unsigned char *const salt = &ubuffer[MSG_IDX + enc_len];
+        const unsigned char *const nonce = salt + crypto_pwhash_SALTBYTES;
+
+        if (get_cached_key(salt, password, NULL))
+                return true;
+
+        if (enc_len < crypto_secretbox_MACBYTES)
+                LOG_RETURN(false, LOG_ERR, "Message too short!");
+
+        unsigned char key[crypto_secretbox_KEYBYTES];
+        if (!generate_key(key, crypto_secretbox_KEYBYTES, password, salt))
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to generate receive key!");
+
+        unsigned char *const plain = xmalloc(enc_len);
+        const bool verified = crypto_secretbox_open_easy(plain,
+                        &ubuffer[MSG_IDX], enc_len, nonce, key) == 0;
+        sodium_memzero(plain, enc_len);
+        free(plain);
+
+        if (verified)
+                add_cached_key(salt, key, password);
+        sodium_memzero(key, crypto_secretbox_KEYBYTES);
+
+        if (!verified)
+                LOG_RETURN(false, LOG_ERR, "Unable to verify message with "
+                                "key derived for its salt!");
+
+        return true;
+}
+
+/*
+ * Decrypts a message of enc_len bytes (incl. MAC) in place. Salt and nonce
+ * follow right after the encrypted message.
+ *
+ * Will derive the key for the salt (and add it to the cache) if necessary.
+ */
+bool
+decrypt_buffer(char *const buffer, const size_t enc_len,
+                const char *const password, la_address_t *const from_addr)
 {
 	assert(buffer); assert(password); assert_address(from_addr);
         unsigned char *const ubuffer = (unsigned char *const) buffer;
+        const unsigned char *const salt = &ubuffer[MSG_IDX + enc_len];
+        const unsigned char *const nonce = salt + crypto_pwhash_SALTBYTES;
+
+        if (enc_len < crypto_secretbox_MACBYTES)
+                LOG_RETURN(false, LOG_ERR, "Message from host %s too short!",
+                                from_addr->text);
 
         if (sodium_init() < 0)
                 LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to  initialize libsodium!");
 
-        /* check wether salt is the same as last time for host. If not,
-         * copy new salt and regenerate key */
-        if (!same_salt_as_before(ubuffer, from_addr))
+        unsigned char key[crypto_secretbox_KEYBYTES];
+        if (!get_cached_key(salt, password, key))
         {
-                if (!copy_salt_and_generate_key_for_address(ubuffer, password,
-                                from_addr))
-                        LOG_RETURN_ERRNO(false, LOG_ERR,
-                                        "Unable to generate receive key for "
-                                        "host %s!", from_addr->text);
+                if (!derive_receive_key(buffer, enc_len, password) ||
+                                !get_cached_key(salt, password, key))
+                        LOG_RETURN(false, LOG_ERR, "Unable to generate receive "
+                                        "key for host %s!", from_addr->text);
         }
 
 	/* Decrypt encrypted message with key and nonce */
-        if (crypto_secretbox_open_easy(&ubuffer[MSG_IDX], &ubuffer[MSG_IDX],
-                                ENC_MSG_LEN, &ubuffer[NONCE_IDX],
-                                from_addr->key) == -1)
+        const int r = crypto_secretbox_open_easy(&ubuffer[MSG_IDX],
+                        &ubuffer[MSG_IDX], enc_len, nonce, key);
+        sodium_memzero(key, crypto_secretbox_KEYBYTES);
+        if (r == -1)
                 LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to decrypt message from host %s",
                                 from_addr->text);
         return true;
 }
 
 bool
-encrypt_message(char *buffer)
+decrypt_message(char *const buffer, const char *const password,
+                la_address_t *const from_addr)
+{
+        return decrypt_buffer(buffer, ENC_MSG_LEN, password, from_addr);
+}
+#endif /* CLIENTONLY */
+
+/*
+ * Encrypts a message of msg_len bytes in place. Buffer must have room for
+ * msg_len + CRYPTO_OVERHEAD bytes.
+ */
+bool
+encrypt_buffer(char *buffer, const size_t msg_len)
 {
 	assert(buffer);
         unsigned char *ubuffer = (unsigned char *) buffer;
+        unsigned char *const salt = &ubuffer[MSG_IDX + msg_len +
+                crypto_secretbox_MACBYTES];
+        unsigned char *const nonce = salt + crypto_pwhash_SALTBYTES;
 
         if (sodium_init() < 0)
                 LOG_RETURN(false, LOG_ERR, "Unable to  initialize libsodium!");
 
-        memcpy(&ubuffer[SALT_IDX], send_salt, crypto_pwhash_SALTBYTES);
-
 	/* Initialize nonce with random data */
-        randombytes_buf(&ubuffer[NONCE_IDX], crypto_secretbox_NONCEBYTES);
+        randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
+
+        lock_crypto();
 
-	/* And then encrypt the the message with key and nonce */
-        if (crypto_secretbox_easy(&ubuffer[MSG_IDX], &ubuffer[MSG_IDX], MSG_LEN,
-                                &ubuffer[NONCE_IDX], send_key) == -1)
+                memcpy(salt, send_salt, crypto_pwhash_SALTBYTES);
+
+                /* And then encrypt the the message with key and nonce */
+                const int r = crypto_secretbox_easy(&ubuffer[MSG_IDX],
+                                &ubuffer[MSG_IDX], msg_len, nonce, send_key);
+
+        unlock_crypto();
+
+        if (r == -1)
                 LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to encrypt message!");
 
         return true;
 }
+
+bool
+encrypt_message(char *buffer)
+{
+        return encrypt_buffer(buffer, MSG_LEN);
+}
 #endif /* WITH_LIBSODIUM */
 
 /* 
@@ -20,13 +20,36 @@
 #define __crypto_h
 
 #include <stdbool.h>
+#include <time.h>
 
 #include "ndebug.h"
 #include "addresses.h"
 
+/* Number of receive keys (i.e. salts of remote hosts) cached */
+#define KEY_CACHE_SIZE 32
+
 bool generate_send_key_and_salt(const char *password);
 
+#ifndef CLIENTONLY
+time_t send_salt_creation_time(void);
+
+bool rotate_send_key_and_salt(const char *password);
+
+bool restore_send_key_and_salt(const char *password, int max_age);
+
+bool receive_key_cached(const char *buffer, size_t enc_len,
+                const char *password);
+
+bool derive_receive_key(const char *buffer, size_t enc_len,
+                const char *password);
+
+bool decrypt_buffer(char *buffer, size_t enc_len, const char *password,
+                la_address_t *from_addr);
+
 bool decrypt_message(char *buffer, const char *password, la_address_t *from_addr);
+#endif /* CLIENTONLY */
+
+bool encrypt_buffer(char *buffer, size_t msg_len);
 
 bool encrypt_message(char *buffer);
 
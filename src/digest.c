@@ -0,0 +1,210 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Digest over the addresses in the end queue (remote setting anti_entropy).
+ *
+ * Hosts periodically send their digest to the send_to hosts. A host receiving
+ * a digest which differs from its own sends the entries of the differing
+ * buckets and - if asked to - its own digest in return, so the other host can
+ * do the same. Only addresses are taken into account, not rules or end times,
+ * as a host won't add an address it has already banned anyway.
+ *
+ * Bucket digests are the XOR of the hashes of their addresses, so they don't
+ * depend on the order in which the end queue is walked.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ndebug.h"
+#include "digest.h"
+#include "addresses.h"
+#include "messages.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static void
+store_be64(unsigned char *const bytes, uint64_t value)
+{
+        for (int i = 7; i >= 0; i--)
+        {
+                bytes[i] = value & 0xFF;
+                value >>= 8;
+        }
+}
+
+static uint64_t
+load_be64(const unsigned char *const bytes)
+{
+        uint64_t result = 0;
+
+        for (int i = 0; i < 8; i++)
+                result = (result << 8) | bytes[i];
+
+        return result;
+}
+
+/*
+ * 64 bit FNV-1a hash over the textual representation of address, which is the
+ * same on all hosts.
+ */
+
+static uint64_t
+address_hash(const la_address_t *const address)
+{
+        uint64_t result = FNV_OFFSET_BASIS;
+
+        for (const char *ptr = address->text; *ptr; ptr++)
+                result = (result ^ (unsigned char) *ptr) * FNV_PRIME;
+
+        return result;
+}
+
+/*
+ * Returns the bucket address falls into.
+ */
+
+int
+digest_bucket(const la_address_t *const address)
+{
+        assert_address(address);
+
+        return address_hash(address) % DIGEST_BUCKETS;
+}
+
+void
+init_digest(la_digest_t *const digest)
+{
+        assert(digest);
+
+        memset(digest, 0, sizeof *digest);
+}
+
+void
+add_to_digest(la_digest_t *const digest, const la_address_t *const address)
+{
+        assert(digest); assert_address(address);
+
+        const uint64_t hash = address_hash(address);
+        digest->buckets[hash % DIGEST_BUCKETS] ^= hash;
+}
+
+/*
+ * Computes root of digest. Must be called after the last add_to_digest().
+ */
+
+void
+finish_digest(la_digest_t *const digest)
+{
+        assert(digest);
+
+        uint64_t result = FNV_OFFSET_BASIS;
+
+        for (int i = 0; i < DIGEST_BUCKETS; i++)
+        {
+                unsigned char bytes[8];
+                store_be64(bytes, digest->buckets[i]);
+                for (int j = 0; j < 8; j++)
+                        result = (result ^ bytes[j]) * FNV_PRIME;
+        }
+
+        digest->root = result;
+}
+
+/*
+ * Creates digest message of the given type in buffer. Returns its length.
+ */
+
+int
+init_digest_message(char *const buffer, const la_digest_t *const digest,
+                const char type)
+{
+        assert(buffer); assert(digest);
+        assert(type == DIGEST_REQUEST || type == DIGEST_REPLY);
+
+        unsigned char *const ubuffer = (unsigned char *) buffer;
+        ubuffer[0] = PROTOCOL_VERSION_DIGEST;
+        ubuffer[1] = type;
+        store_be64(&ubuffer[2], digest->root);
+        for (int i = 0; i < DIGEST_BUCKETS; i++)
+                store_be64(&ubuffer[10 + i * 8], digest->buckets[i]);
+
+        return DIGEST_MSG_LEN;
+}
+
+/*
+ * Parses digest message of len bytes. Returns false if it's malformed.
+ */
+
+bool
+parse_digest_message(const char *const buffer, const size_t len,
+                la_digest_t *const digest, char *const type)
+{
+        assert(buffer); assert(digest); assert(type);
+
+        const unsigned char *const ubuffer = (const unsigned char *) buffer;
+        if (len < DIGEST_MSG_LEN || ubuffer[0] != PROTOCOL_VERSION_DIGEST ||
+                        (ubuffer[1] != DIGEST_REQUEST &&
+                         ubuffer[1] != DIGEST_REPLY))
+                return false;
+
+        *type = ubuffer[1];
+        for (int i = 0; i < DIGEST_BUCKETS; i++)
+                digest->buckets[i] = load_be64(&ubuffer[10 + i * 8]);
+        finish_digest(digest);
+
+        /* Root must match buckets */
+        return digest->root == load_be64(&ubuffer[2]);
+}
+
+/*
+ * Compares two digests. Sets differing[i] to true for each bucket i which
+ * differs (differing must hold DIGEST_BUCKETS elements). Returns the number
+ * of differing buckets.
+ */
+
+int
+compare_digests(const la_digest_t *const d1, const la_digest_t *const d2,
+                bool *const differing)
+{
+        assert(d1); assert(d2); assert(differing);
+
+        if (d1->root == d2->root)
+        {
+                memset(differing, 0, DIGEST_BUCKETS * sizeof *differing);
+                return 0;
+        }
+
+        int result = 0;
+        for (int i = 0; i < DIGEST_BUCKETS; i++)
+        {
+                differing[i] = d1->buckets[i] != d2->buckets[i];
+                if (differing[i])
+                        result++;
+        }
+
+        return result;
+}
+
+/* vim: set autowrite expandtab: */
@@ -0,0 +1,73 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __digest_h
+#define __digest_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ndebug.h"
+#include "addresses.h"
+
+/* Number of buckets the addresses in the end queue are spread across */
+#define DIGEST_BUCKETS 128
+
+/*
+ * Digest message (protocol version '3'):
+ *      '3'<type><root><bucket digest 0>...<bucket digest DIGEST_BUCKETS-1>
+ *
+ * type is DIGEST_REQUEST if the receiver should answer with its own digest,
+ * DIGEST_REPLY otherwise. root and bucket digests are 8 bytes each in network
+ * byte order. Fits into a single datagram.
+ */
+#define DIGEST_REQUEST '?'
+#define DIGEST_REPLY '!'
+#define DIGEST_MSG_LEN (2 + 8 + DIGEST_BUCKETS * 8)
+
+/*
+ * Two level hash tree over the addresses in the end queue. Each bucket digest
+ * combines the hashes of the addresses falling into that bucket, root is the
+ * hash over all bucket digests. Equal roots mean there's nothing to sync.
+ */
+typedef struct la_digest_s
+{
+        uint64_t root;
+        uint64_t buckets[DIGEST_BUCKETS];
+} la_digest_t;
+
+int digest_bucket(const la_address_t *address);
+
+void init_digest(la_digest_t *digest);
+
+void add_to_digest(la_digest_t *digest, const la_address_t *address);
+
+void finish_digest(la_digest_t *digest);
+
+int init_digest_message(char *buffer, const la_digest_t *digest, char type);
+
+bool parse_digest_message(const char *buffer, size_t len, la_digest_t *digest,
+                char *type);
+
+int compare_digests(const la_digest_t *d1, const la_digest_t *d2,
+                bool *differing);
+
+#endif /* __digest_h */
+
+/* vim: set autowrite expandtab: */
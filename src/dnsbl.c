@@ -21,17 +21,53 @@
 
 #include <netdb.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdnoreturn.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <arpa/inet.h>
 
 #include "ndebug.h"
 #include "nodelist.h"
 #include "addresses.h"
+#include "binarytree.h"
+#include "configfile.h"
+#include "endqueue.h"
+#include "logactiond.h"
 #include "logging.h"
+#include "misc.h"
+#include "rules.h"
 #include "dnsbl.h"
 
+static pthread_mutex_t dnsbl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t zone_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dnsbl_condition = PTHREAD_COND_INITIALIZER;
+
+/* Results of previous lookups, protected by dnsbl_mutex */
+static kw_tree_t *dnsbl_cache;
+
+/* Lookups waiting for a DNSBL thread, protected by dnsbl_mutex. Besides
+ * DNSBL lookups, the DNSBL threads also do reverse lookups of addresses (see
+ * lookup_domainname()). */
+static kw_list_t *query_queue;
+
+/* Number of lookups in query_queue and number of lookups dropped because
+ * query_queue was full (in total and since the last lookup that could be
+ * queued again), protected by dnsbl_mutex */
+static int query_queue_length;
+static unsigned long queries_dropped;
+static unsigned int queries_dropped_recently;
+
+/* Zone files loaded so far, protected by zone_mutex */
+static kw_list_t *zones;
+
 static int
 convert_to_dnsbl_hostname_4_sa(const struct sockaddr_in *const si,
                 const char *const dnsbl_domainname, char *const hostname)
@@ -134,28 +170,1103 @@ host_on_dnsbl(const la_address_t *const address,
         return !r;
 }
 
-/* Checks whether host is on any of the given blacklists. Return NULL if not
- * found, otherwise returns pointer to blacklists name.
+static bool
+is_zone_file(const char *const blacklist)
+{
+        return !strncmp(blacklist, DNSBL_FILE_PREFIX,
+                        sizeof DNSBL_FILE_PREFIX - 1);
+}
+
+/*
+ * Parses (possibly abbreviated) IPv4 address, e.g. "10.1" for 10.1.0.0. Sets
+ * *n_octets to the number of octets found. Returns pointer to the first
+ * character after the address, NULL if str doesn't start with an address.
+ */
+
+static const char *
+parse_ipv4_prefix(const char *str, uint32_t *const result, int *const n_octets)
+{
+        *result = 0;
+        *n_octets = 0;
+
+        for (;;)
+        {
+                if (!isdigit((unsigned char) *str))
+                        return NULL;
+
+                char *end;
+                const unsigned long octet = strtoul(str, &end, 10);
+                if (octet > 255 || end - str > 3)
+                        return NULL;
+
+                *result |= (uint32_t) octet << (24 - 8 * (*n_octets)++);
+                str = end;
+
+                if (*str != '.' || *n_octets == 4)
+                        return str;
+                str++;
+        }
+}
+
+static void
+add_ipv4_to_zone(la_prefix_tree_t *const tree, const uint32_t address,
+                const int prefix, la_address_t *const payload)
+{
+        struct sockaddr_in sin = { .sin_family = AF_INET };
+        sin.sin_addr.s_addr = htonl(address);
+
+        add_sa_to_prefix_tree(tree, (struct sockaddr *) &sin, prefix, payload);
+}
+
+/*
+ * Splits range into the smallest number of networks.
+ */
+
+static void
+add_ipv4_range_to_zone(la_prefix_tree_t *const tree, const uint32_t first,
+                const uint32_t last, la_address_t *const payload)
+{
+        uint64_t start = first;
+
+        while (start <= last)
+        {
+                /* Find largest network beginning at start that doesn't
+                 * extend beyond last */
+                int prefix = 32;
+                while (prefix > 0)
+                {
+                        const uint64_t size = 1ULL << (33 - prefix);
+                        if (start & (size - 1) || start + size - 1 > last)
+                                break;
+                        prefix--;
+                }
+
+                add_ipv4_to_zone(tree, (uint32_t) start, prefix, payload);
+                start += 1ULL << (32 - prefix);
+        }
+}
+
+/*
+ * Adds one entry of a zone file to tree. Besides addresses and networks
+ * understood by init_address_numeric(), rbldnsd allows abbreviated IPv4
+ * networks ("10.1" for 10.1.0.0/16) and IPv4 ranges ("10.1.1.1-10.1.1.20" or
+ * "10.1.1.1-20").
+ */
+
+static bool
+add_zone_entry(la_prefix_tree_t *const tree, const char *const entry,
+                la_address_t *const payload)
+{
+        assert(tree); assert(entry); assert(payload);
+
+        if (strchr(entry, ':'))
+        {
+                la_address_t address = { 0 };
+                if (!init_address_numeric(&address, entry))
+                        return false;
+
+                add_sa_to_prefix_tree(tree, (struct sockaddr *) &address.sa,
+                                address.prefix, payload);
+                return true;
+        }
+
+        uint32_t first;
+        int n_octets;
+        const char *const rest = parse_ipv4_prefix(entry, &first, &n_octets);
+        if (!rest)
+                return false;
+
+        if (*rest == '-')
+        {
+                uint32_t last;
+                int n_last;
+                const char *const end = parse_ipv4_prefix(rest + 1, &last,
+                                &n_last);
+                if (!end || *end || n_octets != 4)
+                        return false;
+
+                if (n_last == 1)
+                        last = (first & 0xFFFFFF00u) | (last >> 24);
+                else if (n_last != 4)
+                        return false;
+
+                if (last < first)
+                        return false;
+
+                add_ipv4_range_to_zone(tree, first, last, payload);
+                return true;
+        }
+
+        int prefix = 8 * n_octets;
+        if (*rest == '/')
+        {
+                char *end;
+                const unsigned long parsed = strtoul(rest + 1, &end, 10);
+                if (end == rest + 1 || *end || parsed > 32)
+                        return false;
+                prefix = parsed;
+        }
+        else if (*rest)
+        {
+                return false;
+        }
+
+        add_ipv4_to_zone(tree, first, prefix, payload);
+        return true;
+}
+
+/*
+ * Reads rbldnsd style zone file (ip4set, ip4trie or ip6trie dataset) into
+ * tree. Values (A record, TXT template) and "$" directives are ignored.
+ */
+
+static bool
+read_zone_file(la_dnsbl_zone_t *const zone, la_prefix_tree_t *const tree,
+                int *const n_entries)
+{
+        assert(zone); assert(tree); assert(n_entries);
+        la_debug_func(zone->node.nodename);
+
+        FILE *const stream = fopen(zone->node.nodename, "r");
+        if (!stream)
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to open zone file "
+                                "\"%s\"", zone->node.nodename);
+
+        init_prefix_tree(tree);
+        *n_entries = 0;
+        char *linebuffer = NULL;
+        size_t linebuffer_size = 0;
+        unsigned int line_no = 0;
+
+        while (getline(&linebuffer, &linebuffer_size, stream) != -1)
+        {
+                line_no++;
+
+                char *start = linebuffer;
+                while (isspace((unsigned char) *start))
+                        start++;
+                if (!*start || strchr("#;:$", *start))
+                        continue;
+
+                la_address_t *payload = &zone->listed;
+                if (*start == '!')
+                {
+                        payload = &zone->excluded;
+                        start++;
+                }
+
+                char *end = start;
+                while (*end && !isspace((unsigned char) *end))
+                        end++;
+                *end = '\0';
+
+                /* IPv4 entries may be directly followed by ":value" */
+                char *const colon = strchr(start, ':');
+                if (colon && memchr(start, '.', colon - start))
+                        *colon = '\0';
+
+                if (add_zone_entry(tree, start, payload))
+                        (*n_entries)++;
+                else
+                        la_log(LOG_WARNING, "Invalid entry \"%s\" in line %u "
+                                        "of zone file \"%s\"!", start,
+                                        line_no, zone->node.nodename);
+        }
+
+        const bool read_error = ferror(stream);
+        free(linebuffer);
+        fclose(stream);
+
+        if (read_error)
+        {
+                empty_prefix_tree(tree);
+                LOG_RETURN(false, LOG_ERR, "Error reading zone file \"%s\"",
+                                zone->node.nodename);
+        }
+
+        return true;
+}
+
+static void
+free_zone(la_dnsbl_zone_t *const zone)
+{
+        assert(zone);
+
+        empty_prefix_tree(&zone->tree);
+        free_node((kw_node_t *) zone);
+}
+
+/*
+ * Returns the zone for filename, NULL if it hasn't been used so far.
+ *
+ * Must be called with zone_mutex held.
+ */
+
+static la_dnsbl_zone_t *
+find_zone(const char *const filename)
+{
+        assert(filename);
+
+        if (!zones)
+                return NULL;
+
+        FOREACH(la_dnsbl_zone_t, zone, zones)
+        {
+                if (!strcmp(zone->node.nodename, filename))
+                        return zone;
+        }
+
+        return NULL;
+}
+
+/*
+ * (Re-)loads zone file filename if it has changed since last time. Called by
+ * the DNSBL threads only. The new tree is built without holding any lock,
+ * zone_mutex is only held to swap in the new tree. Keeps the previous
+ * contents in case of errors.
+ *
+ * Zones are only freed once all DNSBL threads have terminated, so the zone
+ * can safely be used after releasing zone_mutex.
+ */
+
+static void
+run_zone_query(const char *const filename)
+{
+        assert(filename);
+        la_debug_func(filename);
+
+        xpthread_mutex_lock(&zone_mutex);
+
+                la_dnsbl_zone_t *const zone = find_zone(filename);
+                const time_t mtime = zone ? zone->mtime : 0;
+                const bool failed = zone ? zone->failed : false;
+
+        xpthread_mutex_unlock(&zone_mutex);
+
+        if (!zone)
+                return;
+
+        struct stat stat_buf;
+        if (stat(filename, &stat_buf) == -1)
+        {
+                if (!failed)
+                        la_log_errno(LOG_ERR, "Unable to stat zone file "
+                                        "\"%s\"", filename);
+
+                xpthread_mutex_lock(&zone_mutex);
+
+                        zone->failed = true;
+                        zone->reloading = false;
+
+                xpthread_mutex_unlock(&zone_mutex);
+
+                return;
+        }
+
+        la_prefix_tree_t tree;
+        int n_entries = 0;
+        const bool changed = stat_buf.st_mtime != mtime;
+        const bool loaded = changed && read_zone_file(zone, &tree,
+                        &n_entries);
+
+        xpthread_mutex_lock(&zone_mutex);
+
+                if (loaded)
+                {
+                        const la_prefix_tree_t old_tree = zone->tree;
+                        zone->tree = tree;
+                        tree = old_tree;
+                        zone->n_entries = n_entries;
+                }
+
+                /* Don't try again before zone file changes */
+                if (changed)
+                        zone->failed = !loaded;
+                zone->mtime = stat_buf.st_mtime;
+                zone->reloading = false;
+
+        xpthread_mutex_unlock(&zone_mutex);
+
+        if (loaded)
+        {
+                empty_prefix_tree(&tree);
+                la_log(LOG_INFO, "Loaded %u entries from zone file \"%s\".",
+                                n_entries, filename);
+        }
+}
+
+static void
+free_dnsbl_query(la_dnsbl_query_t *const query)
+{
+        assert(query);
+
+        free_address(query->address);
+        free_node((kw_node_t *) query);
+}
+
+/*
+ * Adds query to query_queue and wakes up a DNSBL thread. In case
+ * query_queue is full, the query is dropped (and free()d) and false is
+ * returned.
+ *
+ * Must be called with dnsbl_mutex held.
+ */
+
+static bool
+enqueue_query(la_dnsbl_query_t *const query)
+{
+        assert(query);
+
+        if (query_queue_length >= MAX_QUERY_QUEUE_LEN)
+        {
+                if (!queries_dropped_recently++)
+                        la_log(LOG_WARNING, "DNSBL query queue full, dropping "
+                                        "lookups!");
+                queries_dropped++;
+                free_dnsbl_query(query);
+                return false;
+        }
+
+        if (queries_dropped_recently)
+        {
+                la_log(LOG_NOTICE, "Dropped %u DNSBL lookups while query "
+                                "queue was full.", queries_dropped_recently);
+                queries_dropped_recently = 0;
+        }
+
+        if (!query_queue)
+                query_queue = create_list();
+        add_tail(query_queue, (kw_node_t *) query);
+        query_queue_length++;
+        xpthread_cond_signal(&dnsbl_condition);
+
+        return true;
+}
+
+/*
+ * Queues a reload of zone file filename for the DNSBL threads. Returns false
+ * if the query queue is full.
+ */
+
+static bool
+queue_zone_query(const char *const filename)
+{
+        assert(filename);
+        la_vdebug_func(filename);
+
+        la_dnsbl_query_t *const query = create_node0(sizeof *query, 0,
+                        filename);
+        query->type = LA_QUERY_ZONE;
+
+        xpthread_mutex_lock(&dnsbl_mutex);
+
+                const bool result = enqueue_query(query);
+
+        xpthread_mutex_unlock(&dnsbl_mutex);
+
+        return result;
+}
+
+/*
+ * Checks whether address is listed in zone file filename. Zone file will be
+ * loaded by the DNSBL threads on first use and reloaded whenever it changes.
+ * Until the first load has finished, no address is considered listed.
+ *
+ * Never does any file I/O, so it's fine to call with config_mutex or
+ * end_queue_mutex held.
+ */
+
+static bool
+host_in_zone(const char *const filename, const la_address_t *const address)
+{
+        assert(filename); assert_address(address);
+        la_vdebug("host_in_zone(%s, %s)", filename, address->text);
+
+        const time_t now = xtime(NULL);
+        bool reload = false;
+
+        xpthread_mutex_lock(&zone_mutex);
+
+                la_dnsbl_zone_t *zone = find_zone(filename);
+                if (!zone)
+                {
+                        if (!zones)
+                                zones = create_list();
+                        zone = create_node0(sizeof *zone, 0, filename);
+                        init_prefix_tree(&zone->tree);
+                        add_tail(zones, (kw_node_t *) zone);
+                }
+
+                if (!zone->reloading && (!zone->last_check || now -
+                                        zone->last_check >=
+                                        DNSBL_ZONE_CHECK_INTERVAL))
+                {
+                        zone->last_check = now;
+                        zone->reloading = true;
+                        reload = true;
+                }
+
+                const bool result = address_in_prefix_tree(&zone->tree,
+                                address) == &zone->listed;
+
+        xpthread_mutex_unlock(&zone_mutex);
+
+        /* Try again next time if the query queue is full */
+        if (reload && !queue_zone_query(filename))
+        {
+                xpthread_mutex_lock(&zone_mutex);
+
+                        zone->reloading = false;
+
+                xpthread_mutex_unlock(&zone_mutex);
+        }
+
+        return result;
+}
+
+static void
+free_dnsbl_entry(la_dnsbl_entry_t *const entry)
+{
+        assert(entry);
+
+        free(entry->blacklist);
+        free(entry->domainname);
+        if (entry->waiters)
+                free_list(entry->waiters, (void (*)(void *)) free_node);
+        free(entry);
+}
+
+int
+dnsbl_cache_length(void)
+{
+        xpthread_mutex_lock(&dnsbl_mutex);
+
+                const int result = dnsbl_cache ? dnsbl_cache->count : 0;
+
+        xpthread_mutex_unlock(&dnsbl_mutex);
+
+        return result;
+}
+
+unsigned long
+dnsbl_queries_dropped(void)
+{
+        xpthread_mutex_lock(&dnsbl_mutex);
+
+                const unsigned long result = queries_dropped;
+
+        xpthread_mutex_unlock(&dnsbl_mutex);
+
+        return result;
+}
+
+/*
+ * Must only be called after all DNSBL threads have terminated.
+ */
+
+void
+free_dnsbl_cache(void)
+{
+        la_vdebug_func(NULL);
+
+        if (dnsbl_cache)
+        {
+                free_tree(dnsbl_cache, (void (*)(const void *)) free_dnsbl_entry,
+                                false);
+                dnsbl_cache = NULL;
+        }
+
+        if (query_queue)
+        {
+                free_list(query_queue, (void (*)(void *)) free_dnsbl_query);
+                query_queue = NULL;
+        }
+        query_queue_length = 0;
+
+        if (zones)
+        {
+                free_list(zones, (void (*)(void *)) free_zone);
+                zones = NULL;
+        }
+}
+
+static int
+cmp_dnsbl_entries(const void *p1, const void *p2)
+{
+        const la_dnsbl_entry_t *const e1 = p1;
+        const la_dnsbl_entry_t *const e2 = p2;
+
+        const int result = adrkeycmp(&e1->key, &e2->key);
+        if (result)
+                return result;
+
+        /* Entries for reverse lookups (without blacklist) come first */
+        if (!e1->blacklist || !e2->blacklist)
+                return (e1->blacklist != NULL) - (e2->blacklist != NULL);
+
+        return strcmp(e1->blacklist, e2->blacklist);
+}
+
+/*
+ * Returns the cache entry for the given address key and blacklist - if one is
+ * in the cache. Returns NULL otherwise.
+ *
+ * While searching through dnsbl_cache, will remove (and free) all expired
+ * entries (same as find_aggregate()).
+ *
+ * Must be called with dnsbl_mutex held.
+ */
+
+static la_dnsbl_entry_t *
+find_dnsbl_entry(const la_dnsbl_entry_t *const search, const time_t now)
+{
+        assert(search);
+
+        assert_tree(dnsbl_cache);
+
+        kw_tree_node_t *node = dnsbl_cache->root;
+        for (;;)
+        {
+                if (!node)
+                        return NULL;
+
+                la_dnsbl_entry_t *const entry = node->payload;
+                assert(entry);
+                const int cmp = cmp_dnsbl_entries(entry, search);
+
+                if (now >= entry->expires)
+                {
+                        /* Remove expired entries */
+                        kw_tree_node_t *tmp = node;
+                        node = remove_tree_node(dnsbl_cache, node);
+                        free_dnsbl_entry((la_dnsbl_entry_t *) tmp->payload);
+                }
+                else if (cmp == 0)
+                {
+                        return entry;
+                }
+                else if (cmp < 0 && node->right)
+                {
+                        node = node->right;
+                }
+                else if (cmp > 0 && node->left)
+                {
+                        node = node->left;
+                }
+                else
+                {
+                        return NULL;
+                }
+        }
+
+        /* control flow must not reach this point */
+        assert(false);
+        return NULL;
+}
+
+/*
+ * Stores result for address key and blacklist of search in dnsbl_cache.
+ * Returns the cache entry.
+ *
+ * Must be called with dnsbl_mutex held.
+ */
+
+static la_dnsbl_entry_t *
+set_dnsbl_entry(const la_dnsbl_entry_t *const search,
+                const la_dnsbl_state_t state, const time_t now,
+                const int ttl)
+{
+        assert(search);
+
+        if (!dnsbl_cache)
+                dnsbl_cache = create_tree();
+
+        la_dnsbl_entry_t *entry = find_dnsbl_entry(search, now);
+        if (!entry)
+        {
+                entry = xmalloc(sizeof *entry);
+                entry->tree_node.payload = entry;
+                entry->key = search->key;
+                entry->blacklist = xstrdup(search->blacklist);
+                entry->domainname = NULL;
+                entry->waiters = NULL;
+                add_to_tree(dnsbl_cache, &entry->tree_node, cmp_dnsbl_entries);
+        }
+
+        entry->state = state;
+        entry->expires = now + ttl;
+
+        return entry;
+}
+
+/*
+ * Lets rule_name and id wait for the result of the pending lookup of entry
+ * (unless already waiting). See notify_dnsbl_waiters().
+ *
+ * Must be called with dnsbl_mutex held.
+ */
+
+static void
+add_dnsbl_waiter(la_dnsbl_entry_t *const entry, const char *const rule_name,
+                const int id, const la_query_type_t type)
+{
+        assert(entry); assert(entry->state == LA_DNSBL_PENDING);
+        assert(rule_name);
+
+        if (!entry->waiters)
+                entry->waiters = create_list();
+
+        FOREACH(la_dnsbl_waiter_t, waiter, entry->waiters)
+        {
+                if (waiter->id == id && waiter->type == type &&
+                                !strcmp(waiter->node.nodename, rule_name))
+                        return;
+        }
+
+        la_dnsbl_waiter_t *const waiter = create_node(sizeof *waiter, 0,
+                        rule_name);
+        waiter->id = id;
+        waiter->type = type;
+        add_tail(entry->waiters, (kw_node_t *) waiter);
+}
+
+/*
+ * Queues lookup of address on the blacklist of search (or reverse lookup of
+ * address) for the DNSBL threads. Adds a pending entry to dnsbl_cache, so the
+ * same lookup is not queued again while it's still running - other checks
+ * will wait for this lookup instead. Returns false if the lookup has been
+ * dropped because the query queue is full.
+ *
+ * Must be called with dnsbl_mutex held.
+ */
+
+static bool
+queue_query(const la_address_t *const address,
+                const la_dnsbl_entry_t *const search,
+                const char *const rule_name, const int id,
+                const la_query_type_t type, const time_t now)
+{
+        assert_address(address); assert(search);
+        la_vdebug("queue_query(%s, %u)", address->text, type);
+
+        la_dnsbl_query_t *const query = create_node(sizeof *query, 0,
+                        search->blacklist);
+        query->address = dup_address(address);
+        query->type = type;
+        if (type == LA_QUERY_DOMAINNAME)
+        {
+                query->positive_ttl = DOMAINNAME_TTL;
+                query->negative_ttl = DOMAINNAME_NEGATIVE_TTL;
+        }
+        else
+        {
+                query->positive_ttl = la_config->dnsbl_positive_ttl;
+                query->negative_ttl = la_config->dnsbl_negative_ttl;
+        }
+
+        if (!enqueue_query(query))
+                return false;
+
+        la_dnsbl_entry_t *const entry = set_dnsbl_entry(search,
+                        LA_DNSBL_PENDING, now, DNSBL_QUERY_TIMEOUT);
+        if (rule_name)
+                add_dnsbl_waiter(entry, rule_name, id, type);
+
+        return true;
+}
+
+/*
+ * Looks up address in dnsbl_cache for all blacklists. Returns
+ * LA_DNSBL_LISTED (and sets *blname) if found on any of the blacklists,
+ * LA_DNSBL_NOT_LISTED if known to be on none of them and LA_DNSBL_PENDING
+ * otherwise.
+ *
+ * For each blacklist without a (current) result, a lookup is queued for the
+ * DNSBL threads.
+ */
+
+static la_dnsbl_state_t
+check_dnsbl_cache(const kw_list_t *const blacklists,
+                const la_address_t *const address, const char *const rule_name,
+                const int id, const la_query_type_t type,
+                const char **const blname)
+{
+        assert_list(blacklists); assert_address(address); assert(rule_name);
+        assert(blname);
+
+        const time_t now = xtime(NULL);
+        la_dnsbl_entry_t search;
+        init_address_key(&search.key, address);
+        la_dnsbl_state_t result = LA_DNSBL_NOT_LISTED;
+
+        /* Zone files are always up to date, no need to cache their answers */
+        FOREACH(kw_node_t, bl, blacklists)
+        {
+                if (is_zone_file(bl->nodename) && host_in_zone(bl->nodename +
+                                        sizeof DNSBL_FILE_PREFIX - 1, address))
+                {
+                        *blname = bl->nodename;
+                        return LA_DNSBL_LISTED;
+                }
+        }
+
+        xpthread_mutex_lock(&dnsbl_mutex);
+
+                if (!dnsbl_cache)
+                        dnsbl_cache = create_tree();
+
+                FOREACH(kw_node_t, bl, blacklists)
+                {
+                        if (is_zone_file(bl->nodename))
+                                continue;
+
+                        search.blacklist = bl->nodename;
+                        la_dnsbl_entry_t *const entry =
+                                find_dnsbl_entry(&search, now);
+                        if (entry && entry->state == LA_DNSBL_LISTED)
+                        {
+                                *blname = bl->nodename;
+                                result = LA_DNSBL_LISTED;
+                                break;
+                        }
+                        else if (entry && entry->state == LA_DNSBL_PENDING)
+                        {
+                                /* Lookup queued by someone else, wait for
+                                 * its result as well */
+                                add_dnsbl_waiter(entry, rule_name, id, type);
+                                result = LA_DNSBL_PENDING;
+                        }
+                        /* Dropped lookups count as not listed */
+                        else if (!entry && queue_query(address, &search,
+                                                rule_name, id, type, now))
+                        {
+                                result = LA_DNSBL_PENDING;
+                        }
+                }
+
+        xpthread_mutex_unlock(&dnsbl_mutex);
+
+        return result;
+}
+
+/*
+ * Checks whether host is on any of the given blacklists - as far as known
+ * from previous lookups. Returns NULL if not found, otherwise returns pointer
+ * to blacklists name.
+ *
+ * For each blacklist without a (current) result, a lookup is queued for the
+ * DNSBL threads. Should the host turn out to be on one of the blacklists,
+ * trigger_blacklisted_command() will be called for rule_name and id.
  *
  * Do NOT free() the returned string!
+ *
+ * Must be called with config_mutex held.
  */
 
 const char *
 host_on_any_dnsbl(const kw_list_t *const blacklists,
-                const la_address_t *const address)
+                const la_address_t *const address, const char *const rule_name,
+                const int id)
 {
-        assert_list(blacklists);
-        FOREACH(kw_node_t, bl, blacklists)
+        la_debug_func(address->text);
+
+        const char *result = NULL;
+        (void) check_dnsbl_cache(blacklists, address, rule_name, id,
+                        LA_QUERY_DNSBL, &result);
+
+        return result;
+}
+
+/*
+ * Same as host_on_any_dnsbl() but for end commands about to be removed from
+ * the end queue. Returns LA_DNSBL_PENDING in case the answer is not known
+ * yet. In this case, dnsbl_renewal_checked() will be called for rule_name and
+ * id as soon as each of the queued lookups has finished.
+ */
+
+la_dnsbl_state_t
+host_on_any_dnsbl_for_renewal(const kw_list_t *const blacklists,
+                const la_address_t *const address, const char *const rule_name,
+                const int id, const char **const blname)
+{
+        la_debug_func(address->text);
+
+        return check_dnsbl_cache(blacklists, address, rule_name, id,
+                        LA_QUERY_DNSBL_RENEWAL, blname);
+}
+
+/*
+ * Sets address->domainname in case the domain name of address is known from
+ * a previous reverse lookup. Otherwise queues a reverse lookup for the DNSBL
+ * threads, so the domain name will be known next time.
+ *
+ * Never blocks on DNS.
+ */
+
+void
+lookup_domainname(la_address_t *const address)
+{
+        assert_address(address);
+        la_vdebug_func(address->text);
+
+        if (address->domainname)
+                return;
+
+        const time_t now = xtime(NULL);
+        la_dnsbl_entry_t search = { .blacklist = NULL };
+        init_address_key(&search.key, address);
+
+        xpthread_mutex_lock(&dnsbl_mutex);
+
+                if (!dnsbl_cache)
+                        dnsbl_cache = create_tree();
+
+                const la_dnsbl_entry_t *const entry =
+                        find_dnsbl_entry(&search, now);
+                if (!entry)
+                        (void) queue_query(address, &search, NULL, 0,
+                                        LA_QUERY_DOMAINNAME, now);
+                else if (entry->domainname)
+                        address->domainname = xstrdup(entry->domainname);
+
+        xpthread_mutex_unlock(&dnsbl_mutex);
+}
+
+static void
+cleanup_dnsbl(void *arg)
+{
+        la_debug_func(NULL);
+
+        wait_final_barrier();
+        la_debug("dnsbl thread exiting");
+}
+
+static void
+unlock_dnsbl_mutex(void *arg)
+{
+        xpthread_mutex_unlock(&dnsbl_mutex);
+}
+
+/*
+ * Waits until a lookup is queued and returns it.
+ */
+
+static la_dnsbl_query_t *
+next_query(void)
+{
+        la_dnsbl_query_t *query;
+
+        xpthread_mutex_lock(&dnsbl_mutex);
+        /* Release dnsbl_mutex in case thread is cancelled while waiting.
+         * Otherwise other DNSBL threads would block forever. */
+        pthread_cleanup_push(unlock_dnsbl_mutex, NULL);
+
+                while (!(query = (la_dnsbl_query_t *) rem_head(query_queue)))
+                        xpthread_cond_wait(&dnsbl_condition, &dnsbl_mutex);
+                query_queue_length--;
+
+        pthread_cleanup_pop(1);
+
+        return query;
+}
+
+/*
+ * Do the actual (blocking) lookups and store results in dnsbl_cache. If host
+ * is listed, lets rules.c trigger the pending command. Lookups for renewals
+ * always let endqueue.c know that the result is in.
+ */
+
+static void
+run_domainname_query(la_dnsbl_query_t *const query)
+{
+        assert(query);
+        la_debug_func(query->address->text);
+
+        char domainname[NI_MAXHOST];
+        const bool found = !getnameinfo((struct sockaddr *)
+                        &query->address->sa, query->address->salen,
+                        domainname, sizeof domainname, NULL, 0, 0);
+
+        la_dnsbl_entry_t search = { .blacklist = NULL };
+        init_address_key(&search.key, query->address);
+
+        xpthread_mutex_lock(&dnsbl_mutex);
+
+                la_dnsbl_entry_t *const entry = set_dnsbl_entry(&search,
+                                found ? LA_DNSBL_LISTED : LA_DNSBL_NOT_LISTED,
+                                xtime(NULL), found ? query->positive_ttl :
+                                query->negative_ttl);
+                free(entry->domainname);
+                entry->domainname = found ? xstrdup(domainname) : NULL;
+
+        xpthread_mutex_unlock(&dnsbl_mutex);
+}
+
+/*
+ * Lets everyone who waited for the lookup of address on blacklist know that
+ * the result is in: renewals are always told, other checks only if the
+ * address is listed. Frees waiters.
+ */
+
+static void
+notify_dnsbl_waiters(kw_list_t *const waiters,
+                const la_address_t *const address, const char *const blacklist,
+                const bool listed)
+{
+        assert_address(address); assert(blacklist);
+
+        if (!waiters)
+                return;
+
+        FOREACH(la_dnsbl_waiter_t, waiter, waiters)
+        {
+                if (waiter->type == LA_QUERY_DNSBL_RENEWAL)
+                        dnsbl_renewal_checked(waiter->node.nodename,
+                                        waiter->id, address);
+                else if (listed)
+                        trigger_blacklisted_command(waiter->node.nodename,
+                                        waiter->id, address, blacklist);
+        }
+
+        free_list(waiters, (void (*)(void *)) free_node);
+}
+
+static void
+run_query(la_dnsbl_query_t *const query)
+{
+        assert(query);
+
+        if (query->type == LA_QUERY_DOMAINNAME)
+        {
+                run_domainname_query(query);
+                return;
+        }
+
+        if (query->type == LA_QUERY_ZONE)
+        {
+                run_zone_query(query->node.nodename);
+                return;
+        }
+
+        la_debug("run_query(%s, %s)", query->address->text,
+                        query->node.nodename);
+
+        const bool listed = host_on_dnsbl(query->address,
+                        query->node.nodename);
+
+        la_dnsbl_entry_t search = { .blacklist = query->node.nodename };
+        init_address_key(&search.key, query->address);
+
+        xpthread_mutex_lock(&dnsbl_mutex);
+
+                la_dnsbl_entry_t *const entry = set_dnsbl_entry(&search,
+                                listed ? LA_DNSBL_LISTED : LA_DNSBL_NOT_LISTED,
+                                xtime(NULL), listed ? query->positive_ttl :
+                                query->negative_ttl);
+                kw_list_t *const waiters = entry->waiters;
+                entry->waiters = NULL;
+
+        xpthread_mutex_unlock(&dnsbl_mutex);
+
+        notify_dnsbl_waiters(waiters, query->address, query->node.nodename,
+                        listed);
+}
+
+noreturn static void *
+dnsbl_loop(void *ptr)
+{
+        la_debug_func(NULL);
+
+        pthread_cleanup_push(cleanup_dnsbl, NULL);
+
+        for (;;)
         {
-                if (host_on_dnsbl(address, bl->nodename))
+                la_dnsbl_query_t *const query = next_query();
+
+                if (shutdown_ongoing)
                 {
-                        reprioritize_node((kw_node_t *) bl, 1);
-                        return bl->nodename;
+                        la_debug("Shutting down dnsbl thread.");
+                        free_dnsbl_query(query);
+                        pthread_exit(NULL);
                 }
+
+                pthread_cleanup_push((void (*)(void *)) free_dnsbl_query, query);
+                        run_query(query);
+                pthread_cleanup_pop(1);
         }
-        
-        return NULL;
+
+        assert(false);
+        /* Will never be reached, simple here to make potential pthread macros
+         * happy */
+        pthread_cleanup_pop(1);
+}
+
+/*
+ * Returns true if any rule of source_group has dnsbl_enabled set and
+ * blacklists assigned.
+ *
+ * Must be called with config_mutex held.
+ */
+
+static bool
+blacklists_in_use(const la_source_group_t *const source_group)
+{
+        if (!source_group)
+                return false;
+
+        FOREACH(la_rule_t, rule, &source_group->rules)
+        {
+                if (rule->dnsbl_enabled && !is_list_empty(&rule->blacklists))
+                        return true;
+        }
+
+        return false;
 }
 
+/*
+ * Starts the threads doing DNSBL lookups (and reverse lookups) in parallel:
+ * dnsbl_threads threads if any rule uses blacklists, otherwise a single
+ * thread for the reverse lookups. Until this has been called,
+ * host_on_any_dnsbl() will only consult the cache.
+ *
+ * As threads can only be started on startup, rules using blacklists only
+ * after a reload will have to make do with a single thread.
+ */
+
+void
+start_dnsbl_threads(void)
+{
+        la_debug_func(NULL);
+
+        int n_threads = 1;
+
+        xpthread_mutex_lock(&config_mutex);
+
+                assert(la_config);
+                bool in_use = blacklists_in_use(
+                                la_config->systemd_source_group);
+                FOREACH(la_source_group_t, source_group,
+                                &la_config->source_groups)
+                        in_use = in_use || blacklists_in_use(source_group);
+                if (in_use)
+                        n_threads = la_config->dnsbl_threads;
+
+        xpthread_mutex_unlock(&config_mutex);
+
+        xpthread_mutex_lock(&dnsbl_mutex);
+
+                if (!query_queue)
+                        query_queue = create_list();
+
+        xpthread_mutex_unlock(&dnsbl_mutex);
+
+        la_debug("Starting %u DNSBL threads", n_threads);
+        for (int i = 0; i < n_threads; i++)
+        {
+                pthread_t thread;
+                xpthread_create(&thread, NULL, dnsbl_loop, NULL, "dnsbl");
+                thread_started(thread);
+        }
+}
 
 /* vim: set autowrite expandtab: */
@@ -19,10 +19,118 @@
 #ifndef __dnsbl_h
 #define __dnsbl_h
 
+#include <time.h>
+#include <stdbool.h>
+
 #include "ndebug.h"
+#include "addresses.h"
+#include "binarytree.h"
+#include "nodelist.h"
+
+/* Maximum number of threads doing DNSBL lookups in parallel (see
+ * dnsbl_threads) */
+#define MAX_DNSBL_THREADS 16
+
+/* Maximum number of lookups waiting for a DNSBL thread. Further lookups are
+ * dropped, i.e. the host is treated as not listed. */
+#define MAX_QUERY_QUEUE_LEN 1024
+
+/* Time after which a lookup that is still pending is queued again */
+#define DNSBL_QUERY_TIMEOUT 60
+
+/* Blacklists starting with this prefix are rbldnsd style zone files */
+#define DNSBL_FILE_PREFIX "file:"
+
+/* Minimum time between checks whether a zone file has changed */
+#define DNSBL_ZONE_CHECK_INTERVAL 1
+
+/* How long results of reverse lookups are cached */
+#define DOMAINNAME_TTL 3600
+#define DOMAINNAME_NEGATIVE_TTL 300
+
+typedef enum la_dnsbl_state_s {
+        LA_DNSBL_PENDING,
+        LA_DNSBL_LISTED,
+        LA_DNSBL_NOT_LISTED
+} la_dnsbl_state_t;
+
+typedef enum la_query_type_s {
+        LA_QUERY_DNSBL,
+        LA_QUERY_DNSBL_RENEWAL,
+        LA_QUERY_DOMAINNAME,
+        LA_QUERY_ZONE
+} la_query_type_t;
+
+/* Cached result of the lookup of one address on one blacklist. For reverse
+ * lookups of the address, blacklist is NULL and domainname holds the
+ * result (if any). While the lookup is pending, waiters holds the checks
+ * waiting for the result (if any). */
+typedef struct la_dnsbl_entry_s
+{
+        kw_tree_node_t tree_node;
+        la_address_key_t key;
+        char *blacklist;
+        char *domainname;
+        la_dnsbl_state_t state;
+        time_t expires;
+        kw_list_t *waiters;
+} la_dnsbl_entry_t;
+
+/* Check waiting for a pending lookup. node.nodename is the rule name, type is
+ * either LA_QUERY_DNSBL or LA_QUERY_DNSBL_RENEWAL. */
+typedef struct la_dnsbl_waiter_s
+{
+        kw_node_t node;
+        int id;
+        la_query_type_t type;
+} la_dnsbl_waiter_t;
+
+/* In-memory copy of a zone file. Lookups in tree return &listed for listed
+ * and &excluded for excluded networks (lines starting with "!"). The file is
+ * (re-)loaded by the DNSBL threads, reloading is set while such a reload is
+ * queued or running. */
+typedef struct la_dnsbl_zone_s
+{
+        kw_node_t node;         /* nodename is the path of the zone file */
+        la_prefix_tree_t tree;
+        la_address_t listed;
+        la_address_t excluded;
+        int n_entries;
+        time_t mtime;
+        time_t last_check;
+        bool failed;
+        bool reloading;
+} la_dnsbl_zone_t;
+
+/* Lookup waiting for one of the DNSBL threads. node.nodename is the name of
+ * the blacklist (NULL for reverse lookups, path of the zone file for zone
+ * reloads). Whoever waits for the result is kept with the cache entry (see
+ * la_dnsbl_entry_t). */
+typedef struct la_dnsbl_query_s
+{
+        kw_node_t node;
+        la_address_t *address;
+        la_query_type_t type;
+        int positive_ttl;
+        int negative_ttl;
+} la_dnsbl_query_t;
 
 const char *host_on_any_dnsbl(const kw_list_t *blacklists,
-                const la_address_t *address);
+                const la_address_t *address, const char *rule_name, int id);
+
+la_dnsbl_state_t host_on_any_dnsbl_for_renewal(const kw_list_t *blacklists,
+                const la_address_t *address, const char *rule_name, int id,
+                const char **blname);
+
+void lookup_domainname(la_address_t *address);
+
+int dnsbl_cache_length(void);
+
+unsigned long dnsbl_queries_dropped(void);
+
+void free_dnsbl_cache(void);
+
+void start_dnsbl_threads(void);
 
 #endif /* __dnsbl_h */
 
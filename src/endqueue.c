@@ -26,18 +26,22 @@
 #include <stdatomic.h>
 #include <stdnoreturn.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ndebug.h"
 #include "logactiond.h"
 #include "addresses.h"
 #include "commands.h"
 #include "configfile.h"
+#include "dnsbl.h"
 #include "endqueue.h"
 #include "logging.h"
 #include "misc.h"
 #include "nodelist.h"
 #include "rules.h"
+#include "state.h"
 #include "binarytree.h"
+#include "cluster.h"
 
 kw_tree_t *adr_tree = NULL;
 kw_list_t *end_time_list = NULL;
@@ -46,6 +50,14 @@ kw_list_t *queue_pointers = NULL;
 int end_queue_running = 0;
 
 int queue_length = 0;
+
+/* Number of commands for networks (as opposed to single addresses) in the
+ * queue, in total and by family and prefix length. Lets
+ * find_end_command_no_mutex() find commands for networks independent of the
+ * current aggregation settings. */
+static int network_commands = 0;
+static int network_commands_v4[32];
+static int network_commands_v6[128];
 #ifndef CLIENTONLY
 pthread_mutex_t end_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t end_queue_condition = PTHREAD_COND_INITIALIZER;
@@ -100,16 +112,40 @@ update_queue_count_numbers(void)
 }
 #endif /* CLIENTONLY */
 
+/*
+ * Returns the counter in network_commands_v4 / network_commands_v6 for key -
+ * or NULL if key is not a network.
+ */
+
+static int *
+network_command_counter(const la_address_key_t *const key)
+{
+        assert(key);
+
+        if (key->family == AF_INET && key->prefix < 32)
+                return &network_commands_v4[key->prefix];
+        else if (key->family == AF_INET6 && key->prefix < 128)
+                return &network_commands_v6[key->prefix];
+        else
+                return NULL;
+}
+
 static int
 cmp_command_address(const void *p1, const void *p2)
 {
-        return adrcmp(((la_command_t *) p1)->address, (la_address_t *) p2);
+        return adrkeycmp(&((la_command_t *) p1)->adr_key,
+                        (la_address_key_t *) p2);
 }
 
 /*
  * Search for a command by a certain host for a given rule on the end_que
  * list. Return if found, return NULL otherwise
  *
+ * If no command for the host itself is found, but there are commands for
+ * networks in the queue (see aggregation.c), also return a command for the
+ * most specific network the host is part of. This is independent of the
+ * current aggregation settings, as these might have changed with a reload.
+ *
  * address may be NULL
  */
 
@@ -125,8 +161,29 @@ find_end_command_no_mutex(const la_address_t *const address)
         if (queue_length == 0)
                 return NULL;
 
-        kw_tree_node_t *node = find_tree_node(adr_tree,
-                        address, cmp_command_address);
+        la_address_key_t key;
+        init_address_key(&key, address);
+
+        kw_tree_node_t *node = find_tree_node(adr_tree, &key,
+                        cmp_command_address);
+
+        if (!node && network_commands > 0 && (key.family == AF_INET ||
+                                key.family == AF_INET6))
+        {
+                const int *const counters = key.family == AF_INET ?
+                        network_commands_v4 : network_commands_v6;
+                for (int prefix = key.prefix - 1; !node && prefix >= 0;
+                                prefix--)
+                {
+                        if (!counters[prefix])
+                                continue;
+
+                        mask_address_key(&key, prefix);
+                        node = find_tree_node(adr_tree, &key,
+                                        cmp_command_address);
+                }
+        }
+
         if (node)
                 return (la_command_t *) node->payload;
         else
@@ -187,11 +244,20 @@ remove_command_from_queues(la_command_t *const command)
         (void) remove_tree_node(adr_tree, &(command->adr_node));
 #ifndef CLIENTONLY
         fix_queue_pointers(command);
+        journal_remove(command);
 #endif /* CLIENTONLY */
         (void) remove_node((kw_node_t *) command);
 
         assert(queue_length > 0);
         queue_length--;
+
+        int *const counter = network_command_counter(&command->adr_key);
+        if (counter)
+        {
+                assert(*counter > 0 && network_commands > 0);
+                (*counter)--;
+                network_commands--;
+        }
 }
 
 #ifndef CLIENTONLY
@@ -341,7 +407,8 @@ add_to_end_time_list(la_command_t *command)
 static int
 cmp_addresses(const void *p1, const void *p2)
 {
-        return adrcmp(((la_command_t *) p1)->address, ((la_command_t *) p2)->address);
+        return adrkeycmp(&((la_command_t *) p1)->adr_key,
+                        &((la_command_t *) p2)->adr_key);
 }
 
 /*
@@ -357,7 +424,17 @@ add_command_to_queues(la_command_t *command)
 
         queue_length++;
 
+        int *const counter = network_command_counter(&command->adr_key);
+        if (counter)
+        {
+                (*counter)++;
+                network_commands++;
+        }
+
         add_to_tree(adr_tree, &command->adr_node, cmp_addresses);
+#ifndef CLIENTONLY
+        journal_add(command);
+#endif /* CLIENTONLY */
 
         return add_to_end_time_list(command);
 }
@@ -405,6 +482,93 @@ remove_and_trigger(la_address_t *const address)
         return result;
 }
 
+/*
+ * Removes all commands with the given id for addresses within network from
+ * end queue, triggers and frees them. Commands for the network itself are
+ * left alone. Returns number of removed commands.
+ *
+ * Will lock the endqueue mutex thus must not be called from functions which
+ * already have locked the mutex (such as consume_end_queue()).
+ */
+
+int
+remove_and_trigger_network(const la_address_key_t *const network, const int id)
+{
+        assert(network);
+        la_debug_func(NULL);
+
+        la_command_t **commands = NULL;
+        int n_commands = 0;
+        int commands_size = 0;
+
+#ifndef CLIENTONLY
+        xpthread_mutex_lock(&end_queue_mutex);
+#endif /* CLIENTONLY */
+
+                /* Find first command with key >= network. As a network sorts
+                 * before the addresses within, all addresses within follow
+                 * from there on. */
+                kw_tree_node_t *node = NULL;
+                kw_tree_node_t *tmp = adr_tree->root;
+                while (tmp)
+                {
+                        if (adrkeycmp(&((la_command_t *) tmp->payload)->adr_key,
+                                                network) >= 0)
+                        {
+                                node = tmp;
+                                tmp = tmp->left;
+                        }
+                        else
+                        {
+                                tmp = tmp->right;
+                        }
+                }
+
+                /* Collect first, remove afterwards to keep tree iteration
+                 * simple */
+                for (; node; node = next_node_in_tree(node))
+                {
+                        la_command_t *const command = node->payload;
+                        la_address_key_t masked = command->adr_key;
+                        if (masked.family != network->family)
+                                break;
+                        mask_address_key(&masked, network->prefix);
+                        if (masked.high != network->high ||
+                                        masked.low != network->low)
+                                break;
+
+                        if (command->id != id ||
+                                        command->adr_key.prefix <= network->prefix)
+                                continue;
+
+                        if (n_commands == commands_size)
+                        {
+                                commands_size = commands_size ?
+                                        commands_size * 2 : 16;
+                                commands = xrealloc(commands, commands_size *
+                                                sizeof *commands);
+                        }
+                        commands[n_commands++] = command;
+                }
+
+                for (int i = 0; i < n_commands; i++)
+                {
+                        remove_command_from_queues(commands[i]);
+#ifndef NOCOMMANDS
+                        trigger_end_command(commands[i], true);
+#endif /* NOCOMMANDS */
+                        free_command(commands[i]);
+                }
+
+#ifndef CLIENTONLY
+        xpthread_mutex_unlock(&end_queue_mutex);
+#endif /* CLIENTONLY */
+
+        free(commands);
+
+        return n_commands;
+}
+
 #ifndef NOCOMMANDS
 static void
 finalize_command(const void *p)
@@ -412,6 +576,13 @@ finalize_command(const void *p)
         la_command_t *command = (la_command_t *) p;
         assert_command(command);
 
+#ifndef CLIENTONLY
+        /* On shutdown, the queue is emptied but its content must survive in
+         * the state file */
+        if (!shutdown_ongoing)
+                journal_remove(command);
+#endif /* CLIENTONLY */
+
         if (!command->quick_shutdown || command->is_template)
                 trigger_end_command(command, true);
         free_command(command);
@@ -442,6 +613,9 @@ empty_end_queue(void)
          * empty_tree() */
         init_list(end_time_list);
         queue_length = 0;
+        network_commands = 0;
+        memset(network_commands_v4, 0, sizeof network_commands_v4);
+        memset(network_commands_v6, 0, sizeof network_commands_v6);
 
 #ifndef CLIENTONLY
         if (!shutdown_ongoing && end_queue_running)
@@ -564,13 +738,86 @@ set_end_time(la_command_t *const command, const time_t manual_end_time)
 }
 
 #ifndef CLIENTONLY
+/*
+ * Keeps command in the end queue until the answers of the DNSBL lookups for
+ * its renewal are in - but no longer than DNSBL_QUERY_TIMEOUT seconds.
+ */
+
+static void
+postpone_until_dnsbl_checked(la_command_t *const command, const time_t now)
+{
+        la_vdebug_func(command->address->text);
+
+        if (!command->dnsbl_check_deadline)
+                command->dnsbl_check_deadline = now + DNSBL_QUERY_TIMEOUT;
+
+        (void) remove_node(&(command->node));
+        command->end_time = command->dnsbl_check_deadline;
+        (void) add_to_end_time_list(command);
+}
+
+/*
+ * Called by the DNSBL threads whenever a lookup for the renewal of an end
+ * command has finished. Moves command to the start of the end queue so that
+ * remove_or_renew() will look at it again right away.
+ */
+
+void
+dnsbl_renewal_checked(const char *const rule_name, const int id,
+                const la_address_t *const address)
+{
+        assert(rule_name); assert_address(address);
+        la_debug_func(address->text);
+
+        xpthread_mutex_lock(&end_queue_mutex);
+
+                la_command_t *const command =
+                        find_end_command_no_mutex(address);
+
+                if (command && command->dnsbl_check_deadline &&
+                                command->id == id &&
+                                !strcmp(command->rule_name, rule_name))
+                {
+                        (void) remove_node(&(command->node));
+                        command->end_time = xtime(NULL);
+                        if (add_to_end_time_list(command))
+                                xpthread_cond_signal(&end_queue_condition);
+                }
+
+        xpthread_mutex_unlock(&end_queue_mutex);
+}
+
+/*
+ * Triggers and removes command - unless its host is still on a blacklist. In
+ * this case, the command will be renewed.
+ *
+ * Blacklist lookups happen in the DNSBL threads. As long as their answers are
+ * not in, the command will be kept in the queue (see
+ * postpone_until_dnsbl_checked()).
+ */
+
 static void
 remove_or_renew(la_command_t *const command)
 {
         la_debug_func(NULL);
         const char *blname = NULL;
-        if (command->previously_on_blacklist)
-                blname = command_address_on_dnsbl(command);
+        if (command->previously_on_blacklist && command->rule)
+        {
+                const time_t now = xtime(NULL);
+                const la_dnsbl_state_t state = host_on_any_dnsbl_for_renewal(
+                                &command->rule->blacklists, command->address,
+                                command->rule_name, command->id, &blname);
+
+                if (state == LA_DNSBL_PENDING &&
+                                (!command->dnsbl_check_deadline ||
+                                 now < command->dnsbl_check_deadline))
+                {
+                        postpone_until_dnsbl_checked(command, now);
+                        return;
+                }
+        }
+
+        command->dnsbl_check_deadline = 0;
 
         if (blname)
         {
@@ -582,6 +829,7 @@ remove_or_renew(la_command_t *const command)
                                 command->end_time - xtime(NULL));
                 command->submission_type = LA_SUBMISSION_RENEW;
                 (void) add_to_end_time_list(command);
+                journal_add(command);
         }
         else
         {
@@ -734,6 +982,41 @@ enqueue_end_command(la_command_t *const end_command, const time_t manual_end_tim
 #endif /* CLIENTONLY */
 }
 
+#ifndef CLIENTONLY
+/*
+ * Takes over the end actions of commands whose begin action has been executed
+ * by another cluster member, once this host owns their address - i.e. once
+ * that member has gone quiet. The begin action is not executed again, the
+ * shared firewall still holds the entry.
+ */
+
+void
+adopt_end_commands(void)
+{
+        la_debug_func(NULL);
+
+        xpthread_mutex_lock(&end_queue_mutex);
+
+                for (kw_tree_node_t *node = adr_tree ? adr_tree->first : NULL;
+                                node; node = next_node_in_tree(node))
+                {
+                        la_command_t *const command = node->payload;
+                        if (command->is_template || !command->address ||
+                                        command->begin_executed ||
+                                        !owns_address(command->address))
+                                continue;
+
+                        command->begin_executed = true;
+                        la_log(LOG_INFO, "Host: %s, took over action \"%s\" "
+                                        "from other cluster member.",
+                                        command->address->text,
+                                        command->node.nodename);
+                }
+
+        xpthread_mutex_unlock(&end_queue_mutex);
+}
+#endif /* CLIENTONLY */
+
 int
 get_queue_length(void)
 {
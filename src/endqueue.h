@@ -45,12 +45,19 @@ typedef struct la_queue_pointer_s
 
 #ifndef CLIENTONLY
 void update_queue_count_numbers(void);
+
+void dnsbl_renewal_checked(const char *rule_name, int id,
+                const la_address_t *address);
+
+void adopt_end_commands(void);
 #endif /* CLIENTONLY */
 
 la_command_t *find_end_command(const la_address_t *address);
 
 int remove_and_trigger(la_address_t *address);
 
+int remove_and_trigger_network(const la_address_key_t *network, int id);
+
 void empty_end_queue(void);
 
 void enqueue_end_command(la_command_t *end_command, time_t manual_end_time);
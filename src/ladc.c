@@ -61,6 +61,8 @@ print_usage(void)
                         "Usage: ladc [-h host][-p password][-s port] "
                         "reload\n"
                         "Usage: ladc [-h host][-p password][-s port] "
+                        "reload-ignore\n"
+                        "Usage: ladc [-h host][-p password][-s port] "
                         "shutdown\n"
                         "Usage: ladc [-h host][-p password][-s port] "
                         "pause\n"
@@ -329,6 +331,10 @@ main(int argc, char *argv[])
         {
                 success = init_reload_message(message);
         }
+        else if (!strcmp(command, "reload-ignore"))
+        {
+                success = init_reload_ignore_file_message(message);
+        }
         else if (!strcmp(command, "shutdown"))
         {
                 success = init_shutdown_message(message);
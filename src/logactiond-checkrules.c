@@ -133,22 +133,32 @@ next_line(la_rule_t *rule, char *line)
 
         la_debug_func(line);
 
-        FOREACH(la_pattern_t, pattern, &rule->patterns)
+        /* Patterns of rules with syslog_header only see the message */
+        const char *const message = get_message_for_rule(rule, line);
+
+        if (message)
         {
-                la_debug("pattern %u: %s\n", pattern->num, pattern->string);
-                /* TODO: make this dynamic based on detected tokens */
-                regmatch_t pmatch[MAX_NMATCH];
-                if (!regexec(&(pattern->regex), line, MAX_NMATCH, pmatch, 0))
+                FOREACH(la_pattern_t, pattern, &rule->patterns)
                 {
-                        if (!show_undetected)
-                        {
-                                printf("%s(%i): %s", rule->node.nodename, pattern->num, line);
-                                if (line[strlen(line)-1] != '\n')
-                                        printf("\n");
-                        }
-                        else
+                        la_debug("pattern %u: %s\n", pattern->num,
+                                        pattern->string);
+                        /* TODO: make this dynamic based on detected tokens */
+                        regmatch_t pmatch[MAX_NMATCH];
+                        if (!regexec(&(pattern->regex), message, MAX_NMATCH,
+                                                pmatch, 0))
                         {
-                                return;
+                                if (!show_undetected)
+                                {
+                                        printf("%s(%i): %s",
+                                                        rule->node.nodename,
+                                                        pattern->num, line);
+                                        if (line[strlen(line)-1] != '\n')
+                                                printf("\n");
+                                }
+                                else
+                                {
+                                        return;
+                                }
                         }
                 }
         }
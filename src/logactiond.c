@@ -50,7 +50,9 @@
 #include "logging.h"
 #include "messages.h"
 #include "misc.h"
+#include "patterns.h"
 #include "remote.h"
+#include "session.h"
 #include "state.h"
 #include "status.h"
 #if HAVE_LIBSYSTEMD
@@ -61,13 +63,15 @@
 #include "binarytree.h"
 #include "crypto.h"
 #include "metacommands.h"
+#include "aggregation.h"
+#include "dnsbl.h"
 #include "pthread_barrier.h"
 
 pthread_t main_thread = 0;
 pthread_barrier_t final_barrier;
 bool barrier_initialized = false;
 
-#define MAX_THREADS 20
+#define MAX_THREADS 32
 pthread_t all_threads[MAX_THREADS] = {0};
 /* num_threads not declared as atomic because only main thread ever modifies it
  */
@@ -395,18 +399,11 @@ sync_with_other_instances(void)
         sleep(1);
 
         assert(la_config);
-#ifdef WITH_LIBSODIUM
-        generate_send_key_and_salt(la_config->remote_secret);
-#endif /* WITH_LIBSODIUM */
+        update_send_key();
 
         char message[TOTAL_MSG_LEN];
         if (!init_sync_message(message, NULL))
                 LOG_RETURN(, LOG_ERR, "Unable to create sync message");
-#ifdef WITH_LIBSODIUM
-        if (!encrypt_message(message))
-                LOG_RETURN(, LOG_ERR, "Unable to encrypt sync message");
-#endif /* WITH_LIBSODIUM */
-
         send_message_to_all_remote_hosts(message);
 }
 
@@ -481,7 +478,9 @@ main(int argc, char *argv[])
                 die_hard(false, "Error loading configuration.");
         load_la_config();
 
+        start_dnsbl_threads();
         start_watching_threads();
+        start_reorder_patterns_thread();
 #ifndef NOMONITORING
         start_monitoring_thread();
 #endif /* NOMONITORING */
@@ -518,7 +517,12 @@ main(int argc, char *argv[])
         unload_la_config();
 #if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
         free_meta_list();  // TODO: probably should go somewhere else
+        free_aggregate_list();
+        free_dnsbl_cache();
 #endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+#ifdef WITH_LIBSODIUM
+        free_sessions();
+#endif /* WITH_LIBSODIUM */
 
         if (!remove_pidfile(PIDFILE))
                 la_log_errno(LOG_ERR, "Unable to remove pidfile");
@@ -45,6 +45,8 @@
 #define BAK_SUFFIX ".bak"
 #define HOSTSFILE STATE_DIR "/logactiond.hosts"
 #define RULESFILE STATE_DIR "/logactiond.rules"
+#define SALTFILE STATE_DIR "/logactiond.salt"
+#define NEW_SALTFILE SALTFILE ".new"
 #define DIAGFILE STATE_DIR "/logactiond.diagnostics"
 
 /* Run directory */
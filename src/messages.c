@@ -23,14 +23,20 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "ndebug.h"
 #include "logactiond.h"
 #include "addresses.h"
+#include "binmsg.h"
 #include "commands.h"
 #include "configfile.h"
 #include "crypto.h"
+#include "dnsbl.h"
 #include "endqueue.h"
 #include "logging.h"
 #include "messages.h"
@@ -104,10 +110,100 @@
  *   +----------------------------------------------------------------   1 byte
  *                                                                    ==========
  *                                                                     180 bytes
+ *
+ * Batch messages (protocol version '1') contain several add or remove
+ * commands. Each command is the corresponding version '0' message without the
+ * version character, terminated by '\0':
+ *
+ *  "1+<ip-address>,<rule-name>\0+<ip-address>,<rule-name>\0-<ip-address>\0"
+ *
+ * Unlike version '0' messages, batch messages are not padded but have
+ * variable length of up to BATCH_MSG_LEN bytes.
  */
 
 #ifndef CLIENTONLY
 
+/* Add messages received from remote hosts during the last DEDUP_WINDOW
+ * seconds, see seen_recently(). Protected by seen_mutex. */
+typedef struct la_seen_entry_s
+{
+        uint64_t fingerprint;
+        time_t time;
+} la_seen_entry_t;
+
+static pthread_mutex_t seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static la_seen_entry_t seen_entries[DEDUP_CACHE_SIZE];
+
+/*
+ * 64 bit FNV-1a hash over address and rule name of an add command (i.e. up to
+ * the second comma), so an entry resent with a different end time or factor
+ * still has the same fingerprint. Never returns 0 as 0 marks an empty slot.
+ */
+
+static uint64_t
+add_fingerprint(const char *entry)
+{
+        uint64_t result = 14695981039346656037ULL;
+        int commas = 0;
+
+        for (; *entry && !(*entry == ',' && ++commas == 2); entry++)
+                result = (result ^ (unsigned char) *entry) * 1099511628211ULL;
+
+        return result ? result : 1;
+}
+
+/*
+ * Returns true if the same (address, rule) has been added by a remote host
+ * during the last DEDUP_WINDOW seconds. Remembers it otherwise. Where several
+ * hosts send to each other, the same entry tends to arrive from more than one
+ * host - no need to parse it and lock config_mutex more than once.
+ *
+ * entry is an add command without protocol version, i.e. "+<ip>,<rule>...".
+ */
+
+static bool
+seen_recently(const char *const entry)
+{
+        assert(entry); assert(*entry == CMD_ADD);
+
+        const uint64_t fingerprint = add_fingerprint(entry);
+        const time_t now = xtime(NULL);
+        bool result;
+
+        xpthread_mutex_lock(&seen_mutex);
+
+                la_seen_entry_t *const slot = &seen_entries[fingerprint &
+                        (DEDUP_CACHE_SIZE - 1)];
+                result = slot->fingerprint == fingerprint &&
+                        now - slot->time < DEDUP_WINDOW;
+                /* Don't refresh time on duplicates, otherwise a steady trickle
+                 * of duplicates would suppress an entry forever */
+                if (!result)
+                {
+                        slot->fingerprint = fingerprint;
+                        slot->time = now;
+                }
+
+        xpthread_mutex_unlock(&seen_mutex);
+
+        return result;
+}
+
+/*
+ * Forgets all entries seen. Called whenever entries are removed from the end
+ * queue by request, so they can be added again right away.
+ */
+
+static void
+forget_seen_entries(void)
+{
+        xpthread_mutex_lock(&seen_mutex);
+
+                memset(seen_entries, 0, sizeof seen_entries);
+
+        xpthread_mutex_unlock(&seen_mutex);
+}
+
 static bool
 is_empty_line(const char *const message)
 {
@@ -231,6 +327,8 @@ del_entry(const char *const buffer)
         if (!init_address(&address, buffer+2))
                 LOG_RETURN(, LOG_ERR, "Cannot convert address in command %s!", buffer+2);
 
+        forget_seen_entries();
+
         // TODO: locking really necessary here?
 
         xpthread_mutex_lock(&config_mutex);
@@ -247,12 +345,14 @@ del_entry(const char *const buffer)
 static void
 perform_flush(void)
 {
+        forget_seen_entries();
         empty_end_queue();
 }
 
 static void
 perform_reload(void)
 {
+        forget_seen_entries();
         trigger_reload();
 }
 
@@ -353,6 +453,8 @@ enable_rule(const char *const buffer)
                 {
                         la_log(LOG_INFO, "Enabling rule \"%s\".", buffer+2);
                         rule->enabled = true;
+                        /* Lines cached as non-matching might match now */
+                        clear_line_cache(rule->source_group);
                 }
 
         xpthread_mutex_unlock(&config_mutex);
@@ -387,7 +489,15 @@ parse_message_trigger_command(const char *const buf, la_address_t *from_addr)
                                 "from %s!", *buf, from_addr->text);
 
         if (from_addr != &fifo_address)
-                (void) query_domainname(from_addr);
+        {
+                if (*(buf+1) == CMD_ADD && seen_recently(buf+1))
+                {
+                        la_vdebug("Ignored duplicate %s from %s", buf,
+                                        from_addr->text);
+                        return;
+                }
+                lookup_domainname(from_addr);
+        }
         const char *const from = ADDRESS_NAME(from_addr);
 
         switch (*(buf+1))
@@ -406,6 +516,11 @@ parse_message_trigger_command(const char *const buf, la_address_t *from_addr)
                 la_log(LOG_INFO, "Received reload command from %s.", from);
                 perform_reload();
                 break;
+        case CMD_RELOAD_IGNORE_FILE:
+                la_log(LOG_INFO, "Received reload ignore file command from %s.",
+                                from);
+                (void) reload_ignore_file();
+                break;
         case CMD_SHUTDOWN:
                 la_log(LOG_INFO, "Received shutdown command from %s.", from);
                 perform_shutdown();
@@ -433,6 +548,9 @@ parse_message_trigger_command(const char *const buf, la_address_t *from_addr)
         case CMD_DUMP_STATUS:
                 perform_dump();
                 break;
+        case CMD_HEARTBEAT:
+                /* Nothing to do, receiving it is all that counts */
+                break;
         case CMD_ENABLE_RULE:
                 enable_rule(buf);
                 break;
@@ -454,8 +572,160 @@ parse_message_trigger_command(const char *const buf, la_address_t *from_addr)
         }
 }
 
+/*
+ * Triggers all commands contained in a batch message of len bytes. Only add
+ * and remove commands are accepted in batch messages.
+ */
+
+void
+parse_batch_message_trigger_commands(const char *const buf, const size_t len,
+                la_address_t *from_addr)
+{
+        assert(buf); assert(*buf == PROTOCOL_VERSION_BATCH);
+        la_debug("parse_batch_message_trigger_commands(%s)", from_addr->text);
+
+        const char *const end = buf + len;
+        for (const char *ptr = buf + 1; ptr < end && *ptr;)
+        {
+                const size_t entry_len = strnlen(ptr, end - ptr);
+                if (ptr + entry_len == end || entry_len > MSG_LEN - 2)
+                        LOG_RETURN(, LOG_ERR, "Malformed batch message from "
+                                        "%s!", from_addr->text);
+
+                if (*ptr == CMD_ADD || *ptr == CMD_DEL)
+                {
+                        char message[MSG_LEN];
+                        message[0] = PROTOCOL_VERSION;
+                        memcpy(&message[1], ptr, entry_len + 1);
+                        parse_message_trigger_command(message, from_addr);
+                }
+                else
+                {
+                        la_log(LOG_ERR, "Received illegal command '%c' in "
+                                        "batch message from %s.", *ptr,
+                                        from_addr->text);
+                }
+
+                ptr += entry_len + 1;
+        }
+}
+
+/*
+ * Triggers the add command of a single binary entry unless the same entry has
+ * been seen recently.
+ */
+
+static void
+add_binary_entry(la_address_t *const address, const char *const rule_name,
+                const time_t end_time, const int factor,
+                la_address_t *const from_addr)
+{
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
+        assert_address(address); assert(rule_name);
+
+        /* Same fingerprint as the textual version of the entry */
+        char entry[MSG_LEN];
+        snprintf(entry, MSG_LEN, "%c%s,%s", CMD_ADD, address->text, rule_name);
+        if (seen_recently(entry))
+        {
+                la_vdebug("Ignored duplicate %s from %s", entry,
+                                from_addr->text);
+                return;
+        }
+
+        lookup_domainname(from_addr);
+
+        xpthread_mutex_lock(&config_mutex);
+
+                la_rule_t *const rule = find_rule(rule_name);
+                if (rule && rule->enabled)
+                        trigger_manual_commands_for_rule(address, rule,
+                                        end_time, factor, from_addr, false);
+
+        xpthread_mutex_unlock(&config_mutex);
+
+        if (!rule)
+                la_log_verbose(LOG_ERR, "Ignoring remote message '%s' - rule "
+                                "not active on local system", entry);
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+}
+
+/*
+ * Triggers all commands contained in a binary message of len bytes (see
+ * binmsg.h). Unlike textual messages, entries are decoded without scanning
+ * strings or calling the resolver.
+ */
+
+void
+parse_binary_message_trigger_commands(const char *const buf, const size_t len,
+                la_address_t *from_addr)
+{
+        assert(buf); assert(*buf == PROTOCOL_VERSION_BINARY);
+        la_debug("parse_binary_message_trigger_commands(%s)", from_addr->text);
+
+        const char *const end = buf + len;
+        for (const char *ptr = buf + 1; ptr < end;)
+        {
+                la_address_t address;
+                char rule_name[BINMSG_MAX_RULE_LEN + 1];
+                time_t end_time;
+                int factor;
+
+                const size_t entry_len = parse_binary_entry(ptr, end - ptr,
+                                &address, rule_name, &end_time, &factor);
+                if (!entry_len || *ptr != CMD_ADD)
+                        LOG_RETURN(, LOG_ERR, "Malformed binary message from "
+                                        "%s!", from_addr->text);
+
+                add_binary_entry(&address, rule_name, end_time, factor,
+                                from_addr);
+
+                ptr += entry_len;
+        }
+}
+
 #endif /* CLIENTONLY */
 
+/*
+ * Appends message (an unencrypted version '0' add or remove message or a
+ * binary message with a single entry) to the batch message in buffer.
+ * batch_len is the current length of the batch message (0 to start a new one)
+ * and will be updated accordingly. Entries of binary messages go into a
+ * binary message, entries of version '0' messages into a version '1' message.
+ *
+ * Returns false if message doesn't fit into the batch message anymore or the
+ * batch message is of the other kind.
+ */
+
+bool
+append_to_batch_message(char *const buffer, int *const batch_len,
+                const char *const message)
+{
+        assert(buffer); assert(batch_len); assert(message);
+        assert(*message == PROTOCOL_VERSION ||
+                        *message == PROTOCOL_VERSION_BINARY);
+        assert(*(message+1) == CMD_ADD || *(message+1) == CMD_DEL);
+
+        const bool binary = *message == PROTOCOL_VERSION_BINARY;
+        const char version = binary ? PROTOCOL_VERSION_BINARY :
+                PROTOCOL_VERSION_BATCH;
+
+        if (*batch_len == 0)
+                buffer[MSG_IDX + (*batch_len)++] = version;
+        else if (buffer[MSG_IDX] != version)
+                return false;
+
+        const size_t entry_len = binary ? binary_entry_len(message + 1,
+                        MSG_LEN - 1) : strlen(message + 1) + 1;
+        if (*batch_len + entry_len > BATCH_MSG_LEN)
+                return false;
+
+        memcpy(&buffer[MSG_IDX + *batch_len], message + 1, entry_len);
+        *batch_len += entry_len;
+
+        return true;
+}
+
 bool
 init_add_message(char *const buffer, const char *const ip,
                 const char *const rule, const char *const end_time,
@@ -483,24 +753,15 @@ init_add_message(char *const buffer, const char *const ip,
 }
 
 int
-print_add_message(FILE *const stream, const la_command_t *const command)
+print_add_message(FILE *const stream, const char *const address,
+                const char *const rule_name, const time_t end_time,
+                const int factor)
 {
-	/* Don't assert_command() here to make sure this also works in case
-	 * no proper configuration (la_config...) is available at the
-	 * moment */
-        assert(stream);
-
-        /* TODO: would this make sense for commands w/o address as well? Then
-         * maybe we should reflect this in the protocol and then implement
-         * here... */
-        if (!command->address)
-                return 0;
-
-        la_debug_func(command->address->text);
+        assert(stream); assert(address); assert(rule_name);
+        la_debug_func(address);
 
         return fprintf(stream, "%c%c%s,%s,%ld,%d\n", PROTOCOL_VERSION, CMD_ADD,
-                        command->address->text, command->rule_name,
-                        command->end_time, command->factor);
+                        address, rule_name, end_time, factor);
 }
 
 bool
@@ -542,6 +803,18 @@ init_reload_message(char *const buffer)
         return init_simple_message(buffer, CMD_RELOAD, NULL);
 }
 
+bool
+init_reload_ignore_file_message(char *const buffer)
+{
+        return init_simple_message(buffer, CMD_RELOAD_IGNORE_FILE, NULL);
+}
+
+bool
+init_heartbeat_message(char *const buffer)
+{
+        return init_simple_message(buffer, CMD_HEARTBEAT, NULL);
+}
+
 bool
 init_shutdown_message(char *const buffer)
 {
@@ -30,6 +30,14 @@
 
 #define PROTOCOL_VERSION '0'
 #define PROTOCOL_VERSION_STR "0"
+/* Several add / del entries in one datagram */
+#define PROTOCOL_VERSION_BATCH '1'
+/* Key exchange for sessions, see session.h */
+#define PROTOCOL_VERSION_KX '2'
+/* End queue digest for anti-entropy, see digest.h */
+#define PROTOCOL_VERSION_DIGEST '3'
+/* Add entries in binary encoding, see binmsg.h */
+#define PROTOCOL_VERSION_BINARY '4'
 #define CMD_ADD '+'
 #define CMD_ADD_STR "+"
 #define CMD_DEL '-'
@@ -46,6 +54,8 @@
 #define CMD_DISABLE_RULE 'N'
 #define CMD_UPDATE_STATUS_MONITORING 'M'
 #define CMD_UPDATE_WATCHING 'W'
+#define CMD_RELOAD_IGNORE_FILE 'I'
+#define CMD_HEARTBEAT 'H'
 
 
 /* Length of unencrypted message*/
@@ -59,6 +69,8 @@
 #ifdef WITH_LIBSODIUM
 /* Length of encrypted message (i.e. incl. MAC */
 #define ENC_MSG_LEN MSG_LEN + crypto_secretbox_MACBYTES
+/* Bytes added to a message by encryption (MAC, salt and nonce) */
+#define CRYPTO_OVERHEAD (crypto_secretbox_MACBYTES + crypto_secretbox_NONCEBYTES + crypto_pwhash_SALTBYTES)
 /* Length of whole message that will be send, i.e.
  * - nonce
  * - MAC
@@ -66,9 +78,23 @@
  */
 #define TOTAL_MSG_LEN (ENC_MSG_LEN + crypto_secretbox_NONCEBYTES + crypto_pwhash_SALTBYTES)
 #else
+#define CRYPTO_OVERHEAD 0
 #define TOTAL_MSG_LEN MSG_LEN
 #endif
 
+/* Maximum length of a datagram incl. encryption. Stays below the IPv6 minimum
+ * MTU (1280 bytes minus 48 bytes IPv6 and UDP header), so batch messages
+ * don't get fragmented on any path. */
+#define MAX_DATAGRAM_LEN 1232
+
+/* Maximum length of unencrypted batch message */
+#define BATCH_MSG_LEN (MAX_DATAGRAM_LEN - CRYPTO_OVERHEAD)
+
+/* Seconds an add message from a remote host suppresses identical ones */
+#define DEDUP_WINDOW 60
+/* Number of slots for remembering add messages (must be a power of 2) */
+#define DEDUP_CACHE_SIZE 4096
+
 #define MSG_IDX 0
 #define SALT_IDX ENC_MSG_LEN
 #define NONCE_IDX (ENC_MSG_LEN+crypto_pwhash_SALTBYTES)
@@ -78,11 +104,21 @@ int parse_add_entry_message(const char *message, la_address_t *address,
                 la_rule_t **rule, time_t *end_time, int *factor);
 
 void parse_message_trigger_command(const char *buf, la_address_t *from_addr);
+
+void parse_batch_message_trigger_commands(const char *buf, size_t len,
+                la_address_t *from_addr);
+
+void parse_binary_message_trigger_commands(const char *buf, size_t len,
+                la_address_t *from_addr);
 #endif /* CLIENTONLY */
 
+bool append_to_batch_message(char *buffer, int *batch_len,
+                const char *message);
+
 bool init_add_message(char *buffer, const char *ip, const char *rule, const char *end_time, const char *factor);
 
-int print_add_message(FILE *stream, const la_command_t *command);
+int print_add_message(FILE *stream, const char *address, const char *rule_name,
+                time_t end_time, int factor);
 
 bool init_del_message(char *buffer, const char *ip);
 
@@ -94,6 +130,10 @@ bool init_flush_message(char *buffer);
 
 bool init_reload_message(char *buffer);
 
+bool init_reload_ignore_file_message(char *buffer);
+
+bool init_heartbeat_message(char *buffer);
+
 bool init_shutdown_message(char *buffer);
 
 bool init_save_message(char *buffer);
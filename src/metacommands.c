@@ -44,7 +44,6 @@ free_meta_command(la_meta_command_t *const meta_command)
         la_vdebug_func(NULL);
         assert(meta_command);
 
-        free_address(meta_command->address);
         free(meta_command);
 }
 
@@ -69,7 +68,7 @@ create_meta_command(const la_command_t *const command)
         result->adr_node.payload = result;
 
         result->rule = command->rule;
-        result->address = dup_address(command->address);
+        result->key = command->adr_key;
         result->meta_start_time = xtime(NULL);
         result->factor = 1;
 
@@ -102,11 +101,18 @@ find_on_meta_list(const la_command_t *const command)
 
                 la_meta_command_t *mcmd = (la_meta_command_t *) node->payload;
                 assert(mcmd);
-                const int cmp = adrcmp(mcmd->address, command->address);
+                const int cmp = adrkeycmp(&mcmd->key, &command->adr_key);
 
                 if (now >= mcmd->meta_start_time + mcmd->rule->meta_period)
                 {
                         /* Remove expired commands from meta list */
+                        if (log_level >= LOG_VDEBUG)
+                        {
+                                char text[INET6_ADDRSTRLEN];
+                                la_vdebug("Removing %s from meta list",
+                                                address_key_text(&mcmd->key,
+                                                        text));
+                        }
                         kw_tree_node_t *tmp = node;
                         node = remove_tree_node(meta_list, node);
                         free_meta_command((la_meta_command_t *) tmp->payload);
@@ -137,7 +143,8 @@ find_on_meta_list(const la_command_t *const command)
 static int
 cmp_meta_commands(const void *p1, const void *p2)
 {
-        return adrcmp(((la_meta_command_t *) p1)->address, ((la_meta_command_t *) p2)->address);
+        return adrkeycmp(&((la_meta_command_t *) p1)->key,
+                        &((la_meta_command_t *) p2)->key);
 }
 
 /*
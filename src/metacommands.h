@@ -40,7 +40,7 @@ typedef struct la_meta_command_s
 {
         kw_tree_node_t adr_node;
         la_rule_t *rule;
-        la_address_t *address;
+        la_address_key_t key;
         time_t meta_start_time;
         int factor;
 } la_meta_command_t;
@@ -110,6 +110,8 @@ kw_node_t *get_head(const kw_list_t *list);
 
 kw_node_t *get_tail(const kw_list_t *list);
 
+void insert_node_after(kw_node_t *ex_node, kw_node_t *new_node);
+
 void insert_node_before(kw_node_t *ex_node, kw_node_t *new_node);
 
 kw_node_t *remove_node(kw_node_t *node);
@@ -24,8 +24,14 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdnoreturn.h>
 
 #include "ndebug.h"
+#include "logactiond.h"
+#include "configfile.h"
 #include "logging.h"
 #include "misc.h"
 #include "patterns.h"
@@ -220,7 +226,10 @@ create_pattern(const char *const string_from_configfile,
         assert(string_from_configfile); assert_rule(rule);
         la_vdebug_func(string_from_configfile);
 
-        char *const full_string = concat(rule->source_group->prefix,
+        /* With syslog_header, the header is parsed separately and patterns
+         * are only matched against the message */
+        char *const full_string = concat(rule->source_group->syslog_header ?
+                        "^" : rule->source_group->prefix,
                         string_from_configfile);
         assert(full_string);
         la_vdebug("full_string=%s", full_string);
@@ -240,6 +249,8 @@ create_pattern(const char *const string_from_configfile,
                 die_re(r, &(result->regex));
 
         result->detection_count = result->invocation_count = 0;
+        result->exec_count = result->match_count = 0;
+        result->sample_count = result->sample_nsecs = 0;
 
         assert_pattern(result);
         return result;
@@ -266,4 +277,161 @@ free_pattern(la_pattern_t *const pattern)
         free(pattern);
 }
 
+/*
+ * Adds time passed since start to the pattern's sampled execution time.
+ */
+
+void
+sample_pattern_exec_time(la_pattern_t *const pattern,
+                const struct timespec *const start)
+{
+        assert(pattern); assert(start);
+
+        struct timespec now;
+        if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+                die_hard(true, "Can't get current time");
+
+        pattern->sample_nsecs += (now.tv_sec - start->tv_sec) * 1000000000LL +
+                now.tv_nsec - start->tv_nsec;
+        pattern->sample_count++;
+}
+
+/*
+ * Average execution time of regexec() for pattern in nanoseconds, 0 if not
+ * sampled yet.
+ */
+
+long int
+get_average_exec_time(const la_pattern_t *const pattern)
+{
+        assert(pattern);
+
+        return pattern->sample_count ?
+                pattern->sample_nsecs / pattern->sample_count : 0;
+}
+
+/*
+ * Matching stops at the first matching pattern. Expected cost per line is
+ * minimal when patterns are sorted by hit rate / execution time in
+ * descending order. Patterns without any samples keep their relative
+ * position behind the others.
+ */
+
+static double
+pattern_score(const la_pattern_t *const pattern)
+{
+        const long int avg_time = get_average_exec_time(pattern);
+
+        if (!pattern->exec_count || !avg_time)
+                return 0;
+
+        return (double) pattern->match_count / (double) pattern->exec_count /
+                (double) avg_time;
+}
+
+/*
+ * Reorder list of patterns based on their statistics. Must be called with
+ * config_mutex locked.
+ */
+
+void
+reorder_patterns(kw_list_t *const patterns)
+{
+        assert_list(patterns);
+
+        kw_list_t sorted;
+        init_list(&sorted);
+
+        /* Simple insertion sort - lists are short. Stable, so patterns with
+         * equal score keep the order from the config file */
+        la_pattern_t *pattern;
+        while ((pattern = (la_pattern_t *) rem_head(patterns)))
+        {
+                const double score = pattern_score(pattern);
+                kw_node_t *pred = sorted.tail_pred;
+                while (pred->pred && pattern_score((la_pattern_t *) pred) <
+                                score)
+                        pred = pred->pred;
+                insert_node_after(pred, (kw_node_t *) pattern);
+
+                if (pattern->exec_count >= PATTERN_STATS_DECAY_COUNT)
+                {
+                        pattern->exec_count /= 2;
+                        pattern->match_count /= 2;
+                        pattern->sample_count /= 2;
+                        pattern->sample_nsecs /= 2;
+                }
+        }
+
+        while ((pattern = (la_pattern_t *) rem_head(&sorted)))
+                add_tail(patterns, (kw_node_t *) pattern);
+}
+
+#ifndef NOWATCH
+static void
+reorder_patterns_of_source_group(la_source_group_t *const source_group)
+{
+        FOREACH(la_rule_t, rule, &source_group->rules)
+                reorder_patterns(&rule->patterns);
+}
+
+static void
+cleanup_reorder_patterns(void *const arg)
+{
+        la_debug_func(NULL);
+
+        wait_final_barrier();
+        la_debug("reorder patterns thread exiting");
+}
+
+noreturn static void *
+periodically_reorder_patterns(void *const ptr)
+{
+        la_debug_func(NULL);
+
+        pthread_cleanup_push(cleanup_reorder_patterns, NULL);
+
+        for (;;)
+        {
+                sleep(PATTERN_REORDER_PERIOD);
+
+                if (shutdown_ongoing)
+                {
+                        la_debug("Shutting down reorder patterns thread.");
+                        pthread_exit(NULL);
+                }
+
+                xpthread_mutex_lock(&config_mutex);
+
+                        FOREACH(la_source_group_t, source_group,
+                                        &la_config->source_groups)
+                                reorder_patterns_of_source_group(source_group);
+#if HAVE_LIBSYSTEMD
+                        if (la_config->systemd_source_group)
+                                reorder_patterns_of_source_group(
+                                                la_config->systemd_source_group);
+#endif /* HAVE_LIBSYSTEMD */
+
+                xpthread_mutex_unlock(&config_mutex);
+        }
+
+        assert(false);
+        /* Will never be reached, simply here to make potential pthread macros
+         * happy */
+        pthread_cleanup_pop(1);
+}
+
+void
+start_reorder_patterns_thread(void)
+{
+        la_debug_func(NULL);
+
+        pthread_t thread;
+        xpthread_create(&thread, NULL, periodically_reorder_patterns, NULL,
+                        "reorder");
+        thread_started(thread);
+        la_debug("reorder patterns thread started (%i)", thread);
+}
+#endif /* NOWATCH */
+
 /* vim: set autowrite expandtab: */
@@ -20,6 +20,7 @@
 #define __patterns_h
 
 #include <regex.h>
+#include <time.h>
 
 #include "ndebug.h"
 #include "nodelist.h"
@@ -38,6 +39,16 @@
 #define free_pattern_list(list) \
         free_list(list, (void (*)(void *const)) free_pattern)
 
+/* Measure execution time of every n-th regexec() of a pattern only */
+#define PATTERN_SAMPLE_INTERVAL 16
+
+/* Seconds between reordering patterns */
+#define PATTERN_REORDER_PERIOD 60
+
+/* Halve statistics once a pattern has been executed that often, so ordering
+ * adapts to changing log contents */
+#define PATTERN_STATS_DECAY_COUNT 1048576
+
 typedef struct la_pattern_s
 {
         kw_node_t node;
@@ -49,6 +60,11 @@ typedef struct la_pattern_s
         kw_list_t properties; /* list of la_property_t */
         long int detection_count;
         long int invocation_count;
+        /* Statistics for ordering patterns, protected by config_mutex */
+        long int exec_count;
+        long int match_count;
+        long int sample_count;
+        long long int sample_nsecs;
 } la_pattern_t;
 
 void assert_pattern_ffl(const la_pattern_t *pattern, const char *func,
@@ -59,6 +75,15 @@ la_pattern_t *create_pattern(const char *string_from_configfile, int num,
 
 void free_pattern(la_pattern_t *pattern);
 
+void sample_pattern_exec_time(la_pattern_t *pattern,
+                const struct timespec *start);
+
+long int get_average_exec_time(const la_pattern_t *pattern);
+
+void reorder_patterns(kw_list_t *patterns);
+
+void start_reorder_patterns_thread(void);
+
 #endif /* __patterns_h */
 
 /* vim: set autowrite expandtab: */
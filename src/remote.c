@@ -18,6 +18,8 @@
 
 #include <config.h>
 
+/* define _GNU_SOURCE to get sendmmsg() and recvmmsg() */
+#define _GNU_SOURCE
 #include <syslog.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -34,6 +36,7 @@
 #include <stdatomic.h>
 #endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
 #include <stdnoreturn.h>
+#include <time.h>
 
 #ifdef WITH_LIBSODIUM
 #ifndef NOCRYPTO
@@ -44,6 +47,8 @@
 #include "ndebug.h"
 #include "logactiond.h"
 #include "addresses.h"
+#include "binmsg.h"
+#include "cluster.h"
 #include "commands.h"
 #include "configfile.h"
 #include "crypto.h"
@@ -51,11 +56,19 @@
 #include "logging.h"
 #include "messages.h"
 #include "misc.h"
+#include "remote.h"
+#include "session.h"
+#include "syncstream.h"
+#include "digest.h"
 #include "fifo.h"
 
 static int client_fd4;
 static int client_fd6;
 pthread_t sync_entries_thread = 0;
+/* Protects sync_entries_thread and sync_entries_thread_running. As the sync
+ * thread is detached, its thread id is only valid while
+ * sync_entries_thread_running is set. */
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
 #if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
 atomic_bool sync_entries_thread_running = ATOMIC_VAR_INIT(false);
 #else /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
@@ -64,235 +77,1964 @@ bool sync_entries_thread_running = false;
 
 pthread_once_t  once_control = PTHREAD_ONCE_INIT;
 
+/* Send queue of one of the send_to hosts. Messages are stored only once for
+ * all hosts (in send_ring), a host's queue consists of the messages from next
+ * up to send_head. Once the queue holds SEND_QUEUE_LEN messages, the oldest
+ * ones are dropped (and counted). */
+typedef struct la_send_queue_s
+{
+        la_address_t address;
+        /* Number of the next message to send to the host */
+        unsigned long next;
+        unsigned int dropped;
+} la_send_queue_t;
+
+/* Send queues, one per send_to host, emptied by sender_loop() once
+ * send_deadline has passed or send_now is set. Protected by send_mutex. Lock
+ * config_mutex before send_mutex. */
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t send_condition = PTHREAD_COND_INITIALIZER;
+static la_send_queue_t *send_queues = NULL;
+static int send_queues_length = 0;
+static char send_ring[SEND_QUEUE_LEN][MSG_LEN];
+/* Number of messages queued so far */
+static unsigned long send_head = 0;
+/* Total length of the entries queued since the queues were last emptied */
+static size_t send_pending_len = 0;
+static bool send_now = false;
+static struct timespec send_deadline;
+
+/* Messages taken from a send queue. Only used by sender_loop(). */
+static char send_buffer[SEND_QUEUE_LEN][MSG_LEN];
+
+/* Entries sync_all_entries() should send where. buffer is allocated by
+ * sync_all_entries() itself. */
+typedef struct la_sync_request_s
+{
+        la_address_t address;
+        /* Send all entries or only those falling into the marked buckets */
+        bool all;
+        bool buckets[DIGEST_BUCKETS];
+        void *buffer;
+} la_sync_request_t;
+
+/* Settings the send functions depend on. Copied from la_config, so the sender
+ * thread can encrypt and send without holding config_mutex. */
+typedef struct la_send_settings_s
+{
+        bool enabled;
+        bool key_exchange;
+        int batch_latency;
+        int port;
+} la_send_settings_t;
+
+#ifdef WITH_LIBSODIUM
+/* Datagram waiting for the KDF thread to derive the key for its salt */
+typedef struct la_pending_datagram_s
+{
+        kw_node_t node;
+        ssize_t num_read;
+        struct sockaddr_storage remote_client;
+        char buf[MAX_DATAGRAM_LEN + 1];
+} la_pending_datagram_t;
+
+/* Queue of datagrams for kdf_loop(). Protected by kdf_mutex. */
+static pthread_mutex_t kdf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kdf_condition = PTHREAD_COND_INITIALIZER;
+static kw_list_t *kdf_queue = NULL;
+static int kdf_queue_length = 0;
+#endif /* WITH_LIBSODIUM */
+
 /* TODO: freeaddrinfo(), but only once. Probably need a mutex for this.
  * TODO: close server_fd (will also need a mutex)
  * TODO: maybe connect socket? */
 
+/*
+ * Binds client socket to the address specified by remote setting bind (if
+ * any), so remote hosts see messages coming from the same address they send
+ * to. Matters for sessions with remote hosts which are tied to the address
+ * and for sync streams, which are only accepted from receive_from hosts.
+ */
+
 void
-send_message_to_single_address(const char *const message,
-                const la_address_t *const remote_address)
+bind_client_socket(const int fd, const int family)
 {
-        assert(la_config); assert_address(remote_address);
-        la_debug_func( remote_address->text);
-        if (!la_config->remote_enabled)
+        assert(la_config);
+        if (!la_config->remote_bind || !strcmp("*", la_config->remote_bind))
                 return;
 
-        /* Test for shutdown first, just to make sure nobody has closed the fds
-         * already */
-        if (shutdown_ongoing)
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = family;
+        hints.ai_socktype = SOCK_DGRAM;
+        struct addrinfo *ai;
+        if (getaddrinfo(la_config->remote_bind, NULL, &hints, &ai))
                 return;
 
-        /* Select correct file descriptor, open new socket if not already done
-         * so */
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+                la_log_errno(LOG_WARNING, "Unable to bind client socket to %s",
+                                la_config->remote_bind);
+
+        freeaddrinfo(ai);
+}
+
+/*
+ * Returns file descriptor of client socket for family, opens new socket if not
+ * already done so. Returns -1 on error.
+ */
+
+static int
+get_client_fd(const int family)
+{
         /* TODO: would there any scenario where to threads want to send at the
          * same time, if so: do we need a mutex? */
-        int *fd_ptr = remote_address->sa.ss_family == AF_INET ? &client_fd4 : &client_fd6;
+        int *fd_ptr = family == AF_INET ? &client_fd4 : &client_fd6;
         if ((*fd_ptr == 0 || *fd_ptr == -1))
         {
-                *fd_ptr = socket(remote_address->sa.ss_family, SOCK_DGRAM, 0);
+                *fd_ptr = socket(family, SOCK_DGRAM, 0);
                 if (*fd_ptr == -1)
-                        LOG_RETURN_ERRNO(, LOG_ERR, "Unable to create server socket");
+                        LOG_RETURN_ERRNO(-1, LOG_ERR, "Unable to create server socket");
+                bind_client_socket(*fd_ptr, family);
         }
 
-        const ssize_t message_sent = sendto(*fd_ptr, message, TOTAL_MSG_LEN, 0,
+        return *fd_ptr;
+}
+
+#if !HAVE_MMSG
+static void
+send_datagram_to_single_address(const char *const message, const size_t len,
+                const la_address_t *const remote_address)
+{
+        assert_address(remote_address);
+        la_debug_func( remote_address->text);
+
+        /* Test for shutdown first, just to make sure nobody has closed the fds
+         * already */
+        if (shutdown_ongoing)
+                return;
+
+        const int fd = get_client_fd(remote_address->sa.ss_family);
+        if (fd == -1)
+                return;
+
+        const ssize_t message_sent = sendto(fd, message, len, 0,
                         (struct sockaddr *) &remote_address->sa,
                         sizeof remote_address->sa);
         if (message_sent == -1)
                 la_log_errno(LOG_ERR, "Unable to send message to %s",
                                 remote_address->text);
-        else if (message_sent != TOTAL_MSG_LEN)
+        else if ((size_t) message_sent != len)
                 la_log_errno(LOG_ERR, "Sent truncated message to %s",
                                 remote_address->text);
 }
+#endif /* !HAVE_MMSG */
+
+#if HAVE_MMSG
+/*
+ * Sends the datagrams to hosts of the given address family with as few
+ * sendmmsg() calls as possible. Datagram iov[i] goes to addresses[i].
+ */
+
+static void
+send_datagrams_to_family(const int family, const struct iovec *const iov,
+                const la_address_t *const *const addresses, const int n)
+{
+        assert(iov); assert(addresses); assert(n > 0);
+
+        const int fd = get_client_fd(family);
+        if (fd == -1)
+                return;
+
+        struct mmsghdr msgs[n];
+        const la_address_t *msg_addresses[n];
+        int m = 0;
+        for (int i = 0; i < n; i++)
+        {
+                if (addresses[i]->sa.ss_family != family)
+                        continue;
+
+                memset(&msgs[m], 0, sizeof msgs[m]);
+                msgs[m].msg_hdr.msg_name = (void *) &addresses[i]->sa;
+                msgs[m].msg_hdr.msg_namelen = sizeof addresses[i]->sa;
+                msgs[m].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+                msgs[m].msg_hdr.msg_iovlen = 1;
+                msg_addresses[m++] = addresses[i];
+        }
+
+        for (int sent = 0; sent < m;)
+        {
+                const int r = sendmmsg(fd, &msgs[sent], m - sent, 0);
+                if (r == -1)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        /* Error refers to first message, skip it and carry on
+                         * with the next one */
+                        la_log_errno(LOG_ERR, "Unable to send message to %s",
+                                        msg_addresses[sent]->text);
+                        sent++;
+                        continue;
+                }
+
+                for (int i = sent; i < sent + r; i++)
+                {
+                        if (msgs[i].msg_len != msgs[i].msg_hdr.msg_iov->iov_len)
+                                la_log(LOG_ERR, "Sent truncated message to %s",
+                                                msg_addresses[i]->text);
+                }
+                sent += r;
+        }
+}
+#endif /* HAVE_MMSG */
+
+/*
+ * Sends n datagrams, iov[i] to addresses[i]. Uses one sendmmsg() call per
+ * address family where available.
+ */
+
+static void
+send_datagrams(const la_send_settings_t *const settings,
+                const struct iovec *const iov,
+                const la_address_t *const *const addresses, const int n)
+{
+        assert(settings); assert(iov); assert(addresses);
+        if (!settings->enabled)
+                return;
+#if HAVE_MMSG
+        if (shutdown_ongoing || !n)
+                return;
+
+        send_datagrams_to_family(AF_INET, iov, addresses, n);
+        send_datagrams_to_family(AF_INET6, iov, addresses, n);
+#else /* HAVE_MMSG */
+        for (int i = 0; i < n; i++)
+                send_datagram_to_single_address(iov[i].iov_base,
+                                iov[i].iov_len, addresses[i]);
+#endif /* HAVE_MMSG */
+}
+
+/*
+ * Copies the settings needed for sending from la_config. Must be called with
+ * config_mutex held.
+ */
+
+static void
+get_send_settings(la_send_settings_t *const settings)
+{
+        assert(settings); assert(la_config);
+
+        settings->enabled = la_config->remote_enabled;
+        settings->key_exchange = la_config->remote_key_exchange;
+        settings->batch_latency = la_config->remote_batch_latency;
+        settings->port = la_config->remote_port;
+}
+
+#ifdef WITH_LIBSODIUM
+/*
+ * Sends key exchange message of the given type to address.
+ */
+
+static void
+send_kx_message(const la_send_settings_t *const settings,
+                const la_address_t *const address, const char type)
+{
+        assert(settings); assert_address(address);
+        la_debug_func(address->text);
+
+        char buffer[MAX_DATAGRAM_LEN];
+        const int len = init_kx_message(buffer, type, settings->port,
+                        address);
+
+        if (!encrypt_buffer(buffer, len))
+                LOG_RETURN(, LOG_ERR, "Unable to encrypt message");
+
+        const struct iovec iov = { .iov_base = buffer,
+                .iov_len = len + CRYPTO_OVERHEAD };
+        send_datagrams(settings, &iov, &address, 1);
+}
+
+/*
+ * Encrypts message of len bytes in buffer with the session keys of each
+ * address and sends it. Hosts without session get the message encrypted with
+ * the key derived from the secret plus a hello to set up a session.
+ */
+
+static void
+send_datagram_via_sessions(const la_send_settings_t *const settings,
+                char *const buffer, const size_t len,
+                const la_address_t *const *const addresses, const int n)
+{
+        assert(settings); assert(buffer); assert(addresses);
+
+        /* Version '0' messages needn't be padded in a session datagram */
+        const size_t session_len = *buffer == PROTOCOL_VERSION ?
+                strnlen(buffer, len - 1) + 1 : len;
+
+        struct iovec iov[n];
+        char *const session_buffer = xmalloc(n * MAX_DATAGRAM_LEN);
+        bool need_fallback = false;
+        for (int i = 0; i < n; i++)
+        {
+                char *const datagram = &session_buffer[i * MAX_DATAGRAM_LEN];
+                size_t datagram_len;
+                if (session_encrypt(buffer, session_len, addresses[i],
+                                        datagram, &datagram_len))
+                {
+                        iov[i].iov_base = datagram;
+                        iov[i].iov_len = datagram_len;
+                }
+                else
+                {
+                        iov[i].iov_base = NULL;
+                        need_fallback = true;
+                }
+        }
+
+        /* Encrypt in place only after all session datagrams are done */
+        if (need_fallback)
+        {
+                if (!encrypt_buffer(buffer, len))
+                {
+                        free(session_buffer);
+                        LOG_RETURN(, LOG_ERR, "Unable to encrypt message");
+                }
+
+                for (int i = 0; i < n; i++)
+                {
+                        if (iov[i].iov_base)
+                                continue;
+
+                        iov[i].iov_base = buffer;
+                        iov[i].iov_len = len + CRYPTO_OVERHEAD;
+                        if (kx_hello_due(addresses[i]))
+                                send_kx_message(settings, addresses[i],
+                                                KX_HELLO);
+                }
+        }
+
+        send_datagrams(settings, iov, addresses, n);
+        free(session_buffer);
+}
+#endif /* WITH_LIBSODIUM */
+
+/*
+ * Encrypts message of len bytes in buffer and sends it to the n addresses.
+ * Unless sessions are used, the message is encrypted only once for all of
+ * them. buffer must have room for len + CRYPTO_OVERHEAD bytes, its contents
+ * will be overwritten.
+ */
+
+static void
+send_datagram_to_hosts(const la_send_settings_t *const settings,
+                char *const buffer, const size_t len,
+                const la_address_t *const *const addresses, const int n)
+{
+        assert(settings); assert(buffer); assert(addresses);
+
+        if (!n)
+                return;
+
+#ifdef WITH_LIBSODIUM
+        if (settings->key_exchange)
+        {
+                send_datagram_via_sessions(settings, buffer, len, addresses,
+                                n);
+                return;
+        }
+
+        if (!encrypt_buffer(buffer, len))
+                LOG_RETURN(, LOG_ERR, "Unable to encrypt message");
+#endif /* WITH_LIBSODIUM */
+
+        struct iovec iov[n];
+        for (int i = 0; i < n; i++)
+        {
+                iov[i].iov_base = buffer;
+                iov[i].iov_len = len + CRYPTO_OVERHEAD;
+        }
+
+        send_datagrams(settings, iov, addresses, n);
+}
+
+/*
+ * Encrypts message of len bytes in buffer and sends it to address - or to all
+ * remote hosts if address is NULL. buffer must have room for len +
+ * CRYPTO_OVERHEAD bytes, its contents will be overwritten.
+ *
+ * Must be called with config_mutex held.
+ */
+
+static void
+send_plain_datagram(char *const buffer, const size_t len,
+                const la_address_t *const address)
+{
+        assert(la_config); assert(buffer);
+
+        const int n = address ? 1 : list_length(&la_config->remote_send_to);
+        if (!n)
+                return;
+
+        const la_address_t *addresses[n];
+        if (address)
+        {
+                addresses[0] = address;
+        }
+        else
+        {
+                int i = 0;
+                FOREACH(la_address_t, remote_address, &la_config->remote_send_to)
+                        addresses[i++] = remote_address;
+        }
+
+        la_send_settings_t settings;
+        get_send_settings(&settings);
+        update_send_key();
+        send_datagram_to_hosts(&settings, buffer, len, addresses, n);
+}
+
+/*
+ * Returns the number of bytes of message to send. Version '0' messages are
+ * padded to MSG_LEN, binary messages are sent without padding.
+ */
+
+static size_t
+message_len(const char *const message)
+{
+        assert(message);
+
+        if (*message == PROTOCOL_VERSION_BINARY)
+                return 1 + binary_entry_len(message + 1, MSG_LEN - 1);
+        else
+                return MSG_LEN;
+}
+
+/*
+ * Encrypts and sends message (TOTAL_MSG_LEN bytes buffer) to remote_address.
+ */
+
+void
+send_message_to_single_address(char *const message,
+                const la_address_t *const remote_address)
+{
+        send_plain_datagram(message, message_len(message), remote_address);
+}
+
+/*
+ * Encrypts and sends message (TOTAL_MSG_LEN bytes buffer) to all remote hosts.
+ */
+
+void
+send_message_to_all_remote_hosts(char *const message)
+{
+        send_plain_datagram(message, message_len(message), NULL);
+}
+
+/*
+ * Creates an add message for command in buffer (TOTAL_MSG_LEN bytes) - binary
+ * or textual depending on the binary_messages setting. Deliberately leaves out
+ * end_time and factor, receiving end should decide on duration.
+ */
+
+static bool
+init_add_message_for_command(char *const buffer,
+                const la_command_t *const command)
+{
+        assert(la_config); assert(buffer); assert(command->address);
+
+        if (la_config->remote_binary_messages)
+                return init_binary_add_message(buffer, command->address,
+                                command->rule_name, 0, 0);
+        else
+                return init_add_message(buffer, command->address->text,
+                                command->rule_name, NULL, NULL);
+}
+
+#ifdef WITH_LIBSODIUM
+/*
+ * Returns a copy of remote_secret in case it has changed since the send key
+ * has been derived, NULL otherwise. Copies salt_rotation as well. Must be
+ * called with config_mutex held.
+ */
+
+static char *
+take_changed_secret(int *const salt_rotation)
+{
+        assert(la_config); assert(salt_rotation);
+
+        if (!la_config->remote_secret_changed)
+                return NULL;
+
+        la_config->remote_secret_changed = false;
+        *salt_rotation = la_config->remote_salt_rotation;
+
+        return xstrdup(la_config->remote_secret);
+}
+
+/*
+ * Derives the send key from secret returned by take_changed_secret(), then
+ * frees secret. Needn't be called with config_mutex held.
+ */
+
+static void
+install_changed_secret(char *const secret, const int salt_rotation)
+{
+        assert(secret);
+
+        restore_send_key_and_salt(secret, salt_rotation);
+        free(secret);
+
+        /* Let KDF thread know about the new rotation deadline */
+        xpthread_mutex_lock(&kdf_mutex);
+
+                xpthread_cond_signal(&kdf_condition);
+
+        xpthread_mutex_unlock(&kdf_mutex);
+}
+#endif /* WITH_LIBSODIUM */
+
+/*
+ * (Re-)derives the send key in case remote_secret has changed. Reuses the salt
+ * saved by a previous run unless it's older than salt_rotation seconds, so
+ * receivers can keep using their cached keys.
+ *
+ * Must be called with config_mutex held.
+ */
 
 void
-send_message_to_all_remote_hosts(const char *const message)
+update_send_key(void)
+{
+        assert(la_config);
+#ifdef WITH_LIBSODIUM
+        int salt_rotation;
+        char *const secret = take_changed_secret(&salt_rotation);
+        if (secret)
+                install_changed_secret(secret, salt_rotation);
+#endif /* WITH_LIBSODIUM */
+}
+
+/*
+ * Encrypts batch message in buffer and sends it to address - or to all remote
+ * hosts if address is NULL. buffer must be MAX_DATAGRAM_LEN bytes long.
+ */
+
+static void
+send_batch_message(char *const buffer, const int len,
+                const la_address_t *const address)
+{
+        assert(buffer); assert(len > 0); assert(len <= BATCH_MSG_LEN);
+        assert(la_config);
+        la_debug("send_batch_message(%u)", len);
+
+        send_plain_datagram(buffer, len, address);
+}
+
+/*
+ * Returns the number of bytes message (version '0' or binary) occupies in a
+ * batch message.
+ */
+
+static size_t
+batch_entry_len(const char *const message)
+{
+        assert(message);
+
+        if (*message == PROTOCOL_VERSION_BINARY)
+                return binary_entry_len(message + 1, MSG_LEN - 1);
+        else
+                return strlen(message + 1) + 1;
+}
+
+/*
+ * Makes sure there's exactly one send queue for each host on send_to. Queues
+ * of hosts which are still on send_to (e.g. after a reload) are kept.
+ *
+ * Must be called with config_mutex and send_mutex held.
+ */
+
+static void
+update_send_queues(void)
 {
-        assert(la_config); assert_list(&la_config->remote_send_to);
+        assert(la_config);
+
+        const int n = list_length(&la_config->remote_send_to);
+        bool changed = n != send_queues_length;
+        int i = 0;
         FOREACH(la_address_t, remote_address, &la_config->remote_send_to)
         {
-                send_message_to_single_address(message, remote_address);
+                if (changed)
+                        break;
+                changed = adrcmp(remote_address, &send_queues[i].address) ||
+                        get_port(remote_address) !=
+                        get_port(&send_queues[i].address);
+                i++;
+        }
+        if (!changed)
+                return;
+
+        la_debug("update_send_queues(%u)", n);
+
+        la_send_queue_t *const new_queues = n ? xmalloc0(n *
+                        sizeof *new_queues) : NULL;
+        i = 0;
+        FOREACH(la_address_t, remote_address, &la_config->remote_send_to)
+        {
+                la_send_queue_t *const queue = &new_queues[i++];
+                queue->next = send_head;
+                for (int j = 0; j < send_queues_length; j++)
+                {
+                        if (!adrcmp(remote_address, &send_queues[j].address) &&
+                                        get_port(remote_address) ==
+                                        get_port(&send_queues[j].address))
+                        {
+                                memcpy(queue, &send_queues[j], sizeof *queue);
+                                break;
+                        }
+                }
+                memcpy(&queue->address, remote_address, sizeof queue->address);
+                queue->address.domainname = NULL;
+        }
+
+        free(send_queues);
+        send_queues = new_queues;
+        send_queues_length = n;
+}
+
+/*
+ * Queues message for all send_to hosts and lets sender_loop() know. Sender
+ * will send it after batch_latency milliseconds - or right away if batching
+ * is switched off or a batch message is full.
+ *
+ * Must be called with config_mutex held.
+ */
+
+static void
+queue_message(const char *const message)
+{
+        assert(message); assert(la_config);
+
+        xpthread_mutex_lock(&send_mutex);
+
+                update_send_queues();
+
+                memcpy(send_ring[send_head % SEND_QUEUE_LEN], message,
+                                MSG_LEN);
+                send_head++;
+
+                /* Message has replaced the oldest one of full queues */
+                for (int i = 0; i < send_queues_length; i++)
+                {
+                        la_send_queue_t *const queue = &send_queues[i];
+                        if (send_head - queue->next > SEND_QUEUE_LEN)
+                        {
+                                queue->next++;
+                                queue->dropped++;
+                        }
+                }
+
+                if (!send_pending_len)
+                {
+                        /* Start the clock */
+                        if (clock_gettime(CLOCK_REALTIME, &send_deadline) == -1)
+                                die_hard(true, "Can't get current time");
+                        send_deadline.tv_sec +=
+                                la_config->remote_batch_latency / 1000;
+                        send_deadline.tv_nsec +=
+                                (la_config->remote_batch_latency % 1000) *
+                                1000000;
+                        if (send_deadline.tv_nsec >= 1000000000)
+                        {
+                                send_deadline.tv_sec++;
+                                send_deadline.tv_nsec -= 1000000000;
+                        }
+                }
+
+                send_pending_len += batch_entry_len(message);
+                if (la_config->remote_batch_latency <= 0 ||
+                                send_pending_len >= BATCH_MSG_LEN - 1)
+                        send_now = true;
+
+                xpthread_cond_signal(&send_condition);
+
+        xpthread_mutex_unlock(&send_mutex);
+}
+
+/*
+ * Currently only called from trigger_command()
+ */
+void
+send_add_entry_message(const la_command_t *const command, const la_address_t *const address)
+{
+        la_debug_func(NULL);
+        assert(la_config); assert_command(command);
+
+        if (!la_config->remote_enabled)
+                return;
+
+        /* TODO: would this make sense for commands w/o address as well? Then
+         * maybe we should reflect this in the protocol and then implement
+         * here... */
+        if (!command->address)
+                LOG_RETURN(, LOG_ERR, "Can't create message for command without "
+                                "address");
+
+        /* TODO: leaving out end_time and factor - does that make sense? */
+        char message[TOTAL_MSG_LEN];
+        if (!init_add_message_for_command(message, command))
+                LOG_RETURN(, LOG_ERR, "Unable to create message");
+
+        if (address)
+                send_message_to_single_address(message, address);
+        else
+                queue_message(message);
+}
+
+static void
+close_fds(void)
+{
+        /* TODO: re-enable mt save */
+        /*if (server_fd > 0 && close(server_fd) == -1)
+                die_hard(true, "Unable to close socket");*/
+        /* TODO set to 0 after close() */
+
+        if (client_fd4 > 0)
+        {
+                if (close(client_fd4) == -1)
+                        la_log_errno(LOG_ERR, "Unable to close socket");
+                client_fd4 = 0;
+        }
+
+        if (client_fd6 > 0)
+        {
+                if (close(client_fd6) == -1)
+                        la_log_errno(LOG_ERR, "Unable to close socket");
+                client_fd6 = 0;
+        }
+}
+
+/*
+ * Cleanup when exiting.
+ */
+
+static void
+cleanup_remote(void *const arg)
+{
+        la_debug_func(NULL);
+
+
+        (void) pthread_once(&once_control, close_fds);
+
+        wait_final_barrier();
+        la_debug("Remote thread (%i) exiting", pthread_self());
+}
+
+/*
+ * Waits for datagrams on fd and returns the number of datagrams received (up
+ * to REMOTE_RECEIVE_BATCH). Uses recvmmsg() where available so a burst of
+ * datagrams is drained with a single call. The length of a truncated datagram
+ * will be reported as larger than MAX_DATAGRAM_LEN.
+ */
+
+static int
+receive_datagrams(const int fd, char buf[][MAX_DATAGRAM_LEN + 1],
+                struct sockaddr_storage *const remote_client,
+                ssize_t *const num_read)
+{
+        for (;;)
+        {
+#if HAVE_MMSG
+                struct iovec iov[REMOTE_RECEIVE_BATCH];
+                struct mmsghdr msgs[REMOTE_RECEIVE_BATCH];
+                memset(msgs, 0, sizeof msgs);
+                for (int i = 0; i < REMOTE_RECEIVE_BATCH; i++)
+                {
+                        iov[i].iov_base = buf[i];
+                        iov[i].iov_len = MAX_DATAGRAM_LEN;
+                        msgs[i].msg_hdr.msg_name = &remote_client[i];
+                        msgs[i].msg_hdr.msg_namelen = sizeof remote_client[i];
+                        msgs[i].msg_hdr.msg_iov = &iov[i];
+                        msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                const int n = recvmmsg(fd, msgs, REMOTE_RECEIVE_BATCH,
+                                MSG_WAITFORONE, NULL);
+                if (n == -1)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        else
+                                die_hard(true, "Error while receiving remote "
+                                                "messages");
+                }
+
+                for (int i = 0; i < n; i++)
+                        num_read[i] = msgs[i].msg_hdr.msg_flags & MSG_TRUNC ?
+                                MAX_DATAGRAM_LEN + 1 : (ssize_t) msgs[i].msg_len;
+
+                return n;
+#else /* HAVE_MMSG */
+                socklen_t remote_client_size = sizeof *remote_client;
+                num_read[0] = recvfrom(fd, buf[0], MAX_DATAGRAM_LEN, MSG_TRUNC,
+                                (struct sockaddr *) remote_client,
+                                &remote_client_size);
+                if (num_read[0] == -1)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        else
+                                die_hard(true, "Error while receiving remote "
+                                                "messages");
+                }
+
+                return 1;
+#endif /* HAVE_MMSG */
+        }
+}
+
+static void
+cleanup_sync_all_entries(void *arg)
+{
+        la_sync_request_t *const request = arg;
+
+        free(request->buffer);
+        free(request);
+
+        xpthread_mutex_lock(&sync_mutex);
+
+                sync_entries_thread_running = false;
+
+        xpthread_mutex_unlock(&sync_mutex);
+}
+
+/* 
+ * start_routine for pthread_create called from start_sync_thread(). ptr points
+ * to the la_sync_request_t.
+ */
+
+static void *
+sync_all_entries(void *ptr)
+{
+        la_sync_request_t *const request = (la_sync_request_t *) ptr;
+        la_address_t *const address = &request->address;
+
+        /* Nobody will join us */
+        pthread_detach(pthread_self());
+
+        /* request->buffer is still NULL here, so cleanup is safe from now
+         * on */
+        pthread_cleanup_push(cleanup_sync_all_entries, request);
+
+        assert(la_config);
+        set_port(address, la_config->remote_port);
+
+        /* Allocate in one shot so both can be free()d at once in
+         * cleanup_sync_all_entries() */
+        const int queue_length = get_queue_length();
+        void *buffer = xmalloc(((queue_length + 1) * sizeof (char*)) +
+                        queue_length * TOTAL_MSG_LEN);
+        char **message_array = buffer;
+        char *message_buffer = (char *) buffer + (queue_length + 1) * sizeof (char*);
+        request->buffer = buffer;
+
+        xpthread_mutex_lock(&end_queue_mutex);
+
+                int message_array_length = 0;
+
+                /* TODO: walking through tree via next_command_in_queue() will
+                 * create a highly imbalanced tree on the other end. Better
+                 * recurse through adr_tree from bottom to top (like
+                 * recursively_save_state does). */
+
+                /* Queue might have grown since get_queue_length() */
+                for (la_command_t *command = first_command_in_queue(); command
+                                && message_array_length < queue_length;
+                                (command = next_command_in_queue(command)))
+                {
+                        if (!command->is_template && command->address &&
+                                        (request->all || request->buckets[
+                                         digest_bucket(command->address)]))
+                        {
+                                char *message = message_buffer +
+                                        message_array_length * TOTAL_MSG_LEN;
+                                if (init_add_message_for_command(message,
+                                                        command))
+                                        message_array[message_array_length++] =
+                                                message;
+                        }
+                }
+
+        xpthread_mutex_unlock(&end_queue_mutex);
+
+        if (la_config->remote_sync_stream && message_array_length)
+        {
+                if (stream_entries_to_host(address, message_array,
+                                        message_array_length))
+                        message_array_length = 0;
+                else
+                        la_log(LOG_NOTICE, "Falling back to syncing %s via "
+                                        "datagrams.", address->text);
+        }
+
+        if (la_config->remote_batch_latency > 0)
+        {
+                char batch_buffer[MAX_DATAGRAM_LEN];
+                int batch_buffer_len = 0;
+                for (int i = 0; i < message_array_length; i++)
+                {
+                        if (!append_to_batch_message(batch_buffer,
+                                                &batch_buffer_len,
+                                                message_array[i]))
+                        {
+                                send_batch_message(batch_buffer,
+                                                batch_buffer_len, address);
+                                batch_buffer_len = 0;
+                                (void) append_to_batch_message(batch_buffer,
+                                                &batch_buffer_len,
+                                                message_array[i]);
+                                xnanosleep(0, 200000000);
+                        }
+                }
+                if (batch_buffer_len)
+                        send_batch_message(batch_buffer, batch_buffer_len,
+                                        address);
+                message_array_length = 0;
+        }
+
+        for (int i = 0; i < message_array_length; i++)
+        {
+                send_message_to_single_address(message_array[i], address);
+                xnanosleep(0, 200000000);
+        }
+
+        pthread_cleanup_pop(1);
+
+        return NULL;
+}
+
+/*
+ * Starts thread sending the entries as requested - unless a sync is already
+ * going on. Takes ownership of request.
+ */
+
+static void
+start_sync_thread(la_sync_request_t *const request)
+{
+        assert(request);
+
+        xpthread_mutex_lock(&sync_mutex);
+
+                if (sync_entries_thread_running)
+                {
+                        xpthread_mutex_unlock(&sync_mutex);
+                        la_log(LOG_INFO, "Sync with %s skipped - another sync "
+                                        "is still going on.",
+                                        request->address.text);
+                        free(request);
+                        return;
+                }
+
+                sync_entries_thread_running = true;
+                xpthread_create(&sync_entries_thread, NULL, sync_all_entries,
+                                request, "sync");
+
+        xpthread_mutex_unlock(&sync_mutex);
+}
+
+/*
+ * Computes digest over the addresses in the end queue.
+ */
+
+static void
+compute_end_queue_digest(la_digest_t *const digest)
+{
+        assert(digest);
+
+        init_digest(digest);
+
+        xpthread_mutex_lock(&end_queue_mutex);
+
+                for (la_command_t *command = first_command_in_queue(); command;
+                                (command = next_command_in_queue(command)))
+                {
+                        if (!command->is_template && command->address)
+                                add_to_digest(digest, command->address);
+                }
+
+        xpthread_mutex_unlock(&end_queue_mutex);
+
+        finish_digest(digest);
+}
+
+/*
+ * Sends digest to address - or to all remote hosts if address is NULL. In the
+ * latter case, must be called with config_mutex held.
+ */
+
+static void
+send_digest_message(const la_digest_t *const digest,
+                const la_address_t *const address, const char type)
+{
+        assert(digest);
+        la_debug("send_digest_message(%c)", type);
+
+        char buffer[MAX_DATAGRAM_LEN];
+        const int len = init_digest_message(buffer, digest, type);
+        send_plain_datagram(buffer, len, address);
+}
+
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
+/*
+ * Returns new address of the sender of a datagram, listening on port. Returns
+ * NULL on error.
+ */
+
+static la_address_t *
+create_client_address(const struct sockaddr_storage *const remote_client,
+                const int port)
+{
+        assert(remote_client);
+
+        char host[INET6_ADDRSTRLEN + 1];
+        const int r = getnameinfo((struct sockaddr *) remote_client,
+                        sizeof *remote_client, host, INET6_ADDRSTRLEN + 1,
+                        NULL, 0, NI_NUMERICHOST);
+        if (r)
+                LOG_RETURN(NULL, LOG_ERR, "Cannot determine remote host "
+                                "address: %s", gai_strerror(r));
+
+        return create_address_port(host, port);
+}
+
+/*
+ * Compares digest received from a remote host with our own. Sends the entries
+ * of all differing buckets to the remote host and - if asked to - our own
+ * digest, so the remote host can send us its entries of these buckets.
+ */
+
+static void
+handle_digest_datagram(const char *const buf, const size_t msg_len,
+                const struct sockaddr_storage *const remote_client)
+{
+        assert(buf); assert(remote_client); assert(la_config);
+
+        if (!la_config->remote_anti_entropy)
+                LOG_RETURN(, LOG_INFO, "Ignored digest message - anti_entropy "
+                                "not enabled.");
+
+        la_digest_t remote_digest;
+        char type;
+        if (!parse_digest_message(buf, msg_len, &remote_digest, &type))
+                LOG_RETURN(, LOG_ERR, "Ignored malformed digest message!");
+
+        la_digest_t digest;
+        compute_end_queue_digest(&digest);
+
+        la_sync_request_t *const request = xmalloc0(sizeof *request);
+        const int differing = compare_digests(&digest, &remote_digest,
+                        request->buckets);
+        if (!differing)
+        {
+                free(request);
+                return;
+        }
+
+        la_address_t *const address = create_client_address(remote_client,
+                        la_config->remote_port);
+        if (!address)
+        {
+                free(request);
+                return;
+        }
+        request->address = *address;
+        free_address(address);
+
+        la_log_verbose(LOG_INFO, "%u of %u buckets differ from %s.", differing,
+                        DIGEST_BUCKETS, request->address.text);
+
+        if (type == DIGEST_REQUEST)
+                send_digest_message(&digest, &request->address, DIGEST_REPLY);
+
+        start_sync_thread(request);
+}
+
+#ifdef WITH_LIBSODIUM
+/*
+ * Returns number of datagrams from the host of remote_client waiting on
+ * kdf_queue. Must be called with kdf_mutex held.
+ */
+
+static int
+kdf_queue_length_for_host(const struct sockaddr_storage *const remote_client)
+{
+        assert(remote_client);
+        la_address_key_t key;
+        init_address_key_sa(&key, (const struct sockaddr *) remote_client);
+
+        int result = 0;
+        FOREACH(la_pending_datagram_t, pending, kdf_queue)
+        {
+                la_address_key_t pending_key;
+                init_address_key_sa(&pending_key,
+                                (const struct sockaddr *) &pending->remote_client);
+                if (!adrkeycmp(&key, &pending_key))
+                        result++;
+        }
+
+        return result;
+}
+
+/*
+ * Queues a copy of a datagram whose key has not been derived yet for the KDF
+ * thread. Drops the datagram if the queue is full already - or if the host
+ * has too many datagrams waiting already, so a single host sending random
+ * salts can't keep the KDF thread busy all on its own.
+ */
+
+static void
+queue_for_kdf(const char *const buf, const ssize_t num_read,
+                const struct sockaddr_storage *const remote_client)
+{
+        assert(buf); assert(remote_client);
+        la_debug_func(NULL);
+
+        xpthread_mutex_lock(&kdf_mutex);
+
+                if (!kdf_queue)
+                        kdf_queue = create_list();
+
+                const bool full = kdf_queue_length >= KDF_QUEUE_LENGTH ||
+                        kdf_queue_length_for_host(remote_client) >=
+                        KDF_QUEUE_LENGTH_PER_HOST;
+                if (!full)
+                {
+                        la_pending_datagram_t *const pending =
+                                create_node(sizeof *pending, 0, NULL);
+                        memcpy(pending->buf, buf, num_read);
+                        pending->num_read = num_read;
+                        pending->remote_client = *remote_client;
+                        add_tail(kdf_queue, (kw_node_t *) pending);
+                        kdf_queue_length++;
+                        xpthread_cond_signal(&kdf_condition);
+                }
+
+        xpthread_mutex_unlock(&kdf_mutex);
+
+        if (full)
+                la_log(LOG_WARNING, "Too many remote messages waiting for key "
+                                "derivation, message dropped!");
+}
+
+/*
+ * Sends key exchange message to the sender of a datagram, listening on port.
+ * Hellos are sent only if due.
+ */
+
+static void
+send_kx_message_to_client(const struct sockaddr_storage *const remote_client,
+                const int port, const char type)
+{
+        assert(remote_client);
+
+        la_address_t *const address = create_client_address(remote_client,
+                        port);
+        if (!address)
+                return;
+
+        if (type == KX_ANSWER || kx_hello_due(address))
+        {
+                la_send_settings_t settings;
+                xpthread_mutex_lock(&config_mutex);
+
+                        get_send_settings(&settings);
+                        update_send_key();
+
+                xpthread_mutex_unlock(&config_mutex);
+
+                send_kx_message(&settings, address, type);
+        }
+
+        free_address(address);
+}
+
+/*
+ * Handles decrypted key exchange message and answers it if asked to.
+ */
+
+static void
+handle_kx_datagram(const char *const buf, const size_t msg_len,
+                const struct sockaddr_storage *const remote_client)
+{
+        assert(buf); assert(remote_client);
+
+        if (!la_config->remote_key_exchange)
+                LOG_RETURN(, LOG_INFO, "Ignored key exchange message - "
+                                "key_exchange not enabled.");
+
+        bool reply;
+        int port;
+        if (handle_kx_message(buf, msg_len, (struct sockaddr *) remote_client,
+                                &reply, &port) && reply)
+                send_kx_message_to_client(remote_client, port, KX_ANSWER);
+}
+
+/*
+ * Returns the port remote_client listens on, i.e. the port of its entry on the
+ * send_to list. For hosts not on that list, the source port of the datagram
+ * is the best guess there is.
+ */
+
+static int
+client_port(const struct sockaddr_storage *const remote_client)
+{
+        assert(remote_client);
+
+        xpthread_mutex_lock(&config_mutex);
+
+                const la_address_t *const send_to = address_on_list_sa(
+                                (struct sockaddr *) remote_client,
+                                &la_config->remote_send_to);
+                const int result = send_to ? get_port(send_to) : -1;
+
+        xpthread_mutex_unlock(&config_mutex);
+
+        if (result != -1)
+                return result;
+        else if (remote_client->ss_family == AF_INET)
+                return ntohs(((struct sockaddr_in *) remote_client)->sin_port);
+        else
+                return ntohs(((struct sockaddr_in6 *)
+                                        remote_client)->sin6_port);
+}
+
+/*
+ * Decrypts buf if it's a session datagram. Returns false if it's not a session
+ * datagram. Sets msg_len to 0 if it is one but couldn't be decrypted.
+ */
+
+static bool
+handle_session_datagram(char *const buf, const ssize_t num_read,
+                const struct sockaddr_storage *const remote_client,
+                const la_address_t *const from_addr, size_t *const msg_len)
+{
+        assert(buf); assert(remote_client); assert_address(from_addr);
+        assert(msg_len);
+
+        switch (session_decrypt(buf, num_read, (struct sockaddr *) remote_client,
+                                msg_len))
+        {
+        case LA_SESSION_NONE:
+                return false;
+        case LA_SESSION_OK:
+                return true;
+        case LA_SESSION_UNKNOWN:
+                /* Probably we have been restarted and forgot about the
+                 * session, so let sender know about our new key */
+                la_log(LOG_WARNING, "Ignored session message from %s - no "
+                                "session established!", from_addr->text);
+                send_kx_message_to_client(remote_client,
+                                client_port(remote_client), KX_HELLO);
+                break;
+        case LA_SESSION_INVALID:
+                la_log(LOG_ERR, "Unable to decrypt session message from %s",
+                                from_addr->text);
+                break;
+        }
+
+        *msg_len = 0;
+        return true;
+}
+#endif /* WITH_LIBSODIUM */
+
+/*
+ * Decrypts a single datagram of num_read bytes received from remote_client
+ * and triggers the command(s) contained. from_addr is a copy of the matching
+ * entry on the receive_from list (if any), secret a copy of remote_secret -
+ * both taken under config_mutex, as the originals might go away with a reload
+ * while the datagram is handled.
+ */
+
+static void
+handle_datagram(char *const buf, const ssize_t num_read,
+                const struct sockaddr_storage *const remote_client,
+                la_address_t *const from_addr, const char *const secret)
+{
+        assert(buf); assert(remote_client);
+
+        if (num_read > MAX_DATAGRAM_LEN)
+                LOG_RETURN(, LOG_ERR, "Ignored remote message with illegal "
+                                "length %li!", (long) num_read);
+
+        if (!from_addr)
+        {
+                char from[INET6_ADDRSTRLEN + 1];
+                const int r = getnameinfo((struct sockaddr *) remote_client,
+                                sizeof *remote_client, from, INET6_ADDRSTRLEN + 1,
+                                NULL, 0, NI_NUMERICHOST);
+                if (!r)
+                        la_log(LOG_ERR, "Ignored message from %s - not on "
+                                        "receive_from list!", from);
+                else
+                        la_log(LOG_ERR, "Cannot determine remote host address: %s",
+                                        gai_strerror(r));
+                return;
+        }
+
+        /* TODO: this might go wrong if la_config->remote_receive_from
+         * would contain addresses with prefixes other than 32 / 128.
+         * Salt might be different for different address in a network.
+         * Plus the subsequent log messages will list the network
+         * rather than the address :-O */
+
+        /* Length of unencrypted message */
+        size_t msg_len;
+
+#ifdef WITH_LIBSODIUM
+        if (la_config->remote_key_exchange && handle_session_datagram(buf,
+                                num_read, remote_client, from_addr, &msg_len))
+        {
+                if (!msg_len)
+                        return;
+        }
+        else
+        {
+#endif /* WITH_LIBSODIUM */
+                if (num_read <= (ssize_t) CRYPTO_OVERHEAD)
+                        LOG_RETURN(, LOG_ERR, "Ignored remote message with "
+                                        "illegal length %li!", (long) num_read);
+
+                msg_len = num_read - CRYPTO_OVERHEAD;
+
+#ifdef WITH_LIBSODIUM
+                /* Deriving a key for a salt not seen before takes a while.
+                 * Leave that to the KDF thread instead of stalling the receive
+                 * loop. */
+                if (!receive_key_cached(buf, msg_len + crypto_secretbox_MACBYTES,
+                                        secret))
+                {
+                        queue_for_kdf(buf, num_read, remote_client);
+                        return;
+                }
+
+                if (!decrypt_buffer(buf, msg_len + crypto_secretbox_MACBYTES,
+                                        secret, from_addr))
+                        return;
+        }
+#endif /* WITH_LIBSODIUM */
+
+        if (la_config->remote_cluster)
+                cluster_member_seen((struct sockaddr *) remote_client);
+
+        buf[msg_len] = '\0';
+
+        la_debug("Received message '%s' from %s",  buf, from_addr->text);
+
+        if (*buf == PROTOCOL_VERSION_BATCH)
+                parse_batch_message_trigger_commands(buf, msg_len, from_addr);
+        else if (*buf == PROTOCOL_VERSION_BINARY)
+                parse_binary_message_trigger_commands(buf, msg_len, from_addr);
+#ifdef WITH_LIBSODIUM
+        else if (*buf == PROTOCOL_VERSION_KX)
+                handle_kx_datagram(buf, msg_len, remote_client);
+#endif /* WITH_LIBSODIUM */
+        else if (*buf == PROTOCOL_VERSION_DIGEST)
+                handle_digest_datagram(buf, msg_len, remote_client);
+        else
+                parse_message_trigger_command(buf, from_addr);
+}
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+
+/*
+ * Main loop
+ */
+
+noreturn static void *
+remote_loop(void *const ptr)
+{
+        la_debug_func(NULL);
+
+        const struct addrinfo *const ai = (struct addrinfo *) ptr;
+
+        pthread_cleanup_push(cleanup_remote, NULL);
+
+        const int server_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (server_fd == -1)
+                die_hard(true, "Unable to create server socket");
+
+        /* Set IPV6_V6ONLY to 1, otherwise it's not possible to bind to both
+         * 0.0.0.0 and :: a the same time. Using only IPv6 would IMHO
+         * complicate things (deal with IPv4 mapped addresses; feature not
+         * available on some platforms). See
+         * https://stackoverflow.com/questions/1618240/how-to-support-both-ipv4-and-ipv6-connections
+         * for a discussion.
+         */
+
+        setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int) { 1 }, sizeof (int));
+
+        if (bind(server_fd, (struct sockaddr *) ai->ai_addr, ai->ai_addrlen) == -1)
+                die_hard(true, "Unable to bind to server socket");
+
+        for (;;)
+        {
+                if (shutdown_ongoing)
+                {
+                        la_debug("Shutting down remote thread.");
+                        pthread_exit(NULL);
+                }
+
+                char buf[REMOTE_RECEIVE_BATCH][MAX_DATAGRAM_LEN + 1];
+                struct sockaddr_storage remote_client[REMOTE_RECEIVE_BATCH];
+                ssize_t num_read[REMOTE_RECEIVE_BATCH];
+                const int n = receive_datagrams(server_fd, buf, remote_client,
+                                num_read);
+
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
+                /* Look up senders of the whole burst at once. Handling the
+                 * messages happens outside of the lock, as the commands
+                 * lock config_mutex on their own. Hence copy senders and
+                 * secret, a reload might free them in the meantime. */
+                la_address_t *from_addr[REMOTE_RECEIVE_BATCH];
+                xpthread_mutex_lock(&config_mutex);
+
+                        for (int i = 0; i < n; i++)
+                        {
+                                const la_address_t *const match =
+                                        address_in_prefix_tree_sa(
+                                                &la_config->remote_receive_from_tree,
+                                                (struct sockaddr *) &remote_client[i]);
+                                from_addr[i] = match ? dup_address(match) : NULL;
+                        }
+                        char *const secret = xstrdup(la_config->remote_secret);
+
+                xpthread_mutex_unlock(&config_mutex);
+
+                for (int i = 0; i < n; i++)
+                {
+                        handle_datagram(buf[i], num_read[i], &remote_client[i],
+                                        from_addr[i], secret);
+                        free_address(from_addr[i]);
+                }
+                free(secret);
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+        }
+
+        assert(false);
+
+        pthread_cleanup_pop(1);
+}
+
+#ifdef WITH_LIBSODIUM
+static void
+cleanup_kdf(void *const arg)
+{
+        la_debug_func(NULL);
+
+        wait_final_barrier();
+        la_debug("KDF thread exiting");
+}
+
+static void
+unlock_kdf_mutex(void *const arg)
+{
+        xpthread_mutex_unlock(&kdf_mutex);
+}
+
+/*
+ * Sets deadline to the time the send salt is due for rotation. Returns false
+ * if there is no such time.
+ */
+
+static bool
+get_salt_rotation_deadline(struct timespec *const deadline)
+{
+        assert(deadline); assert(la_config);
+
+        const time_t created = send_salt_creation_time();
+        if (!created || la_config->remote_salt_rotation <= 0)
+                return false;
+
+        deadline->tv_sec = created + la_config->remote_salt_rotation;
+        deadline->tv_nsec = 0;
+
+        return true;
+}
+
+/*
+ * Waits for the next datagram on kdf_queue - or until the send salt is due for
+ * rotation. In the latter case, sets rotate to true and returns NULL.
+ */
+
+static la_pending_datagram_t *
+next_kdf_job(bool *const rotate)
+{
+        la_pending_datagram_t *pending = NULL;
+        *rotate = false;
+
+        xpthread_mutex_lock(&kdf_mutex);
+        pthread_cleanup_push(unlock_kdf_mutex, NULL);
+
+                while (!*rotate && !(kdf_queue && (pending =
+                                                (la_pending_datagram_t *)
+                                                rem_head(kdf_queue))))
+                {
+                        struct timespec deadline;
+                        if (get_salt_rotation_deadline(&deadline))
+                                *rotate = xpthread_cond_timedwait(
+                                                &kdf_condition, &kdf_mutex,
+                                                &deadline) == ETIMEDOUT;
+                        else
+                                xpthread_cond_wait(&kdf_condition,
+                                                &kdf_mutex);
+                }
+                if (pending)
+                        kdf_queue_length--;
+
+        pthread_cleanup_pop(1);
+
+        return pending;
+}
+
+/*
+ * Derives keys for datagrams whose salt was not in the key cache, then handles
+ * these datagrams. Also rotates the send salt once it is due.
+ */
+
+noreturn static void *
+kdf_loop(void *const ptr)
+{
+        la_debug_func(NULL);
+
+        pthread_cleanup_push(cleanup_kdf, NULL);
+
+        for (;;)
+        {
+                bool rotate;
+                la_pending_datagram_t *const pending = next_kdf_job(&rotate);
+
+                if (shutdown_ongoing)
+                {
+                        la_debug("Shutting down KDF thread.");
+                        free(pending);
+                        pthread_exit(NULL);
+                }
+
+                xpthread_mutex_lock(&config_mutex);
+
+                        char *const secret = xstrdup(la_config->remote_secret);
+
+                xpthread_mutex_unlock(&config_mutex);
+
+                if (pending)
+                {
+                        const size_t enc_len = pending->num_read -
+                                CRYPTO_OVERHEAD + crypto_secretbox_MACBYTES;
+                        if (derive_receive_key(pending->buf, enc_len, secret))
+                        {
+                                xpthread_mutex_lock(&config_mutex);
+
+                                        const la_address_t *const match =
+                                                address_in_prefix_tree_sa(
+                                                        &la_config->remote_receive_from_tree,
+                                                        (struct sockaddr *)
+                                                        &pending->remote_client);
+                                        la_address_t *const from_addr = match ?
+                                                dup_address(match) : NULL;
+
+                                xpthread_mutex_unlock(&config_mutex);
+
+                                handle_datagram(pending->buf, pending->num_read,
+                                                &pending->remote_client,
+                                                from_addr, secret);
+                                free_address(from_addr);
+                        }
+                        free(pending);
+                }
+
+                /* Don't retry right away if rotation failed */
+                if (rotate && !rotate_send_key_and_salt(secret))
+                        xnanosleep(60, 0);
+
+                free(secret);
+        }
+
+        assert(false);
+        /* Will never be reached, simple here to make potential pthread macros
+         * happy */
+        pthread_cleanup_pop(1);
+}
+#endif /* WITH_LIBSODIUM */
+
+/*
+ * Sends the n messages in messages to the hosts - in batch messages if
+ * batch_latency is set. Each batch resp. message is encrypted only once for
+ * all hosts.
+ */
+
+static void
+send_messages_to_hosts(const la_send_settings_t *const settings,
+                char messages[][MSG_LEN], const int n,
+                const la_address_t *const *const addresses,
+                const int n_addresses)
+{
+        assert(settings); assert(messages); assert(addresses);
+
+        if (settings->batch_latency > 0)
+        {
+                char batch[MAX_DATAGRAM_LEN];
+                int batch_len = 0;
+                for (int i = 0; i < n; i++)
+                {
+                        if (!append_to_batch_message(batch, &batch_len,
+                                                messages[i]))
+                        {
+                                send_datagram_to_hosts(settings, batch,
+                                                batch_len, addresses,
+                                                n_addresses);
+                                batch_len = 0;
+                                (void) append_to_batch_message(batch,
+                                                &batch_len, messages[i]);
+                        }
+                }
+                if (batch_len)
+                        send_datagram_to_hosts(settings, batch, batch_len,
+                                        addresses, n_addresses);
+        }
+        else
+        {
+                for (int i = 0; i < n; i++)
+                {
+                        char message[TOTAL_MSG_LEN];
+                        memcpy(message, messages[i], MSG_LEN);
+                        send_datagram_to_hosts(settings, message,
+                                        message_len(message), addresses,
+                                        n_addresses);
+                }
         }
 }
 
 /*
- * Currently only called from trigger_command()
+ * Takes all messages from the send queues and sends them. Hosts whose queues
+ * start at the same message (i.e. all of them, unless messages have been
+ * dropped or a host has been added by a reload) share batch messages and
+ * thus their encryption.
+ *
+ * config_mutex and send_mutex are only held while taking the messages and
+ * copying addresses and settings. Encrypting and sending (and deriving a new
+ * send key after a reload) happen afterwards, so threads triggering commands
+ * don't have to wait for them.
  */
-void
-send_add_entry_message(const la_command_t *const command, const la_address_t *const address)
+
+static void
+send_queued_messages(void)
 {
-        la_debug_func(NULL);
-        assert(la_config); assert_command(command);
+        la_send_settings_t settings;
+#ifdef WITH_LIBSODIUM
+        int salt_rotation = 0;
+#endif /* WITH_LIBSODIUM */
 
-        if (!la_config->remote_enabled)
-                return;
+        xpthread_mutex_lock(&config_mutex);
 
-        /* TODO: would this make sense for commands w/o address as well? Then
-         * maybe we should reflect this in the protocol and then implement
-         * here... */
-        if (!command->address)
-                LOG_RETURN(, LOG_ERR, "Can't create message for command without "
-                                "address");
+                assert(la_config);
+                get_send_settings(&settings);
+#ifdef WITH_LIBSODIUM
+                char *const secret = take_changed_secret(&salt_rotation);
+#endif /* WITH_LIBSODIUM */
+
+                const int n = list_length(&la_config->remote_send_to);
+                la_address_t *const addresses = xmalloc((n ? n : 1) *
+                                sizeof *addresses);
+                int starts[n ? n : 1];
+                unsigned int dropped[n ? n : 1];
+                int length = 0;
+
+                xpthread_mutex_lock(&send_mutex);
+
+                        /* Afterwards, send_queues are in the same order as
+                         * remote_send_to */
+                        update_send_queues();
+
+                        unsigned long first = send_head;
+                        for (int i = 0; i < n; i++)
+                                if (send_queues[i].next < first)
+                                        first = send_queues[i].next;
+
+                        length = send_head - first;
+                        for (int i = 0; i < length; i++)
+                                memcpy(send_buffer[i], send_ring[(first + i) %
+                                                SEND_QUEUE_LEN], MSG_LEN);
+
+                        for (int i = 0; i < n; i++)
+                        {
+                                /* Queues hold copies of the send_to
+                                 * addresses already */
+                                addresses[i] = send_queues[i].address;
+                                starts[i] = send_queues[i].next - first;
+                                dropped[i] = send_queues[i].dropped;
+                                send_queues[i].next = send_head;
+                                send_queues[i].dropped = 0;
+                        }
+
+                xpthread_mutex_unlock(&send_mutex);
+
+                /* Open client sockets now, as binding them depends on
+                 * remote_bind */
+                if (settings.enabled)
+                        for (int i = 0; i < n; i++)
+                                (void) get_client_fd(addresses[i].sa.ss_family);
+
+        xpthread_mutex_unlock(&config_mutex);
 
-        /* delibarately left out end_time and factor  here. Receiving end
-         * should decide on duration. TODO: does that make sense? */
-        char message[TOTAL_MSG_LEN];
-        if (!init_add_message(message, command->address->text,
-                                command->rule_name, NULL, NULL))
-                LOG_RETURN(, LOG_ERR, "Unable to create message");
 #ifdef WITH_LIBSODIUM
-        if (la_config->remote_secret_changed)
+        if (secret)
+                install_changed_secret(secret, salt_rotation);
+#endif /* WITH_LIBSODIUM */
+
+        for (int i = 0; i < n; i++)
         {
-                generate_send_key_and_salt(la_config->remote_secret);
-                la_config->remote_secret_changed = false;
+                if (dropped[i])
+                        la_log(LOG_WARNING, "Dropped %u messages for %s - "
+                                        "send queue full.", dropped[i],
+                                        addresses[i].text);
         }
-        if (!encrypt_message(message))
-                LOG_RETURN(, LOG_ERR, "Unable to encrypt message");
-#endif /* WITH_LIBSODIUM */
 
-        if (address)
-                send_message_to_single_address(message, address);
-        else
-                send_message_to_all_remote_hosts(message);
+        for (int i = 0; i < n; i++)
+        {
+                if (starts[i] == -1 || starts[i] == length)
+                        continue;
+
+                /* Collect hosts with the same queue */
+                const la_address_t *group[n];
+                int n_group = 0;
+                const int start = starts[i];
+                for (int j = i; j < n; j++)
+                {
+                        if (starts[j] == start)
+                        {
+                                group[n_group++] = &addresses[j];
+                                starts[j] = -1;
+                        }
+                }
+
+                send_messages_to_hosts(&settings, &send_buffer[start],
+                                length - start, group, n_group);
+        }
+
+        free(addresses);
 }
 
 static void
-close_fds(void)
+cleanup_sender(void *const arg)
 {
-        /* TODO: re-enable mt save */
-        /*if (server_fd > 0 && close(server_fd) == -1)
-                die_hard(true, "Unable to close socket");*/
-        /* TODO set to 0 after close() */
+        la_debug_func(NULL);
 
-        if (client_fd4 > 0)
-        {
-                if (close(client_fd4) == -1)
-                        la_log_errno(LOG_ERR, "Unable to close socket");
-                client_fd4 = 0;
-        }
+        wait_final_barrier();
+        la_debug("Sender thread exiting");
+}
 
-        if (client_fd6 > 0)
-        {
-                if (close(client_fd6) == -1)
-                        la_log_errno(LOG_ERR, "Unable to close socket");
-                client_fd6 = 0;
-        }
+static void
+unlock_send_mutex(void *const arg)
+{
+        xpthread_mutex_unlock(&send_mutex);
 }
 
 /*
- * Cleanup when exiting.
+ * Waits until queued messages are due, i.e. until send_deadline has passed or
+ * send_now has been set.
  */
 
 static void
-cleanup_remote(void *const arg)
+wait_for_queued_messages(void)
 {
-        la_debug_func(NULL);
+        xpthread_mutex_lock(&send_mutex);
+        pthread_cleanup_push(unlock_send_mutex, NULL);
 
+                while (!send_pending_len)
+                        xpthread_cond_wait(&send_condition, &send_mutex);
 
-        (void) pthread_once(&once_control, close_fds);
+                while (!send_now && xpthread_cond_timedwait(&send_condition,
+                                        &send_mutex, &send_deadline) !=
+                                ETIMEDOUT)
+                        ;
 
-        wait_final_barrier();
-        la_debug("Remote thread (%i) exiting", pthread_self());
+                send_pending_len = 0;
+                send_now = false;
+
+        pthread_cleanup_pop(1);
 }
 
 /*
- * Main loop
+ * Sends the messages queued by send_add_entry_message(), so threads
+ * triggering commands don't have to wait for encryption and sendto().
  */
 
 noreturn static void *
-remote_loop(void *const ptr)
+sender_loop(void *const ptr)
 {
         la_debug_func(NULL);
 
-        const struct addrinfo *const ai = (struct addrinfo *) ptr;
+        pthread_cleanup_push(cleanup_sender, NULL);
 
-        pthread_cleanup_push(cleanup_remote, NULL);
+        for (;;)
+        {
+                wait_for_queued_messages();
 
-        const int server_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        if (server_fd == -1)
-                die_hard(true, "Unable to create server socket");
+                if (shutdown_ongoing)
+                {
+                        la_debug("Shutting down sender thread.");
+                        pthread_exit(NULL);
+                }
 
-        /* Set IPV6_V6ONLY to 1, otherwise it's not possible to bind to both
-         * 0.0.0.0 and :: a the same time. Using only IPv6 would IMHO
-         * complicate things (deal with IPv4 mapped addresses; feature not
-         * available on some platforms). See
-         * https://stackoverflow.com/questions/1618240/how-to-support-both-ipv4-and-ipv6-connections
-         * for a discussion.
-         */
+                send_queued_messages();
+        }
 
-        setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int) { 1 }, sizeof (int));
+        assert(false);
+        /* Will never be reached, simple here to make potential pthread macros
+         * happy */
+        pthread_cleanup_pop(1);
+}
 
-        if (bind(server_fd, (struct sockaddr *) ai->ai_addr, ai->ai_addrlen) == -1)
-                die_hard(true, "Unable to bind to server socket");
+static void
+cleanup_anti_entropy(void *const arg)
+{
+        la_debug_func(NULL);
+
+        wait_final_barrier();
+        la_debug("Anti-entropy thread exiting");
+}
+
+/*
+ * Sends digest of the end queue to all remote hosts every anti_entropy
+ * seconds.
+ */
+
+noreturn static void *
+anti_entropy_loop(void *const ptr)
+{
+        la_debug_func(NULL);
+
+        pthread_cleanup_push(cleanup_anti_entropy, NULL);
 
         for (;;)
         {
-                if (shutdown_ongoing)
+                xpthread_mutex_lock(&config_mutex);
+
+                        assert(la_config);
+                        const int interval = la_config->remote_anti_entropy;
+
+                xpthread_mutex_unlock(&config_mutex);
+
+                if (interval <= 0)
                 {
-                        la_debug("Shutting down remote thread.");
+                        la_log(LOG_INFO, "Anti-entropy disabled, stopping "
+                                        "anti-entropy thread.");
                         pthread_exit(NULL);
                 }
 
-                char buf[DEFAULT_LINEBUFFER_SIZE];
-                struct sockaddr_storage remote_client;
-                socklen_t remote_client_size = sizeof remote_client;
-                const ssize_t num_read = recvfrom(server_fd, &buf,
-                                DEFAULT_LINEBUFFER_SIZE, MSG_TRUNC,
-                                (struct sockaddr *) &remote_client,
-                                &remote_client_size);
-                if (num_read == -1)
+                xnanosleep(interval, 0);
+
+                if (shutdown_ongoing)
                 {
-                        if (errno == EINTR)
-                                continue;
-                        else
-                                die_hard(true, "Error while receiving remote "
-                                                "messages");
+                        la_debug("Shutting down anti-entropy thread.");
+                        pthread_exit(NULL);
                 }
 
-                buf[num_read] = '\0';
+                la_digest_t digest;
+                compute_end_queue_digest(&digest);
 
-#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
-                la_address_t *const from_addr = address_on_list_sa(
-                                (struct sockaddr *) &remote_client,
-                                &la_config->remote_receive_from);
-
-                if (!from_addr)
-                {
-                        char from[INET6_ADDRSTRLEN + 1];
-                        const int r = getnameinfo((struct sockaddr *) &remote_client,
-                                        sizeof remote_client, from, INET6_ADDRSTRLEN + 1,
-                                        NULL, 0, NI_NUMERICHOST);
-                        if (!r)
-                                la_log(LOG_ERR, "Ignored message from %s - not on "
-                                                "receive_from list!", from);
-                        else
-                                la_log(LOG_ERR, "Cannot determine remote host address: %s",
-                                                gai_strerror(r));
-                        continue;
+                xpthread_mutex_lock(&config_mutex);
+
+                        send_digest_message(&digest, NULL, DIGEST_REQUEST);
+
+                xpthread_mutex_unlock(&config_mutex);
+        }
+
+        assert(false);
+        /* Will never be reached, simple here to make potential pthread macros
+         * happy */
+        pthread_cleanup_pop(1);
+}
+
+/*
+ * Updates the cluster members from the configuration and lets them know we're
+ * still around. Switches cluster mode off if it has been switched off in the
+ * configuration.
+ *
+ * Resolving remote_bind might take a while, so this happens on a copy without
+ * holding config_mutex.
+ */
+
+static void
+update_cluster(void)
+{
+        xpthread_mutex_lock(&config_mutex);
+
+                assert(la_config);
+                char *const bind = la_config->remote_cluster ?
+                        xstrdup(la_config->remote_bind) : NULL;
+
+        xpthread_mutex_unlock(&config_mutex);
+
+        la_address_t self;
+        const bool resolved = bind && init_address(&self, bind);
+        free(bind);
+
+        xpthread_mutex_lock(&config_mutex);
+
+                /* Configuration might have changed in the meantime */
+                if (!resolved || !la_config->remote_cluster)
+                {
+                        set_cluster_members(NULL, NULL);
+                }
+                else
+                {
+                        set_cluster_members(&self, &la_config->remote_send_to);
+
+                        char message[TOTAL_MSG_LEN];
+                        if (init_heartbeat_message(message))
+                                send_message_to_all_remote_hosts(message);
                 }
 
-                reprioritize_node((kw_node_t *) from_addr, 1);
+        xpthread_mutex_unlock(&config_mutex);
+}
 
-                /* TODO: this might go wrong if la_config->remote_receive_from
-                 * would contain addresses with prefixes other than 32 / 128.
-                 * Salt might be different for different address in a network.
-                 * Plus the subsequent log messages will list the network
-                 * rather than the address :-O */
+static void
+cleanup_cluster(void *const arg)
+{
+        la_debug_func(NULL);
 
-#ifdef WITH_LIBSODIUM
-                if (!decrypt_message(buf, la_config->remote_secret, from_addr))
-                        continue;
-#endif /* WITH_LIBSODIUM */
+        wait_final_barrier();
+        la_debug("Cluster thread exiting");
+}
 
-                la_debug("Received message '%s' from %s",  buf, from_addr->text);
+/*
+ * Sends a heartbeat to all cluster members every CLUSTER_HEARTBEAT_INTERVAL
+ * seconds. Also takes over end actions from members which have gone quiet.
+ */
 
-                parse_message_trigger_command(buf, from_addr);
-                
+noreturn static void *
+cluster_loop(void *const ptr)
+{
+        la_debug_func(NULL);
+
+        pthread_cleanup_push(cleanup_cluster, NULL);
+
+        for (;;)
+        {
+                xnanosleep(CLUSTER_HEARTBEAT_INTERVAL, 0);
+
+                if (shutdown_ongoing)
+                {
+                        la_debug("Shutting down cluster thread.");
+                        pthread_exit(NULL);
+                }
+
+                update_cluster();
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
+                adopt_end_commands();
 #endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
         }
 
         assert(false);
-
+        /* Will never be reached, simple here to make potential pthread macros
+         * happy */
         pthread_cleanup_pop(1);
 }
 
@@ -335,89 +2077,58 @@ start_all_remote_threads(void)
 
                 thread_started(thread);;
                 la_debug("remote thread %i started (%i)", i, thread);
-        }
-}
-
-static void
-cleanup_sync_all_entries(void *arg)
-{
-        free(arg);
-        sync_entries_thread_running = false;
-}
-
-/* 
- * start_routine for pthread_create called from sync_entries(). ptr points to a
- * string with the destination IP address.
- */
-
-static void *
-sync_all_entries(void *ptr)
-{
-        la_address_t *address = (la_address_t *) ptr;
 
-        assert(la_config);
-        set_port(address, la_config->remote_port);
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
+                if (la_config->remote_sync_stream)
+                        start_sync_stream_thread(ai);
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+        }
 
-        /* Allocate in one shot so both can be free()d at once in
-         * cleanup_sync_all_entries() */
-        const int queue_length = get_queue_length();
-        void *buffer = xmalloc(((queue_length + 1) * sizeof (char*)) +
-                        queue_length * TOTAL_MSG_LEN);
-        char **message_array = buffer;
-        char *message_buffer = (char *) buffer + (queue_length + 1) * sizeof (char*);
+        pthread_t thread;
+        xpthread_create(&thread, NULL, sender_loop, NULL, "sender");
+        thread_started(thread);
 
-        pthread_cleanup_push(cleanup_sync_all_entries, buffer);
+        if (la_config->remote_anti_entropy > 0)
+        {
+                xpthread_create(&thread, NULL, anti_entropy_loop, NULL,
+                                "antientropy");
+                thread_started(thread);
+        }
 
-        xpthread_mutex_lock(&end_queue_mutex);
+        if (la_config->remote_cluster)
+        {
+                /* Members must be known before state is restored */
+                update_cluster();
+                xpthread_create(&thread, NULL, cluster_loop, NULL, "cluster");
+                thread_started(thread);
+        }
 
-                int message_array_length = 0;
+#ifdef WITH_LIBSODIUM
+        xpthread_create(&thread, NULL, kdf_loop, NULL, "kdf");
+        thread_started(thread);
 
-                /* TODO: walking through tree via next_command_in_queue() will
-                 * create a highly imbalanced tree on the other end. Better
-                 * recurse through adr_tree from bottom to top (like
-                 * recursively_save_state does). */
+        /* Let all hosts know our new public key right away, in case they
+         * still have a session with our previous incarnation */
+        if (la_config->remote_key_exchange)
+        {
+                xpthread_mutex_lock(&config_mutex);
 
-                for (la_command_t *command = first_command_in_queue(); command;
-                                (command = next_command_in_queue(command)))
-                {
-                        if (!command->is_template && command->address)
+                        la_send_settings_t settings;
+                        get_send_settings(&settings);
+                        update_send_key();
 
+                        FOREACH(la_address_t, remote_address,
+                                        &la_config->remote_send_to)
                         {
-                                assert(message_array_length < queue_length);
-                                char *message = message_buffer +
-                                        message_array_length * TOTAL_MSG_LEN;
-                                if (init_add_message(message,
-                                                        command->address->text,
-                                                        command->rule_name,
-                                                        NULL, NULL))
-                                        message_array[message_array_length++] =
-                                                message;
+                                if (kx_hello_due(remote_address))
+                                        send_kx_message(&settings,
+                                                        remote_address,
+                                                        KX_HELLO);
                         }
-                }
-
-        xpthread_mutex_unlock(&end_queue_mutex);
 
-#ifdef WITH_LIBSODIUM
-        if (la_config->remote_secret_changed)
-        {
-                generate_send_key_and_salt(la_config->remote_secret);
-                la_config->remote_secret_changed = false;
+                xpthread_mutex_unlock(&config_mutex);
         }
 #endif /* WITH_LIBSODIUM */
-
-        for (int i = 0; i < message_array_length; i++)
-        {
-#ifdef WITH_LIBSODIUM
-                if (!encrypt_message(message_array[i]))
-                        LOG_RETURN(NULL, LOG_ERR, "Unable to encrypt message");
-#endif /* WITH_LIBSODIUM */
-                send_message_to_single_address(message_array[i], address);
-                xnanosleep(0, 200000000);
-        }
-
-        pthread_cleanup_pop(1);
-
-        return NULL;
 }
 
 void
@@ -426,38 +2137,50 @@ sync_entries(const char *const buffer, la_address_t *from_addr)
         assert(buffer);
         la_debug_func(buffer);
 
+        /* Only a shortcut, start_sync_thread() checks again under
+         * sync_mutex */
         if (sync_entries_thread_running)
                 return;
 
-        la_address_t *thread_argument = NULL;
+        la_sync_request_t *const request = xmalloc0(sizeof *request);
+        request->all = true;
 
         if (buffer[2])
         {
-                /* static is important, as a pointer to this may be referenced
-                 * from within sync_all_entries() */
-                static la_address_t manual_addr;
-                thread_argument = &manual_addr;
-                init_address(thread_argument, buffer + 2);
+                if (!init_address(&request->address, buffer + 2))
+                {
+                        free(request);
+                        LOG_RETURN(, LOG_ERR, "Can't sync with invalid "
+                                        "address %s!", buffer + 2);
+                }
         }
         else if (from_addr != &fifo_address)
         {
-                thread_argument = from_addr;
+                /* Copy, as from_addr might go away with the next reload */
+                request->address = *from_addr;
+                request->address.domainname = NULL;
         }
         else
         {
+                free(request);
                 return;
         }
 
-        xpthread_create(&sync_entries_thread, NULL, sync_all_entries,
-                        thread_argument, "sync");
-
+        start_sync_thread(request);
 }
 
 void
 stop_syncing(void)
 {
-        if (sync_entries_thread_running)
-                pthread_cancel(sync_entries_thread);
+        /* The sync thread can't terminate before its cleanup handler has
+         * reset sync_entries_thread_running under sync_mutex, so holding the
+         * mutex guarantees the thread id is still valid. */
+        xpthread_mutex_lock(&sync_mutex);
+
+                if (sync_entries_thread_running)
+                        pthread_cancel(sync_entries_thread);
+
+        xpthread_mutex_unlock(&sync_mutex);
 }
 
 
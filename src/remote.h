@@ -21,19 +21,35 @@
 
 #include "ndebug.h"
 
-void send_message_to_all_remote_hosts(const char *message);
+/* Maximum number of datagrams received with a single recvmmsg() call */
+#define REMOTE_RECEIVE_BATCH 16
+
+/* Maximum number of datagrams waiting for the derivation of their key */
+#define KDF_QUEUE_LENGTH 64
+
+/* Maximum number of those datagrams from a single host */
+#define KDF_QUEUE_LENGTH_PER_HOST 16
+
+/* Maximum number of add messages waiting to be sent to a single host */
+#define SEND_QUEUE_LEN 1024
+
+void send_message_to_all_remote_hosts(char *message);
 
 void send_add_entry_message(const la_command_t *command, const la_address_t *address);
 
 void start_all_remote_threads(void);
 
-void send_message_to_single_address(const char *message,
+void send_message_to_single_address(char *message,
                 const la_address_t *remote_address);
 
 void sync_entries(const char *buffer, la_address_t *from_addr);
 
 void stop_syncing(void);
 
+void update_send_key(void);
+
+void bind_client_socket(int fd, int family);
+
 #endif /* __remote_h */
 
 /* vim: set autowrite expandtab: */
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <time.h>
 #if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
 #include <stdatomic.h>
 #endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
@@ -34,8 +35,10 @@
 #include "ndebug.h"
 #include "logactiond.h"
 #include "addresses.h"
+#include "aggregation.h"
 #include "commands.h"
 #include "configfile.h"
+#include "dnsbl.h"
 #include "endqueue.h"
 #include "logging.h"
 #include "misc.h"
@@ -85,7 +88,7 @@ assert_rule_ffl(const la_rule_t *rule, const char *func, const char *file, int l
                                 ">= 0' failed. ", file, line, func);
         if (rule->queue_count < 0)
                 die_hard(false, "%s:%u: %s: Assertion 'rule(%s)->queue_count >= 0' "
-                                "failed. ", rule->node.nodename, file, line, func);
+                                "failed. ", file, line, func, rule->node.nodename);
         assert_list_ffl(&rule->blacklists, func, file, line);
 }
 
@@ -123,6 +126,8 @@ find_trigger(const la_command_t *const template, const la_address_t *const addre
         assert_address(address);
 
         const time_t now = xtime(NULL);
+        la_address_key_t key;
+        init_address_key(&key, address);
 
         /* Don't use standard FOREACH idiom here to avoid that remove_node()
          * breaks the whole thing */
@@ -132,7 +137,7 @@ find_trigger(const la_command_t *const template, const la_address_t *const addre
         {
                 /* Return command if ids match */
                 if (command->id == template->id &&
-                                !adrcmp(command->address, address))
+                                !adrkeycmp(&command->adr_key, &key))
                         return command;
 
                 la_command_t *const tmp = command;
@@ -176,9 +181,16 @@ trigger_then_enqueue_or_free(la_command_t *const command, const bool remove_comm
                 (void) remove_node((kw_node_t *) command);
         trigger_command(command);
         if (command->end_string && command->duration > 0)
-                enqueue_end_command(command, 0);
+        {
+                /* aggregate_command() will take care of command in case it
+                 * has been replaced by a command for the whole network */
+                if (!aggregate_command(command))
+                        enqueue_end_command(command, 0);
+        }
         else
+        {
                 free_command(command);
+        }
 }
 
 /*
@@ -214,6 +226,10 @@ handle_command_on_trigger_list(la_command_t *const command)
 /*
  * Check whether address is on a dnsbl, if so trigger_command directly on first
  * sight. Only do dnsbl lookup if dnsbl_enabled==true and threshold>1
+ *
+ * Only cached results are taken into account here. Lookups of addresses not
+ * in the cache are done in the background, trigger_blacklisted_command() will
+ * take care of the command in case the address turns out to be listed.
  */
 
 static bool
@@ -239,6 +255,67 @@ trigger_if_on_dnsbl(la_command_t *command, bool from_trigger_list)
         return true;
 }
 
+/*
+ * Called by the DNSBL threads once address has been found on blacklist.
+ * Triggers the command for rule_name and id directly, provided it is still
+ * waiting on the trigger list.
+ */
+
+void
+trigger_blacklisted_command(const char *const rule_name, const int id,
+                const la_address_t *const address, const char *const blacklist)
+{
+        assert(rule_name); assert_address(address); assert(blacklist);
+        la_debug_func(rule_name);
+
+        if (shutdown_ongoing)
+                return;
+
+        xpthread_mutex_lock(&config_mutex);
+
+                const la_rule_t *const rule = find_rule(rule_name);
+                la_command_t *command = NULL;
+                if (rule)
+                {
+                        FOREACH(la_command_t, template, &rule->begin_commands)
+                        {
+                                if (template->id == id)
+                                {
+                                        command = find_trigger(template,
+                                                        address);
+                                        break;
+                                }
+                        }
+                }
+
+                /* Host might have become active in the meantime (e.g. via
+                 * another rule or a remote host), don't trigger twice then */
+                const la_command_t *const active = command ?
+                        find_end_command(address) : NULL;
+
+                if (active)
+                {
+                        la_log_verbose(LOG_INFO, "Host: %s blacklisted on %s, "
+                                        "ignored, action \"%s\" already "
+                                        "active (triggered by rule \"%s\").",
+                                        address->text, blacklist,
+                                        active->node.nodename,
+                                        active->rule_name);
+                        (void) remove_node((kw_node_t *) command);
+                        free_command(command);
+                }
+                else if (command)
+                {
+                        la_log(LOG_INFO, "Host: %s blacklisted on %s.",
+                                        address->text, blacklist);
+
+                        command->previously_on_blacklist = true;
+                        trigger_then_enqueue_or_free(command, true);
+                }
+
+        xpthread_mutex_unlock(&config_mutex);
+}
+
 /*
  * Trigger command directly (in case threshold == 1 or no host identified) or
  * go via trigger list otherwise.
@@ -351,10 +428,14 @@ trigger_all_commands(la_pattern_t *const pattern)
 
                 /* Do nothing if on ignore list */
                 assert(la_config);
-                la_address_t *tmp_addr = address_on_list(&address, &la_config->ignore_addresses);
+                la_address_t *tmp_addr = find_ignored_address(&address);
                 if (tmp_addr)
                 {
-                        reprioritize_node((kw_node_t *) tmp_addr, 1);
+#ifndef CLIENTONLY
+                        /* Never blocks, name will show up once the reverse
+                         * lookup has finished */
+                        lookup_domainname(tmp_addr);
+#endif /* CLIENTONLY */
                         LOG_RETURN_VERBOSE(, LOG_INFO,
                                         "Host: %s, always ignored.",
                                         tmp_addr->domainname ? tmp_addr->domainname :
@@ -442,10 +523,26 @@ handle_log_line_for_rule(const la_rule_t *const rule, const char *const line)
 
         FOREACH(la_pattern_t, pattern, &rule->patterns)
         {
+                /* Only measure every PATTERN_SAMPLE_INTERVAL'th execution
+                 * - statistics are used by reorder_patterns() */
+                const bool sample = !(pattern->exec_count++ %
+                                PATTERN_SAMPLE_INTERVAL);
+                struct timespec start;
+                if (sample && clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+                        die_hard(true, "Can't get current time");
+
                 /* TODO: make this dynamic based on detected tokens */
                 regmatch_t pmatch[MAX_NMATCH];
-                if (!regexec(&(pattern->regex), line, MAX_NMATCH, pmatch, 0))
+                const int r = regexec(&(pattern->regex), line, MAX_NMATCH,
+                                pmatch, 0);
+
+                if (sample)
+                        sample_pattern_exec_time(pattern, &start);
+
+                if (!r)
                 {
+                        pattern->match_count++;
+
                         /* TODO: maybe better to make a copy of peroprty list
                          * first and assign values to this list so these don't
                          * have to be cleared afterwards */
@@ -457,7 +554,6 @@ handle_log_line_for_rule(const la_rule_t *const rule, const char *const line)
                                                 "log line ignored");
                         clear_property_values(&pattern->properties);
 
-                        reprioritize_node((kw_node_t *) pattern, 1);
                         return true;
                 }
         }
@@ -529,6 +625,19 @@ create_rule(const bool enabled, const char *const name,
         result->dnsbl_enabled = dnsbl_enabled;
 
         result->service = xstrdup(service);
+        result->service_regex = NULL;
+        if (service && source_group->syslog_header)
+        {
+                const size_t len = xstrlen(service) + 5;
+                char *const service_string = xmalloc(len);
+                snprintf(service_string, len, "^(%s)$", service);
+                result->service_regex = xmalloc(sizeof (regex_t));
+                if (regcomp(result->service_regex, service_string,
+                                        REG_EXTENDED | REG_NOSUB))
+                        die_hard(false, "Invalid service \"%s\" in rule %s!",
+                                        service, name);
+                free(service_string);
+        }
 #if HAVE_LIBSYSTEMD
         result->systemd_unit = xstrdup(systemd_unit);
 #else /* HAVE_LIBSYSTEMD */
@@ -570,6 +679,11 @@ free_rule(la_rule_t *const rule)
         free(rule->systemd_unit);
 #endif /* HAVE_LISTSYSTEMD */
         free(rule->service);
+        if (rule->service_regex)
+        {
+                regfree(rule->service_regex);
+                free(rule->service_regex);
+        }
 
         empty_pattern_list(&rule->patterns);
         empty_command_list(&rule->begin_commands);
@@ -22,6 +22,8 @@
 #if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
 #include <stdatomic.h>
 #endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <sys/types.h>
+#include <regex.h>
 
 #include "ndebug.h"
 #include "addresses.h"
@@ -57,6 +59,8 @@ struct la_rule_s
         int id;
         struct la_source_group_s *source_group;
         char *service;
+        /* Only used with syslog_header, matches complete program name */
+        regex_t *service_regex;
         struct kw_list_s patterns;
         struct kw_list_s begin_commands;
         int threshold;
@@ -102,6 +106,9 @@ void free_rule(la_rule_t *rule);
 
 la_rule_t *find_rule(const char *rule_name);
 
+void trigger_blacklisted_command(const char *rule_name, int id,
+                const la_address_t *address, const char *blacklist);
+
 #endif /* __rules_h */
 
 /* vim: set autowrite expandtab: */
@@ -0,0 +1,628 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sessions with remote hosts (remote setting key_exchange).
+ *
+ * Each daemon creates a key pair on startup and sends its public key to all
+ * send_to hosts in a key exchange message. These messages are encrypted with
+ * the key derived from the shared secret, so only hosts knowing the secret can
+ * take part. Once both sides know each other's public key, they compute a
+ * pair of session keys (crypto_kx) and exchange messages encrypted with these
+ * and a counter as nonce - no salt, no random nonce and no Argon2 needed any
+ * more.
+ *
+ * The host with the lower public key takes the client role, so both sides
+ * end up with matching keys.
+ *
+ * Key pairs only change with a restart. To get fresh keys for every session
+ * nonetheless, each side picks a random session nonce when setting up state
+ * for a host. Both nonces are hashed into the session keys. Counters thus
+ * never repeat under the same key, even if session state has been dropped
+ * and set up again - and datagrams recorded before can't be replayed then.
+ */
+
+#include <config.h>
+
+#ifdef WITH_LIBSODIUM
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sodium.h>
+
+#include "ndebug.h"
+#include "session.h"
+#include "addresses.h"
+#include "logging.h"
+#include "messages.h"
+#include "misc.h"
+#include "nodelist.h"
+#include "binarytree.h"
+
+/* Sessions are kept in a tree sorted by address and - for eviction - in a list
+ * sorted by last use */
+typedef struct la_session_s
+{
+        kw_node_t node;
+        kw_tree_node_t tree_node;
+        la_address_key_t key;
+        time_t last_used;
+        unsigned char peer_pk[crypto_kx_PUBLICKEYBYTES];
+        unsigned char own_nonce[KX_NONCE_LEN];
+        unsigned char peer_nonce[KX_NONCE_LEN];
+        unsigned char rx[crypto_kx_SESSIONKEYBYTES];
+        unsigned char tx[crypto_kx_SESSIONKEYBYTES];
+        /* Never reset, as all keys of a session depend on own_nonce */
+        uint64_t tx_counter;
+        /* Highest counter received and bitmap of the counters received just
+         * before it (bit n set: rx_counter - n has been received) */
+        uint64_t rx_counter;
+        uint64_t rx_window;
+        /* Timestamp of last key exchange message accepted from host */
+        uint64_t kx_timestamp;
+        time_t hello_sent;
+        bool established;
+} la_session_t;
+
+/* Protects sessions, session_tree and own key pair */
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static kw_list_t *sessions = NULL;
+static kw_tree_t *session_tree = NULL;
+
+static unsigned char own_pk[crypto_kx_PUBLICKEYBYTES];
+static unsigned char own_sk[crypto_kx_SECRETKEYBYTES];
+static bool own_keys_created = false;
+
+static void
+store_be64(unsigned char *const bytes, uint64_t value)
+{
+        for (int i = 7; i >= 0; i--)
+        {
+                bytes[i] = value & 0xFF;
+                value >>= 8;
+        }
+}
+
+static uint64_t
+load_be64(const unsigned char *const bytes)
+{
+        uint64_t result = 0;
+
+        for (int i = 0; i < 8; i++)
+                result = (result << 8) | bytes[i];
+
+        return result;
+}
+
+/*
+ * Must be called with session_mutex held.
+ */
+
+static void
+create_own_keys(void)
+{
+        if (own_keys_created)
+                return;
+
+        if (sodium_init() < 0)
+                die_hard(false, "Unable to initialize libsodium!");
+
+        if (crypto_kx_keypair(own_pk, own_sk))
+                die_hard(false, "Unable to create key pair!");
+
+        own_keys_created = true;
+}
+
+static int
+cmp_sessions(const void *const p1, const void *const p2)
+{
+        return adrkeycmp(&((const la_session_t *) p1)->key,
+                        &((const la_session_t *) p2)->key);
+}
+
+static void
+free_session(void *const session)
+{
+        sodium_memzero(session, sizeof (la_session_t));
+        free(session);
+}
+
+/*
+ * Drops the least recently used sessions while there are MAX_SESSIONS or
+ * more, as well as sessions never established and unused for KX_MAX_AGE
+ * seconds. Must be called with session_mutex held.
+ */
+
+static void
+expire_sessions(const time_t now)
+{
+        assert_list(sessions);
+
+        for (;;)
+        {
+                la_session_t *const oldest = (la_session_t *)
+                        sessions->head;
+                if (!oldest->node.succ)
+                        return;
+
+                if (session_tree->count < MAX_SESSIONS &&
+                                (oldest->established || oldest->last_used +
+                                 KX_MAX_AGE > now))
+                        return;
+
+                if (oldest->established)
+                {
+                        char text[MAX_ADDR_TEXT_SIZE + 1];
+                        la_log(LOG_WARNING, "Too many sessions, dropped "
+                                        "session with %s.",
+                                        address_key_text(&oldest->key, text));
+                }
+
+                (void) remove_tree_node(session_tree, &oldest->tree_node);
+                (void) remove_node((kw_node_t *) oldest);
+                free_session(oldest);
+        }
+}
+
+/*
+ * Returns session for host, creates new one if create is true. Must be called
+ * with session_mutex held.
+ */
+
+static la_session_t *
+find_session(const la_address_key_t *const key, const bool create)
+{
+        assert(key);
+
+        if (!sessions)
+        {
+                sessions = create_list();
+                session_tree = create_tree();
+        }
+
+        const time_t now = xtime(NULL);
+        la_session_t search;
+        search.key = *key;
+        kw_tree_node_t *const node = find_tree_node(session_tree, &search,
+                        cmp_sessions);
+        if (node)
+        {
+                la_session_t *const session = node->payload;
+                session->last_used = now;
+                /* Keep sessions list sorted by last use */
+                (void) remove_node((kw_node_t *) session);
+                add_tail(sessions, (kw_node_t *) session);
+                return session;
+        }
+
+        if (!create)
+                return NULL;
+
+        expire_sessions(now);
+
+        la_session_t *const result = create_node0(sizeof *result, 0, NULL);
+        result->tree_node.payload = result;
+        result->key = *key;
+        result->last_used = now;
+        randombytes_buf(result->own_nonce, KX_NONCE_LEN);
+        add_tail(sessions, (kw_node_t *) result);
+        add_to_tree(session_tree, &result->tree_node, cmp_sessions);
+
+        return result;
+}
+
+/*
+ * Creates a key exchange message for the own public key and the session nonce
+ * for address in buffer. Returns length of message.
+ */
+
+int
+init_kx_message(char *const buffer, const char type, const int port,
+                const la_address_t *const address)
+{
+        assert(buffer); assert(type == KX_HELLO || type == KX_ANSWER);
+        assert_address(address);
+        unsigned char *const ubuffer = (unsigned char *) buffer;
+        la_address_key_t key;
+        init_address_key_sa(&key, (struct sockaddr *) &address->sa);
+
+        ubuffer[0] = PROTOCOL_VERSION_KX;
+        ubuffer[1] = type;
+        ubuffer[2] = (port >> 8) & 0xFF;
+        ubuffer[3] = port & 0xFF;
+        store_be64(&ubuffer[4], xtime(NULL));
+
+        xpthread_mutex_lock(&session_mutex);
+
+                create_own_keys();
+                memcpy(&ubuffer[12], own_pk, crypto_kx_PUBLICKEYBYTES);
+                const la_session_t *const session = find_session(&key, true);
+                memcpy(&ubuffer[12 + crypto_kx_PUBLICKEYBYTES],
+                                session->own_nonce, KX_NONCE_LEN);
+
+        xpthread_mutex_unlock(&session_mutex);
+
+        return KX_MSG_LEN;
+}
+
+/*
+ * Hashes key computed by crypto_kx together with the session nonces of sender
+ * and receiver into the key for one direction.
+ */
+
+static bool
+mix_session_key(unsigned char *const result, const unsigned char *const key,
+                const unsigned char *const sender_nonce,
+                const unsigned char *const receiver_nonce)
+{
+        assert(result); assert(key); assert(sender_nonce);
+        assert(receiver_nonce);
+
+        unsigned char input[crypto_kx_SESSIONKEYBYTES + 2 * KX_NONCE_LEN];
+        memcpy(input, key, crypto_kx_SESSIONKEYBYTES);
+        memcpy(&input[crypto_kx_SESSIONKEYBYTES], sender_nonce, KX_NONCE_LEN);
+        memcpy(&input[crypto_kx_SESSIONKEYBYTES + KX_NONCE_LEN],
+                        receiver_nonce, KX_NONCE_LEN);
+
+        const int r = crypto_generichash(result, crypto_kx_SESSIONKEYBYTES,
+                        input, sizeof input, NULL, 0);
+        sodium_memzero(input, sizeof input);
+
+        return !r;
+}
+
+/*
+ * Computes session keys from peer's public key and session nonce. Only the
+ * receive side starts over, as the peer's counter will do so as well in case
+ * its nonce has changed. Our own counter keeps going, keys of this session
+ * always depend on own_nonce.
+ *
+ * Must be called with session_mutex held.
+ */
+
+static bool
+compute_session_keys(la_session_t *const session,
+                const unsigned char *const peer_pk,
+                const unsigned char *const peer_nonce)
+{
+        assert(session); assert(peer_pk); assert(peer_nonce);
+
+        create_own_keys();
+
+        unsigned char rx[crypto_kx_SESSIONKEYBYTES];
+        unsigned char tx[crypto_kx_SESSIONKEYBYTES];
+        int r;
+        if (memcmp(own_pk, peer_pk, crypto_kx_PUBLICKEYBYTES) < 0)
+                r = crypto_kx_client_session_keys(rx, tx, own_pk, own_sk,
+                                peer_pk);
+        else
+                r = crypto_kx_server_session_keys(rx, tx, own_pk, own_sk,
+                                peer_pk);
+
+        const bool result = !r &&
+                mix_session_key(session->rx, rx, peer_nonce,
+                                session->own_nonce) &&
+                mix_session_key(session->tx, tx, session->own_nonce,
+                                peer_nonce);
+        sodium_memzero(rx, crypto_kx_SESSIONKEYBYTES);
+        sodium_memzero(tx, crypto_kx_SESSIONKEYBYTES);
+        if (!result)
+        {
+                session->established = false;
+                return false;
+        }
+
+        memcpy(session->peer_pk, peer_pk, crypto_kx_PUBLICKEYBYTES);
+        memcpy(session->peer_nonce, peer_nonce, KX_NONCE_LEN);
+        session->rx_counter = session->rx_window = 0;
+        session->established = true;
+
+        return true;
+}
+
+/*
+ * Handles a (decrypted) key exchange message received from sa. Sets reply to
+ * true if sender wants to receive our public key. In that case port is the
+ * port it listens on.
+ *
+ * Returns false if message is invalid.
+ */
+
+bool
+handle_kx_message(const char *const buffer, const size_t len,
+                const struct sockaddr *const sa, bool *const reply,
+                int *const port)
+{
+        assert(buffer); assert(sa); assert(reply); assert(port);
+        la_debug_func(NULL);
+        const unsigned char *const ubuffer = (const unsigned char *) buffer;
+
+        if (len < KX_MSG_LEN || (buffer[1] != KX_HELLO &&
+                                buffer[1] != KX_ANSWER))
+                LOG_RETURN(false, LOG_ERR, "Received invalid key exchange "
+                                "message!");
+
+        *reply = buffer[1] == KX_HELLO;
+        *port = (ubuffer[2] << 8) | ubuffer[3];
+
+        const uint64_t timestamp = load_be64(&ubuffer[4]);
+        const time_t now = xtime(NULL);
+        if (timestamp + KX_MAX_AGE < (uint64_t) now ||
+                        timestamp > (uint64_t) now + KX_MAX_AGE)
+                LOG_RETURN(false, LOG_WARNING, "Ignored key exchange message "
+                                "with wrong timestamp - check clocks!");
+
+        la_address_key_t key;
+        init_address_key_sa(&key, sa);
+        char text[MAX_ADDR_TEXT_SIZE + 1];
+        const unsigned char *const peer_pk = &ubuffer[12];
+        const unsigned char *const peer_nonce =
+                &ubuffer[12 + crypto_kx_PUBLICKEYBYTES];
+
+        xpthread_mutex_lock(&session_mutex);
+
+                create_own_keys();
+                const bool own = !sodium_memcmp(own_pk, peer_pk,
+                                crypto_kx_PUBLICKEYBYTES);
+                la_session_t *const session = find_session(&key, true);
+                const bool changed = !session->established ||
+                        sodium_memcmp(session->peer_pk, peer_pk,
+                                        crypto_kx_PUBLICKEYBYTES) ||
+                        sodium_memcmp(session->peer_nonce, peer_nonce,
+                                        KX_NONCE_LEN);
+                /* New keys only with a strictly newer message, otherwise an
+                 * older message of the same second could bring back previous
+                 * keys - and reset the replay window for them */
+                const bool replayed = timestamp < session->kx_timestamp ||
+                        (changed && session->established &&
+                         timestamp == session->kx_timestamp);
+                bool ok = !replayed && !own;
+                if (ok && changed)
+                {
+                        ok = compute_session_keys(session, peer_pk,
+                                        peer_nonce);
+                        if (ok)
+                                la_log(LOG_INFO, "Established session with %s.",
+                                                address_key_text(&key, text));
+                }
+                if (ok)
+                        session->kx_timestamp = timestamp;
+
+        xpthread_mutex_unlock(&session_mutex);
+
+        if (own)
+                LOG_RETURN(false, LOG_WARNING, "Ignored own key exchange "
+                                "message from %s!", address_key_text(&key, text));
+        if (replayed)
+                LOG_RETURN(false, LOG_WARNING, "Ignored outdated key exchange "
+                                "message from %s!", address_key_text(&key, text));
+        if (!ok)
+                LOG_RETURN(false, LOG_ERR, "Unable to compute session keys!");
+
+        return true;
+}
+
+/*
+ * Returns true if it's time to send a hello to address, i.e. if there is no
+ * session yet and there was no hello within the last KX_HELLO_INTERVAL
+ * seconds. Also if address has forgotten the session (after a restart).
+ */
+
+bool
+kx_hello_due(const la_address_t *const address)
+{
+        assert_address(address);
+        la_address_key_t key;
+        init_address_key_sa(&key, (struct sockaddr *) &address->sa);
+        const time_t now = xtime(NULL);
+
+        xpthread_mutex_lock(&session_mutex);
+
+                la_session_t *const session = find_session(&key, true);
+                const bool result = session->hello_sent +
+                        KX_HELLO_INTERVAL <= now;
+                if (result)
+                        session->hello_sent = now;
+
+        xpthread_mutex_unlock(&session_mutex);
+
+        return result;
+}
+
+/*
+ * Encrypts message of len bytes for address and stores the resulting session
+ * datagram (len + SESSION_OVERHEAD bytes) in datagram. Returns false if there
+ * is no session with address.
+ */
+
+bool
+session_encrypt(const char *const message, const size_t len,
+                const la_address_t *const address, char *const datagram,
+                size_t *const datagram_len)
+{
+        assert(message); assert_address(address); assert(datagram);
+        assert(datagram_len);
+        unsigned char *const udatagram = (unsigned char *) datagram;
+        la_address_key_t key;
+        init_address_key_sa(&key, (struct sockaddr *) &address->sa);
+        unsigned char tx[crypto_kx_SESSIONKEYBYTES];
+        uint64_t counter = 0;
+
+        xpthread_mutex_lock(&session_mutex);
+
+                la_session_t *const session = find_session(&key, false);
+                if (session && session->established)
+                {
+                        counter = ++session->tx_counter;
+                        memcpy(tx, session->tx, crypto_kx_SESSIONKEYBYTES);
+                }
+
+        xpthread_mutex_unlock(&session_mutex);
+
+        if (!counter)
+                return false;
+
+        unsigned char nonce[crypto_secretbox_NONCEBYTES] = { 0 };
+        store_be64(nonce, counter);
+
+        memcpy(udatagram, SESSION_MAGIC, SESSION_MAGIC_LEN);
+        memcpy(&udatagram[SESSION_MAGIC_LEN], nonce, SESSION_COUNTER_LEN);
+        const int r = crypto_secretbox_easy(&udatagram[SESSION_MAGIC_LEN +
+                        SESSION_COUNTER_LEN], (const unsigned char *) message,
+                        len, nonce, tx);
+        sodium_memzero(tx, crypto_kx_SESSIONKEYBYTES);
+        if (r)
+                LOG_RETURN(false, LOG_ERR, "Unable to encrypt message!");
+
+        *datagram_len = len + SESSION_OVERHEAD;
+
+        return true;
+}
+
+/*
+ * Returns false if counter has been seen before or is too old. Must be called
+ * with session_mutex held.
+ */
+
+static bool
+check_replay_window(la_session_t *const session, const uint64_t counter)
+{
+        assert(session);
+
+        if (counter > session->rx_counter)
+        {
+                const uint64_t shift = counter - session->rx_counter;
+                session->rx_window = shift >= SESSION_REPLAY_WINDOW ? 0 :
+                        session->rx_window << shift;
+                session->rx_window |= 1;
+                session->rx_counter = counter;
+                return true;
+        }
+
+        const uint64_t offset = session->rx_counter - counter;
+        if (offset >= SESSION_REPLAY_WINDOW ||
+                        (session->rx_window >> offset) & 1)
+                return false;
+
+        session->rx_window |= (uint64_t) 1 << offset;
+        return true;
+}
+
+/*
+ * Decrypts session datagram of len bytes received from sa. On success, the
+ * message will be at the start of buffer and msg_len its length. buffer
+ * remains unchanged otherwise.
+ */
+
+la_session_result_t
+session_decrypt(char *const buffer, const size_t len,
+                const struct sockaddr *const sa, size_t *const msg_len)
+{
+        assert(buffer); assert(sa); assert(msg_len);
+        const unsigned char *const ubuffer = (unsigned char *) buffer;
+
+        if (len <= SESSION_OVERHEAD || memcmp(buffer, SESSION_MAGIC,
+                                SESSION_MAGIC_LEN))
+                return LA_SESSION_NONE;
+
+        la_address_key_t key;
+        init_address_key_sa(&key, sa);
+        unsigned char rx[crypto_kx_SESSIONKEYBYTES];
+        bool established = false;
+
+        xpthread_mutex_lock(&session_mutex);
+
+                const la_session_t *const session = find_session(&key, false);
+                if (session && session->established)
+                {
+                        established = true;
+                        memcpy(rx, session->rx, crypto_kx_SESSIONKEYBYTES);
+                }
+
+        xpthread_mutex_unlock(&session_mutex);
+
+        if (!established)
+                return LA_SESSION_UNKNOWN;
+
+        unsigned char nonce[crypto_secretbox_NONCEBYTES] = { 0 };
+        memcpy(nonce, &ubuffer[SESSION_MAGIC_LEN], SESSION_COUNTER_LEN);
+        const uint64_t counter = load_be64(nonce);
+
+        unsigned char message[len];
+        const int r = crypto_secretbox_open_easy(message,
+                        &ubuffer[SESSION_MAGIC_LEN + SESSION_COUNTER_LEN],
+                        len - SESSION_MAGIC_LEN - SESSION_COUNTER_LEN, nonce,
+                        rx);
+        sodium_memzero(rx, crypto_kx_SESSIONKEYBYTES);
+        if (r)
+                return LA_SESSION_INVALID;
+
+        bool fresh = false;
+        xpthread_mutex_lock(&session_mutex);
+
+                la_session_t *const current = find_session(&key, false);
+                if (current)
+                        fresh = check_replay_window(current, counter);
+
+        xpthread_mutex_unlock(&session_mutex);
+
+        if (!fresh)
+                return LA_SESSION_INVALID;
+
+        *msg_len = len - SESSION_OVERHEAD;
+        memcpy(buffer, message, *msg_len);
+
+        return LA_SESSION_OK;
+}
+
+int
+session_count(void)
+{
+        xpthread_mutex_lock(&session_mutex);
+
+                const int result = session_tree ? session_tree->count : 0;
+
+        xpthread_mutex_unlock(&session_mutex);
+
+        return result;
+}
+
+void
+free_sessions(void)
+{
+        la_debug_func(NULL);
+
+        xpthread_mutex_lock(&session_mutex);
+
+                /* Sessions are freed via the list */
+                free_tree(session_tree, NULL, false);
+                session_tree = NULL;
+                free_list(sessions, free_session);
+                sessions = NULL;
+                sodium_memzero(own_sk, crypto_kx_SECRETKEYBYTES);
+                own_keys_created = false;
+
+        xpthread_mutex_unlock(&session_mutex);
+}
+#endif /* WITH_LIBSODIUM */
+
+/* vim: set autowrite expandtab: */
@@ -0,0 +1,107 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __session_h
+#define __session_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ndebug.h"
+#include "addresses.h"
+
+#ifdef WITH_LIBSODIUM
+#include <sodium.h>
+
+/*
+ * Key exchange message (protocol version '2'), sent like any other message
+ * encrypted with the key derived from the shared secret:
+ *      '2'<type><port><timestamp><public key><session nonce>
+ *
+ * type is KX_HELLO if the receiver should answer with its own public key,
+ * KX_ANSWER otherwise. port is the port the sender listens on. port (2 bytes)
+ * and timestamp (8 bytes) are in network byte order. The session nonce is
+ * chosen randomly whenever the sender sets up session state for the receiver.
+ */
+#define KX_HELLO 'H'
+#define KX_ANSWER 'A'
+#define KX_NONCE_LEN 16
+#define KX_MSG_LEN (2 + 2 + 8 + crypto_kx_PUBLICKEYBYTES + KX_NONCE_LEN)
+
+/* Minimum time between two hellos sent to the same host */
+#define KX_HELLO_INTERVAL 60
+
+/* Maximum difference between timestamp of a key exchange message and local
+ * time */
+#define KX_MAX_AGE 300
+
+/* Maximum number of hosts to keep session state for. Once reached, the least
+ * recently used one is dropped. Hosts without established session are also
+ * dropped once unused for KX_MAX_AGE seconds. */
+#define MAX_SESSIONS 1024
+
+/*
+ * Session datagram:
+ *      <SESSION_MAGIC><counter><encrypted message incl. MAC>
+ *
+ * counter (8 bytes, network byte order) is incremented for every datagram and
+ * serves as nonce.
+ */
+#define SESSION_MAGIC "\xa5LAS"
+#define SESSION_MAGIC_LEN 4
+#define SESSION_COUNTER_LEN 8
+#define SESSION_OVERHEAD (SESSION_MAGIC_LEN + SESSION_COUNTER_LEN + \
+                crypto_secretbox_MACBYTES)
+
+/* Number of most recent counters remembered to detect replayed datagrams */
+#define SESSION_REPLAY_WINDOW 64
+
+typedef enum la_session_result_s
+{
+        LA_SESSION_NONE,        /* not a session datagram */
+        LA_SESSION_OK,
+        LA_SESSION_UNKNOWN,     /* no session with sender */
+        LA_SESSION_INVALID      /* failed to decrypt or replayed */
+} la_session_result_t;
+
+int init_kx_message(char *buffer, char type, int port,
+                const la_address_t *address);
+
+bool handle_kx_message(const char *buffer, size_t len,
+                const struct sockaddr *sa, bool *reply, int *port);
+
+bool kx_hello_due(const la_address_t *address);
+
+bool session_encrypt(const char *message, size_t len,
+                const la_address_t *address, char *datagram,
+                size_t *datagram_len);
+
+la_session_result_t session_decrypt(char *buffer, size_t len,
+                const struct sockaddr *sa, size_t *msg_len);
+
+int session_count(void);
+
+void free_sessions(void);
+
+#endif /* WITH_LIBSODIUM */
+
+#endif /* __session_h */
+
+/* vim: set autowrite expandtab: */
@@ -22,6 +22,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <regex.h>
 
 #include "ndebug.h"
 #include "configfile.h"
@@ -30,6 +32,27 @@
 #include "rules.h"
 #include "sources.h"
 
+/* Longer program names will never match a rule's service */
+#define MAX_PROGRAM_LENGTH 64
+
+/*
+ * Parts of a traditional syslog line - i.e. "timestamp host program[pid]: "
+ * followed by the message. Pointers point into the original line, only the
+ * program name is copied so it is '\0'-terminated for regexec().
+ */
+
+typedef struct la_syslog_header_s
+{
+        const char *timestamp;
+        size_t timestamp_len;
+        const char *host;
+        size_t host_len;
+        char program[MAX_PROGRAM_LENGTH];
+        const char *pid;
+        size_t pid_len;
+        const char *message;
+} la_syslog_header_t;
+
 
 void
 assert_source_ffl(const la_source_t *source, const char *func,
@@ -61,8 +84,345 @@ assert_source_group_ffl(const la_source_group_t *source_group, const char *func,
         assert_list_ffl(&source_group->rules, func, file, line);
 }
 
+#if HAVE_LIBSYSTEMD
+static int
+compare_systemd_units(const void *const p1, const void *const p2)
+{
+        return strcmp((*(const la_systemd_unit_t *const *) p1)->node.nodename,
+                        (*(const la_systemd_unit_t *const *) p2)->node.nodename);
+}
+
+static int
+compare_name_with_systemd_unit(const void *const key, const void *const p)
+{
+        return strcmp((const char *) key,
+                        (*(const la_systemd_unit_t *const *) p)->node.nodename);
+}
+
+/*
+ * Returns systemd unit with given name or NULL if no rule is interested in
+ * this unit. Relies on index_systemd_units() having been called.
+ */
+
+static la_systemd_unit_t *
+find_systemd_unit(const la_source_group_t *const source_group,
+                const char *const name)
+{
+        assert(name);
+
+        la_systemd_unit_t *const *const result = bsearch(name,
+                        source_group->systemd_unit_index,
+                        source_group->n_systemd_units,
+                        sizeof *source_group->systemd_unit_index,
+                        compare_name_with_systemd_unit);
+
+        return result ? *result : NULL;
+}
+
 /*
- * Call handle_log_line_for_rule() for each of the sources rules
+ * Add systemd unit to source group's list of systemd units. Makes sure, a
+ * unit with the same name isn't added more than once. Returns the (new or
+ * already existing) unit.
+ */
+
+static la_systemd_unit_t *
+add_systemd_unit_to_list(la_source_group_t *const source_group,
+                const char *const name)
+{
+        assert_source_group(source_group); assert(name);
+        assert_list(&source_group->systemd_units);
+
+        FOREACH(la_systemd_unit_t, unit, &source_group->systemd_units)
+        {
+                if (!strcmp(name, unit->node.nodename))
+                        return unit;
+        }
+
+        la_systemd_unit_t *const result = create_node(sizeof *result, 0, name);
+        result->rules = NULL;
+        result->n_rules = 0;
+        add_tail(&source_group->systemd_units, (kw_node_t *) result);
+
+        return result;
+}
+
+/*
+ * Register rule with the systemd unit it's interested in.
+ */
+
+void
+add_rule_to_systemd_unit(la_source_group_t *const source_group,
+                la_rule_t *const rule)
+{
+        assert_source_group(source_group); assert_rule(rule);
+        assert(rule->systemd_unit);
+
+        la_systemd_unit_t *const unit = add_systemd_unit_to_list(source_group,
+                        rule->systemd_unit);
+        unit->rules = xrealloc(unit->rules,
+                        (unit->n_rules + 1) * sizeof *unit->rules);
+        unit->rules[unit->n_rules++] = rule;
+}
+
+/*
+ * (Re)creates the sorted index over source group's systemd units. Must be
+ * called after the last unit has been added.
+ */
+
+void
+index_systemd_units(la_source_group_t *const source_group)
+{
+        assert_source_group(source_group);
+        assert_list(&source_group->systemd_units);
+
+        free(source_group->systemd_unit_index);
+        source_group->n_systemd_units =
+                list_length(&source_group->systemd_units);
+        source_group->systemd_unit_index = xmalloc(
+                        source_group->n_systemd_units *
+                        sizeof *source_group->systemd_unit_index);
+
+        int i = 0;
+        FOREACH(la_systemd_unit_t, unit, &source_group->systemd_units)
+                source_group->systemd_unit_index[i++] = unit;
+
+        qsort(source_group->systemd_unit_index, source_group->n_systemd_units,
+                        sizeof *source_group->systemd_unit_index,
+                        compare_systemd_units);
+}
+
+static void
+free_systemd_unit(la_systemd_unit_t *const unit)
+{
+        if (!unit)
+                return;
+
+        free(unit->node.nodename);
+        free(unit->rules);
+        free(unit);
+}
+#endif /* HAVE_LIBSYSTEMD */
+
+/*
+ * Splits line into the parts of a syslog header and the message. The
+ * timestamp is either the traditional "Mmm dd hh:mm:ss" or a single token
+ * (e.g. RFC 3339). The pid is optional.
+ *
+ * Returns false if line doesn't start with a syslog header.
+ */
+
+static bool
+parse_syslog_header(const char *const line, la_syslog_header_t *const header)
+{
+        assert(line); assert(header);
+
+        const char *ptr = line;
+
+        header->timestamp = ptr;
+        if (strnlen(line, 16) == 16 && line[3] == ' ' && line[6] == ' ' &&
+                        line[9] == ':' && line[12] == ':')
+                ptr += 15;
+        else
+                ptr += strcspn(ptr, " ");
+        header->timestamp_len = ptr - line;
+        if (!header->timestamp_len || *ptr++ != ' ')
+                return false;
+
+        header->host = ptr;
+        header->host_len = strcspn(ptr, " ");
+        ptr += header->host_len;
+        if (!header->host_len || *ptr++ != ' ')
+                return false;
+
+        const size_t program_len = strcspn(ptr, "[: ");
+        if (!program_len)
+                return false;
+        if (program_len < MAX_PROGRAM_LENGTH)
+        {
+                memcpy(header->program, ptr, program_len);
+                header->program[program_len] = '\0';
+        }
+        else
+        {
+                header->program[0] = '\0';
+        }
+        ptr += program_len;
+
+        header->pid = NULL;
+        header->pid_len = 0;
+        if (*ptr == '[')
+        {
+                header->pid = ++ptr;
+                header->pid_len = strspn(ptr, "0123456789");
+                ptr += header->pid_len;
+                if (*ptr++ != ']')
+                        return false;
+        }
+
+        if (ptr[0] != ':' || ptr[1] != ' ')
+                return false;
+
+        header->message = ptr + 2;
+
+        return true;
+}
+
+/*
+ * Returns true if rule's service matches the program name from the syslog
+ * header. Rules without service match any program.
+ */
+
+static bool
+service_matches(const la_rule_t *const rule, const char *const program)
+{
+        return !rule->service_regex ||
+                !regexec(rule->service_regex, program, 0, NULL, 0);
+}
+
+/*
+ * Returns the part of line the patterns of rule must be matched against. For
+ * source groups with syslog_header this is the message following the header,
+ * otherwise the line itself. Returns NULL if rule isn't interested in line at
+ * all.
+ *
+ * handle_log_line() doesn't use this as it parses the header only once for
+ * all rules.
+ */
+
+const char *
+get_message_for_rule(const la_rule_t *const rule, const char *const line)
+{
+        assert_rule(rule); assert(line);
+
+        if (!rule->source_group->syslog_header)
+                return line;
+
+        la_syslog_header_t header;
+        if (!parse_syslog_header(line, &header) ||
+                        !service_matches(rule, header.program))
+                return NULL;
+
+        return header.message;
+}
+
+/*
+ * Call handle_log_line_for_rule() for each of the sources rules. Returns true
+ * if any rule matched.
+ */
+
+static bool
+dispatch_log_line(const la_source_t *const source, const char *const line,
+                const char *const systemd_unit)
+{
+        bool result = false;
+
+#if HAVE_LIBSYSTEMD
+        /* In case we use systemd, only look at the rules of the matching
+         * systemd unit, otherwise we can save us going through all the
+         * pattern matching stuff */
+        if (systemd_unit)
+        {
+                const la_systemd_unit_t *const unit =
+                        find_systemd_unit(source->source_group, systemd_unit);
+                if (!unit)
+                        return false;
+
+                for (int i = 0; i < unit->n_rules; i++)
+                {
+                        if (unit->rules[i]->enabled &&
+                                        handle_log_line_for_rule(
+                                                unit->rules[i], line))
+                                result = true;
+                }
+                return result;
+        }
+#endif /* HAVE_LIBSYSTEMD */
+
+        if (source->source_group->syslog_header)
+        {
+                la_syslog_header_t header;
+                if (!parse_syslog_header(line, &header))
+                        return false;
+
+                FOREACH(la_rule_t, rule, &source->source_group->rules)
+                {
+                        if (rule->enabled && service_matches(rule,
+                                                header.program) &&
+                                        handle_log_line_for_rule(rule,
+                                                header.message))
+                                result = true;
+                }
+                return result;
+        }
+
+        FOREACH(la_rule_t, rule, &source->source_group->rules)
+        {
+                if (rule->enabled && handle_log_line_for_rule(rule, line))
+                        result = true;
+        }
+
+        return result;
+}
+
+/*
+ * 64 bit FNV-1a hash over systemd unit (if any) and line - without the first
+ * skip characters of line. Never returns 0 as 0 marks an empty cache slot.
+ */
+
+static uint64_t
+line_fingerprint(const char *const systemd_unit, const char *line,
+                const size_t skip)
+{
+        uint64_t result = 14695981039346656037ULL;
+
+        if (systemd_unit)
+        {
+                for (const char *ptr = systemd_unit; *ptr; ptr++)
+                        result = (result ^ (unsigned char) *ptr) *
+                                1099511628211ULL;
+                result = (result ^ '\0') * 1099511628211ULL;
+        }
+
+        for (line += strnlen(line, skip); *line; line++)
+                result = (result ^ (unsigned char) *line) * 1099511628211ULL;
+
+        return result ? result : 1;
+}
+
+/*
+ * Returns true if entry holds exactly the given systemd unit (if any) and
+ * line - the latter already without the skipped characters.
+ */
+
+static bool
+line_cache_entry_matches(const la_line_cache_entry_t *const entry,
+                const uint64_t fingerprint, const char *const systemd_unit,
+                const char *const line)
+{
+        if (entry->fingerprint != fingerprint || !entry->line)
+                return false;
+
+        if (systemd_unit ? !entry->systemd_unit ||
+                        strcmp(entry->systemd_unit, systemd_unit) :
+                        entry->systemd_unit != NULL)
+                return false;
+
+        return !strcmp(entry->line, line);
+}
+
+static void
+empty_line_cache_entry(la_line_cache_entry_t *const entry)
+{
+        entry->fingerprint = 0;
+        free(entry->systemd_unit);
+        entry->systemd_unit = NULL;
+        free(entry->line);
+        entry->line = NULL;
+}
+
+/*
+ * Hand line to the rules of source. In case the line cache is enabled, lines
+ * which recently didn't match any rule are skipped right away.
  */
 
 void
@@ -74,23 +434,83 @@ handle_log_line(const la_source_t *const source, const char *const line,
          * logging to syslog */
         /* la_debug("handle_log_line(%s, %s)", systemd_unit, line); */
 
-        FOREACH(la_rule_t, rule, &source->source_group->rules)
+        la_source_group_t *const source_group = source->source_group;
+
+        if (!source_group->line_cache)
         {
-                if (rule->enabled)
-                {
-                        /* In case we use systemd, check whether the systemd unit
-                         * matches, otherwise we can save us going through all the
-                         * pattern matching stuff */
-#if HAVE_LIBSYSTEMD
-                        if (!systemd_unit ||
-                                        (rule->systemd_unit &&
-                                         !strcmp(systemd_unit, rule->systemd_unit)))
-#endif /* HAVE_LIBSYSTEMD */
-                                handle_log_line_for_rule(rule, line);
-                }
+                dispatch_log_line(source, line, systemd_unit);
+                return;
+        }
+
+        const uint64_t fingerprint = line_fingerprint(systemd_unit, line,
+                        source_group->line_cache_skip);
+        const char *const rest = line + strnlen(line,
+                        source_group->line_cache_skip);
+        la_line_cache_entry_t *const slot = &source_group->line_cache[
+                fingerprint & source_group->line_cache_mask];
+
+        if (line_cache_entry_matches(slot, fingerprint, systemd_unit, rest))
+        {
+                source_group->line_cache_hits++;
+                return;
+        }
+
+        if (!dispatch_log_line(source, line, systemd_unit))
+        {
+                empty_line_cache_entry(slot);
+                slot->fingerprint = fingerprint;
+                slot->systemd_unit = xstrdup(systemd_unit);
+                slot->line = xstrdup(rest);
         }
 }
 
+/*
+ * Forget all cached non-matching lines - e.g. after a rule has been enabled.
+ */
+
+void
+clear_line_cache(la_source_group_t *const source_group)
+{
+        assert_source_group(source_group);
+
+        if (source_group->line_cache)
+                for (unsigned int i = 0; i <= source_group->line_cache_mask;
+                                i++)
+                        empty_line_cache_entry(&source_group->line_cache[i]);
+}
+
+/*
+ * Enable line cache with (at least) size entries. Size will be rounded up to
+ * the next power of 2. Size 0 disables the cache.
+ */
+
+void
+init_line_cache(la_source_group_t *const source_group, const int size,
+                const int skip)
+{
+        assert_source_group(source_group);
+        la_debug("init_line_cache(%s, %i, %i)", source_group->node.nodename,
+                        size, skip);
+
+        clear_line_cache(source_group);
+        free(source_group->line_cache);
+        source_group->line_cache = NULL;
+        source_group->line_cache_mask = 0;
+        source_group->line_cache_skip = skip > 0 ? skip : 0;
+        source_group->line_cache_hits = 0;
+
+        if (size <= 0)
+                return;
+
+        unsigned int n = 1;
+        while (n < (unsigned int) size)
+                n <<= 1;
+
+        source_group->line_cache = xmalloc0(n *
+                        sizeof *source_group->line_cache);
+        source_group->line_cache_mask = n - 1;
+}
+
 /*
  * Read new content from file and hand over to handle_log_line()
  *
@@ -131,10 +551,17 @@ create_source_group(const char *const name, const char *const glob_pattern,
         la_source_group_t *const result = create_node(sizeof *result, 0, name);
         result->glob_pattern = xstrdup(glob_pattern);
         result->prefix = xstrdup(prefix);
+        result->syslog_header = false;
+        result->line_cache = NULL;
+        result->line_cache_mask = 0;
+        result->line_cache_skip = 0;
+        result->line_cache_hits = 0;
         init_list(&result->sources);
         init_list(&result->rules);
 #if HAVE_LIBSYSTEMD
         init_list(&result->systemd_units);
+        result->systemd_unit_index = NULL;
+        result->n_systemd_units = 0;
 #endif
 
         assert_source_group(result);
@@ -195,6 +622,8 @@ free_source_group(la_source_group_t *const source_group)
 
         la_vdebug_func(source_group->node.nodename);
 
+        clear_line_cache(source_group);
+
         free(source_group->node.nodename);
 
         free(source_group->glob_pattern);
@@ -204,8 +633,12 @@ free_source_group(la_source_group_t *const source_group)
 
         free(source_group->prefix);
 
+        free(source_group->line_cache);
+
 #if HAVE_LIBSYSTEMD
-        empty_list(&source_group->systemd_units, NULL);
+        empty_list(&source_group->systemd_units,
+                        (void (*)(void *const)) free_systemd_unit);
+        free(source_group->systemd_unit_index);
 #endif /* HAVE_LISTSYSTEMD */
 
         free(source_group);
@@ -22,10 +22,13 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "ndebug.h"
 #include "nodelist.h"
 
+struct la_rule_s;
+
 /* assertions */
 
 #ifdef NDEBUG
@@ -48,6 +51,36 @@
 #define free_source_group_list(list) \
         free_list(list, (void (*)(void *const)) free_source_group)
 
+#if HAVE_LIBSYSTEMD
+/*
+ * A systemd unit together with all rules interested in its log lines. Node
+ * name is the unit name. Rules are not owned by the unit, they still belong
+ * to the source group's rules list.
+ */
+
+typedef struct la_systemd_unit_s la_systemd_unit_t;
+struct la_systemd_unit_s
+{
+        struct kw_node_s node;
+        struct la_rule_s **rules;
+        int n_rules;
+};
+#endif /* HAVE_LIBSYSTEMD */
+
+/*
+ * Line that recently didn't match any rule. Line is stored without the
+ * skipped leading characters and is compared on a fingerprint hit, so lines
+ * with colliding fingerprints are never skipped. Empty slots have fingerprint
+ * 0 and line NULL.
+ */
+
+typedef struct la_line_cache_entry_s
+{
+        uint64_t fingerprint;
+        char *systemd_unit;
+        char *line;
+} la_line_cache_entry_t;
+
 typedef struct la_source_group_s la_source_group_t;
 struct la_source_group_s
 {
@@ -60,10 +93,25 @@ struct la_source_group_s
         struct kw_list_s rules;
         /* Prefix to prepend before rule patterns */
         char *prefix;
+        /* Parse syslog header once per line and dispatch only to rules with
+         * matching service (prefix will not be used then) */
+        bool syslog_header;
+        /* Recent lines that didn't match any rule - NULL if disabled. Size
+         * is line_cache_mask + 1 */
+        la_line_cache_entry_t *line_cache;
+        unsigned int line_cache_mask;
+        /* Number of leading characters (e.g. timestamp) not included in
+         * fingerprint */
+        size_t line_cache_skip;
+        long int line_cache_hits;
         /* Next one is only used in systemd.c */
-        /* systemd_units we're interested in */
+        /* systemd_units we're interested in (la_systemd_unit_t) */
 #if HAVE_LIBSYSTEMD
         struct kw_list_s systemd_units;
+        /* Same units sorted by name for bsearch() in handle_log_line() -
+         * created by index_systemd_units() */
+        struct la_systemd_unit_s **systemd_unit_index;
+        int n_systemd_units;
 #endif /* HAVE_LIBSYSTEMD */
 };
 
@@ -104,6 +152,9 @@ void assert_source_group_ffl(const la_source_group_t *source_group, const char *
 
 void handle_log_line(const la_source_t *source, const char *line, const char *systemd_unit);
 
+const char *get_message_for_rule(const struct la_rule_s *rule,
+                const char *line);
+
 bool handle_new_content(const la_source_t *source);
 
 la_source_group_t *create_source_group(const char *name,
@@ -115,12 +166,23 @@ void free_source(la_source_t *source);
 
 void free_source_group(la_source_group_t *source_group);
 
+void init_line_cache(la_source_group_t *source_group, int size, int skip);
+
+void clear_line_cache(la_source_group_t *source_group);
+
 la_source_group_t *find_source_group_by_location(const char *location);
 
 la_source_group_t *find_source_group_by_name(const char *name);
 
 void reset_counts(void);
 
+#if HAVE_LIBSYSTEMD
+void add_rule_to_systemd_unit(la_source_group_t *source_group,
+                struct la_rule_s *rule);
+
+void index_systemd_units(la_source_group_t *source_group);
+#endif /* HAVE_LIBSYSTEMD */
+
 #endif /* __sources_h */
 
 /* vim: set autowrite expandtab: */
@@ -23,18 +23,22 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <pthread.h>
 #if HAVE_ALLOCA_H
 #include <alloca.h>
 #endif /* HAVE_ALLOCA_H */
 #include <stdlib.h>
 #include <limits.h>
+#include <inttypes.h>
 #include <stdnoreturn.h>
 #include <stddef.h>
 
 #include "ndebug.h"
 #include "logactiond.h"
 #include "addresses.h"
+#include "binarytree.h"
+#include "binmsg.h"
 #include "configfile.h"
 #include "endqueue.h"
 #include "logging.h"
@@ -44,49 +48,365 @@
 #include "state.h"
 
 const char *saved_state = NULL;
+char *state_journal = NULL;
+static char *new_saved_state = NULL;
+static char *new_state_journal = NULL;
 
 pthread_mutex_t save_state_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* journal_fd, journal_entries and journal_buffer are protected by
+ * end_queue_mutex, journal_fd is only changed with save_state_mutex locked as
+ * well. Entries are collected in journal_buffer and written to journal_fd by
+ * flush_journal() resp. write_snapshot() only, so no file I/O happens with
+ * end_queue_mutex locked. journal_pending (protected by save_state_mutex) is
+ * set while journal_fd still refers to new_state_journal, i.e. the snapshot
+ * preceding the journal hasn't been written yet. */
+static int journal_fd = -1;
+static int journal_entries = 0;
+static char *journal_buffer = NULL;
+static size_t journal_buffer_len = 0;
+static size_t journal_buffer_size = 0;
+static bool journal_pending = false;
+/* Generation of the journal journal_fd refers to (see state.h), protected by
+ * save_state_mutex */
+static uint64_t journal_generation = 0;
+
+/*
+ * Copy of what's needed from a command in the end queue to write it to the
+ * state file.
+ */
+
+typedef struct la_snapshot_entry_s
+{
+        char address[MAX_ADDR_TEXT_SIZE + 1];
+        char rule_name[RULE_LENGTH + 1];
+        time_t end_time;
+        int factor;
+} la_snapshot_entry_t;
+
+/*
+ * Entry read from the state file or journal while restoring state. Entries
+ * are kept in a tree sorted by address so journal entries can replace resp.
+ * remove previous ones.
+ */
+
+typedef struct la_saved_entry_s
+{
+        kw_tree_node_t node;
+        la_address_key_t key;
+        la_address_t address;
+        la_rule_t *rule;
+        time_t end_time;
+        int factor;
+} la_saved_entry_t;
+
 static bool
-move_state_file_to_backup(void)
+move_file_to_backup(const char *const file_name)
 {
-        assert(saved_state);
-        la_debug_func(saved_state);
+        assert(file_name);
+        la_debug_func(file_name);
 
-        const size_t length = strlen(saved_state) + sizeof BAK_SUFFIX - 1;
+        const size_t length = strlen(file_name) + sizeof BAK_SUFFIX - 1;
         char *const backup_file_name = alloca(length + 1);
 
-        if (snprintf(backup_file_name, length + 1, "%s%s", saved_state, BAK_SUFFIX) !=
+        if (snprintf(backup_file_name, length + 1, "%s%s", file_name, BAK_SUFFIX) !=
                         (int) length)
                 LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to create backup file name!");
 
-        if (rename(saved_state, backup_file_name) == -1 && errno != ENOENT)
+        if (rename(file_name, backup_file_name) == -1 && errno != ENOENT)
                 LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to create backup file!");
 
         return true;
 }
 
-static bool
-recursively_save_state(FILE *const stream, const kw_tree_node_t *const node)
+static void
+append_to_journal(const la_command_t *const command, const char type)
+{
+        assert(command);
+
+        if (journal_fd == -1 || !command->address || command->is_template ||
+                        command->end_time == INT_MAX)
+                return;
+
+        if (journal_buffer_len + BINMSG_ENTRY_LEN + BINMSG_MAX_RULE_LEN >
+                        journal_buffer_size)
+        {
+                journal_buffer_size = journal_buffer_size ?
+                        2 * journal_buffer_size : JOURNAL_BUFFER_SIZE;
+                journal_buffer = xrealloc(journal_buffer, journal_buffer_size);
+        }
+
+        const size_t len = init_binary_entry(
+                        &journal_buffer[journal_buffer_len], type,
+                        command->address, command->rule_name,
+                        command->end_time, command->factor);
+        if (!len)
+                return;
+
+        journal_buffer_len += len;
+        journal_entries++;
+}
+
+/*
+ * Writes len bytes of buffer taken from journal_buffer to fd and frees buffer.
+ * Must be called with save_state_mutex locked so entries end up in the
+ * journal in the order they were recorded.
+ */
+
+static void
+write_journal_buffer(const int fd, char *const buffer, const size_t len)
+{
+        /* Entries have been counted already, so if write fails the next
+         * save_state() will write a fresh snapshot */
+        if (len && write(fd, buffer, len) != (ssize_t) len)
+                la_log_errno(LOG_ERR, "Unable to write to state journal");
+
+        free(buffer);
+}
+
+/*
+ * Takes the entries collected so far. Must be called with end_queue_mutex
+ * locked.
+ */
+
+static char *
+take_journal_buffer(size_t *const len)
+{
+        char *const result = journal_buffer;
+        *len = journal_buffer_len;
+
+        journal_buffer = NULL;
+        journal_buffer_len = journal_buffer_size = 0;
+
+        return result;
+}
+
+/*
+ * Writes all entries collected so far to the journal. Called by the save
+ * state thread every JOURNAL_FLUSH_PERIOD seconds.
+ */
+
+static void
+flush_journal(void)
+{
+        xpthread_mutex_lock(&save_state_mutex);
+
+                size_t len;
+                xpthread_mutex_lock(&end_queue_mutex);
+
+                        const int fd = journal_fd;
+                        char *const buffer = take_journal_buffer(&len);
+
+                xpthread_mutex_unlock(&end_queue_mutex);
+
+                write_journal_buffer(fd, buffer, len);
+
+        xpthread_mutex_unlock(&save_state_mutex);
+}
+
+/*
+ * Record addition resp. removal of command to / from end queue in the
+ * journal. Must be called with end_queue_mutex locked. Entries are only
+ * buffered here, see flush_journal().
+ */
+
+void
+journal_add(const la_command_t *const command)
+{
+        append_to_journal(command, CMD_ADD);
+}
+
+void
+journal_remove(const la_command_t *const command)
+{
+        append_to_journal(command, CMD_DEL);
+}
+
+/*
+ * Copies commands parents first, so that restoring them in the same order
+ * won't end up with a degenerated end queue.
+ */
+
+static void
+recursively_copy_state(const kw_tree_node_t *const node,
+                la_snapshot_entry_t *const entries, int *const n_entries)
 {
         if (node)
         {
                 const la_command_t *const command = (la_command_t *)
                         node->payload;
-                if (command->end_time != INT_MAX && !command->is_template)
+                /* TODO: would this make sense for commands w/o address as
+                 * well? Then maybe we should reflect this in the protocol and
+                 * then implement here... */
+                if (command->end_time != INT_MAX && !command->is_template &&
+                                command->address)
                 {
-                        if (print_add_message(stream, command) < 0)
-                                return false;
+                        la_snapshot_entry_t *const entry =
+                                &entries[(*n_entries)++];
+                        memcpy(entry->address, command->address->text,
+                                        sizeof entry->address);
+                        (void) string_copy(entry->rule_name,
+                                        sizeof entry->rule_name,
+                                        command->rule_name, 0, '\0');
+                        entry->end_time = command->end_time;
+                        entry->factor = command->factor;
                 }
-                if (!recursively_save_state(stream, node->left))
-                        return false;
-                if (!recursively_save_state(stream, node->right))
-                        return false;
+                recursively_copy_state(node->left, entries, n_entries);
+                recursively_copy_state(node->right, entries, n_entries);
         }
+}
+
+/*
+ * Creates new_state_journal starting with the header for generation. Returns
+ * its file descriptor or -1 on error.
+ */
+
+static int
+create_journal(const uint64_t generation)
+{
+        const int fd = open(new_state_journal, O_WRONLY | O_CREAT | O_TRUNC |
+                        O_APPEND | O_CLOEXEC, 0666);
+        if (fd == -1)
+                LOG_RETURN_ERRNO(-1, LOG_ERR, "Unable to create state journal "
+                                "\"%s\"", new_state_journal);
+
+        unsigned char header[JOURNAL_HEADER_LEN];
+        header[0] = JOURNAL_MAGIC;
+        for (int i = 0; i < 8; i++)
+                header[1 + i] = generation >> (56 - 8 * i);
+
+        if (write(fd, header, sizeof header) != sizeof header)
+        {
+                la_log_errno(LOG_ERR, "Unable to write to state journal");
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+/*
+ * Writes entries to a new file which then replaces the state file - but only
+ * once it's safely on disk. generation is the generation of the journal
+ * following the snapshot (0 if there's none).
+ */
+
+static bool
+write_state_file(const la_snapshot_entry_t *const entries,
+                const int n_entries, const uint64_t generation)
+{
+        FILE *const stream = fopen(new_saved_state, "w");
+        if (!stream)
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to open state file");
+
+        const time_t now = xtime(NULL);
+        char date_string[26];
+        fprintf(stream, "# logactiond state %s\n",
+                        ctime_r(&now, date_string));
+        if (generation)
+                fprintf(stream, "# journal %" PRIu64 "\n", generation);
+
+        bool success = true;
+        for (int i = 0; i < n_entries; i++)
+        {
+                if (print_add_message(stream, entries[i].address,
+                                        entries[i].rule_name,
+                                        entries[i].end_time,
+                                        entries[i].factor) < 0)
+                {
+                        la_log_errno(LOG_ERR, "Failure to dump queue.");
+                        success = false;
+                        break;
+                }
+        }
+
+        if (success && (fflush(stream) == EOF || fsync(fileno(stream)) == -1))
+        {
+                la_log_errno(LOG_ERR, "Unable to sync state file");
+                success = false;
+        }
+
+        if (fclose(stream) == EOF)
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to close state file");
+
+        if (!success)
+                return false;
+
+        if (rename(new_saved_state, saved_state) == -1)
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to replace state file");
 
         return true;
 }
 
+/*
+ * Writes all commands in the end queue to the state file. end_queue_mutex is
+ * only locked to copy the commands, formatting and writing them happens
+ * afterwards.
+ *
+ * From the moment of the copy on, changes go to a new journal. Entries
+ * buffered before the copy still go to the old one. The new journal replaces
+ * the old journal once the state file has been written. Until then,
+ * restore_state() replays both - unless the state file already names the
+ * new journal's generation, i.e. the old journal is contained in the state
+ * file. If writing the state file fails, the new journal is kept for the next
+ * attempt.
+ *
+ * Must be called with save_state_mutex locked.
+ */
+
+static void
+write_snapshot(void)
+{
+        int new_journal_fd = -1;
+        if (!journal_pending)
+                new_journal_fd = create_journal(journal_generation + 1);
+
+        int old_journal_fd = -1;
+        la_snapshot_entry_t *entries;
+        int n_entries = 0;
+        int buffer_fd;
+        char *buffer;
+        size_t buffer_len;
+
+        xpthread_mutex_lock(&end_queue_mutex);
+
+                entries = xmalloc(get_queue_length() * sizeof *entries);
+                recursively_copy_state(get_root_of_queue(), entries,
+                                &n_entries);
+
+                buffer_fd = journal_fd;
+                buffer = take_journal_buffer(&buffer_len);
+
+                if (new_journal_fd != -1)
+                {
+                        old_journal_fd = journal_fd;
+                        journal_fd = new_journal_fd;
+                        journal_entries = 0;
+                        journal_pending = true;
+                        journal_generation++;
+                }
+
+        xpthread_mutex_unlock(&end_queue_mutex);
+
+        write_journal_buffer(buffer_fd, buffer, buffer_len);
+
+        if (old_journal_fd != -1 && close(old_journal_fd) == -1)
+                la_log_errno(LOG_ERR, "Unable to close state journal");
+
+        const bool success = write_state_file(entries, n_entries,
+                        journal_fd != -1 ? journal_generation : 0);
+        free(entries);
+
+        if (success && journal_pending)
+        {
+                if (rename(new_state_journal, state_journal) == -1)
+                        la_log_errno(LOG_ERR, "Unable to replace state "
+                                        "journal");
+                else
+                        journal_pending = false;
+        }
+}
+
 void
 save_state(bool verbose)
 {
@@ -96,7 +416,10 @@ save_state(bool verbose)
         if (!saved_state)
                 return;
 
-        if (!get_queue_length())
+        /* With a journal, a new snapshot is only necessary if something
+         * has changed since the last one (or the last one failed) */
+        if (journal_fd == -1 ? !get_queue_length() :
+                        !journal_entries && !journal_pending)
                 return;
 
         if (log_verbose || verbose)
@@ -105,39 +428,99 @@ save_state(bool verbose)
 
         xpthread_mutex_lock(&save_state_mutex);
 
-                FILE *const stream = fopen(saved_state, "w");
-                if (!stream)
-                        LOG_RETURN(, LOG_ERR, "Unable to open state file");
+                write_snapshot();
 
-                const time_t now = xtime(NULL);
-                char date_string[26];
-                fprintf(stream, "# logactiond state %s\n",
-                                ctime_r(&now, date_string));
+        xpthread_mutex_unlock(&save_state_mutex);
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+}
 
-                xpthread_mutex_lock(&end_queue_mutex);
+static int
+cmp_saved_entries(const void *p1, const void *p2)
+{
+        return adrkeycmp(&((la_saved_entry_t *) p1)->key,
+                        &((la_saved_entry_t *) p2)->key);
+}
 
-                        if (!recursively_save_state(stream, get_root_of_queue()))
-                                la_log_errno(LOG_ERR, "Failure to dump queue.");
+static void
+free_saved_entry(const void *p)
+{
+        free((void *) p);
+}
 
-                xpthread_mutex_unlock(&end_queue_mutex);
+static void
+add_saved_entry(kw_tree_t *const entries, const la_address_t *const address,
+                la_rule_t *const rule, const time_t end_time, const int factor)
+{
+        assert_tree(entries); assert_address(address); assert(rule);
 
-                if (fclose(stream) == EOF)
-                        la_log_errno(LOG_ERR, "Unable to close state file");
+        la_saved_entry_t tmp;
+        init_address_key(&tmp.key, address);
 
-        xpthread_mutex_unlock(&save_state_mutex);
-#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+        la_saved_entry_t *entry;
+        const kw_tree_node_t *const node = find_tree_node(entries, &tmp,
+                        cmp_saved_entries);
+        if (node)
+        {
+                entry = node->payload;
+        }
+        else
+        {
+                entry = xmalloc(sizeof *entry);
+                entry->key = tmp.key;
+                entry->node.payload = entry;
+                add_to_tree(entries, &entry->node, cmp_saved_entries);
+        }
+
+        entry->address = *address;
+        entry->rule = rule;
+        entry->end_time = end_time;
+        entry->factor = factor;
 }
 
-/* Return false on error. Non-existant state file is not considered an eror */
+static void
+remove_saved_entry(kw_tree_t *const entries, const la_address_t *const address)
+{
+        assert_tree(entries); assert_address(address);
 
-static bool
-restore_state(const bool create_backup_file)
+        la_saved_entry_t tmp;
+        init_address_key(&tmp.key, address);
+
+        kw_tree_node_t *const node = find_tree_node(entries, &tmp,
+                        cmp_saved_entries);
+        if (node)
+        {
+                (void) remove_tree_node(entries, node);
+                free(node->payload);
+        }
+}
+
+/*
+ * Triggers entries parents first (just like recursively_save_state() writes
+ * them) to not end up with a degenerated end queue.
+ */
+
+static void
+trigger_saved_entries(const kw_tree_node_t *const node)
 {
-        if (!saved_state)
-                return false;
+        if (node)
+        {
+                const la_saved_entry_t *const entry = node->payload;
+                trigger_manual_commands_for_rule(&entry->address, entry->rule,
+                                entry->end_time, entry->factor, NULL, true);
+                trigger_saved_entries(node->left);
+                trigger_saved_entries(node->right);
+        }
+}
 
-        la_log(LOG_INFO, "Restoring state from \"%s\".", saved_state);
+/*
+ * Return false on error. Non-existant state file is not considered an eror.
+ * generation will be set to the generation of the journal following the
+ * snapshot - or 0 if the state file doesn't name one.
+ */
 
+static bool
+read_snapshot(kw_tree_t *const entries, uint64_t *const generation)
+{
         FILE *const stream = fopen(saved_state, "r");
         if (!stream)
         {
@@ -162,6 +545,11 @@ restore_state(const bool create_backup_file)
                 la_address_t address; la_rule_t *rule;
                 time_t end_time; int factor;
 
+                /* Just a comment for parse_add_entry_message() */
+                if (*linebuffer == '#')
+                        (void) sscanf(linebuffer, "# journal %" SCNu64,
+                                        generation);
+
                 parse_result = parse_add_entry_message(linebuffer,
                                 &address, &rule, &end_time, &factor);
                 if (parse_result)
@@ -175,17 +563,12 @@ restore_state(const bool create_backup_file)
                 if (parse_result == -1)
                         break;
                 else if (parse_result > 0)
-                        trigger_manual_commands_for_rule(&address, rule,
-                                        end_time, factor, NULL, true);
+                        add_saved_entry(entries, &address, rule, end_time,
+                                        factor);
 
                 line_no++;
         }
 
-        // TODO: probably should be implemented differently instead of calling
-        // empty_queue_pointers() from here (hint: start queue only after
-        // restoring, don't create queue pointers when queue is not running)
-        empty_queue_pointers();
-
         free(linebuffer);
 
         /* Return false to make sure state file is not overwritten in case of
@@ -203,13 +586,191 @@ restore_state(const bool create_backup_file)
         if (fclose(stream) == EOF)
                 LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to close state file");
 
-        if (create_backup_file && !move_state_file_to_backup())
+        return true;
+}
+
+/*
+ * Applies the journal to the entries read from the state file. An incomplete
+ * entry at the end of the journal (e.g. after a crash while writing it) is
+ * ignored. So is a journal older than first_generation, i.e. one which is
+ * already contained in the state file. Journals without header (written by
+ * older versions) are always applied.
+ *
+ * Return false on error. Non-existant journal is not considered an eror.
+ */
+
+static bool
+replay_journal(kw_tree_t *const entries, const char *const journal,
+                const uint64_t first_generation)
+{
+        FILE *const stream = fopen(journal, "r");
+        if (!stream)
+        {
+                if (errno == ENOENT)
+                        return true;
+                else
+                        LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to open state "
+                                        "journal \"%s\"", journal);
+        }
+
+        char buffer[4096];
+        size_t len = fread(buffer, 1, JOURNAL_HEADER_LEN, stream);
+        int n_entries = 0;
+        bool eof = len < JOURNAL_HEADER_LEN;
+
+        uint64_t generation = 0;
+        if (len && buffer[0] == JOURNAL_MAGIC)
+        {
+                /* Incomplete header means an empty journal */
+                if (len == JOURNAL_HEADER_LEN)
+                        for (int i = 1; i < JOURNAL_HEADER_LEN; i++)
+                                generation = (generation << 8) |
+                                        (unsigned char) buffer[i];
+                len = 0;
+        }
+
+        if (generation > journal_generation)
+                journal_generation = generation;
+
+        if (generation && generation < first_generation)
+        {
+                if (fclose(stream) == EOF)
+                        LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to close "
+                                        "state journal");
+                LOG_RETURN_VERBOSE(true, LOG_INFO, "Skipped state journal "
+                                "\"%s\" - already contained in state file.",
+                                journal);
+        }
+
+        while (!eof)
+        {
+                const size_t n = fread(&buffer[len], 1, sizeof buffer - len,
+                                stream);
+                eof = n < sizeof buffer - len;
+                len += n;
+
+                size_t pos = 0;
+                for (;;)
+                {
+                        la_address_t address;
+                        char rule_name[BINMSG_MAX_RULE_LEN + 1];
+                        time_t end_time;
+                        int factor;
+
+                        const size_t entry_len = parse_binary_entry(
+                                        &buffer[pos], len - pos, &address,
+                                        rule_name, &end_time, &factor);
+                        if (!entry_len)
+                                break;
+
+                        if (buffer[pos] == CMD_DEL)
+                        {
+                                remove_saved_entry(entries, &address);
+                        }
+                        else
+                        {
+                                xpthread_mutex_lock(&config_mutex);
+
+                                        la_rule_t *const rule =
+                                                find_rule(rule_name);
+
+                                xpthread_mutex_unlock(&config_mutex);
+
+                                if (rule)
+                                        add_saved_entry(entries, &address,
+                                                        rule, end_time, factor);
+                                else
+                                        la_log(LOG_ERR, "Ignoring journal "
+                                                        "entry for %s - rule "
+                                                        "\"%s\" not active",
+                                                        address.text,
+                                                        rule_name);
+                        }
+
+                        n_entries++;
+                        pos += entry_len;
+                }
+
+                memmove(buffer, &buffer[pos], len - pos);
+                len -= pos;
+        }
+
+        if (ferror(stream))
+                LOG_RETURN_ERRNO(false, LOG_ERR,
+                                "Reading from state journal \"%s\" failed",
+                                journal);
+
+        if (fclose(stream) == EOF)
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to close state "
+                                "journal");
+
+        if (len)
+                la_log(LOG_WARNING, "Ignored incomplete entry at end of "
+                                "state journal \"%s\"", journal);
+
+        la_log_verbose(LOG_INFO, "Replayed %u entries from state journal "
+                        "\"%s\".", n_entries, journal);
+
+        return true;
+}
+
+/* Return false on error. Non-existant state file is not considered an eror */
+
+static bool
+restore_state(const bool create_backup_file)
+{
+        if (!saved_state)
+                return false;
+
+        la_log(LOG_INFO, "Restoring state from \"%s\".", saved_state);
+
+        kw_tree_t *const entries = create_tree();
+
+        uint64_t generation = 0;
+        const bool result = read_snapshot(entries, &generation) &&
+                replay_journal(entries, state_journal, generation) &&
+                replay_journal(entries, new_state_journal, generation);
+        if (generation > journal_generation)
+                journal_generation = generation;
+        if (result)
+                trigger_saved_entries(entries->root);
+
+        free_tree(entries, free_saved_entry, false);
+
+        // TODO: probably should be implemented differently instead of calling
+        // empty_queue_pointers() from here (hint: start queue only after
+        // restoring, don't create queue pointers when queue is not running)
+        empty_queue_pointers();
+
+        if (!result)
+                return false;
+
+        if (create_backup_file && (!move_file_to_backup(saved_state) ||
+                                !move_file_to_backup(state_journal) ||
+                                !move_file_to_backup(new_state_journal)))
                 LOG_RETURN_ERRNO(false, LOG_ERR, "Error creating backup file!");
 
         la_log(LOG_INFO, "Finished restoring state from \"%s\"", saved_state);
         return true;
 }
 
+/*
+ * Writes a fresh snapshot which also starts the journal. If the journal can't
+ * be created, save_state() will keep writing full snapshots.
+ */
+
+static void
+start_journal(void)
+{
+        la_debug_func(state_journal);
+
+        xpthread_mutex_lock(&save_state_mutex);
+
+                write_snapshot();
+
+        xpthread_mutex_unlock(&save_state_mutex);
+}
+
 void
 restore_state_and_start_save_state_thread(const bool create_backup_file)
 {
@@ -225,6 +786,8 @@ restore_state_and_start_save_state_thread(const bool create_backup_file)
                 die_hard(true, "Error reading state file");
         }
 
+        start_journal();
+
         start_save_state_thread();
 }
 
@@ -244,9 +807,10 @@ periodically_save_state(void *const ptr)
 
         pthread_cleanup_push(cleanup_state, NULL);
 
+        int elapsed = 0;
         for (;;)
         {
-                sleep(DEFAULT_STATE_SAVE_PERIOD);
+                sleep(JOURNAL_FLUSH_PERIOD);
 
                 if (shutdown_ongoing)
                 {
@@ -254,7 +818,14 @@ periodically_save_state(void *const ptr)
                         pthread_exit(NULL);
                 }
 
-                save_state(false);
+                flush_journal();
+
+                elapsed += JOURNAL_FLUSH_PERIOD;
+                if (elapsed >= DEFAULT_STATE_SAVE_PERIOD)
+                {
+                        elapsed = 0;
+                        save_state(false);
+                }
         }
         assert(false);
         /* Will never be reached, simply here to make potential pthread macros
@@ -274,11 +845,27 @@ start_save_state_thread(void)
         la_debug("state save thread started (%i)", thread);
 }
 
+static char *
+file_name_with_suffix(const char *const file_name, const char *const suffix)
+{
+        char *const result = xmalloc(strlen(file_name) + strlen(suffix) + 1);
+        sprintf(result, "%s%s", file_name, suffix);
+
+        return result;
+}
+
 void
 set_saved_state(const char *const pathname)
 {
         assert(pathname);
         saved_state = pathname;
+
+        free(state_journal);
+        free(new_saved_state);
+        free(new_state_journal);
+        state_journal = file_name_with_suffix(pathname, JOURNAL_SUFFIX);
+        new_saved_state = file_name_with_suffix(pathname, NEW_SUFFIX);
+        new_state_journal = file_name_with_suffix(state_journal, NEW_SUFFIX);
 }
 
 /* vim: set autowrite expandtab: */
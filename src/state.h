@@ -22,9 +22,40 @@
 #include <config.h>
 
 #include "ndebug.h"
+#include "commands.h"
 
 #define BAK_SUFFIX ".bak"
 
+/* Suffix of the files a snapshot and the journal following it are written to
+ * before they replace the previous ones */
+#define NEW_SUFFIX ".new"
+
+/*
+ * State journal (the state file name with JOURNAL_SUFFIX appended). Each
+ * command added to or removed from the end queue appends a binary entry (see
+ * binmsg.h) with CMD_ADD resp. CMD_DEL to the journal. save_state() writes a
+ * fresh snapshot of the end queue to the state file and starts a new journal.
+ * restore_state() replays the journal on top of the snapshot.
+ *
+ * Each journal starts with a header of JOURNAL_HEADER_LEN bytes: JOURNAL_MAGIC
+ * followed by the journal's generation (8 bytes, network byte order). Every
+ * new journal gets the next generation. The state file names the generation
+ * of the journal following it in a "# journal <generation>" line, so
+ * restore_state() can skip an older journal that's already contained in the
+ * state file.
+ */
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAGIC 'J'
+#define JOURNAL_HEADER_LEN 9
+
+/* Entries are buffered in memory and written to the journal by the save state
+ * thread every JOURNAL_FLUSH_PERIOD seconds - i.e. a crash loses at most the
+ * changes of the last JOURNAL_FLUSH_PERIOD seconds */
+#define JOURNAL_FLUSH_PERIOD 1
+
+/* Initial size of the journal buffer */
+#define JOURNAL_BUFFER_SIZE 4096
+
 void save_state(bool verbose);
 
 void restore_state_and_start_save_state_thread(const bool create_backup_file);
@@ -33,6 +64,10 @@ void start_save_state_thread(void);
 
 void set_saved_state(const char *pathname);
 
+void journal_add(const la_command_t *command);
+
+void journal_remove(const la_command_t *command);
+
 #endif /* __state_h */
 
 /* vim: set autowrite expandtab: */
@@ -37,10 +37,13 @@
 #include "endqueue.h"
 #include "logging.h"
 #include "misc.h"
+#include "patterns.h"
 #include "rules.h"
 #include "sources.h"
 #include "status.h"
 #include "metacommands.h"
+#include "aggregation.h"
+#include "dnsbl.h"
 
 int status_monitoring = 0;
 
@@ -130,6 +133,20 @@ human_readable_time_delta(const time_t delta, time_t *const value,
         *unit = 'd';
 }
 
+static void
+dump_source_group_diagnostics(FILE *const diag_file,
+                const la_source_group_t *const source_group)
+{
+        assert(diag_file), assert_source_group(source_group);
+        la_vdebug_func(source_group->node.nodename);
+
+        if (source_group->line_cache)
+                fprintf(diag_file, "%s, line cache size=%u, hits=%li\n",
+                                source_group->node.nodename,
+                                source_group->line_cache_mask + 1,
+                                source_group->line_cache_hits);
+}
+
 static void
 dump_rule_diagnostics(FILE *const diag_file, const la_rule_t *const rule)
 {
@@ -138,6 +155,13 @@ dump_rule_diagnostics(FILE *const diag_file, const la_rule_t *const rule)
 
         fprintf(diag_file, "%s, list length=%i\n", rule->node.nodename,
                         list_length(&rule->trigger_list));
+
+        /* Patterns in their current order, c.f. reorder_patterns() */
+        FOREACH(la_pattern_t, pattern, &rule->patterns)
+                fprintf(diag_file, "  pattern %i: executions=%li, hits=%li, "
+                                "average time=%lins\n", pattern->num,
+                                pattern->exec_count, pattern->match_count,
+                                get_average_exec_time(pattern));
 }
 
 /*
@@ -180,6 +204,9 @@ dump_rules(void)
                 assert(la_config); assert_list(&la_config->source_groups);
                 FOREACH(la_source_group_t, source_group, &la_config->source_groups)
                 {
+                        if (status_monitoring >= 2)
+                                dump_source_group_diagnostics(diag_file,
+                                                source_group);
                         FOREACH(la_rule_t, rule, &source_group->rules)
                         {
                                 dump_single_rule(rules_file, rule);
@@ -192,6 +219,9 @@ dump_rules(void)
                 /* Then print systemd rules - if any */
                 if (la_config->systemd_source_group)
                 {
+                        if (status_monitoring >= 2)
+                                dump_source_group_diagnostics(diag_file,
+                                                la_config->systemd_source_group);
                         FOREACH(la_rule_t, rule, &la_config->systemd_source_group->rules)
                         {
                                 dump_single_rule(rules_file, rule);
@@ -394,9 +424,14 @@ dump_queue_status(const bool force)
                 {
                         fputs("\n", diag_file);
                         fprintf(diag_file, "\nQueue length: %i (%i local), "
-                                        "meta_command: %i\n",
+                                        "meta_command: %i, aggregates: %i, "
+                                        "dnsbl cache: %i (%lu lookups "
+                                        "dropped)\n",
                                         num_elems, num_elems_local,
-                                        meta_list_length());
+                                        meta_list_length(),
+                                        aggregate_list_length(),
+                                        dnsbl_cache_length(),
+                                        dnsbl_queries_dropped());
 
                         fprintf(diag_file, "adr_tree depth=%i, end_time_list length=%i\n",
                                         max_depth, num_items);
@@ -0,0 +1,511 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bulk transfer of the end queue to a remote host (remote setting
+ * sync_stream).
+ *
+ * Syncing via datagrams has to be paced to not overrun the receiver's socket
+ * buffer. A TCP connection comes with flow control, so entries can be sent as
+ * fast as the receiver processes them. Entries are packed into large batch
+ * messages (frames) which are encrypted like datagrams, so a frame costs one
+ * encryption and at most one key derivation on the receiving end.
+ */
+
+#include <config.h>
+
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdbool.h>
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <stdnoreturn.h>
+
+#ifdef WITH_LIBSODIUM
+#include <sodium.h>
+#endif /* WITH_LIBSODIUM */
+
+#include "ndebug.h"
+#include "syncstream.h"
+#include "addresses.h"
+#include "binmsg.h"
+#include "configfile.h"
+#include "crypto.h"
+#include "logactiond.h"
+#include "logging.h"
+#include "messages.h"
+#include "misc.h"
+#include "remote.h"
+
+/* Length of the frame header */
+#define STREAM_HEADER_LEN 4
+
+static void
+set_stream_timeouts(const int fd)
+{
+        const struct timeval timeout = { .tv_sec = STREAM_TIMEOUT };
+
+        /* On Linux, SO_SNDTIMEO applies to connect() as well */
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                                sizeof timeout) == -1 ||
+                        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                                sizeof timeout) == -1)
+                la_log_errno(LOG_ERR, "Unable to set sync stream timeout");
+}
+
+static void
+close_stream_fd(void *const arg)
+{
+        if (close(*(int *) arg) == -1)
+                la_log_errno(LOG_ERR, "Unable to close sync stream");
+}
+
+/*
+ * Sends len bytes from buf, carrying on after partial writes.
+ */
+
+static bool
+send_all(const int fd, const char *const buf, const size_t len)
+{
+        assert(buf);
+
+        for (size_t sent = 0; sent < len;)
+        {
+                const ssize_t r = send(fd, buf + sent, len - sent,
+                                MSG_NOSIGNAL);
+                if (r == -1)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to send to "
+                                        "sync stream");
+                }
+                sent += r;
+        }
+
+        return true;
+}
+
+/*
+ * Encrypts the batch message of len bytes after the header of frame and
+ * sends the whole frame.
+ */
+
+static bool
+send_frame(const int fd, char *const frame, const size_t len)
+{
+        assert(frame); assert(len > 0); assert(len <= STREAM_FRAME_LEN);
+
+#ifdef WITH_LIBSODIUM
+        if (!encrypt_buffer(&frame[STREAM_HEADER_LEN], len))
+                return false;
+#endif /* WITH_LIBSODIUM */
+
+        const uint32_t enc_len = htonl(len + CRYPTO_OVERHEAD);
+        memcpy(frame, &enc_len, STREAM_HEADER_LEN);
+
+        return send_all(fd, frame, STREAM_HEADER_LEN + len + CRYPTO_OVERHEAD);
+}
+
+/*
+ * Packs messages into as few frames as possible and sends them. frame must be
+ * large enough for a full frame incl. header and encryption overhead.
+ */
+
+static bool
+send_frames(const int fd, char *const frame, char *const *const messages,
+                const int n)
+{
+        assert(frame); assert(messages);
+
+        char *const batch = &frame[STREAM_HEADER_LEN];
+        size_t len = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+                /* Binary entries go into binary frames */
+                const bool binary = *messages[i] == PROTOCOL_VERSION_BINARY;
+                assert(binary || *messages[i] == PROTOCOL_VERSION);
+                const char version = binary ? PROTOCOL_VERSION_BINARY :
+                        PROTOCOL_VERSION_BATCH;
+                const size_t entry_len = binary ? binary_entry_len(
+                                messages[i] + 1, MSG_LEN - 1) :
+                        strlen(messages[i] + 1) + 1;
+
+                if (len && (len + entry_len > STREAM_FRAME_LEN ||
+                                        *batch != version))
+                {
+                        if (!send_frame(fd, frame, len))
+                                return false;
+                        len = 0;
+                }
+
+                if (!len)
+                        batch[len++] = version;
+                memcpy(&batch[len], messages[i] + 1, entry_len);
+                len += entry_len;
+        }
+
+        return !len || send_frame(fd, frame, len);
+}
+
+/*
+ * Sends the n (unencrypted, version '0' add or remove or binary) messages over
+ * the connected stream fd. Returns false on error.
+ */
+
+bool
+send_entries_to_stream(const int fd, char *const *const messages, const int n)
+{
+        assert(messages);
+        la_debug("send_entries_to_stream(%u)", n);
+
+        char *const frame = xmalloc(STREAM_HEADER_LEN + STREAM_FRAME_LEN +
+                        CRYPTO_OVERHEAD);
+        bool result;
+
+        pthread_cleanup_push(free, frame);
+
+                result = send_frames(fd, frame, messages, n);
+
+        pthread_cleanup_pop(1);
+
+        return result;
+}
+
+/*
+ * Connects to the sync stream listener of address and sends the n messages.
+ * Returns false if the remote host can't be reached (e.g. because it doesn't
+ * support sync streams) or the connection breaks.
+ */
+
+bool
+stream_entries_to_host(const la_address_t *const address,
+                char *const *const messages, const int n)
+{
+        assert_address(address); assert(messages);
+        la_debug_func(address->text);
+
+        const int fd = socket(address->sa.ss_family, SOCK_STREAM, IPPROTO_TCP);
+        if (fd == -1)
+                LOG_RETURN_ERRNO(false, LOG_ERR, "Unable to create sync stream "
+                                "socket");
+        bool result = false;
+
+        pthread_cleanup_push(close_stream_fd, (void *) &fd);
+
+                set_stream_timeouts(fd);
+                bind_client_socket(fd, address->sa.ss_family);
+
+                if (connect(fd, (struct sockaddr *) &address->sa,
+                                        sizeof address->sa) == -1)
+                        la_log_errno(LOG_NOTICE, "Unable to open sync stream "
+                                        "to %s", address->text);
+                else
+                        result = send_entries_to_stream(fd, messages, n);
+
+        pthread_cleanup_pop(1);
+
+        return result;
+}
+
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
+/*
+ * Receives exactly len bytes into buf. Returns len on success, 0 if the
+ * connection has been closed before the first byte and -1 otherwise.
+ */
+
+static ssize_t
+receive_all(const int fd, char *const buf, const size_t len)
+{
+        assert(buf);
+
+        size_t received = 0;
+        while (received < len)
+        {
+                const ssize_t r = recv(fd, buf + received, len - received, 0);
+                if (r == -1)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        LOG_RETURN_ERRNO(-1, LOG_ERR, "Unable to receive from "
+                                        "sync stream");
+                }
+                else if (r == 0)
+                {
+                        if (!received)
+                                return 0;
+                        LOG_RETURN(-1, LOG_ERR, "Sync stream closed "
+                                        "prematurely");
+                }
+                received += r;
+        }
+
+        return received;
+}
+
+/*
+ * Receives frames until the remote host closes the connection and triggers
+ * the commands contained. buffer must hold a full frame incl. encryption
+ * overhead.
+ */
+
+static int
+receive_frames(const int fd, char *const buffer, la_address_t *const from_addr,
+                const char *const password)
+{
+        assert(buffer); assert_address(from_addr);
+
+        for (int frames = 0;; frames++)
+        {
+                char header[STREAM_HEADER_LEN];
+                const ssize_t r = receive_all(fd, header, STREAM_HEADER_LEN);
+                if (r == 0)
+                        return frames;
+                else if (r == -1)
+                        return -1;
+
+                uint32_t enc_len;
+                memcpy(&enc_len, header, STREAM_HEADER_LEN);
+                enc_len = ntohl(enc_len);
+                if (enc_len <= CRYPTO_OVERHEAD || enc_len > STREAM_FRAME_LEN +
+                                CRYPTO_OVERHEAD)
+                        LOG_RETURN(-1, LOG_ERR, "Illegal frame length %u in "
+                                        "sync stream from %s!", enc_len,
+                                        from_addr->text);
+
+                if (receive_all(fd, buffer, enc_len) != enc_len)
+                        return -1;
+
+                const size_t msg_len = enc_len - CRYPTO_OVERHEAD;
+#ifdef WITH_LIBSODIUM
+                if (!decrypt_buffer(buffer, msg_len + crypto_secretbox_MACBYTES,
+                                        password, from_addr))
+                        return -1;
+#endif /* WITH_LIBSODIUM */
+
+                buffer[msg_len] = '\0';
+
+                if (*buffer == PROTOCOL_VERSION_BATCH)
+                        parse_batch_message_trigger_commands(buffer, msg_len,
+                                        from_addr);
+                else if (*buffer == PROTOCOL_VERSION_BINARY)
+                        parse_binary_message_trigger_commands(buffer, msg_len,
+                                        from_addr);
+                else
+                        LOG_RETURN(-1, LOG_ERR, "Illegal frame in sync stream "
+                                        "from %s!", from_addr->text);
+        }
+}
+
+/*
+ * Receives entries sent by stream_entries_to_host() over the connected stream
+ * fd from from_addr. Returns the number of frames received or -1 on error.
+ */
+
+int
+receive_entries_from_stream(const int fd, la_address_t *const from_addr,
+                const char *const password)
+{
+        assert_address(from_addr);
+        la_debug_func(from_addr->text);
+
+        char *const buffer = xmalloc(STREAM_FRAME_LEN + CRYPTO_OVERHEAD + 1);
+        int result;
+
+        pthread_cleanup_push(free, buffer);
+
+                result = receive_frames(fd, buffer, from_addr, password);
+
+        pthread_cleanup_pop(1);
+
+        return result;
+}
+
+/* Connection accepted by sync_stream_loop(), cleaned up by
+ * cleanup_connection() */
+typedef struct la_stream_connection_s
+{
+        int fd;
+        la_address_t *from_addr;
+        char *secret;
+} la_stream_connection_t;
+
+static void
+cleanup_connection(void *const arg)
+{
+        la_stream_connection_t *const connection = arg;
+
+        close_stream_fd(&connection->fd);
+        free_address(connection->from_addr);
+        free(connection->secret);
+}
+
+static void
+handle_connection(const int fd,
+                const struct sockaddr_storage *const remote_client)
+{
+        assert(remote_client); assert(la_config);
+
+        la_address_t *from_addr = NULL;
+        char *secret = NULL;
+
+        xpthread_mutex_lock(&config_mutex);
+
+                /* Copy as the receive_from list and the secret might be
+                 * replaced by a reload while the stream is still being
+                 * received */
+                la_address_t *const address = address_in_prefix_tree_sa(
+                                &la_config->remote_receive_from_tree,
+                                (struct sockaddr *) remote_client);
+                if (address)
+                {
+                        from_addr = dup_address(address);
+                        secret = xstrdup(la_config->remote_secret);
+                }
+
+        xpthread_mutex_unlock(&config_mutex);
+
+        const la_stream_connection_t connection = { fd, from_addr, secret };
+
+        pthread_cleanup_push(cleanup_connection, (void *) &connection);
+
+                if (!from_addr)
+                {
+                        char from[INET6_ADDRSTRLEN + 1];
+                        if (!getnameinfo((struct sockaddr *) remote_client,
+                                                sizeof *remote_client, from,
+                                                INET6_ADDRSTRLEN + 1, NULL, 0,
+                                                NI_NUMERICHOST))
+                                la_log(LOG_ERR, "Refused sync stream from %s - "
+                                                "not on receive_from list!",
+                                                from);
+                }
+                else
+                {
+                        set_stream_timeouts(fd);
+                        const int frames = receive_entries_from_stream(fd,
+                                        from_addr, secret);
+                        if (frames >= 0)
+                                la_log(LOG_INFO, "Received %u frames via sync "
+                                                "stream from %s.", frames,
+                                                from_addr->text);
+                }
+
+        pthread_cleanup_pop(1);
+}
+
+static void
+cleanup_sync_stream(void *const arg)
+{
+        la_debug_func(NULL);
+
+        const int server_fd = *(int *) arg;
+        if (server_fd != -1 && close(server_fd) == -1)
+                la_log_errno(LOG_ERR, "Unable to close sync stream socket");
+
+        wait_final_barrier();
+        la_debug("Sync stream thread exiting");
+}
+
+/*
+ * Accepts sync streams on the address of ai and handles them one after the
+ * other.
+ */
+
+noreturn static void *
+sync_stream_loop(void *const ptr)
+{
+        la_debug_func(NULL);
+
+        const struct addrinfo *const ai = (struct addrinfo *) ptr;
+        const int server_fd = socket(ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+
+        pthread_cleanup_push(cleanup_sync_stream, (void *) &server_fd);
+
+        if (server_fd == -1)
+                die_hard(true, "Unable to create sync stream socket");
+
+        /* See remote_loop() */
+        setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int) { 1 }, sizeof (int));
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int) { 1 }, sizeof (int));
+
+        if (bind(server_fd, (struct sockaddr *) ai->ai_addr, ai->ai_addrlen) == -1)
+                die_hard(true, "Unable to bind to sync stream socket");
+
+        if (listen(server_fd, STREAM_BACKLOG) == -1)
+                die_hard(true, "Unable to listen on sync stream socket");
+
+        for (;;)
+        {
+                struct sockaddr_storage remote_client;
+                socklen_t remote_client_len = sizeof remote_client;
+                const int fd = accept(server_fd,
+                                (struct sockaddr *) &remote_client,
+                                &remote_client_len);
+
+                if (shutdown_ongoing)
+                {
+                        la_debug("Shutting down sync stream thread.");
+                        if (fd != -1)
+                                close(fd);
+                        pthread_exit(NULL);
+                }
+
+                if (fd == -1)
+                {
+                        if (errno != EINTR)
+                                la_log_errno(LOG_ERR, "Unable to accept sync "
+                                                "stream");
+                        continue;
+                }
+
+                handle_connection(fd, &remote_client);
+        }
+
+        assert(false);
+
+        pthread_cleanup_pop(1);
+}
+
+void
+start_sync_stream_thread(const struct addrinfo *const ai)
+{
+        assert(ai);
+        la_debug_func(NULL);
+
+        pthread_t thread;
+        xpthread_create(&thread, NULL, sync_stream_loop, (void *) ai,
+                        "syncstream");
+        thread_started(thread);
+}
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+
+/* vim: set autowrite expandtab: */
@@ -0,0 +1,62 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __syncstream_h
+#define __syncstream_h
+
+#include <stdbool.h>
+#include <netdb.h>
+
+#include "ndebug.h"
+#include "addresses.h"
+
+/*
+ * Sync stream (remote setting sync_stream): a TCP connection to the port the
+ * remote host receives messages on, carrying a sequence of frames
+ *      <length><encrypted batch message>
+ *
+ * length (4 bytes, network byte order) is the length of the encrypted batch
+ * message incl. CRYPTO_OVERHEAD. The batch message is a protocol version '1'
+ * or (for binary entries) '4' message of up to STREAM_FRAME_LEN bytes.
+ */
+
+/* Maximum length of unencrypted batch message in a frame */
+#define STREAM_FRAME_LEN 16384
+
+/* Seconds to wait for connect(), send() or recv() to make progress. Must
+ * leave the receiver enough time to trigger the commands of a full frame. */
+#define STREAM_TIMEOUT 60
+
+/* Maximum number of pending connections to the sync stream listener */
+#define STREAM_BACKLOG 4
+
+bool send_entries_to_stream(int fd, char *const *messages, int n);
+
+bool stream_entries_to_host(const la_address_t *address,
+                char *const *messages, int n);
+
+#if !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS)
+int receive_entries_from_stream(int fd, la_address_t *from_addr,
+                const char *password);
+
+void start_sync_stream_thread(const struct addrinfo *ai);
+#endif /* !defined(NOCOMMANDS) && !defined(ONLYCLEANUPCOMMANDS) */
+
+#endif /* __syncstream_h */
+
+/* vim: set autowrite expandtab: */
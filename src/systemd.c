@@ -48,8 +48,20 @@
 #define UNIT_LEN 14
 
 
+/* A single journal entry, copied out of the journal so that a whole batch
+ * of entries can be handed to handle_log_line() with only one lock of
+ * config_mutex. */
+typedef struct la_journal_entry_s
+{
+        char *unit;
+        size_t unit_size;
+        char *message;
+        size_t message_size;
+} la_journal_entry_t;
+
 static sd_journal *journal = NULL;
-static char *unit_buffer = NULL;
+static la_journal_entry_t *batch = NULL;
+static int batch_allocated = 0;
 
 static void
 die_systemd(const int systemd_errno, const char *const fmt, ...)
@@ -77,7 +89,12 @@ cleanup_watching_systemd(void *const arg)
 {
         la_debug_func(NULL);
 
-        free(unit_buffer);
+        for (int i = 0; i < batch_allocated; i++)
+        {
+                free(batch[i].unit);
+                free(batch[i].message);
+        }
+        free(batch);
 
         if (journal)
                 sd_journal_close(journal);
@@ -86,26 +103,127 @@ cleanup_watching_systemd(void *const arg)
         la_debug("systemd thread exiting");
 }
 
+/*
+ * Make sure batch has room for at least size entries. New entries start
+ * with empty buffers which are grown on demand by copy_journal_field().
+ */
+
+static void
+ensure_batch_size(const int size)
+{
+        if (size <= batch_allocated)
+                return;
+
+        batch = xrealloc(batch, size * sizeof (la_journal_entry_t));
+        memset(&batch[batch_allocated], 0,
+                        (size - batch_allocated) * sizeof (la_journal_entry_t));
+        batch_allocated = size;
+}
+
+/*
+ * Copies the value of field from the current journal entry into buffer
+ * (skipping the "FIELD=" prefix of length field_len) and '\0'-terminates it.
+ * Buffer will be enlarged if necessary.
+ */
+
+static void
+copy_journal_field(const char *const field, const size_t field_len,
+                char **const buffer, size_t *const buffer_size)
+{
+        const void *data;
+        size_t size;
+
+        const int r = sd_journal_get_data(journal, field, &data, &size);
+        if (r < 0)
+                die_systemd(r, "sd_journal_get_data() failed");
+
+        if (size + 1 > *buffer_size)
+        {
+                *buffer = xrealloc(*buffer, size + 1);
+                *buffer_size = size + 1;
+        }
+        memcpy(*buffer, (char *) data + field_len, size - field_len);
+        (*buffer)[size - field_len] = '\0';
+}
+
+/*
+ * Milliseconds passed since start
+ */
+
+static long
+elapsed_msecs(const struct timespec *const start)
+{
+        struct timespec now;
+
+        if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+                die_hard(true, "Can't get current time");
+
+        return (now.tv_sec - start->tv_sec) * 1000 +
+                (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Hands all n_entries collected journal entries to handle_log_line() while
+ * holding config_mutex only once. Also picks up the (possibly reloaded)
+ * batch settings for the next batch.
+ */
+
+static void
+handle_batch(const int n_entries, int *const batch_size,
+                int *const batch_latency)
+{
+        la_vdebug_func(NULL);
+        assert(n_entries > 0); assert(n_entries <= batch_allocated);
+
+        xpthread_mutex_lock(&config_mutex);
+                const clock_t c = clock();
+                for (int i = 0; i < n_entries; i++)
+                        handle_log_line(SYSTEMD_SOURCE, batch[i].message,
+                                        batch[i].unit);
+                la_config->total_clocks += clock() - c;
+                la_config->invocation_count += n_entries;
+
+                *batch_size = la_config->systemd_batch_size;
+                *batch_latency = la_config->systemd_batch_latency;
+        xpthread_mutex_unlock(&config_mutex);
+
+        ensure_batch_size(*batch_size);
+}
+
 noreturn static void *
 watch_forever_systemd(void *const ptr)
 {
-        static int unit_buffer_length = DEFAULT_LINEBUFFER_SIZE;
-        unit_buffer = xmalloc(unit_buffer_length);
-
         la_debug_func(NULL);
         assert(journal); assert(la_config->systemd_source_group);
 
+        xpthread_mutex_lock(&config_mutex);
+                int batch_size = la_config->systemd_batch_size;
+                int batch_latency = la_config->systemd_batch_latency;
+        xpthread_mutex_unlock(&config_mutex);
+        ensure_batch_size(batch_size);
+
+        int n_entries = 0;
+        struct timespec batch_start;
+
         pthread_cleanup_push(cleanup_watching_systemd, NULL);
 
         for (;;)
         {
-                const void *data;
-                size_t size;
                 int r; /* result from any of the sd_*() calls */
 
                 r = sd_journal_next(journal);
                 if (r == 0)
                 {
+                        /* Journal drained - don't let collected entries wait
+                         * for new ones */
+                        if (n_entries > 0)
+                        {
+                                handle_batch(n_entries, &batch_size,
+                                                &batch_latency);
+                                n_entries = 0;
+                                continue;
+                        }
+
                         /* End of journal, wait for changes */
 
                         do
@@ -138,36 +256,30 @@ watch_forever_systemd(void *const ptr)
                 /* When we reach this, no error occured, shutdown has not been
                  * initiated and there's something to read in the journal */
 
-                /* First get the name of the systemd unit */
-                r = sd_journal_get_data(journal, UNIT, &data, &size);
-                if (r < 0)
-                        die_systemd(r, "sd_journal_get_data() failed");
+                if (!watching_active)
+                        continue;
 
-                if ((int) size+1 > unit_buffer_length)
-                {
-                        unit_buffer = xrealloc(unit_buffer, size+1);
-                        unit_buffer_length = size+1;
-                }
-                memcpy(unit_buffer, (char *)data+UNIT_LEN, size-UNIT_LEN);
-                unit_buffer[size-UNIT_LEN] = '\0';
+                if (n_entries == 0 && clock_gettime(CLOCK_MONOTONIC,
+                                        &batch_start) == -1)
+                        die_hard(true, "Can't get current time");
+
+                la_journal_entry_t *const entry = &batch[n_entries++];
+
+                /* First get the name of the systemd unit */
+                copy_journal_field(UNIT, UNIT_LEN, &entry->unit,
+                                &entry->unit_size);
 
                 /* Second get rest of the log line */
-                r = sd_journal_get_data(journal, MESSAGE, &data, &size);
-                if (r < 0)
-                        die_systemd(r, "sd_journal_get_data() failed");
+                copy_journal_field(MESSAGE, MESSAGE_LEN, &entry->message,
+                                &entry->message_size);
 
-                la_vdebug("Unit: %s, line: %s", unit_buffer, (char *)data+MESSAGE_LEN);
+                la_vdebug("Unit: %s, line: %s", entry->unit, entry->message);
 
-                if (watching_active)
+                if (n_entries >= batch_size ||
+                                elapsed_msecs(&batch_start) >= batch_latency)
                 {
-                        xpthread_mutex_lock(&config_mutex);
-                                const clock_t c = clock();
-                                handle_log_line(SYSTEMD_SOURCE,
-                                                (char *) data+MESSAGE_LEN,
-                                                unit_buffer);
-                                la_config->total_clocks += clock() - c;
-                                la_config->invocation_count++;
-                        xpthread_mutex_unlock(&config_mutex);
+                        handle_batch(n_entries, &batch_size, &batch_latency);
+                        n_entries = 0;
                 }
         }
 
@@ -241,6 +241,92 @@ START_TEST (match)
 }
 END_TEST
 
+START_TEST (compare_keys)
+{
+        la_address_t a, b;
+        la_address_key_t ka, kb;
+        char text[INET6_ADDRSTRLEN];
+
+        init_address(&a, "10.0.0.1");
+        init_address(&b, "10.0.0.1");
+        init_address_key(&ka, &a);
+        init_address_key(&kb, &b);
+        ck_assert_int_eq(adrkeycmp(&ka, &kb), 0);
+        ck_assert_str_eq(address_key_text(&ka, text), "10.0.0.1");
+
+        init_address(&b, "200.0.0.1");
+        init_address_key(&kb, &b);
+        ck_assert_int_lt(adrkeycmp(&ka, &kb), 0);
+        ck_assert_int_gt(adrkeycmp(&kb, &ka), 0);
+
+        init_address(&a, "2a03:4000:23:8c::1");
+        init_address(&b, "2a03:4000:23:8c::2");
+        init_address_key(&ka, &a);
+        init_address_key(&kb, &b);
+        ck_assert_int_lt(adrkeycmp(&ka, &kb), 0);
+        ck_assert_str_eq(address_key_text(&kb, text), "2a03:4000:23:8c::2");
+
+        init_address(&b, "ffff::1");
+        init_address_key(&kb, &b);
+        ck_assert_int_lt(adrkeycmp(&ka, &kb), 0);
+
+        /* Different address families are never equal */
+        init_address(&b, "10.0.0.1");
+        init_address_key(&kb, &b);
+        ck_assert_int_ne(adrkeycmp(&ka, &kb), 0);
+        ck_assert_int_eq(adrkeycmp(&ka, &kb), -adrkeycmp(&kb, &ka));
+}
+END_TEST
+
+START_TEST (prefix_tree)
+{
+        kw_list_t list;
+        init_list(&list);
+        add_tail(&list, (kw_node_t *) create_address("10.0.0.0/8"));
+        add_tail(&list, (kw_node_t *) create_address("10.1.0.0/16"));
+        add_tail(&list, (kw_node_t *) create_address("10.1.2.3"));
+        add_tail(&list, (kw_node_t *) create_address("192.168.0.0/23"));
+        add_tail(&list, (kw_node_t *) create_address("2a03:4000:23:8c::/64"));
+        add_tail(&list, (kw_node_t *) create_address("2a03:4000::/32"));
+
+        la_prefix_tree_t tree;
+        init_prefix_tree(&tree);
+        build_prefix_tree(&tree, &list);
+
+        la_address_t *r;
+        r = address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("10.2.3.4")->sa);
+        ck_assert(r);
+        ck_assert_str_eq(r->text, "10.0.0.0/8");
+        r = address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("10.1.7.7")->sa);
+        ck_assert(r);
+        ck_assert_str_eq(r->text, "10.1.0.0/16");
+        r = address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("10.1.2.3")->sa);
+        ck_assert(r);
+        ck_assert_str_eq(r->text, "10.1.2.3");
+        r = address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("192.168.1.255")->sa);
+        ck_assert(r);
+        ck_assert_str_eq(r->text, "192.168.0.0/23");
+        ck_assert(!address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("192.168.2.1")->sa));
+        ck_assert(!address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("11.0.0.1")->sa));
+
+        r = address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("2a03:4000:23:8c::1")->sa);
+        ck_assert(r);
+        ck_assert_str_eq(r->text, "2a03:4000:23:8c::/64");
+        r = address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("2a03:4000:23:8d::1")->sa);
+        ck_assert(r);
+        ck_assert_str_eq(r->text, "2a03:4000::/32");
+        ck_assert(!address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("2a03:4001::1")->sa));
+
+        /* Result must be the same as a linear scan for every address */
+        FOREACH(la_address_t, a, &list)
+                ck_assert(address_in_prefix_tree(&tree, a));
+
+        empty_prefix_tree(&tree);
+        ck_assert(!address_in_prefix_tree_sa(&tree, (struct sockaddr *) &create_address("10.1.2.3")->sa));
+        empty_address_list(&list);
+}
+END_TEST
+
 Suite *addresses_suite(void)
 {
 	Suite *s = suite_create("Addresses");
@@ -255,7 +341,9 @@ Suite *addresses_suite(void)
         TCase *tc_compare = tcase_create("Compare");
         tcase_add_test(tc_compare, compare);
         tcase_add_test(tc_compare, compare2);
+        tcase_add_test(tc_compare, compare_keys);
         tcase_add_test(tc_compare, match);
+        tcase_add_test(tc_compare, prefix_tree);
         suite_add_tcase(s, tc_compare);
 
         return s;
@@ -0,0 +1,209 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <stdbool.h>
+
+#include <check.h>
+
+#include <../src/binmsg.c>
+#include <../src/addresses.h>
+#include <../src/logactiond.h>
+#include <../src/logging.h>
+#include <../src/misc.h>
+
+/* Mocks */
+
+la_runtype_t run_type = LA_DAEMON_FOREGROUND;
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+atomic_bool shutdown_ongoing = false;
+#else /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+bool shutdown_ongoing = false;
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+const char *const pidfile_name = PIDFILE;
+
+static bool shutdown_good = false;
+static char shutdown_msg[] = "Shutdown message not set";
+
+void
+trigger_shutdown(int status, int saved_errno)
+{
+        la_log(LOG_INFO, "reached shutdown");
+        if (!shutdown_good)
+                ck_abort_msg(shutdown_msg);
+}
+
+/* Tests */
+
+START_TEST (check_roundtrip)
+{
+        const char *const hosts[] = { "1.2.3.4", "10.0.0.0/8",
+                "2001:db8::1", "2001:db8::/32" };
+
+        for (unsigned int i = 0; i < sizeof hosts / sizeof *hosts; i++)
+        {
+                la_address_t a1, a2;
+                ck_assert(init_address(&a1, hosts[i]));
+
+                char buffer[MSG_LEN];
+                ck_assert(init_binary_add_message(buffer, &a1, "sshd",
+                                        1600000000, 16));
+                ck_assert_int_eq(*buffer, PROTOCOL_VERSION_BINARY);
+                ck_assert_int_eq(binary_entry_len(buffer + 1, MSG_LEN - 1),
+                                BINMSG_ENTRY_LEN + 4);
+
+                char rule[BINMSG_MAX_RULE_LEN + 1];
+                time_t end_time;
+                int factor;
+                ck_assert_int_eq(parse_binary_entry(buffer + 1, MSG_LEN - 1,
+                                        &a2, rule, &end_time, &factor),
+                                BINMSG_ENTRY_LEN + 4);
+                ck_assert(!adrcmp(&a1, &a2));
+                ck_assert_int_eq(a1.prefix, a2.prefix);
+                ck_assert_str_eq(a1.text, a2.text);
+                ck_assert_str_eq(rule, "sshd");
+                ck_assert_int_eq(end_time, 1600000000);
+                ck_assert_int_eq(factor, 16);
+        }
+}
+END_TEST
+
+START_TEST (check_rule_length)
+{
+        la_address_t address;
+        ck_assert(init_address(&address, "1.2.3.4"));
+
+        char rule[BINMSG_MAX_RULE_LEN + 2];
+        memset(rule, 'r', BINMSG_MAX_RULE_LEN + 1);
+        rule[BINMSG_MAX_RULE_LEN + 1] = '\0';
+
+        char buffer[MSG_LEN];
+        ck_assert(!init_binary_add_message(buffer, &address, rule, 0, 0));
+        rule[BINMSG_MAX_RULE_LEN] = '\0';
+        ck_assert(init_binary_add_message(buffer, &address, rule, 0, 0));
+        ck_assert_int_eq(binary_entry_len(buffer + 1, MSG_LEN - 1),
+                        BINMSG_ENTRY_LEN + BINMSG_MAX_RULE_LEN);
+}
+END_TEST
+
+START_TEST (check_journal_entry)
+{
+        la_address_t a1, a2;
+        ck_assert(init_address(&a1, "2001:db8::2"));
+
+        char entry[BINMSG_ENTRY_LEN + BINMSG_MAX_RULE_LEN];
+        ck_assert_int_eq(init_binary_entry(entry, CMD_DEL, &a1, "dovecot",
+                                1600000000, 0), BINMSG_ENTRY_LEN + 7);
+        ck_assert_int_eq(*entry, CMD_DEL);
+
+        /* Two entries back to back */
+        ck_assert_int_eq(init_binary_entry(&entry[BINMSG_ENTRY_LEN + 7],
+                                CMD_ADD, &a1, "sshd", 0, 2),
+                        BINMSG_ENTRY_LEN + 4);
+
+        char rule[BINMSG_MAX_RULE_LEN + 1];
+        time_t end_time;
+        int factor;
+        ck_assert_int_eq(parse_binary_entry(entry, sizeof entry, &a2, rule,
+                                &end_time, &factor), BINMSG_ENTRY_LEN + 7);
+        ck_assert(!adrcmp(&a1, &a2));
+        ck_assert_str_eq(rule, "dovecot");
+        ck_assert_int_eq(end_time, 1600000000);
+
+        ck_assert_int_eq(parse_binary_entry(&entry[BINMSG_ENTRY_LEN + 7],
+                                BINMSG_ENTRY_LEN + 4, &a2, rule, &end_time,
+                                &factor), BINMSG_ENTRY_LEN + 4);
+        ck_assert_int_eq(entry[BINMSG_ENTRY_LEN + 7], CMD_ADD);
+        ck_assert_str_eq(rule, "sshd");
+        ck_assert_int_eq(factor, 2);
+}
+END_TEST
+
+START_TEST (check_malformed)
+{
+        la_address_t address;
+        ck_assert(init_address(&address, "1.2.3.4"));
+
+        char buffer[MSG_LEN];
+        ck_assert(init_binary_add_message(buffer, &address, "sshd", 0, 0));
+
+        char rule[BINMSG_MAX_RULE_LEN + 1];
+        time_t end_time;
+        int factor;
+
+        /* Truncated */
+        ck_assert_int_eq(parse_binary_entry(buffer + 1, BINMSG_ENTRY_LEN + 3,
+                                &address, rule, &end_time, &factor), 0);
+
+        /* Unknown command */
+        buffer[1] = CMD_FLUSH;
+        ck_assert_int_eq(parse_binary_entry(buffer + 1, MSG_LEN - 1,
+                                &address, rule, &end_time, &factor), 0);
+        buffer[1] = CMD_ADD;
+
+        /* Unknown family */
+        buffer[2] = 5;
+        ck_assert_int_eq(parse_binary_entry(buffer + 1, MSG_LEN - 1,
+                                &address, rule, &end_time, &factor), 0);
+        buffer[2] = BINMSG_INET;
+
+        /* Illegal prefix */
+        buffer[3] = 33;
+        ck_assert_int_eq(parse_binary_entry(buffer + 1, MSG_LEN - 1,
+                                &address, rule, &end_time, &factor), 0);
+        buffer[3] = 32;
+
+        /* '\0' in rule name */
+        buffer[1 + BINMSG_ENTRY_LEN + 1] = '\0';
+        ck_assert_int_eq(parse_binary_entry(buffer + 1, MSG_LEN - 1,
+                                &address, rule, &end_time, &factor), 0);
+}
+END_TEST
+
+Suite *binmsg_suite(void)
+{
+	Suite *s = suite_create("Binmsg");
+
+        /* Core test case */
+        TCase *tc_core = tcase_create("Core");
+        tcase_add_test(tc_core, check_roundtrip);
+        tcase_add_test(tc_core, check_rule_length);
+        tcase_add_test(tc_core, check_journal_entry);
+        tcase_add_test(tc_core, check_malformed);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int number_failed = 0;
+        Suite *s = binmsg_suite();
+        SRunner *sr = srunner_create(s);
+
+        srunner_run_all(sr, CK_NORMAL);
+        number_failed = srunner_ntests_failed(sr);
+        srunner_free(sr);
+        return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set autowrite expandtab: */
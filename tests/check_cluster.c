@@ -0,0 +1,219 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <stdbool.h>
+
+#include <check.h>
+
+#include <../src/cluster.c>
+#include <../src/addresses.h>
+#include <../src/logactiond.h>
+#include <../src/logging.h>
+#include <../src/misc.h>
+
+/* Mocks */
+
+la_runtype_t run_type = LA_DAEMON_FOREGROUND;
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+atomic_bool shutdown_ongoing = false;
+#else /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+bool shutdown_ongoing = false;
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+const char *const pidfile_name = PIDFILE;
+
+static bool shutdown_good = false;
+static char shutdown_msg[] = "Shutdown message not set";
+
+void
+trigger_shutdown(int status, int saved_errno)
+{
+        la_log(LOG_INFO, "reached shutdown");
+        if (!shutdown_good)
+                ck_abort_msg(shutdown_msg);
+}
+
+static la_address_t *
+create_member(kw_list_t *const list, const char *const host)
+{
+        la_address_t *const address = create_address(host);
+        ck_assert(address);
+        if (list)
+                add_tail(list, (kw_node_t *) address);
+        return address;
+}
+
+static void
+see_all(const kw_list_t *const list)
+{
+        FOREACH(la_address_t, peer, list)
+                cluster_member_seen((struct sockaddr *) &peer->sa);
+}
+
+/* Tests */
+
+START_TEST (check_not_clustered)
+{
+        la_address_t *const a = create_address("1.2.3.4");
+
+        set_cluster_members(NULL, NULL);
+        ck_assert(owns_address(a));
+        ck_assert(!cluster_peers_alive());
+
+        free_address(a);
+}
+END_TEST
+
+START_TEST (check_single_owner)
+{
+        const char *const hosts[] = { "10.0.0.1", "10.0.0.2", "10.0.0.3" };
+        const int n_hosts = sizeof hosts / sizeof *hosts;
+        int owned[3] = { 0 };
+
+        for (int i = 0; i < 300; i++)
+        {
+                char host[20];
+                snprintf(host, 20, "192.168.%u.%u", i / 256, i % 256);
+                la_address_t *const a = create_address(host);
+                int owners = 0;
+
+                /* Look at address from the point of view of each member */
+                for (int self = 0; self < n_hosts; self++)
+                {
+                        kw_list_t *const peers = create_list();
+                        la_address_t *const own = create_member(NULL,
+                                        hosts[self]);
+                        for (int j = 0; j < n_hosts; j++)
+                        {
+                                if (j != self)
+                                        create_member(peers, hosts[j]);
+                        }
+                        set_cluster_members(own, peers);
+                        see_all(peers);
+                        ck_assert(cluster_peers_alive());
+
+                        if (owns_address(a))
+                        {
+                                owners++;
+                                owned[self]++;
+                        }
+
+                        /* Forget about members for next round */
+                        set_cluster_members(own, NULL);
+                        free_address(own);
+                        empty_address_list(peers);
+                        free(peers);
+                }
+
+                ck_assert_int_eq(owners, 1);
+                free_address(a);
+        }
+
+        /* Roughly even distribution */
+        for (int self = 0; self < n_hosts; self++)
+                ck_assert(owned[self] > 50);
+}
+END_TEST
+
+START_TEST (check_quiet_member)
+{
+        kw_list_t *const peers = create_list();
+        la_address_t *const own = create_member(NULL, "10.0.0.1");
+        create_member(peers, "10.0.0.2");
+        set_cluster_members(own, peers);
+
+        /* Not heard from other member yet, but assumed to be alive */
+        ck_assert(cluster_peers_alive());
+        int owned = 0;
+        for (int i = 0; i < 100; i++)
+        {
+                char host[20];
+                snprintf(host, 20, "172.16.0.%u", i);
+                la_address_t *const a = create_address(host);
+                if (owns_address(a))
+                        owned++;
+                free_address(a);
+        }
+        ck_assert(owned > 0 && owned < 100);
+
+        /* Never heard from other member */
+        members[0].last_seen -= CLUSTER_TIMEOUT;
+        ck_assert(!cluster_peers_alive());
+        for (int i = 0; i < 100; i++)
+        {
+                char host[20];
+                snprintf(host, 20, "172.16.0.%u", i);
+                la_address_t *const a = create_address(host);
+                ck_assert(owns_address(a));
+                free_address(a);
+        }
+
+        /* Heard from other member, then it goes quiet again. State
+         * survives update of members */
+        see_all(peers);
+        set_cluster_members(own, peers);
+        ck_assert(cluster_peers_alive());
+        members[0].last_seen -= CLUSTER_TIMEOUT;
+        ck_assert(!cluster_peers_alive());
+        la_address_t *const a = create_address("172.16.0.1");
+        ck_assert(owns_address(a));
+
+        /* Messages from others don't count */
+        la_address_t *const other = create_address("10.0.0.9");
+        cluster_member_seen((struct sockaddr *) &other->sa);
+        ck_assert(!cluster_peers_alive());
+
+        free_address(a);
+        free_address(other);
+        free_address(own);
+        empty_address_list(peers);
+        free(peers);
+}
+END_TEST
+
+Suite *cluster_suite(void)
+{
+	Suite *s = suite_create("Cluster");
+
+        /* Core test case */
+        TCase *tc_core = tcase_create("Core");
+        tcase_add_test(tc_core, check_not_clustered);
+        tcase_add_test(tc_core, check_single_owner);
+        tcase_add_test(tc_core, check_quiet_member);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int number_failed = 0;
+        Suite *s = cluster_suite();
+        SRunner *sr = srunner_create(s);
+
+        srunner_run_all(sr, CK_NORMAL);
+        number_failed = srunner_ntests_failed(sr);
+        srunner_free(sr);
+        return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set autowrite expandtab: */
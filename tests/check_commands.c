@@ -107,6 +107,18 @@ send_add_entry_message(const la_command_t *const command, const la_address_t *co
 {
 }
 
+bool
+owns_address(const la_address_t *const address)
+{
+        return true;
+}
+
+bool
+cluster_peers_alive(void)
+{
+        return false;
+}
+
 /* Compare */
 
 START_TEST (template)
@@ -75,18 +75,95 @@ START_TEST (check_encrypt_decrypt)
         la_address_t *a = create_address("5.5.5.5");
         ck_assert(a);
 
+        ck_assert(!receive_key_cached(buffer, ENC_MSG_LEN, PASSWORD));
         ck_assert(decrypt_message(buffer, PASSWORD, a));
+        ck_assert(receive_key_cached(buffer, ENC_MSG_LEN, PASSWORD));
 
-        ck_assert(same_salt_as_before((unsigned char *) buffer, a));
-        ck_assert(!memcmp(&buffer[SALT_IDX], a->salt, crypto_pwhash_SALTBYTES));
-        ck_assert(!memcmp(send_salt, a->salt, crypto_pwhash_SALTBYTES));
-        ck_assert(!memcmp(send_key, a->key, crypto_secretbox_KEYBYTES));
+        unsigned char key[crypto_secretbox_KEYBYTES];
+        ck_assert(get_cached_key(send_salt, PASSWORD, key));
+        ck_assert(!memcmp(send_key, key, crypto_secretbox_KEYBYTES));
 
         ck_assert_str_eq(&buffer[MSG_IDX], PAYLOAD);
         
 }
 END_TEST
 
+START_TEST (check_encrypt_decrypt_buffer)
+{
+        ck_assert(generate_send_key_and_salt(PASSWORD));
+
+        /* Variable length, as used for batch messages */
+        char *const buffer = alloca(MAX_DATAGRAM_LEN);
+        const int msg_len = snprintf(&buffer[MSG_IDX], BATCH_MSG_LEN, "1-1.2.3.4") + 1;
+
+        ck_assert(encrypt_buffer(buffer, msg_len));
+
+        la_address_t *a = create_address("5.5.5.6");
+        ck_assert(a);
+
+        ck_assert(!decrypt_buffer(buffer, msg_len, PASSWORD, a));
+        ck_assert(decrypt_buffer(buffer, msg_len + crypto_secretbox_MACBYTES,
+                                PASSWORD, a));
+        ck_assert_str_eq(&buffer[MSG_IDX], "1-1.2.3.4");
+}
+END_TEST
+
+START_TEST (check_key_cache)
+{
+        unsigned char salt[crypto_pwhash_SALTBYTES];
+        unsigned char key[crypto_secretbox_KEYBYTES];
+
+        /* One more salt than fits into the cache */
+        for (int i = 0; i <= KEY_CACHE_SIZE; i++)
+        {
+                memset(salt, i, crypto_pwhash_SALTBYTES);
+                memset(key, i, crypto_secretbox_KEYBYTES);
+                add_cached_key(salt, key, PASSWORD);
+        }
+
+        /* Least recently used entry has been replaced */
+        memset(salt, 0, crypto_pwhash_SALTBYTES);
+        ck_assert(!get_cached_key(salt, PASSWORD, key));
+
+        memset(salt, KEY_CACHE_SIZE, crypto_pwhash_SALTBYTES);
+        ck_assert(get_cached_key(salt, PASSWORD, key));
+        ck_assert_int_eq(key[0], KEY_CACHE_SIZE);
+
+        /* Different secret flushes the cache */
+        ck_assert(!get_cached_key(salt, "Other secret", key));
+        ck_assert(!get_cached_key(salt, PASSWORD, key));
+}
+END_TEST
+
+START_TEST (check_derive_unverified)
+{
+        ck_assert(generate_send_key_and_salt(PASSWORD));
+
+        char *const buffer = alloca(MAX_DATAGRAM_LEN);
+        const int msg_len = snprintf(&buffer[MSG_IDX], BATCH_MSG_LEN, "1-1.2.3.4") + 1;
+        const size_t enc_len = msg_len + crypto_secretbox_MACBYTES;
+
+        ck_assert(encrypt_buffer(buffer, msg_len));
+
+        /* Random salt - key doesn't decrypt message, must not be cached */
+        char *const forged = alloca(MAX_DATAGRAM_LEN);
+        memcpy(forged, buffer, MAX_DATAGRAM_LEN);
+        randombytes_buf(&forged[MSG_IDX + enc_len], crypto_pwhash_SALTBYTES);
+
+        ck_assert(!derive_receive_key(forged, enc_len, PASSWORD));
+        ck_assert(!receive_key_cached(forged, enc_len, PASSWORD));
+
+        /* Genuine message - key is cached, message left untouched */
+        ck_assert(derive_receive_key(buffer, enc_len, PASSWORD));
+        ck_assert(receive_key_cached(buffer, enc_len, PASSWORD));
+
+        la_address_t *a = create_address("5.5.5.7");
+        ck_assert(a);
+        ck_assert(decrypt_buffer(buffer, enc_len, PASSWORD, a));
+        ck_assert_str_eq(&buffer[MSG_IDX], "1-1.2.3.4");
+}
+END_TEST
+
 Suite *crypto_suite(void)
 {
 	Suite *s = suite_create("Addresses");
@@ -94,6 +171,9 @@ Suite *crypto_suite(void)
         /* Core test case */
         TCase *tc_core = tcase_create("Core");
         tcase_add_test(tc_core, check_encrypt_decrypt);
+        tcase_add_test(tc_core, check_encrypt_decrypt_buffer);
+        tcase_add_test(tc_core, check_key_cache);
+        tcase_add_test(tc_core, check_derive_unverified);
         suite_add_tcase(s, tc_core);
 
         return s;
@@ -0,0 +1,182 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <stdbool.h>
+
+#include <check.h>
+
+#include <../src/digest.c>
+#include <../src/addresses.h>
+#include <../src/logactiond.h>
+#include <../src/logging.h>
+#include <../src/misc.h>
+
+/* Mocks */
+
+la_runtype_t run_type = LA_DAEMON_FOREGROUND;
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+atomic_bool shutdown_ongoing = false;
+#else /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+bool shutdown_ongoing = false;
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+const char *const pidfile_name = PIDFILE;
+
+static bool shutdown_good = false;
+static char shutdown_msg[] = "Shutdown message not set";
+
+void
+trigger_shutdown(int status, int saved_errno)
+{
+        la_log(LOG_INFO, "reached shutdown");
+        if (!shutdown_good)
+                ck_abort_msg(shutdown_msg);
+}
+
+static void
+add_host(la_digest_t *const digest, const char *const host)
+{
+        la_address_t address;
+        ck_assert(init_address(&address, host));
+        add_to_digest(digest, &address);
+}
+
+static int
+bucket_of(const char *const host)
+{
+        la_address_t address;
+        ck_assert(init_address(&address, host));
+        return digest_bucket(&address);
+}
+
+/* Tests */
+
+START_TEST (check_order_independent)
+{
+        la_digest_t d1, d2;
+        init_digest(&d1);
+        init_digest(&d2);
+
+        add_host(&d1, "1.2.3.4");
+        add_host(&d1, "5.6.7.8");
+        add_host(&d1, "2001:db8::1");
+        finish_digest(&d1);
+
+        add_host(&d2, "2001:db8::1");
+        add_host(&d2, "5.6.7.8");
+        add_host(&d2, "1.2.3.4");
+        finish_digest(&d2);
+
+        bool differing[DIGEST_BUCKETS];
+        ck_assert_int_eq(compare_digests(&d1, &d2, differing), 0);
+        for (int i = 0; i < DIGEST_BUCKETS; i++)
+                ck_assert(!differing[i]);
+}
+END_TEST
+
+START_TEST (check_differing_buckets)
+{
+        la_digest_t d1, d2;
+        init_digest(&d1);
+        init_digest(&d2);
+
+        add_host(&d1, "1.2.3.4");
+        add_host(&d1, "5.6.7.8");
+        finish_digest(&d1);
+
+        add_host(&d2, "1.2.3.4");
+        add_host(&d2, "9.9.9.9");
+        finish_digest(&d2);
+
+        ck_assert(d1.root != d2.root);
+
+        bool differing[DIGEST_BUCKETS];
+        const int expected = bucket_of("5.6.7.8") == bucket_of("9.9.9.9") ?
+                1 : 2;
+        ck_assert_int_eq(compare_digests(&d1, &d2, differing), expected);
+        ck_assert(differing[bucket_of("5.6.7.8")]);
+        ck_assert(differing[bucket_of("9.9.9.9")]);
+        if (bucket_of("1.2.3.4") != bucket_of("5.6.7.8") &&
+                        bucket_of("1.2.3.4") != bucket_of("9.9.9.9"))
+                ck_assert(!differing[bucket_of("1.2.3.4")]);
+}
+END_TEST
+
+START_TEST (check_digest_message)
+{
+        la_digest_t d1, d2;
+        init_digest(&d1);
+        for (int i = 0; i < 1000; i++)
+        {
+                char host[20];
+                snprintf(host, 20, "10.0.%u.%u", i / 256, i % 256);
+                add_host(&d1, host);
+        }
+        finish_digest(&d1);
+
+        char buffer[DIGEST_MSG_LEN];
+        ck_assert_int_eq(init_digest_message(buffer, &d1, DIGEST_REQUEST),
+                        DIGEST_MSG_LEN);
+        ck_assert_int_eq(*buffer, PROTOCOL_VERSION_DIGEST);
+
+        char type;
+        ck_assert(parse_digest_message(buffer, DIGEST_MSG_LEN, &d2, &type));
+        ck_assert_int_eq(type, DIGEST_REQUEST);
+        ck_assert(!memcmp(&d1, &d2, sizeof d1));
+
+        /* Too short */
+        ck_assert(!parse_digest_message(buffer, DIGEST_MSG_LEN - 1, &d2,
+                                &type));
+
+        /* Root doesn't match buckets */
+        buffer[DIGEST_MSG_LEN - 1] ^= 1;
+        ck_assert(!parse_digest_message(buffer, DIGEST_MSG_LEN, &d2, &type));
+}
+END_TEST
+
+Suite *digest_suite(void)
+{
+	Suite *s = suite_create("Digest");
+
+        /* Core test case */
+        TCase *tc_core = tcase_create("Core");
+        tcase_add_test(tc_core, check_order_independent);
+        tcase_add_test(tc_core, check_differing_buckets);
+        tcase_add_test(tc_core, check_digest_message);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int number_failed = 0;
+        Suite *s = digest_suite();
+        SRunner *sr = srunner_create(s);
+
+        srunner_run_all(sr, CK_NORMAL);
+        number_failed = srunner_ntests_failed(sr);
+        srunner_free(sr);
+        return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set autowrite expandtab: */
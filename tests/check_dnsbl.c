@@ -46,6 +46,33 @@ atomic_bool shutdown_ongoing = false;
 bool shutdown_ongoing = false;
 #endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
 const char *const pidfile_name = "/tmp/logactiond.pid";
+la_config_t *la_config;
+pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+thread_started(pthread_t thread)
+{
+}
+
+void
+wait_final_barrier(void)
+{
+}
+
+void
+trigger_blacklisted_command(const char *const rule_name, const int id,
+                const la_address_t *const address, const char *const blacklist)
+{
+}
+
+static int renewals_checked = 0;
+
+void
+dnsbl_renewal_checked(const char *const rule_name, const int id,
+                const la_address_t *const address)
+{
+        renewals_checked++;
+}
 
 static bool shutdown_good = false;
 static char shutdown_msg[] = "Shutdown message not set";
@@ -75,6 +102,145 @@ START_TEST (check_not_on_list)
 }
 END_TEST
 
+static bool
+in_zone(const char *const filename, const char *const host)
+{
+        la_address_t address;
+        ck_assert(init_address(&address, host));
+        return host_in_zone(filename, &address);
+}
+
+START_TEST (check_zone_file)
+{
+        char filename[] = "/tmp/check_dnsbl_XXXXXX";
+        const int fd = mkstemp(filename);
+        ck_assert(fd != -1);
+        FILE *const stream = fdopen(fd, "w");
+        ck_assert(stream);
+        fputs("# comment\n"
+                        ":127.0.0.2:Listed\n"
+                        "$TTL 3600\n"
+                        "10.1.1.1\n"
+                        "10.2 :127.0.0.3:\n"
+                        "10.3.0.0/16\n"
+                        "!10.3.3.0/24\n"
+                        "10.4.0.5-10.4.0.17\n"
+                        "10.5.0.1-3\n"
+                        "2001:db8::/32\n"
+                        "bogus\n", stream);
+        fclose(stream);
+
+        /* First use only queues loading the zone file */
+        ck_assert(!in_zone(filename, "10.1.1.1"));
+        la_dnsbl_query_t *const query =
+                (la_dnsbl_query_t *) rem_head(query_queue);
+        ck_assert(query);
+        ck_assert_int_eq(query->type, LA_QUERY_ZONE);
+        run_query(query);
+        free_dnsbl_query(query);
+        ck_assert(!rem_head(query_queue));
+
+        ck_assert(in_zone(filename, "10.1.1.1"));
+        ck_assert(!in_zone(filename, "10.1.1.2"));
+        ck_assert(in_zone(filename, "10.2.200.1"));
+        ck_assert(in_zone(filename, "10.3.2.1"));
+        ck_assert(!in_zone(filename, "10.3.3.1"));
+        ck_assert(!in_zone(filename, "10.4.0.4"));
+        ck_assert(in_zone(filename, "10.4.0.5"));
+        ck_assert(in_zone(filename, "10.4.0.16"));
+        ck_assert(in_zone(filename, "10.4.0.17"));
+        ck_assert(!in_zone(filename, "10.4.0.18"));
+        ck_assert(in_zone(filename, "10.5.0.3"));
+        ck_assert(!in_zone(filename, "10.5.0.4"));
+        ck_assert(in_zone(filename, "2001:db8:1::1"));
+        ck_assert(!in_zone(filename, "2001:db9::1"));
+
+        unlink(filename);
+        free_dnsbl_cache();
+}
+END_TEST
+
+START_TEST (check_lookup_domainname)
+{
+        la_address_t address;
+        ck_assert(init_address(&address, "127.0.0.1"));
+
+        /* First call only queues the reverse lookup */
+        lookup_domainname(&address);
+        ck_assert(!address.domainname);
+        ck_assert_int_eq(dnsbl_cache_length(), 1);
+
+        la_dnsbl_query_t *const query =
+                (la_dnsbl_query_t *) rem_head(query_queue);
+        ck_assert(query);
+        ck_assert_int_eq(query->type, LA_QUERY_DOMAINNAME);
+        run_query(query);
+        free_dnsbl_query(query);
+
+        /* Second call is answered from the cache */
+        lookup_domainname(&address);
+        ck_assert(address.domainname);
+        ck_assert_int_eq(dnsbl_cache_length(), 1);
+
+        free(address.domainname);
+        free_dnsbl_cache();
+}
+END_TEST
+
+START_TEST (check_query_queue_full)
+{
+        for (int i = 0; i <= MAX_QUERY_QUEUE_LEN; i++)
+        {
+                char host[16];
+                snprintf(host, sizeof host, "10.0.%u.%u", i / 256, i % 256);
+                la_address_t address;
+                ck_assert(init_address(&address, host));
+                lookup_domainname(&address);
+        }
+
+        /* Dropped lookup doesn't leave a pending entry behind */
+        ck_assert_int_eq(query_queue_length, MAX_QUERY_QUEUE_LEN);
+        ck_assert_int_eq(dnsbl_cache_length(), MAX_QUERY_QUEUE_LEN);
+        ck_assert_int_eq(dnsbl_queries_dropped(), 1);
+
+        free_dnsbl_cache();
+}
+END_TEST
+
+START_TEST (check_shared_pending_lookup)
+{
+        la_config_t config = { .dnsbl_positive_ttl = 10,
+                .dnsbl_negative_ttl = 10 };
+        la_config = &config;
+        kw_list_t *const blacklists = create_list();
+        add_tail(blacklists, create_node(sizeof (kw_node_t), 0, "bl.invalid"));
+        la_address_t address;
+        ck_assert(init_address(&address, "10.9.9.9"));
+        const char *blname = NULL;
+        renewals_checked = 0;
+
+        /* Trigger check queues the lookup, renewal check only joins it */
+        ck_assert(!host_on_any_dnsbl(blacklists, &address, "rule", 1));
+        ck_assert_int_eq(host_on_any_dnsbl_for_renewal(blacklists, &address,
+                                "rule", 1, &blname), LA_DNSBL_PENDING);
+        la_dnsbl_query_t *const query =
+                (la_dnsbl_query_t *) rem_head(query_queue);
+        ck_assert(query);
+        ck_assert(!rem_head(query_queue));
+
+        /* Renewal is told about the result nevertheless */
+        run_query(query);
+        free_dnsbl_query(query);
+        ck_assert_int_eq(renewals_checked, 1);
+        ck_assert_int_eq(host_on_any_dnsbl_for_renewal(blacklists, &address,
+                                "rule", 1, &blname), LA_DNSBL_NOT_LISTED);
+
+        free_list(blacklists, (void (*)(void *)) free_node);
+        free_dnsbl_cache();
+        la_config = NULL;
+}
+END_TEST
+
 Suite *dnsbl_suite(void)
 {
 	Suite *s = suite_create("Misc");
@@ -83,6 +249,10 @@ Suite *dnsbl_suite(void)
         TCase *tc_core = tcase_create("Core");
         tcase_add_test(tc_core, check_on_list);
         tcase_add_test(tc_core, check_not_on_list);
+        tcase_add_test(tc_core, check_zone_file);
+        tcase_add_test(tc_core, check_lookup_domainname);
+        tcase_add_test(tc_core, check_query_queue_full);
+        tcase_add_test(tc_core, check_shared_pending_lookup);
         suite_add_tcase(s, tc_core);
 
         return s;
@@ -37,6 +37,7 @@
 #include <../src/binarytree.h>
 #include <../src/sources.h>
 #include <../src/logging.h>
+#include <../src/aggregation.h>
 //#include <../src/commands.c>
 /*#include <../src/properties.h>
 #include <../src/rules.h>
@@ -111,6 +112,38 @@ start_monitoring_thread(void) { }
 void
 pad(char *buffer, const size_t msg_len) { }
 
+void
+thread_started(pthread_t thread) { }
+
+void
+wait_final_barrier(void) { }
+
+void
+update_watching_status(const bool activate) { }
+
+bool
+reload_ignore_file(void)
+{
+        return true;
+}
+
+la_address_t *
+find_ignored_address(const la_address_t *const address)
+{
+        return NULL;
+}
+
+int
+get_unique_id(void)
+{
+        return ++id_counter;
+}
+
+void
+sample_pattern_exec_time(la_pattern_t *const pattern, const struct timespec *const start)
+{
+}
+
 
 /* Trees */
 
@@ -126,23 +159,22 @@ recursively_check_end_queue_adr(kw_tree_node_t *node)
 }
 
 static void
-recursively_check_end_queue_end_time(kw_tree_node_t *node)
+check_end_queue_end_time(void)
 {
-        if (!node)
-                return;
-
-        recursively_check_end_queue_end_time(node->left);
-        la_command_t *command = (la_command_t *) node->payload;
-        la_debug("Found %u: %s, %lu", command_id, command->address->text, command->end_time);
-        commands[command_id++] = command;
-        recursively_check_end_queue_end_time(node->right);
+        FOREACH(la_command_t, command, end_time_list)
+        {
+                la_debug("Found %u: %s, %lu", command_id, command->address ?
+                                command->address->text : "-",
+                                command->end_time);
+                commands[command_id++] = command;
+        }
 }
 
 static int
 check_end_queues(void)
 {
         command_id = 0;
-        recursively_check_end_queue_end_time(end_time_tree->root);
+        check_end_queue_end_time();
 
         int i;
         if (command_id > 0)
@@ -159,7 +191,8 @@ check_end_queues(void)
         if (command_id > 0)
         {
                 for (i = 0; i < command_id - 1; i++)
-                        ck_assert_int_le(adrcmp(commands[i]->address, commands[i+1]->address), 0);
+                        ck_assert_int_le(adrkeycmp(&commands[i]->adr_key,
+                                                &commands[i+1]->adr_key), 0);
         }
 
         ck_assert_int_eq(command_id, command_id_1);
@@ -172,22 +205,17 @@ init_stuff(void)
 {
         log_level++;
         la_config = calloc(sizeof *la_config, 1);
-        la_config->source_groups = create_list();
-        la_config->ignore_addresses = create_list();
-        la_log(LOG_INFO, "1: %u", la_config->source_groups);
+        init_list(&la_config->source_groups);
         sg = create_source_group("Sourcegroup", "", "");
         rule = create_rule(true, "Rulename", sg, 3, 3, 3, 3, 0, 3, 3, 3, 0, "przf", NULL);
-        add_tail(la_config->source_groups, (kw_node_t *) sg);
-        la_log(LOG_INFO, "2: %u", la_config->source_groups);
-        add_tail(sg->rules, (kw_node_t *) rule);
+        add_tail(&la_config->source_groups, (kw_node_t *) sg);
+        add_tail(&sg->rules, (kw_node_t *) rule);
 
         template = create_template("Ruebezahl", rule, "true", "true", 1000,
                         LA_NEED_HOST_NO, true);
-        add_tail(rule->begin_commands, (kw_node_t *) template);
-        la_log(LOG_INFO, "List now: %u", list_length(rule->begin_commands));
+        add_tail(&rule->begin_commands, (kw_node_t *) template);
 
         init_end_queue();
-        la_log(LOG_INFO, "3: %u", la_config->source_groups);
 }
 
 START_TEST (trees)
@@ -258,7 +286,7 @@ START_TEST (trees)
         ck_assert_int_eq(check_end_queues(), 0);
         ck_assert_int_eq(queue_length, 0);
         ck_assert(is_empty(adr_tree));
-        ck_assert(is_empty(end_time_tree));
+        ck_assert(is_list_empty(end_time_list));
 
 
 }
@@ -280,7 +308,6 @@ END_TEST
 START_TEST (state)
 {
         init_stuff();
-        la_log(LOG_INFO, "4: %u", la_config->source_groups);
 
         time_t now = xtime(NULL);
 
@@ -312,7 +339,7 @@ START_TEST (state)
                         create_address("2.2.2.2"), NULL);
         enqueue_end_command(c, now + 1);
 
-        saved_state = "./testsavestate";
+        set_saved_state("./testsavestate");
         save_state(true);
 
         empty_end_queue();
@@ -326,8 +353,7 @@ START_TEST (state)
         ck_assert(!find_end_command(create_address("10.10.10.10")));
         ck_assert(!find_end_command(create_address("20.20.20.20")));
 
-        ck_assert(la_config->source_groups);
-        assert_list(la_config->source_groups);
+        assert_list(&la_config->source_groups);
 
         ck_assert(restore_state(false));
         ck_assert_int_eq(queue_length, 7);
@@ -342,6 +368,83 @@ START_TEST (state)
 }
 END_TEST
 
+/* Enqueues a command for host just like trigger_then_enqueue_or_free() does.
+ * Returns true if it has been replaced by a command for the network */
+
+static bool
+aggregate_host(const char *const host)
+{
+        static la_pattern_t pattern;
+        init_list(&pattern.properties);
+
+        la_command_t *const command = create_command_from_template(template,
+                        &pattern, create_address(host));
+        ck_assert(command);
+        /* Account for the command the way trigger_command() would */
+        command->rule->queue_count++;
+        if (aggregate_command(command))
+                return true;
+
+        enqueue_end_command(command, xtime(NULL) + 100);
+        return false;
+}
+
+START_TEST (aggregation)
+{
+        init_stuff();
+        la_config->aggregate_threshold = 3;
+        la_config->aggregate_period = 60;
+        la_config->aggregate_ipv4_prefix = 24;
+        la_config->aggregate_ipv6_prefix = 64;
+
+        ck_assert(!aggregate_host("192.168.1.1"));
+        ck_assert(!aggregate_host("192.168.1.2"));
+        ck_assert(!aggregate_host("192.168.2.1"));
+        ck_assert(!aggregate_host("10.0.0.1"));
+        ck_assert_int_eq(queue_length, 4);
+
+        /* Threshold reached - network command replaces the host commands of
+         * that network but leaves the others alone */
+        ck_assert(aggregate_host("192.168.1.3"));
+        ck_assert_int_eq(queue_length, 3);
+        ck_assert_int_eq(check_end_queues(), 3);
+        ck_assert_int_eq(network_commands, 1);
+        ck_assert_int_eq(network_commands_v4[24], 1);
+
+        la_command_t *cmd = find_end_command(create_address("192.168.1.1"));
+        ck_assert(cmd);
+        ck_assert_int_eq(cmd->adr_key.prefix, 24);
+        ck_assert_ptr_eq(find_end_command(create_address("192.168.1.2")), cmd);
+        ck_assert_ptr_eq(find_end_command(create_address("192.168.1.3")), cmd);
+        ck_assert_ptr_eq(find_end_command(create_address("192.168.1.200")),
+                        cmd);
+
+        cmd = find_end_command(create_address("192.168.2.1"));
+        ck_assert(cmd);
+        ck_assert_int_eq(cmd->adr_key.prefix, 32);
+        ck_assert(find_end_command(create_address("10.0.0.1")));
+        ck_assert(!find_end_command(create_address("192.168.2.2")));
+
+        /* Network command is still found after aggregation settings have
+         * changed (e.g. with a reload) */
+        la_config->aggregate_threshold = 0;
+        la_config->aggregate_ipv4_prefix = 16;
+        cmd = find_end_command_no_mutex(create_address("192.168.1.100"));
+        ck_assert(cmd);
+        ck_assert_int_eq(cmd->adr_key.prefix, 24);
+        ck_assert(!find_end_command_no_mutex(create_address("192.168.3.1")));
+        ck_assert(!aggregate_host("192.168.3.1"));
+        ck_assert_int_eq(queue_length, 4);
+
+        /* Removing the network command resets the counters */
+        remove_command_from_queues(find_end_command(
+                                create_address("192.168.1.1")));
+        ck_assert_int_eq(network_commands, 0);
+        ck_assert(!find_end_command(create_address("192.168.1.100")));
+        ck_assert_int_eq(check_end_queues(), 3);
+}
+END_TEST
+
 
 Suite *commands_suite(void)
 {
@@ -352,6 +455,7 @@ Suite *commands_suite(void)
         tcase_add_test(tc_main, trees);
         tcase_add_test(tc_main, null_elements);
         tcase_add_test(tc_main, state);
+        tcase_add_test(tc_main, aggregation);
         suite_add_tcase(s, tc_main);
 
         return s;
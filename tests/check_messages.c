@@ -145,6 +145,29 @@ reset_counts(void)
         method_called = "reset_counts";
 }
 
+void
+update_watching_status(const bool activate)
+{
+        method_called = "update_watching_status";
+}
+
+void
+clear_line_cache(la_source_group_t *const source_group)
+{
+}
+
+bool
+reload_ignore_file(void)
+{
+        method_called = "reload_ignore_file";
+        return true;
+}
+
+void
+lookup_domainname(la_address_t *const address)
+{
+}
+
 /* Tests */
 
 START_TEST (parse_add_message)
@@ -313,6 +336,109 @@ START_TEST (parse_xxx_message)
 }
 
 END_TEST
+
+START_TEST (batch_message)
+{
+        char *const batch = alloca(MAX_DATAGRAM_LEN);
+        int batch_len = 0;
+
+        ck_assert(append_to_batch_message(batch, &batch_len,
+                                "0+1.2.3.4,nonexisting"));
+        ck_assert(append_to_batch_message(batch, &batch_len, "0-1.2.3.4"));
+        ck_assert(append_to_batch_message(batch, &batch_len, "0-5.6.7.8"));
+        ck_assert_int_eq(batch_len, 1 + 21 + 9 + 9);
+        ck_assert_int_eq(batch[0], PROTOCOL_VERSION_BATCH);
+        ck_assert_str_eq(batch + 1, "+1.2.3.4,nonexisting");
+
+        method_called = NULL;
+        test_address = NULL;
+        la_address_t from_addr;
+        init_address(&from_addr, "9.9.9.9");
+        parse_batch_message_trigger_commands(batch, batch_len, &from_addr);
+        ck_assert_str_eq(method_called, "remove_and_trigger");
+        ck_assert_str_eq(test_address->text, "5.6.7.8");
+
+        /* Other commands are not accepted in batches */
+        method_called = NULL;
+        parse_batch_message_trigger_commands("1F\0", 3, &from_addr);
+        ck_assert_ptr_eq(method_called, NULL);
+
+        /* Batch is full at some point */
+        batch_len = 0;
+        int n = 0;
+        while (append_to_batch_message(batch, &batch_len, "0-1.2.3.4"))
+                n++;
+        ck_assert_int_eq(n, (BATCH_MSG_LEN - 1) / 9);
+        ck_assert(batch_len <= BATCH_MSG_LEN);
+}
+END_TEST
+
+START_TEST (duplicate_adds)
+{
+        ck_assert(!seen_recently("+1.2.3.4,sshd"));
+        ck_assert(seen_recently("+1.2.3.4,sshd"));
+        /* End time and factor don't matter */
+        ck_assert(seen_recently("+1.2.3.4,sshd,1234567,16"));
+        ck_assert(!seen_recently("+1.2.3.4,apache"));
+        ck_assert(!seen_recently("+1.2.3.5,sshd"));
+
+        /* Window has passed */
+        seen_entries[add_fingerprint("+1.2.3.5,sshd") &
+                (DEDUP_CACHE_SIZE - 1)].time -= DEDUP_WINDOW;
+        ck_assert(!seen_recently("+1.2.3.5,sshd"));
+        ck_assert(seen_recently("+1.2.3.5,sshd"));
+
+        /* Removing an entry forgets what has been seen */
+        la_address_t from_addr;
+        init_address(&from_addr, "9.9.9.9");
+        parse_message_trigger_command("0-1.2.3.4", &from_addr);
+        ck_assert(!seen_recently("+1.2.3.4,sshd"));
+}
+END_TEST
+
+START_TEST (binary_message)
+{
+        char *const batch = alloca(MAX_DATAGRAM_LEN);
+        int batch_len = 0;
+        char message[MSG_LEN];
+        la_address_t address;
+
+        ck_assert(init_address(&address, "1.2.3.6"));
+        ck_assert(init_binary_add_message(message, &address, "nonexisting", 0,
+                                0));
+        ck_assert(append_to_batch_message(batch, &batch_len, message));
+        ck_assert(append_to_batch_message(batch, &batch_len, message));
+        ck_assert_int_eq(batch_len, 1 + 2 * (BINMSG_ENTRY_LEN + 11));
+        ck_assert_int_eq(batch[0], PROTOCOL_VERSION_BINARY);
+
+        /* Textual entries don't go into a binary message */
+        ck_assert(!append_to_batch_message(batch, &batch_len, "0-1.2.3.4"));
+
+        /* Duplicate is filtered, same fingerprint as textual version */
+        la_address_t from_addr;
+        init_address(&from_addr, "9.9.9.9");
+        parse_binary_message_trigger_commands(batch, batch_len, &from_addr);
+        ck_assert(seen_recently("+1.2.3.6,nonexisting"));
+
+        /* Truncated message */
+        ck_assert(init_address(&address, "1.2.3.7"));
+        ck_assert(init_binary_add_message(message, &address, "nonexisting", 0,
+                                0));
+        parse_binary_message_trigger_commands(message, BINMSG_ENTRY_LEN,
+                        &from_addr);
+        ck_assert(!seen_recently("+1.2.3.7,nonexisting"));
+
+        /* Removal entries are only valid in the state journal */
+        ck_assert(init_address(&address, "1.2.3.8"));
+        ck_assert(init_binary_add_message(message, &address, "nonexisting", 0,
+                                0));
+        message[1] = CMD_DEL;
+        parse_binary_message_trigger_commands(message,
+                        1 + BINMSG_ENTRY_LEN + 11, &from_addr);
+        ck_assert(!seen_recently("+1.2.3.8,nonexisting"));
+}
+END_TEST
+
 START_TEST (init_message)
 {
         char *const m = alloca(TOTAL_MSG_LEN);
@@ -377,6 +503,9 @@ Suite *crypto_suite(void)
         TCase *tc_core = tcase_create("Core");
         tcase_add_test(tc_core, parse_add_message);
         tcase_add_test(tc_core, parse_xxx_message);
+        tcase_add_test(tc_core, batch_message);
+        tcase_add_test(tc_core, duplicate_adds);
+        tcase_add_test(tc_core, binary_message);
         tcase_add_test(tc_core, init_message);
         suite_add_tcase(s, tc_core);
 
@@ -0,0 +1,432 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <stdbool.h>
+
+#include <check.h>
+
+#include <../src/session.c>
+#include <../src/addresses.h>
+#include <../src/logactiond.h>
+#include <../src/logging.h>
+#include <../src/misc.h>
+
+/* Mocks */
+
+la_runtype_t run_type = LA_DAEMON_FOREGROUND;
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+atomic_bool shutdown_ongoing = false;
+#else /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+bool shutdown_ongoing = false;
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+const char *const pidfile_name = PIDFILE;
+
+static bool shutdown_good = false;
+static char shutdown_msg[] = "Shutdown message not set";
+
+void
+trigger_shutdown(int status, int saved_errno)
+{
+        la_log(LOG_INFO, "reached shutdown");
+        if (!shutdown_good)
+                ck_abort_msg(shutdown_msg);
+}
+
+/* Peer, i.e. the other end of the session */
+
+static unsigned char peer_pk[crypto_kx_PUBLICKEYBYTES];
+static unsigned char peer_sk[crypto_kx_SECRETKEYBYTES];
+static unsigned char peer_nonce[KX_NONCE_LEN];
+static unsigned char peer_rx[crypto_kx_SESSIONKEYBYTES];
+static unsigned char peer_tx[crypto_kx_SESSIONKEYBYTES];
+/* Last hello sent by peer */
+static char peer_hello[KX_MSG_LEN];
+
+/*
+ * Computes the peer's session keys from the session nonce we'd send to it in
+ * our answer.
+ */
+
+static void
+compute_peer_keys(la_address_t *const address)
+{
+        char answer[KX_MSG_LEN];
+        ck_assert_int_eq(init_kx_message(answer, KX_ANSWER, 16473, address),
+                        KX_MSG_LEN);
+        const unsigned char *const nonce = (unsigned char *)
+                &answer[12 + crypto_kx_PUBLICKEYBYTES];
+
+        unsigned char rx[crypto_kx_SESSIONKEYBYTES];
+        unsigned char tx[crypto_kx_SESSIONKEYBYTES];
+        if (memcmp(peer_pk, own_pk, crypto_kx_PUBLICKEYBYTES) < 0)
+                ck_assert(!crypto_kx_client_session_keys(rx, tx, peer_pk,
+                                        peer_sk, own_pk));
+        else
+                ck_assert(!crypto_kx_server_session_keys(rx, tx, peer_pk,
+                                        peer_sk, own_pk));
+
+        ck_assert(mix_session_key(peer_rx, rx, nonce, peer_nonce));
+        ck_assert(mix_session_key(peer_tx, tx, peer_nonce, nonce));
+}
+
+/*
+ * Lets peer send a hello to us and computes the peer's session keys.
+ */
+
+static void
+establish_session(la_address_t *const address)
+{
+        ck_assert(!crypto_kx_keypair(peer_pk, peer_sk));
+        randombytes_buf(peer_nonce, KX_NONCE_LEN);
+
+        ck_assert_int_eq(init_kx_message(peer_hello, KX_HELLO, 16473, address),
+                        KX_MSG_LEN);
+        /* Replace own public key and nonce by the ones of the peer */
+        memcpy(&peer_hello[12], peer_pk, crypto_kx_PUBLICKEYBYTES);
+        memcpy(&peer_hello[12 + crypto_kx_PUBLICKEYBYTES], peer_nonce,
+                        KX_NONCE_LEN);
+
+        bool reply;
+        int port;
+        ck_assert(handle_kx_message(peer_hello, KX_MSG_LEN,
+                                (struct sockaddr *) &address->sa, &reply, &port));
+        ck_assert(reply);
+        ck_assert_int_eq(port, 16473);
+
+        compute_peer_keys(address);
+}
+
+/*
+ * Returns counter of session datagram our side has created for peer. Fails if
+ * peer can't decrypt it with key.
+ */
+
+static uint64_t
+peer_decrypt(const char *const datagram, const size_t len,
+                const unsigned char *const key)
+{
+        unsigned char nonce[crypto_secretbox_NONCEBYTES] = { 0 };
+        memcpy(nonce, &datagram[SESSION_MAGIC_LEN], SESSION_COUNTER_LEN);
+        unsigned char message[MAX_DATAGRAM_LEN];
+        ck_assert(!crypto_secretbox_open_easy(message,
+                                (unsigned char *) &datagram[SESSION_MAGIC_LEN +
+                                SESSION_COUNTER_LEN], len - SESSION_MAGIC_LEN -
+                                SESSION_COUNTER_LEN, nonce, key));
+
+        return load_be64(nonce);
+}
+
+/*
+ * Creates session datagram as the peer would do.
+ */
+
+static size_t
+peer_encrypt(char *const datagram, const char *const message,
+                const uint64_t counter)
+{
+        unsigned char *const udatagram = (unsigned char *) datagram;
+        unsigned char nonce[crypto_secretbox_NONCEBYTES] = { 0 };
+        store_be64(nonce, counter);
+
+        memcpy(udatagram, SESSION_MAGIC, SESSION_MAGIC_LEN);
+        memcpy(&udatagram[SESSION_MAGIC_LEN], nonce, SESSION_COUNTER_LEN);
+        ck_assert(!crypto_secretbox_easy(&udatagram[SESSION_MAGIC_LEN +
+                                SESSION_COUNTER_LEN],
+                                (const unsigned char *) message,
+                                strlen(message) + 1, nonce, peer_tx));
+
+        return strlen(message) + 1 + SESSION_OVERHEAD;
+}
+
+/* Tests */
+
+START_TEST (check_no_session)
+{
+        la_address_t *const a = create_address("5.5.5.1");
+        ck_assert(a);
+
+        char datagram[MAX_DATAGRAM_LEN];
+        size_t len;
+        ck_assert(!session_encrypt("0+1.2.3.4", 10, a, datagram, &len));
+
+        /* First hello is due, second one not */
+        ck_assert(kx_hello_due(a));
+        ck_assert(!kx_hello_due(a));
+
+        /* Not a session datagram at all */
+        memset(datagram, 'x', 100);
+        ck_assert_int_eq(session_decrypt(datagram, 100,
+                                (struct sockaddr *) &a->sa, &len),
+                        LA_SESSION_NONE);
+
+        memcpy(datagram, SESSION_MAGIC, SESSION_MAGIC_LEN);
+        ck_assert_int_eq(session_decrypt(datagram, 100,
+                                (struct sockaddr *) &a->sa, &len),
+                        LA_SESSION_UNKNOWN);
+
+        free_address(a);
+        free_sessions();
+}
+END_TEST
+
+START_TEST (check_session_roundtrip)
+{
+        la_address_t *const a = create_address("5.5.5.2");
+        ck_assert(a);
+        establish_session(a);
+
+        /* Peer to us */
+        char datagram[MAX_DATAGRAM_LEN];
+        size_t len = peer_encrypt(datagram, "0+1.2.3.4,sshd", 1);
+        size_t msg_len;
+        ck_assert_int_eq(session_decrypt(datagram, len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_OK);
+        ck_assert_int_eq(msg_len, 15);
+        ck_assert_str_eq(datagram, "0+1.2.3.4,sshd");
+
+        /* Us to peer */
+        ck_assert(session_encrypt("0+5.6.7.8,sshd", 15, a, datagram, &len));
+        ck_assert_int_eq(len, 15 + SESSION_OVERHEAD);
+        ck_assert(!memcmp(datagram, SESSION_MAGIC, SESSION_MAGIC_LEN));
+        unsigned char nonce[crypto_secretbox_NONCEBYTES] = { 0 };
+        memcpy(nonce, &datagram[SESSION_MAGIC_LEN], SESSION_COUNTER_LEN);
+        ck_assert_int_eq(load_be64(nonce), 1);
+        unsigned char message[15];
+        ck_assert(!crypto_secretbox_open_easy(message,
+                                (unsigned char *) &datagram[SESSION_MAGIC_LEN +
+                                SESSION_COUNTER_LEN], len - SESSION_MAGIC_LEN -
+                                SESSION_COUNTER_LEN, nonce, peer_rx));
+        ck_assert_str_eq((char *) message, "0+5.6.7.8,sshd");
+
+        free_address(a);
+        free_sessions();
+}
+END_TEST
+
+START_TEST (check_replay)
+{
+        la_address_t *const a = create_address("5.5.5.3");
+        ck_assert(a);
+        establish_session(a);
+
+        char datagram[MAX_DATAGRAM_LEN];
+        char copy[MAX_DATAGRAM_LEN];
+        size_t msg_len;
+
+        size_t len = peer_encrypt(datagram, "0+1.1.1.1,sshd", 5);
+        memcpy(copy, datagram, len);
+        ck_assert_int_eq(session_decrypt(datagram, len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_OK);
+
+        /* Same datagram again */
+        ck_assert_int_eq(session_decrypt(copy, len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_INVALID);
+
+        /* Reordered datagram within window is fine */
+        len = peer_encrypt(datagram, "0+1.1.1.2,sshd", 3);
+        ck_assert_int_eq(session_decrypt(datagram, len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_OK);
+
+        /* Datagram too old for window */
+        len = peer_encrypt(datagram, "0+1.1.1.3,sshd", 5 + SESSION_REPLAY_WINDOW);
+        ck_assert_int_eq(session_decrypt(datagram, len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_OK);
+        len = peer_encrypt(datagram, "0+1.1.1.4,sshd", 4);
+        ck_assert_int_eq(session_decrypt(datagram, len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_INVALID);
+
+        /* Tampered datagram */
+        len = peer_encrypt(datagram, "0+1.1.1.5,sshd", 100);
+        datagram[len - 1] ^= 1;
+        ck_assert_int_eq(session_decrypt(datagram, len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_INVALID);
+
+        free_address(a);
+        free_sessions();
+}
+END_TEST
+
+START_TEST (check_kx_timestamp)
+{
+        la_address_t *const a = create_address("5.5.5.4");
+        ck_assert(a);
+
+        char buffer[KX_MSG_LEN];
+        init_kx_message(buffer, KX_ANSWER, 16473, a);
+        store_be64((unsigned char *) &buffer[4], xtime(NULL) - 2 * KX_MAX_AGE);
+
+        bool reply;
+        int port;
+        ck_assert(!handle_kx_message(buffer, KX_MSG_LEN,
+                                (struct sockaddr *) &a->sa, &reply, &port));
+
+        free_address(a);
+        free_sessions();
+}
+END_TEST
+
+START_TEST (check_session_limit)
+{
+        la_address_t *const a = create_address("5.5.5.4");
+        ck_assert(a);
+        establish_session(a);
+
+        /* Hellos to lots of hosts don't grow the sessions beyond
+         * MAX_SESSIONS */
+        for (int i = 0; i <= MAX_SESSIONS; i++)
+        {
+                char host[16];
+                snprintf(host, sizeof host, "10.0.%u.%u", i / 256, i % 256);
+                la_address_t *const b = create_address(host);
+                ck_assert(b);
+                ck_assert(kx_hello_due(b));
+                free_address(b);
+        }
+        ck_assert_int_eq(session_count(), MAX_SESSIONS);
+
+        /* Least recently used session has been dropped first */
+        char datagram[MAX_DATAGRAM_LEN];
+        size_t len;
+        ck_assert(!session_encrypt("0+1.2.3.4", 10, a, datagram, &len));
+
+        free_address(a);
+        free_sessions();
+}
+END_TEST
+
+START_TEST (check_session_rekey)
+{
+        la_address_t *const a = create_address("5.5.5.5");
+        ck_assert(a);
+        establish_session(a);
+
+        char datagram[MAX_DATAGRAM_LEN];
+        char recorded[MAX_DATAGRAM_LEN];
+        size_t len;
+        size_t msg_len;
+
+        /* Datagram from peer recorded by an attacker */
+        const size_t recorded_len = peer_encrypt(recorded, "0+1.1.1.1,sshd", 1);
+        memcpy(datagram, recorded, recorded_len);
+        ck_assert_int_eq(session_decrypt(datagram, recorded_len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_OK);
+
+        ck_assert(session_encrypt("0+5.6.7.8,sshd", 15, a, datagram, &len));
+        ck_assert_int_eq(peer_decrypt(datagram, len, peer_rx), 1);
+        unsigned char old_peer_rx[crypto_kx_SESSIONKEYBYTES];
+        memcpy(old_peer_rx, peer_rx, crypto_kx_SESSIONKEYBYTES);
+
+        /* Evict session */
+        for (int i = 0; i < MAX_SESSIONS; i++)
+        {
+                char host[16];
+                snprintf(host, sizeof host, "10.1.%u.%u", i / 256, i % 256);
+                la_address_t *const b = create_address(host);
+                ck_assert(b);
+                ck_assert(kx_hello_due(b));
+                free_address(b);
+        }
+        ck_assert(!session_encrypt("0+5.6.7.8,sshd", 15, a, datagram, &len));
+
+        /* Re-established by replaying peer's hello */
+        bool reply;
+        int port;
+        ck_assert(handle_kx_message(peer_hello, KX_MSG_LEN,
+                                (struct sockaddr *) &a->sa, &reply, &port));
+        compute_peer_keys(a);
+        ck_assert(memcmp(old_peer_rx, peer_rx, crypto_kx_SESSIONKEYBYTES));
+
+        /* Recorded datagram is not accepted again */
+        ck_assert_int_eq(session_decrypt(recorded, recorded_len,
+                                (struct sockaddr *) &a->sa, &msg_len),
+                        LA_SESSION_INVALID);
+
+        /* Counter 1 again, but with a fresh key */
+        ck_assert(session_encrypt("0+5.6.7.9,sshd", 15, a, datagram, &len));
+        ck_assert_int_eq(peer_decrypt(datagram, len, peer_rx), 1);
+        unsigned char nonce[crypto_secretbox_NONCEBYTES] = { 0 };
+        memcpy(nonce, &datagram[SESSION_MAGIC_LEN], SESSION_COUNTER_LEN);
+        unsigned char message[MAX_DATAGRAM_LEN];
+        ck_assert(crypto_secretbox_open_easy(message,
+                                (unsigned char *) &datagram[SESSION_MAGIC_LEN +
+                                SESSION_COUNTER_LEN], len - SESSION_MAGIC_LEN -
+                                SESSION_COUNTER_LEN, nonce, old_peer_rx));
+
+        /* Peer's new nonce in the same second must not bring back keys */
+        memcpy(&peer_hello[12 + crypto_kx_PUBLICKEYBYTES], "0123456789abcdef",
+                        KX_NONCE_LEN);
+        ck_assert(!handle_kx_message(peer_hello, KX_MSG_LEN,
+                                (struct sockaddr *) &a->sa, &reply, &port));
+
+        /* Same session, new nonce of the peer: our counter keeps going */
+        store_be64((unsigned char *) &peer_hello[4], xtime(NULL) + 1);
+        memcpy(peer_nonce, "0123456789abcdef", KX_NONCE_LEN);
+        ck_assert(handle_kx_message(peer_hello, KX_MSG_LEN,
+                                (struct sockaddr *) &a->sa, &reply, &port));
+        compute_peer_keys(a);
+        ck_assert(session_encrypt("0+5.6.7.9,sshd", 15, a, datagram, &len));
+        ck_assert_int_eq(peer_decrypt(datagram, len, peer_rx), 2);
+
+        free_address(a);
+        free_sessions();
+}
+END_TEST
+
+Suite *session_suite(void)
+{
+	Suite *s = suite_create("Session");
+
+        /* Core test case */
+        TCase *tc_core = tcase_create("Core");
+        tcase_add_test(tc_core, check_no_session);
+        tcase_add_test(tc_core, check_session_roundtrip);
+        tcase_add_test(tc_core, check_replay);
+        tcase_add_test(tc_core, check_kx_timestamp);
+        tcase_add_test(tc_core, check_session_limit);
+        tcase_add_test(tc_core, check_session_rekey);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int number_failed = 0;
+        Suite *s = session_suite();
+        SRunner *sr = srunner_create(s);
+
+        srunner_run_all(sr, CK_NORMAL);
+        number_failed = srunner_ntests_failed(sr);
+        srunner_free(sr);
+        return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set autowrite expandtab: */
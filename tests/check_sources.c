@@ -0,0 +1,206 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <stdbool.h>
+
+#include <check.h>
+
+#include <../src/sources.c>
+#include <../src/logactiond.h>
+#include <../src/logging.h>
+#include <../src/misc.h>
+
+/* Mocks */
+
+la_runtype_t run_type = LA_DAEMON_FOREGROUND;
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+atomic_bool shutdown_ongoing = false;
+#else /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+bool shutdown_ongoing = false;
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+const char *const pidfile_name = PIDFILE;
+la_config_t *la_config = NULL;
+
+static int rule_calls = 0;
+
+void
+trigger_shutdown(int status, int saved_errno)
+{
+        ck_abort_msg("reached shutdown");
+}
+
+void
+assert_rule_ffl(const la_rule_t *rule, const char *func, const char *file,
+                int line)
+{
+}
+
+void
+free_rule(la_rule_t *rule)
+{
+        free(rule);
+}
+
+/* Lines containing "match" match the rule */
+bool
+handle_log_line_for_rule(const la_rule_t *rule, const char *line)
+{
+        rule_calls++;
+        return strstr(line, "match");
+}
+
+static la_source_t *
+create_test_source(const int size, const int skip)
+{
+        la_source_group_t *const group = create_source_group("test",
+                        "/dev/null", NULL);
+        la_rule_t *const rule = xmalloc0(sizeof *rule);
+        rule->enabled = true;
+        rule->source_group = group;
+        add_tail(&group->rules, (kw_node_t *) rule);
+        init_line_cache(group, size, skip);
+
+        return create_source(group, "/dev/null");
+}
+
+static void
+free_test_source(la_source_t *const source)
+{
+        la_source_group_t *const group = source->source_group;
+        free_source(source);
+        free_source_group(group);
+}
+
+/* Tests */
+
+START_TEST (check_line_cache_hit)
+{
+        la_source_t *const source = create_test_source(8, 16);
+        rule_calls = 0;
+
+        /* Non-matching line is cached, timestamp is skipped */
+        handle_log_line(source, "Oct 18 10:00:01 nothing here", NULL);
+        ck_assert_int_eq(rule_calls, 1);
+        handle_log_line(source, "Oct 18 10:00:02 nothing here", NULL);
+        ck_assert_int_eq(rule_calls, 1);
+        ck_assert_int_eq(source->source_group->line_cache_hits, 1);
+
+        /* Matching lines are never cached */
+        handle_log_line(source, "Oct 18 10:00:03 match", NULL);
+        handle_log_line(source, "Oct 18 10:00:04 match", NULL);
+        ck_assert_int_eq(rule_calls, 3);
+
+        free_test_source(source);
+}
+END_TEST
+
+START_TEST (check_line_cache_miss)
+{
+        la_source_t *const source = create_test_source(8, 0);
+        rule_calls = 0;
+
+        handle_log_line(source, "nothing here", NULL);
+        handle_log_line(source, "nothing there", NULL);
+        ck_assert_int_eq(rule_calls, 2);
+
+        /* Same line from a systemd unit (without systemd units configured,
+         * rules won't see it at all) */
+        handle_log_line(source, "nothing here", "sshd.service");
+        ck_assert_int_eq(source->source_group->line_cache_hits, 0);
+        handle_log_line(source, "nothing here", "sshd.service");
+        ck_assert_int_eq(source->source_group->line_cache_hits, 1);
+        const int calls = rule_calls;
+
+        /* Line with the same fingerprint as a cached one but different
+         * content must still be handed to the rules */
+        const char *const line = "Invalid user x from 1.2.3.4 match";
+        const uint64_t fingerprint = line_fingerprint(NULL, line, 0);
+        la_line_cache_entry_t *const slot = &source->source_group->line_cache[
+                fingerprint & source->source_group->line_cache_mask];
+        empty_line_cache_entry(slot);
+        slot->fingerprint = fingerprint;
+        slot->line = xstrdup("crafted collision");
+        handle_log_line(source, line, NULL);
+        ck_assert_int_eq(rule_calls, calls + 1);
+        ck_assert_str_eq(slot->line, "crafted collision");
+
+        /* Cache disabled */
+        init_line_cache(source->source_group, 0, 0);
+        ck_assert(!source->source_group->line_cache);
+        handle_log_line(source, "nothing here", NULL);
+        handle_log_line(source, "nothing here", NULL);
+        ck_assert_int_eq(rule_calls, calls + 3);
+
+        free_test_source(source);
+}
+END_TEST
+
+START_TEST (check_line_cache_clear)
+{
+        la_source_t *const source = create_test_source(8, 0);
+        rule_calls = 0;
+
+        handle_log_line(source, "nothing here", NULL);
+        clear_line_cache(source->source_group);
+        handle_log_line(source, "nothing here", NULL);
+        ck_assert_int_eq(rule_calls, 2);
+
+        /* Reload re-initializes the cache */
+        init_line_cache(source->source_group, 8, 0);
+        ck_assert_int_eq(source->source_group->line_cache_hits, 0);
+        handle_log_line(source, "nothing here", NULL);
+        ck_assert_int_eq(rule_calls, 3);
+        handle_log_line(source, "nothing here", NULL);
+        ck_assert_int_eq(rule_calls, 3);
+
+        free_test_source(source);
+}
+END_TEST
+
+Suite *sources_suite(void)
+{
+	Suite *s = suite_create("Sources");
+
+        /* Core test case */
+        TCase *tc_core = tcase_create("Core");
+        tcase_add_test(tc_core, check_line_cache_hit);
+        tcase_add_test(tc_core, check_line_cache_miss);
+        tcase_add_test(tc_core, check_line_cache_clear);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int number_failed = 0;
+        Suite *s = sources_suite();
+        SRunner *sr = srunner_create(s);
+
+        srunner_run_all(sr, CK_NORMAL);
+        number_failed = srunner_ntests_failed(sr);
+        srunner_free(sr);
+        return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set autowrite expandtab: */
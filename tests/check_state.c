@@ -0,0 +1,481 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include <check.h>
+
+#include <../src/state.c>
+#include <../src/logactiond.h>
+#include <../src/logging.h>
+#include <../src/misc.h>
+
+/* Mocks */
+
+la_runtype_t run_type = LA_DAEMON_FOREGROUND;
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+atomic_bool shutdown_ongoing = false;
+#else /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+bool shutdown_ongoing = false;
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+const char *const pidfile_name = PIDFILE;
+pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t end_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+trigger_shutdown(int status, int saved_errno)
+{
+        ck_abort_msg("reached shutdown");
+}
+
+void
+thread_started(pthread_t thread)
+{
+}
+
+void
+wait_final_barrier(void)
+{
+}
+
+void
+empty_queue_pointers(void)
+{
+}
+
+kw_tree_node_t *
+get_root_of_queue(void)
+{
+        return NULL;
+}
+
+int
+get_queue_length(void)
+{
+        return 0;
+}
+
+static la_rule_t sshd = { .node = { .nodename = "sshd" } };
+static la_rule_t postfix = { .node = { .nodename = "postfix" } };
+
+la_rule_t *
+find_rule(const char *const rule_name)
+{
+        if (!strcmp(rule_name, "sshd"))
+                return &sshd;
+        else if (!strcmp(rule_name, "postfix"))
+                return &postfix;
+        else
+                return NULL;
+}
+
+/* Same format as the real thing in messages.c */
+int
+parse_add_entry_message(const char *const message, la_address_t *const address,
+                la_rule_t **const rule, time_t *const end_time,
+                int *const factor)
+{
+        if (*message == '#' || *message == '\n')
+                return 0;
+
+        char address_str[MAX_ADDR_TEXT_SIZE + 1];
+        char rule_str[RULE_LENGTH + 1];
+        long parsed_end_time;
+        const int n = sscanf(message, PROTOCOL_VERSION_STR CMD_ADD_STR
+                        "%50[^,],%100[^,],%ld,%d", address_str, rule_str,
+                        &parsed_end_time, factor);
+        if (n != 4 || !init_address(address, address_str))
+                return -1;
+
+        *rule = find_rule(rule_str);
+        if (!*rule)
+                return -1;
+
+        *end_time = parsed_end_time;
+        return 1;
+}
+
+int
+print_add_message(FILE *const stream, const char *const address,
+                const char *const rule_name, const time_t end_time,
+                const int factor)
+{
+        return fprintf(stream, "%c%c%s,%s,%ld,%d\n", PROTOCOL_VERSION, CMD_ADD,
+                        address, rule_name, end_time, factor);
+}
+
+/* Entries restored by restore_state() */
+
+typedef struct restored_s
+{
+        char address[MAX_ADDR_TEXT_SIZE + 1];
+        const la_rule_t *rule;
+        time_t end_time;
+} restored_t;
+
+static restored_t restored[16];
+static int n_restored = 0;
+
+void
+trigger_manual_commands_for_rule(const la_address_t *const address,
+                const la_rule_t *const rule, const time_t end_time,
+                const int factor, const la_address_t *const from_addr,
+                const bool suppress_logging)
+{
+        ck_assert_int_lt(n_restored, 16);
+        restored_t *const entry = &restored[n_restored++];
+        strcpy(entry->address, address->text);
+        entry->rule = rule;
+        entry->end_time = end_time;
+}
+
+/* Helpers */
+
+static char state_dir[] = "/tmp/check_stateXXXXXX";
+static char state_file[sizeof state_dir + 16];
+
+static void
+create_state_dir(void)
+{
+        ck_assert(mkdtemp(state_dir));
+        snprintf(state_file, sizeof state_file, "%s/state", state_dir);
+        set_saved_state(state_file);
+        n_restored = 0;
+}
+
+static void
+remove_state_dir(void)
+{
+        remove(saved_state);
+        remove(state_journal);
+        remove(new_state_journal);
+        remove(new_saved_state);
+        remove(state_dir);
+        strcpy(state_dir, "/tmp/check_stateXXXXXX");
+}
+
+static void
+write_snapshot_file(const char *const content)
+{
+        FILE *const stream = fopen(saved_state, "w");
+        ck_assert(stream);
+        fputs(content, stream);
+        ck_assert_int_eq(fclose(stream), 0);
+}
+
+static void
+append_journal_entry(const char *const journal, const char type,
+                const char *const host, const char *const rule,
+                const time_t end_time, const size_t len)
+{
+        la_address_t *const address = create_address(host);
+        char entry[BINMSG_ENTRY_LEN + BINMSG_MAX_RULE_LEN];
+        const size_t entry_len = init_binary_entry(entry, type, address, rule,
+                        end_time, 1);
+        ck_assert(entry_len);
+
+        FILE *const stream = fopen(journal, "a");
+        ck_assert(stream);
+        ck_assert_int_eq(fwrite(entry, 1, len ? len : entry_len, stream),
+                        len ? len : entry_len);
+        ck_assert_int_eq(fclose(stream), 0);
+        free_address(address);
+}
+
+/* Creates empty journal with header for generation */
+
+static void
+create_journal_file(const char *const journal, const uint64_t generation)
+{
+        const int fd = create_journal(generation);
+        ck_assert_int_ne(fd, -1);
+        ck_assert_int_eq(close(fd), 0);
+        if (strcmp(journal, new_state_journal))
+                ck_assert_int_eq(rename(new_state_journal, journal), 0);
+}
+
+static void
+journal_entry(const char *const journal, const char type,
+                const char *const host, const char *const rule,
+                const time_t end_time)
+{
+        append_journal_entry(journal, type, host, rule, end_time, 0);
+}
+
+static const restored_t *
+find_restored(const char *const host)
+{
+        for (int i = 0; i < n_restored; i++)
+                if (!strcmp(restored[i].address, host))
+                        return &restored[i];
+
+        return NULL;
+}
+
+static void
+assert_restored(const char *const host, const la_rule_t *const rule,
+                const time_t end_time)
+{
+        const restored_t *const entry = find_restored(host);
+        ck_assert_msg(entry, "%s not restored", host);
+        ck_assert_ptr_eq(entry->rule, rule);
+        ck_assert_int_eq(entry->end_time, end_time);
+}
+
+/* Tests */
+
+START_TEST (check_restore_two_journals)
+{
+        create_state_dir();
+        write_snapshot_file("# logactiond state\n"
+                        "0+1.1.1.1,sshd,100,1\n"
+                        "0+2.2.2.2,sshd,100,1\n");
+        journal_entry(state_journal, CMD_ADD, "3.3.3.3", "sshd", 200);
+        journal_entry(state_journal, CMD_DEL, "1.1.1.1", "sshd", 100);
+        journal_entry(new_state_journal, CMD_ADD, "4.4.4.4", "postfix", 300);
+        journal_entry(new_state_journal, CMD_ADD, "2.2.2.2", "sshd", 400);
+
+        ck_assert(restore_state(false));
+
+        ck_assert_int_eq(n_restored, 3);
+        ck_assert(!find_restored("1.1.1.1"));
+        assert_restored("2.2.2.2", &sshd, 400);
+        assert_restored("3.3.3.3", &sshd, 200);
+        assert_restored("4.4.4.4", &postfix, 300);
+
+        remove_state_dir();
+}
+END_TEST
+
+START_TEST (check_restore_truncated)
+{
+        create_state_dir();
+        write_snapshot_file("0+1.1.1.1,sshd,100,1\n");
+        journal_entry(state_journal, CMD_ADD, "3.3.3.3", "sshd", 200);
+        append_journal_entry(state_journal, CMD_ADD, "5.5.5.5", "sshd", 200,
+                        BINMSG_ENTRY_LEN);
+
+        ck_assert(restore_state(false));
+
+        ck_assert_int_eq(n_restored, 2);
+        assert_restored("1.1.1.1", &sshd, 100);
+        assert_restored("3.3.3.3", &sshd, 200);
+
+        remove_state_dir();
+}
+END_TEST
+
+START_TEST (check_restore_del_after_add)
+{
+        create_state_dir();
+        journal_entry(state_journal, CMD_ADD, "5.5.5.5", "sshd", 200);
+        journal_entry(state_journal, CMD_ADD, "6.6.6.6", "sshd", 200);
+        journal_entry(state_journal, CMD_DEL, "5.5.5.5", "sshd", 200);
+        journal_entry(state_journal, CMD_DEL, "7.7.7.7", "sshd", 200);
+
+        ck_assert(restore_state(false));
+
+        ck_assert_int_eq(n_restored, 1);
+        assert_restored("6.6.6.6", &sshd, 200);
+
+        remove_state_dir();
+}
+END_TEST
+
+START_TEST (check_restore_missing_rule)
+{
+        create_state_dir();
+        write_snapshot_file("0+1.1.1.1,sshd,100,1\n");
+        journal_entry(state_journal, CMD_ADD, "3.3.3.3", "gone", 200);
+        journal_entry(state_journal, CMD_ADD, "4.4.4.4", "postfix", 200);
+
+        /* Journal entries for rules no longer active are skipped */
+        ck_assert(restore_state(false));
+        ck_assert_int_eq(n_restored, 2);
+        assert_restored("1.1.1.1", &sshd, 100);
+        assert_restored("4.4.4.4", &postfix, 200);
+
+        /* Whereas the state file must not be overwritten in that case */
+        n_restored = 0;
+        write_snapshot_file("0+1.1.1.1,gone,100,1\n");
+        ck_assert(!restore_state(false));
+        ck_assert_int_eq(n_restored, 0);
+
+        remove_state_dir();
+}
+END_TEST
+
+START_TEST (check_journal_buffered)
+{
+        create_state_dir();
+        journal_fd = open(state_journal, O_WRONLY | O_CREAT | O_TRUNC |
+                        O_APPEND | O_CLOEXEC, 0666);
+        ck_assert_int_ne(journal_fd, -1);
+
+        la_command_t command = { .is_template = false, .end_time = 500,
+                .factor = 1, .rule_name = "sshd" };
+        command.address = create_address("8.8.8.8");
+        journal_add(&command);
+        ck_assert_int_eq(journal_entries, 1);
+
+        /* Nothing written with end_queue_mutex locked */
+        struct stat stat_buffer;
+        ck_assert_int_eq(stat(state_journal, &stat_buffer), 0);
+        ck_assert_int_eq(stat_buffer.st_size, 0);
+
+        flush_journal();
+        ck_assert_int_eq(stat(state_journal, &stat_buffer), 0);
+        ck_assert_int_gt(stat_buffer.st_size, 0);
+
+        ck_assert_int_eq(close(journal_fd), 0);
+        journal_fd = -1;
+        journal_entries = 0;
+
+        ck_assert(restore_state(false));
+        ck_assert_int_eq(n_restored, 1);
+        assert_restored("8.8.8.8", &sshd, 500);
+
+        free_address(command.address);
+
+        remove_state_dir();
+}
+END_TEST
+
+START_TEST (check_restore_contained_journal)
+{
+        create_state_dir();
+        journal_generation = 0;
+
+        /* Crash after the state file has been replaced but before the new
+         * journal replaced the old one */
+        write_snapshot_file("# logactiond state\n"
+                        "# journal 2\n"
+                        "0+1.1.1.1,sshd,100,1\n"
+                        "0+2.2.2.2,sshd,100,1\n");
+        create_journal_file(state_journal, 1);
+        journal_entry(state_journal, CMD_ADD, "3.3.3.3", "sshd", 200);
+        journal_entry(state_journal, CMD_DEL, "1.1.1.1", "sshd", 100);
+        create_journal_file(new_state_journal, 2);
+        journal_entry(new_state_journal, CMD_ADD, "4.4.4.4", "postfix", 300);
+        journal_entry(new_state_journal, CMD_ADD, "2.2.2.2", "sshd", 400);
+
+        ck_assert(restore_state(false));
+
+        /* Snapshot plus new journal only */
+        ck_assert_int_eq(n_restored, 3);
+        assert_restored("1.1.1.1", &sshd, 100);
+        assert_restored("2.2.2.2", &sshd, 400);
+        assert_restored("4.4.4.4", &postfix, 300);
+        ck_assert(!find_restored("3.3.3.3"));
+        ck_assert_int_eq(journal_generation, 2);
+
+        /* Whereas a snapshot that never made it still needs both */
+        n_restored = 0;
+        write_snapshot_file("# journal 1\n"
+                        "0+1.1.1.1,sshd,100,1\n"
+                        "0+2.2.2.2,sshd,100,1\n");
+        ck_assert(restore_state(false));
+        ck_assert_int_eq(n_restored, 3);
+        ck_assert(!find_restored("1.1.1.1"));
+        assert_restored("3.3.3.3", &sshd, 200);
+        assert_restored("4.4.4.4", &postfix, 300);
+
+        remove_state_dir();
+}
+END_TEST
+
+START_TEST (check_snapshot_generation)
+{
+        create_state_dir();
+        journal_generation = 4;
+
+        write_snapshot();
+
+        /* New journal has replaced the old one */
+        ck_assert_int_ne(journal_fd, -1);
+        ck_assert(!journal_pending);
+        ck_assert_int_eq(journal_generation, 5);
+        ck_assert_int_eq(access(new_state_journal, F_OK), -1);
+
+        FILE *const stream = fopen(saved_state, "r");
+        ck_assert(stream);
+        char line[100];
+        ck_assert(fgets(line, sizeof line, stream));
+        ck_assert(fgets(line, sizeof line, stream));
+        ck_assert(fgets(line, sizeof line, stream));
+        ck_assert_str_eq(line, "# journal 5\n");
+        ck_assert_int_eq(fclose(stream), 0);
+
+        /* Restoring doesn't skip the current journal */
+        la_command_t command = { .is_template = false, .end_time = 500,
+                .factor = 1, .rule_name = "sshd" };
+        command.address = create_address("8.8.8.8");
+        journal_add(&command);
+        flush_journal();
+        ck_assert_int_eq(close(journal_fd), 0);
+        journal_fd = -1;
+        journal_entries = 0;
+        journal_generation = 0;
+
+        ck_assert(restore_state(false));
+        ck_assert_int_eq(n_restored, 1);
+        assert_restored("8.8.8.8", &sshd, 500);
+        ck_assert_int_eq(journal_generation, 5);
+
+        free_address(command.address);
+        remove_state_dir();
+}
+END_TEST
+
+Suite *state_suite(void)
+{
+	Suite *s = suite_create("State");
+
+        /* Core test case */
+        TCase *tc_core = tcase_create("Core");
+        tcase_add_test(tc_core, check_restore_two_journals);
+        tcase_add_test(tc_core, check_restore_truncated);
+        tcase_add_test(tc_core, check_restore_del_after_add);
+        tcase_add_test(tc_core, check_restore_missing_rule);
+        tcase_add_test(tc_core, check_journal_buffered);
+        tcase_add_test(tc_core, check_restore_contained_journal);
+        tcase_add_test(tc_core, check_snapshot_generation);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int number_failed = 0;
+        Suite *s = state_suite();
+        SRunner *sr = srunner_create(s);
+
+        srunner_run_all(sr, CK_NORMAL);
+        number_failed = srunner_ntests_failed(sr);
+        srunner_free(sr);
+        return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set autowrite expandtab: */
@@ -0,0 +1,218 @@
+/*
+ *  logactiond - trigger actions based on logfile contents
+ *  Copyright (C) 2019-2021 Klaus Wissmann
+
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <check.h>
+
+#include <../src/syncstream.c>
+#include <../src/addresses.h>
+#include <../src/logactiond.h>
+#include <../src/logging.h>
+#include <../src/misc.h>
+
+#define PASSWORD "Rübezahl"
+#define NUM_ENTRIES 5000
+
+/* Mocks */
+
+la_runtype_t run_type = LA_DAEMON_FOREGROUND;
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+atomic_bool shutdown_ongoing = false;
+#else /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+bool shutdown_ongoing = false;
+#endif /* __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) */
+const char *const pidfile_name = PIDFILE;
+la_config_t *la_config;
+pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool shutdown_good = false;
+static char shutdown_msg[] = "Shutdown message not set";
+
+void
+trigger_shutdown(int status, int saved_errno)
+{
+        la_log(LOG_INFO, "reached shutdown");
+        if (!shutdown_good)
+                ck_abort_msg(shutdown_msg);
+}
+
+void
+thread_started(pthread_t thread)
+{
+}
+
+void
+wait_final_barrier(void)
+{
+}
+
+void
+bind_client_socket(int fd, int family)
+{
+}
+
+static int entries_received;
+static char last_entry[MSG_LEN];
+
+void
+parse_batch_message_trigger_commands(const char *const buf, const size_t len,
+                la_address_t *from_addr)
+{
+        ck_assert_int_eq(*buf, PROTOCOL_VERSION_BATCH);
+        for (const char *ptr = buf + 1; ptr < buf + len; ptr += strlen(ptr) + 1)
+        {
+                entries_received++;
+                snprintf(last_entry, MSG_LEN, "%s", ptr);
+        }
+}
+
+void
+parse_binary_message_trigger_commands(const char *const buf, const size_t len,
+                la_address_t *from_addr)
+{
+        ck_abort_msg("Binary frame received");
+}
+
+/* Sender side */
+
+typedef struct stream_sender_s
+{
+        int fd;
+        char **messages;
+        int n;
+        bool result;
+} stream_sender_t;
+
+static void *
+send_entries(void *const arg)
+{
+        stream_sender_t *const sender = arg;
+        sender->result = send_entries_to_stream(sender->fd, sender->messages,
+                        sender->n);
+        close(sender->fd);
+        return NULL;
+}
+
+/* Tests */
+
+START_TEST (check_stream_entries)
+{
+        ck_assert(generate_send_key_and_salt(PASSWORD));
+
+        char **const messages = xmalloc(NUM_ENTRIES * sizeof (char *));
+        for (int i = 0; i < NUM_ENTRIES; i++)
+        {
+                messages[i] = xmalloc(MSG_LEN);
+                snprintf(messages[i], MSG_LEN, "0+10.%u.%u.%u,sshd",
+                                i >> 16, (i >> 8) & 0xff, i & 0xff);
+        }
+
+        int fds[2];
+        ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+        stream_sender_t sender = { fds[0], messages, NUM_ENTRIES, false };
+        pthread_t thread;
+        ck_assert(!pthread_create(&thread, NULL, send_entries, &sender));
+
+        la_address_t *const a = create_address("5.5.5.5");
+        ck_assert(a);
+        entries_received = 0;
+        /* 5000 entries of 15 to 18 bytes need six frames */
+        ck_assert_int_eq(receive_entries_from_stream(fds[1], a, PASSWORD), 6);
+
+        ck_assert(!pthread_join(thread, NULL));
+        ck_assert(sender.result);
+        ck_assert_int_eq(entries_received, NUM_ENTRIES);
+        ck_assert_str_eq(last_entry, "+10.0.19.135,sshd");
+
+        close(fds[1]);
+        free_address(a);
+        for (int i = 0; i < NUM_ENTRIES; i++)
+                free(messages[i]);
+        free(messages);
+}
+END_TEST
+
+START_TEST (check_illegal_frames)
+{
+        la_address_t *const a = create_address("5.5.5.6");
+        ck_assert(a);
+
+        /* Frame too long */
+        int fds[2];
+        ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        const uint32_t too_long = htonl(STREAM_FRAME_LEN + CRYPTO_OVERHEAD + 1);
+        ck_assert_int_eq(write(fds[0], &too_long, 4), 4);
+        ck_assert_int_eq(receive_entries_from_stream(fds[1], a, PASSWORD), -1);
+        close(fds[0]);
+        close(fds[1]);
+
+        /* Stream ends in the middle of a frame */
+        ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        const uint32_t len = htonl(100 + CRYPTO_OVERHEAD);
+        ck_assert_int_eq(write(fds[0], &len, 4), 4);
+        ck_assert_int_eq(write(fds[0], "1+1.2.3.4", 10), 10);
+        close(fds[0]);
+        ck_assert_int_eq(receive_entries_from_stream(fds[1], a, PASSWORD), -1);
+        close(fds[1]);
+
+        /* Empty stream */
+        ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        close(fds[0]);
+        ck_assert_int_eq(receive_entries_from_stream(fds[1], a, PASSWORD), 0);
+        close(fds[1]);
+
+        free_address(a);
+}
+END_TEST
+
+Suite *syncstream_suite(void)
+{
+	Suite *s = suite_create("Sync stream");
+
+        /* Core test case */
+        TCase *tc_core = tcase_create("Core");
+        tcase_add_test(tc_core, check_stream_entries);
+        tcase_add_test(tc_core, check_illegal_frames);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
+
+int
+main(int argc, char *argv[])
+{
+        int number_failed = 0;
+        Suite *s = syncstream_suite();
+        SRunner *sr = srunner_create(s);
+
+        srunner_run_all(sr, CK_NORMAL);
+        number_failed = srunner_ntests_failed(sr);
+        srunner_free(sr);
+        return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set autowrite expandtab: */